@@ -0,0 +1,349 @@
+"""Benchmarks comparing the bitset types with set, frozenset, int and numpy.
+
+Each benchmark is an operation on one implementation of a set of integers,
+for a universe size and a density of members:
+
+    python benchmarks/bench.py -o results.json
+    python benchmarks/compare.py benchmarks/baselines/cpython-3.11.json results.json
+
+Timings are the seconds per call, measured as pyperf does: the loop count
+is calibrated so that a run takes at least --min-time, and --runs runs are
+recorded.  Memory benchmarks record sys.getsizeof() in bytes.  The data
+comes from a fixed seed, so runs on the same machine are comparable.
+numpy is used if it is installed; no network access is needed.
+"""
+
+from __future__ import print_function
+
+import argparse
+import array
+import binascii
+import json
+import math
+import pickle
+import platform
+import random
+import sys
+import time
+import timeit
+
+import bitset
+from bitset import Bitset, BigBitset, FrozenBitset, RoaringBitset
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+try:
+    xrange
+except NameError:
+    xrange = range
+
+FORMAT_VERSION = 1
+
+UNIVERSES = (32, 10 ** 4, 10 ** 6)
+DENSITIES = (0.01, 0.1, 0.5)
+FAST_UNIVERSES = (32, 10 ** 4)
+
+
+# ints are built and scanned through bytes, since changing one bit of a
+# big int copies all of it
+if hasattr(int, "from_bytes"):
+    def int_from_bytes(data):
+        return int.from_bytes(bytes(data), "little")
+
+    def int_to_bytes(v):
+        return bytearray(v.to_bytes((v.bit_length() + 7) // 8, "little"))
+else:
+    def int_from_bytes(data):
+        return int(binascii.hexlify(bytes(data[::-1])) or b"0", 16)
+
+    def int_to_bytes(v):
+        digits = "%x" % v
+        return bytearray(binascii.unhexlify("0" * (len(digits) % 2) + digits))[::-1]
+
+
+def int_from(values):
+    data = bytearray()
+    for x in values:
+        if x >> 3 >= len(data):
+            data.extend(bytearray((x >> 3) + 1 - len(data)))
+        data[x >> 3] |= 1 << (x & 7)
+    return int_from_bytes(data)
+
+
+def int_members(v):
+    for i, byte in enumerate(int_to_bytes(v)):
+        while byte:
+            low = byte & -byte
+            yield i * 8 + low.bit_length() - 1
+            byte ^= low
+
+
+if hasattr(int, "bit_count"):
+    int_len = int.bit_count
+else:
+    def int_len(v):
+        return bin(v).count("1")
+
+
+class Impl(object):
+    """How to build and query one kind of set.  The operators are the
+    built in ones unless overridden."""
+
+    mutable = True
+
+    def __init__(self, name, build):
+        self.name = name
+        self.build = build
+
+    def applies(self, universe):
+        return True
+
+    def contains(self, s, probes):
+        for x in probes:
+            x in s
+
+    def iterate(self, s):
+        for x in s:
+            pass
+
+    def length(self, s):
+        return len(s)
+
+    @staticmethod
+    def sub(a, b):
+        return a - b
+
+
+class SmallBitsetImpl(Impl):
+    def applies(self, universe):
+        return universe == 32
+
+
+class FrozenImpl(Impl):
+    mutable = False
+
+
+class RoaringImpl(Impl):
+    def applies(self, universe):
+        return universe <= 2 ** 32
+
+
+class IntImpl(Impl):
+    mutable = False
+
+    def contains(self, s, probes):
+        for x in probes:
+            (s >> x) & 1
+
+    def iterate(self, s):
+        for x in int_members(s):
+            pass
+
+    def length(self, s):
+        return int_len(s)
+
+    @staticmethod
+    def sub(a, b):
+        return a & ~b
+
+
+class NumpyImpl(Impl):
+    def __init__(self, name):
+        Impl.__init__(self, name, None)
+
+    def make(self, values, universe):
+        a = numpy.zeros(universe + 1, dtype=bool)
+        a[numpy.fromiter(values, dtype=numpy.intp)] = True
+        return a
+
+    def contains(self, s, probes):
+        for x in probes:
+            s[x]
+
+    def iterate(self, s):
+        for x in numpy.flatnonzero(s):
+            pass
+
+    def length(self, s):
+        return int(numpy.count_nonzero(s))
+
+    @staticmethod
+    def sub(a, b):
+        return a & ~b
+
+
+IMPLS = [
+    SmallBitsetImpl("Bitset", Bitset),
+    Impl("BigBitset", BigBitset),
+    FrozenImpl("FrozenBitset", FrozenBitset),
+    RoaringImpl("RoaringBitset", RoaringBitset),
+    Impl("set", set),
+    FrozenImpl("frozenset", frozenset),
+    IntImpl("int", int_from),
+]
+if numpy is not None:
+    IMPLS.append(NumpyImpl("numpy"))
+
+
+def build(impl, values, universe):
+    if isinstance(impl, NumpyImpl):
+        return impl.make(values, universe)
+    return impl.build(values)
+
+
+def sample(rnd, universe, density):
+    """Returns the members of a random set of the given density.  Bitsets
+    only hold [1..32], so the universe of 32 starts at 1."""
+    lo = 1 if universe == 32 else 0
+    n = max(1, int(universe * density))
+    return sorted(rnd.sample(xrange(lo, lo + universe), n))
+
+
+def operations(impl, universe, density):
+    """Yields (name, setup) pairs; setup() returns the callable to time."""
+    rnd = random.Random(17 + universe + int(density * 1000))
+    lo = 1 if universe == 32 else 0
+    xs = sample(rnd, universe, density)
+    ys = sample(rnd, universe, density)
+    probes = [rnd.randrange(lo, lo + universe) for i in xrange(1000)]
+    fresh = lambda values: build(impl, values, universe)
+    a, b = fresh(xs), fresh(ys)
+
+    yield "construct-list", lambda: lambda: fresh(xs)
+    yield "construct-tuple", lambda: (lambda t: lambda: fresh(t))(tuple(xs))
+    yield "construct-iterator", lambda: lambda: fresh(iter(xs))
+    yield "construct-range", lambda: (lambda r: lambda: fresh(r))(xrange(lo, lo + len(xs)))
+    yield "construct-array", lambda: (lambda r: lambda: fresh(r))(array.array("l", xs))
+    yield "contains", lambda: lambda: impl.contains(a, probes)
+    yield "iterate", lambda: lambda: impl.iterate(a)
+    yield "len", lambda: lambda: impl.length(a)
+    yield "and", lambda: lambda: a & b
+    yield "or", lambda: lambda: a | b
+    yield "xor", lambda: lambda: a ^ b
+    yield "sub", lambda: lambda: impl.sub(a, b)
+
+    if impl.mutable:
+        # the in-place operators are timed repeatedly on one copy, so
+        # after the first call they see its steady state
+        def inplace(op):
+            def setup():
+                c = fresh(xs)
+                return lambda: op(c, b)
+            return setup
+
+        yield "iand", inplace(lambda c, b: c.__iand__(b))
+        yield "ior", inplace(lambda c, b: c.__ior__(b))
+        yield "ixor", inplace(lambda c, b: c.__ixor__(b))
+        if not isinstance(impl, NumpyImpl):
+            yield "isub", inplace(lambda c, b: c.__isub__(b))
+
+    yield "pickle", lambda: lambda: pickle.loads(pickle.dumps(a, pickle.HIGHEST_PROTOCOL))
+
+
+def time_run(func, loops):
+    timer = timeit.default_timer
+    t0 = timer()
+    for i in xrange(loops):
+        func()
+    return (timer() - t0) / loops
+
+
+def calibrate(func, min_time):
+    """Returns the number of loops taking about min_time, estimated from a
+    run of a tenth of that."""
+    loops = 1
+    while True:
+        elapsed = time_run(func, loops) * loops
+        if elapsed >= min_time / 10 or loops >= 10 ** 6:
+            break
+        loops *= 10
+    return max(1, int(math.ceil(loops * min_time / max(elapsed, 1e-9))))
+
+
+def summarize(values, unit):
+    mean = sum(values) / len(values)
+    var = sum((v - mean) ** 2 for v in values) / max(1, len(values) - 1)
+    return {"unit": unit, "values": values, "mean": mean, "stdev": math.sqrt(var),
+            "min": min(values)}
+
+
+def run(args):
+    results = {}
+    universes = FAST_UNIVERSES if args.fast else UNIVERSES
+    impls = [i for i in IMPLS if args.impl is None or i.name in args.impl]
+
+    for universe in universes:
+        for density in DENSITIES:
+            for impl in impls:
+                if not impl.applies(universe):
+                    continue
+                suffix = "/%s/u=%d/d=%g" % (impl.name, universe, density)
+
+                for op, setup in operations(impl, universe, density):
+                    name = op + suffix
+                    if args.filter and args.filter not in name:
+                        continue
+                    func = setup()
+                    loops = calibrate(func, args.min_time)
+                    values = [time_run(func, loops) for i in xrange(args.runs)]
+                    results[name] = summarize(values, "s")
+                    if args.verbose:
+                        print("%-50s %12.3f us +- %.3f" % (
+                            name, results[name]["mean"] * 1e6, results[name]["stdev"] * 1e6))
+
+                name = "memory" + suffix
+                if not args.filter or args.filter in name:
+                    rnd = random.Random(17 + universe + int(density * 1000))
+                    s = build(impl, sample(rnd, universe, density), universe)
+                    results[name] = summarize([float(sys.getsizeof(s))], "bytes")
+                    if args.verbose:
+                        print("%-50s %12d bytes" % (name, results[name]["mean"]))
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("-o", "--output", help="write the results to this JSON file")
+    parser.add_argument("--runs", type=int, default=5, help="runs per benchmark (5)")
+    parser.add_argument("--min-time", type=float, default=0.02,
+                        help="minimum seconds per run (0.02)")
+    parser.add_argument("--fast", action="store_true",
+                        help="skip the largest universe and do 3 shorter runs")
+    parser.add_argument("--filter", help="only run benchmarks with this in their name")
+    parser.add_argument("--impl", action="append",
+                        help="only run this implementation; may be repeated")
+    parser.add_argument("-q", "--quiet", dest="verbose", action="store_false")
+    args = parser.parse_args()
+    if args.fast:
+        args.runs = min(args.runs, 3)
+        args.min_time = min(args.min_time, 0.01)
+
+    started = time.time()
+    results = run(args)
+    data = {
+        "version": FORMAT_VERSION,
+        "metadata": {
+            "python": platform.python_implementation() + " " + platform.python_version(),
+            "platform": platform.platform(),
+            "machine": platform.machine(),
+            "simd_level": bitset.simd_level(),
+            "numpy": numpy.__version__ if numpy is not None else None,
+            "runs": args.runs,
+            "min_time": args.min_time,
+            "date": time.strftime("%Y-%m-%d %H:%M:%S"),
+            "duration": round(time.time() - started, 1),
+        },
+        "benchmarks": results,
+    }
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(data, f, indent=1, sort_keys=True)
+            f.write("\n")
+    print("%d benchmarks in %.1f s" % (len(results), data["metadata"]["duration"]))
+
+
+if __name__ == "__main__":
+    main()
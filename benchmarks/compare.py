@@ -0,0 +1,79 @@
+"""Compares two benchmark result files written by bench.py.
+
+    python benchmarks/compare.py baseline.json results.json [--threshold 0.1]
+
+Prints the ratio of each benchmark's result to the baseline's and exits
+with status 1 if any got slower, or used more memory, by more than the
+threshold.  Timings are compared by their fastest run, as timeit advises,
+since the slower runs mostly measure other load on the machine, and only
+count as regressions if every run was slower than every baseline run.
+Run both on a quiet machine: frequency scaling and other processes
+easily move timings by more than the threshold.
+"""
+
+from __future__ import print_function
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        data = json.load(f)
+    if data.get("version") != 1:
+        sys.exit("%s: unsupported benchmark file version %r" % (path, data.get("version")))
+    return data
+
+
+def regressed(old, new, threshold):
+    if new["min"] <= old["min"] * (1 + threshold):
+        return False
+    return old["unit"] == "bytes" or min(new["values"]) > max(old["values"])
+
+
+def fmt(result):
+    if result["unit"] == "bytes":
+        return "%d B" % result["min"]
+    return "%.3f us" % (result["min"] * 1e6)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("baseline")
+    parser.add_argument("results")
+    parser.add_argument("--threshold", type=float, default=0.1,
+                        help="fractional slowdown to flag (0.1)")
+    parser.add_argument("--all", action="store_true",
+                        help="show every benchmark, not just the changed ones")
+    args = parser.parse_args()
+
+    old, new = load(args.baseline), load(args.results)
+    for key in ("python", "machine", "simd_level"):
+        if old["metadata"].get(key) != new["metadata"].get(key):
+            print("warning: %s differs: %s vs %s" % (
+                key, old["metadata"].get(key), new["metadata"].get(key)))
+
+    regressions = []
+    common = sorted(set(old["benchmarks"]) & set(new["benchmarks"]))
+    for name in common:
+        a, b = old["benchmarks"][name], new["benchmarks"][name]
+        ratio = b["min"] / a["min"] if a["min"] else float("inf")
+        flag = ""
+        if regressed(a, b, args.threshold):
+            regressions.append(name)
+            flag = "  REGRESSION"
+        elif ratio < 1 - args.threshold:
+            flag = "  faster"
+        if flag or args.all:
+            print("%-50s %12s -> %12s  %5.2fx%s" % (name, fmt(a), fmt(b), ratio, flag))
+
+    missing = len(set(old["benchmarks"]) - set(new["benchmarks"]))
+    print("%d benchmarks compared, %d regressions%s" % (
+        len(common), len(regressions),
+        ", %d in the baseline only" % missing if missing else ""))
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -9,27 +9,334 @@
 #include <Python.h>
 #include "structmember.h"
 
+#if defined(HAVE_PTHREAD_H) && (defined(WITH_THREAD) || PY_VERSION_HEX >= 0x03070000)
+#include <pthread.h>
+#define BITSET_THREADS
+#endif
+
+/* BitsetStore maps files where the words can be used as they are */
+#if defined(HAVE_MMAP) && !defined(MS_WINDOWS) && !defined(WORDS_BIGENDIAN)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define BITSET_MMAP
+#endif
+
 PyAPI_DATA(PyTypeObject) bitset_BitsetType;
+PyAPI_DATA(PyTypeObject) bitset_BigBitsetType;
+PyAPI_DATA(PyTypeObject) bitset_FrozenBitsetType;
+PyAPI_DATA(PyTypeObject) bitset_MappedBitsetType;
+PyAPI_DATA(PyTypeObject) bitset_RoaringBitsetType;
+PyAPI_DATA(PyTypeObject) bitset_BitsetArrayType;
 
 #ifndef Py_TYPE
 /* new in 2.6 */
 #define Py_TYPE(ob)        (((PyObject*)(ob))->ob_type)
 #endif
 
+#if PY_VERSION_HEX < 0x03020000
+/* new in 3.2 */
+typedef long Py_hash_t;
+#endif
+
+#ifndef Py_MIN
+/* new in 3.3 */
+#define Py_MIN(x, y) (((x) > (y)) ? (y) : (x))
+#endif
+
+#ifndef Py_MAX
+/* new in 3.3 */
+#define Py_MAX(x, y) (((x) > (y)) ? (x) : (y))
+#endif
+
+#if PY_MAJOR_VERSION >= 3
+#define PyInt_Check PyLong_Check
+#define PyInt_FromLong PyLong_FromLong
+#define PyInt_FromSsize_t PyLong_FromSsize_t
+#define PyInt_AsLong PyLong_AsLong
+#define PyInt_AsSsize_t PyLong_AsSsize_t
+#define PyString_FromString PyUnicode_FromString
+#define PyString_FromFormat PyUnicode_FromFormat
+/* number operators always see mixed types, and all types have the
+   new buffer interface */
+#define Py_TPFLAGS_CHECKTYPES 0
+#define Py_TPFLAGS_HAVE_NEWBUFFER 0
+#endif
+
+#if PY_VERSION_HEX >= 0x03070000
+/* methods taking *others are passed an array rather than a tuple */
+#define BITSET_FASTCALL
+#endif
+
+#if PY_VERSION_HEX >= 0x03090000
+/* types can be called without building an argument tuple */
+#define BITSET_VECTORCALL
+#endif
+
 #define bitset_BitSet_CheckExact(ob) (Py_TYPE(ob) == &bitset_BitsetType)
 #define bitset_Bitset_Check(ob) \
     (Py_TYPE(ob) == &bitset_BitsetType || \
     PyType_IsSubtype(Py_TYPE(ob), &bitset_BitsetType))
+#define bitset_BigBitset_Check(ob) \
+    (Py_TYPE(ob) == &bitset_BigBitsetType || \
+    PyType_IsSubtype(Py_TYPE(ob), &bitset_BigBitsetType))
+#define bitset_FrozenBitset_CheckExact(ob) (Py_TYPE(ob) == &bitset_FrozenBitsetType)
+#define bitset_FrozenBitset_Check(ob) \
+    (Py_TYPE(ob) == &bitset_FrozenBitsetType || \
+    PyType_IsSubtype(Py_TYPE(ob), &bitset_FrozenBitsetType))
+#define bitset_Mapped_Check(ob) \
+    (Py_TYPE(ob) == &bitset_MappedBitsetType || \
+    PyType_IsSubtype(Py_TYPE(ob), &bitset_MappedBitsetType))
+
+/* The type of results computed from ob.  A MappedBitset's words belong to
+   its BitsetStore, so anything derived from one is a FrozenBitset. */
+#define bitset_result_type(ob) \
+    (bitset_Mapped_Check(ob) ? &bitset_FrozenBitsetType : Py_TYPE(ob))
+
+/* True for any of the types sharing bitset_BitsetObject */
+#define bitset_AnyBitset_Check(ob) \
+    (bitset_Bitset_Check(ob) || bitset_BigBitset_Check(ob) || \
+     bitset_FrozenBitset_Check(ob))
+
+#define bitset_Roaring_Check(ob) \
+    (Py_TYPE(ob) == &bitset_RoaringBitsetType || \
+    PyType_IsSubtype(Py_TYPE(ob), &bitset_RoaringBitsetType))
+
+#define bitset_Array_Check(ob) \
+    (Py_TYPE(ob) == &bitset_BitsetArrayType || \
+    PyType_IsSubtype(Py_TYPE(ob), &bitset_BitsetArrayType))
+
+/* True for anything the bitset operators accept, including RoaringBitset */
+#define bitset_BitsetLike_Check(ob) \
+    (bitset_AnyBitset_Check(ob) || bitset_Roaring_Check(ob))
+
+/*
+ * Members are stored as an array of 64 bit words, member v being bit
+ * (v % 64) of word (v / 64).  A Bitset only accepts [1..32] so it always
+ * fits in the inline smallword; a BigBitset or FrozenBitset moves to a heap
+ * block as it grows.  Words beyond the last set bit may be zero, so nothing should
+ * assume nwords is minimal.
+ */
+typedef unsigned PY_LONG_LONG bitset_word;
+
+#define BITSET_WORD_BITS 64
+#define BITSET_WORD_INDEX(v) ((v) / BITSET_WORD_BITS)
+#define BITSET_WORD_MASK(v) (((bitset_word)1) << ((v) % BITSET_WORD_BITS))
+
+#define BITSET_MIN 1
+#define BITSET_MAX 32
+#define BITSET_SMALL_MASK (((bitset_word)0xFFFFFFFFU) << BITSET_MIN)
+#define BIGBITSET_MAX (PY_SSIZE_T_MAX / 2)
 
 typedef struct {
     PyObject_HEAD
-    unsigned int bits;
+    Py_ssize_t nwords;          /* number of words in use */
+    Py_ssize_t allocated;       /* number of words available at words */
+    bitset_word *words;         /* &smallword, or a PyMem block */
+    bitset_word smallword;
+    Py_ssize_t exports;         /* buffer views; the words can't move while > 0 */
+    Py_hash_t hash;             /* FrozenBitset only; -1 until computed */
+    Py_ssize_t *ranks;          /* rank directory, built by the first query */
+    Py_ssize_t nranks;          /* entries in ranks, or 0 if it is out of date */
+    PyObject *base;             /* MappedBitset only: the BitsetStore holding words */
 } bitset_BitsetObject;
 
+/* Every change to the words must go through here or a function calling it */
+#define bitset_changed(bso) ((bso)->nranks = 0)
+
+/*
+ * Operation statistics, compiled in with BITSET_STATS.  Each public
+ * operation counts its calls and, while it runs, the slow path reads of
+ * iterables, the bitsets and word blocks allocated and the words passed
+ * to the kernels; work done outside them is counted as "other".  Nested
+ * operations, such as the copy and update that make up a union, count
+ * towards the outermost.  With BITSET_STATS_CYCLES each call's duration
+ * is also added to a histogram with a bucket per power of two cycles.
+ * Without BITSET_STATS the macros below expand to nothing.
+ */
+#ifdef BITSET_STATS_CYCLES
+#ifndef BITSET_STATS
+#define BITSET_STATS
+#endif
+#endif
+
+#define BITSET_STAT_OTHER 0
+#define BITSET_STAT_CONSTRUCT 1
+#define BITSET_STAT_AND 2
+#define BITSET_STAT_OR 3
+#define BITSET_STAT_XOR 4
+#define BITSET_STAT_SUB 5
+#define BITSET_STAT_IAND 6
+#define BITSET_STAT_IOR 7
+#define BITSET_STAT_IXOR 8
+#define BITSET_STAT_ISUB 9
+#define BITSET_STAT_UNION 10
+#define BITSET_STAT_INTERSECTION 11
+#define BITSET_STAT_DIFFERENCE 12
+#define BITSET_STAT_UPDATE 13
+#define BITSET_STAT_INTERSECTION_UPDATE 14
+#define BITSET_STAT_DIFFERENCE_UPDATE 15
+#define BITSET_STAT_UNION_ALL 16
+#define BITSET_STAT_INTERSECT_ALL 17
+#define BITSET_STAT_COUNT_INTERSECTION 18
+#define BITSET_STAT_DUMPS 19
+#define BITSET_STAT_LOADS 20
+#define BITSET_NSTATS 21
+
+#ifdef BITSET_STATS
+
+#if defined(_MSC_VER)
+#define BITSET_TLS __declspec(thread)
+#else
+#define BITSET_TLS __thread
+#endif
+
+#define BITSET_CYCLE_BUCKETS 64
+
+typedef struct {
+    Py_ssize_t calls;
+    Py_ssize_t fallbacks;       /* iterables read member by member */
+    Py_ssize_t allocations;     /* bitset objects and word blocks */
+    Py_ssize_t words;           /* words passed to the kernels */
+#ifdef BITSET_STATS_CYCLES
+    Py_ssize_t cycles[BITSET_CYCLE_BUCKETS];
+#endif
+} bitset_stat;
+
+typedef struct {
+    int op;                     /* BITSET_STAT_OTHER if nested */
+#ifdef BITSET_STATS_CYCLES
+    unsigned PY_LONG_LONG start;
+#endif
+} bitset_stat_frame;
+
+static const char *bitset_op_names[BITSET_NSTATS] = {
+    "other", "construct", "and", "or", "xor", "sub", "iand", "ior", "ixor",
+    "isub", "union", "intersection", "difference", "update",
+    "intersection_update", "difference_update", "union_all",
+    "intersect_all", "count_intersection", "dumps", "loads"
+};
+
+/* Only changed with the GIL held */
+static bitset_stat bitset_stats[BITSET_NSTATS];
+
+/* Threads release the GIL inside operations, so each has its own */
+static BITSET_TLS int bitset_stat_op = BITSET_STAT_OTHER;
+
+#ifdef BITSET_STATS_CYCLES
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define bitset_cycles() __builtin_ia32_rdtsc()
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define bitset_cycles() __rdtsc()
+#else
+#include <time.h>
+/* nanoseconds stand in for cycles where there's no counter to read */
+static unsigned PY_LONG_LONG
+bitset_cycles(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned PY_LONG_LONG)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+#endif
+
+static void
+bitset_stat_enter(bitset_stat_frame *f, int op)
+{
+    f->op = BITSET_STAT_OTHER;
+    if (bitset_stat_op != BITSET_STAT_OTHER)
+        return;
+
+    f->op = bitset_stat_op = op;
+    bitset_stats[op].calls++;
+#ifdef BITSET_STATS_CYCLES
+    f->start = bitset_cycles();
+#endif
+}
+
+static void
+bitset_stat_exit(bitset_stat_frame *f)
+{
+#ifdef BITSET_STATS_CYCLES
+    unsigned PY_LONG_LONG cycles;
+    int bucket = 0;
+#endif
+
+    if (f->op == BITSET_STAT_OTHER)
+        return;
+
+#ifdef BITSET_STATS_CYCLES
+    cycles = bitset_cycles() - f->start;
+    while (cycles >>= 1)
+        bucket++;
+    bitset_stats[f->op].cycles[bucket]++;
+#endif
+    bitset_stat_op = BITSET_STAT_OTHER;
+}
+
+/* Evaluates call as operation op, assigning its value to result */
+#define BITSET_STAT_CALL(op, result, call)                              \
+    do {                                                                \
+        bitset_stat_frame frame_;                                       \
+        bitset_stat_enter(&frame_, op);                                 \
+        (result) = (call);                                              \
+        bitset_stat_exit(&frame_);                                      \
+    } while (0)
+
+#define BITSET_STAT_ADD(field, n) (bitset_stats[bitset_stat_op].field += (n))
+
+#else
+
+#define BITSET_STAT_CALL(op, result, call) ((result) = (call))
+#define BITSET_STAT_ADD(field, n)
+
+#endif
+
+static PyObject *bitset_from_roaring(PyTypeObject *type, PyObject *r);
+static Py_ssize_t bitset_Roaring_len(PyObject *r);
+
+/* The operations of RoaringBitsets, also applied between a bitset and a
+   RoaringBitset by the functions defined with RoaringBitset below */
+#define ROARING_AND 0
+#define ROARING_OR 1
+#define ROARING_XOR 2
+#define ROARING_ANDNOT 3
+
+static int bitset_roaring_words_op(bitset_BitsetObject *bso, PyObject *r, int op);
+static Py_ssize_t bitset_roaring_and_count_words(bitset_BitsetObject *bso, PyObject *r,
+                                                 int stop);
+static PyObject *bitset_roaring_from_bitset(PyTypeObject *type, PyObject *bso);
+static PyObject *bitset_roaring_union_all(PyTypeObject *type, PyObject **operands,
+                                          Py_ssize_t n);
+static PyObject *bitset_roaring_intersect_all(PyTypeObject *type, PyObject **operands,
+                                              Py_ssize_t n);
+static Py_ssize_t bitset_roaring_count_all(PyObject **operands, Py_ssize_t n);
+static PyObject *bitset_reduce_serialized(PyObject *obj);
+
+/* Reuse dead bitset objects, as setobject.c does, to save the allocator
+   calls for the temporaries that operators and copies create */
+#ifndef BITSET_MAXFREELIST
+#define BITSET_MAXFREELIST 80
+#endif
+static bitset_BitsetObject *bitset_free_list[BITSET_MAXFREELIST];
+static int bitset_numfree = 0;
+static Py_ssize_t bitset_free_list_hits = 0;
+static Py_ssize_t bitset_free_list_misses = 0;
+
 static void
 Bitset_dealloc(bitset_BitsetObject* self)
 {
-    self->ob_type->tp_free((PyObject*)self);
+    if (self->base != NULL)
+        Py_CLEAR(self->base);
+    else if (self->words != &self->smallword)
+        PyMem_Free(self->words);
+    PyMem_Free(self->ranks);
+    if (bitset_numfree < BITSET_MAXFREELIST)
+        bitset_free_list[bitset_numfree++] = self;
+    else
+        Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
 static PyObject *
@@ -37,739 +344,12839 @@ Bitset_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
     bitset_BitsetObject *self;
 
-    self = (bitset_BitsetObject *)type->tp_alloc(type, 0);
+    if (bitset_numfree > 0) {
+        self = bitset_free_list[--bitset_numfree];
+        (void)PyObject_INIT(self, type);
+        bitset_free_list_hits++;
+    }
+    else {
+        self = (bitset_BitsetObject *)type->tp_alloc(type, 0);
+        bitset_free_list_misses++;
+    }
+
     if (self != NULL) {
-        self->bits = 0U;
+        self->nwords = 0;
+        self->allocated = 1;
+        self->words = &self->smallword;
+        self->smallword = 0;
+        self->exports = 0;
+        self->hash = -1;
+        self->ranks = NULL;
+        self->nranks = 0;
+        self->base = NULL;
+        BITSET_STAT_ADD(allocations, 1);
     }
 
     return (PyObject *)self;
 }
 
 static int
-bitset_read_bits_from_sequence(PyObject *obj, unsigned int *bits)
+bitset_check_resizable(bitset_BitsetObject *bso)
 {
-    PyObject *key, *it;
-    unsigned int value;
-    int error = 0;
-
-    it = PyObject_GetIter(obj);
-    if (it == NULL)
+    if (bso->exports > 0) {
+        PyErr_SetString(PyExc_BufferError,
+                        "Existing exports of data: object cannot be re-sized");
         return -1;
-
-    while ((key = PyIter_Next(it)) != NULL) {
-        if (!PyInt_Check(key))
-            error = 1;
-
-        value = PyInt_AsLong(key);
-
-        if (value < 1 || value > 32)
-            error = 1;
-
-        if (error) {
-            PyErr_SetString(PyExc_TypeError, "bitsets can only contain integers [1..32]");
-            return -1;
-        }
-
-        *bits |= 1 << (value - 1);
-        Py_DECREF(key);
     }
-    Py_DECREF(it);
-
-    if (PyErr_Occurred())
-        return -1;
-
     return 0;
 }
 
-/* Returns the position of the rightmost unset bit in *bits, and unsets that bit */
-int
-bitset_pop(unsigned int *bits)
+/* Makes at least nwords words available, zeroing any newly used words */
+static int
+bitset_grow(bitset_BitsetObject *bso, Py_ssize_t nwords)
 {
-    unsigned v = *bits;
-    unsigned int c;     // c will be the number of zero bits on the right,
+    bitset_word *words;
+    Py_ssize_t allocated;
 
-    if (*bits == 0) {
+    if (nwords <= bso->nwords)
         return 0;
-    }
 
-    /* http://graphics.stanford.edu/~seander/bithacks.html#ZerosOnRightBinSearch */
-    if (v & 0x1) {
-        // special case for odd v (assumed to happen half of the time)
-        c = 0;
-    }
-    else {
-        c = 1;
-        if ((v & 0xffff) == 0) {
-            v >>= 16;
-            c += 16;
+    if (bitset_check_resizable(bso))
+        return -1;
+
+    if (nwords > bso->allocated) {
+        /* over-allocate like list_resize, so repeated adds are amortised */
+        allocated = nwords + (nwords >> 3) + (nwords < 9 ? 3 : 6);
+        if (allocated > PY_SSIZE_T_MAX / (Py_ssize_t)sizeof(bitset_word)) {
+            PyErr_NoMemory();
+            return -1;
         }
-        if ((v & 0xff) == 0) {
-            v >>= 8;
-            c += 8;
+
+        if (bso->words == &bso->smallword) {
+            words = (bitset_word *)PyMem_Malloc(allocated * sizeof(bitset_word));
+            if (words != NULL)
+                words[0] = bso->smallword;
         }
-        if ((v & 0xf) == 0) {
-            v >>= 4;
-            c += 4;
+        else {
+            words = (bitset_word *)PyMem_Realloc(bso->words,
+                                                 allocated * sizeof(bitset_word));
         }
-        if ((v & 0x3) == 0) {
-            v >>= 2;
-            c += 2;
+
+        if (words == NULL) {
+            PyErr_NoMemory();
+            return -1;
         }
-        c -= v & 0x1;
+
+        BITSET_STAT_ADD(allocations, 1);
+        bso->words = words;
+        bso->allocated = allocated;
     }
 
-    (*bits) &= ~0U - (1U << c);
-    return c + 1;
+    memset(bso->words + bso->nwords, 0,
+           (nwords - bso->nwords) * sizeof(bitset_word));
+    bso->nwords = nwords;
+    bitset_changed(bso);
+    return 0;
 }
 
-static PyObject *
-bitset_Bitset_copy(bitset_BitsetObject *bso)
+/* Drops the words from n onwards, or zeroes them if the words are exported */
+static void
+bitset_truncate(bitset_BitsetObject *bso, Py_ssize_t n)
 {
-    bitset_BitsetObject *result = (bitset_BitsetObject *)Bitset_new(&bitset_BitsetType, NULL, NULL);
-    result->bits = bso->bits;
-    return (PyObject *)result;
-}
+    if (n >= bso->nwords)
+        return;
 
-PyDoc_STRVAR(copy_doc, "Return a copy of a bitset.");
+    bitset_changed(bso);
+    if (bso->exports > 0)
+        memset(bso->words + n, 0, (bso->nwords - n) * sizeof(bitset_word));
+    else
+        bso->nwords = n;
+}
 
-/***** Bitset iterator type ***********************************************/
+/* Returns the number of words up to and including the last non-zero one */
+static Py_ssize_t
+bitset_used_words(bitset_BitsetObject *bso)
+{
+    Py_ssize_t n = bso->nwords;
 
-typedef struct {
-    PyObject_HEAD
-    bitset_BitsetObject *bi_bitset; /* Set to NULL when iterator is exhausted */
-    unsigned int bi_state;
-} bitset_Bitset_iterobject;
+    while (n > 0 && bso->words[n - 1] == 0)
+        n--;
+    return n;
+}
 
 static void
-bitset_Bitset_iter_dealloc(bitset_Bitset_iterobject *bsi)
+bitset_set_range_error(PyObject *bso)
 {
-    Py_XDECREF(bsi->bi_bitset);
-    PyObject_GC_Del(bsi);
+    if (bitset_Bitset_Check(bso))
+        PyErr_SetString(PyExc_TypeError, "bitsets can only contain integers [1..32]");
+    else
+        PyErr_Format(PyExc_TypeError, "%.100s can only contain non-negative integers",
+                     Py_TYPE(bso)->tp_name);
 }
 
-static PyMethodDef bitset_Bitset_iter_methods[] = {
-    /*    {"__length_hint__", (PyCFunction)setiter_len, METH_NOARGS, length_hint_doc},*/
-     {NULL,        NULL}        /* sentinel */
-};
-
-static PyObject *bitset_Bitset_iter_iternext(bitset_Bitset_iterobject *bi)
+/*
+ * Extracts the value of an integer key, returning -1 if key is not an
+ * integer.  Values that don't fit a Py_ssize_t are reported as -1, which is
+ * never a member.
+ */
+static int
+bitset_key_value(PyObject *key, Py_ssize_t *value)
 {
-    bitset_BitsetObject *bso = bi->bi_bitset;
-    unsigned int v;
-
-    if (bso == NULL)
-        return NULL;
-    assert (bitset_Bitset_Check(bso));
+#if PY_MAJOR_VERSION < 3
+    if (PyInt_Check(key)) {
+        *value = PyInt_AsSsize_t(key);
+        return 0;
+    }
+#endif
 
-    v = bitset_pop(&(bi->bi_state));
-    if (v > 0)
-        return PyInt_FromLong(v);
+    if (PyLong_Check(key)) {
+        *value = PyLong_AsSsize_t(key);
+        if (*value == -1 && PyErr_Occurred())
+            PyErr_Clear();
+        return 0;
+    }
 
-    Py_DECREF(bso);
-    bi->bi_bitset = NULL;
-    return NULL;
+    return -1;
 }
 
-static PyTypeObject bitset_Bitset_iter_Type = {
-    PyObject_HEAD_INIT(&PyType_Type)
-    0,                                         /* ob_size */
-    "Bitset_iterator",                         /* tp_name */
-    sizeof(bitset_Bitset_iterobject),          /* tp_basicsize */
-    0,                                         /* tp_itemsize */
-    /* methods */
-    (destructor)bitset_Bitset_iter_dealloc,    /* tp_dealloc */
-    0,                                         /* tp_print */
-    0,                                         /* tp_getattr */
-    0,                                         /* tp_setattr */
-    0,                                         /* tp_compare */
-    0,                                         /* tp_repr */
-    0,                                         /* tp_as_number */
-    0,                                         /* tp_as_sequence */
-    0,                                         /* tp_as_mapping */
-    0,                                         /* tp_hash */
-    0,                                         /* tp_call */
-    0,                                         /* tp_str */
-    PyObject_GenericGetAttr,                   /* tp_getattro */
-    0,                                         /* tp_setattro */
-    0,                                         /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,                        /* tp_flags */
-    0,                                         /* tp_doc */
-    0,                                         /* tp_traverse */
-    0,                                         /* tp_clear */
-    0,                                         /* tp_richcompare */
-    0,                                         /* tp_weaklistoffset */
-    PyObject_SelfIter,                         /* tp_iter */
-    (iternextfunc)bitset_Bitset_iter_iternext, /* tp_iternext */
-    bitset_Bitset_iter_methods,                /* tp_methods */
-    0,
-};
+/* Converts key to a member of bso, or returns -1 with TypeError set */
+static Py_ssize_t
+bitset_member(PyObject *bso, PyObject *key)
+{
+    Py_ssize_t value;
 
-static PyObject *
-bitset_Bitset_iter(bitset_BitsetObject *bso)
+    if (bitset_key_value(key, &value) == 0) {
+        if (bitset_Bitset_Check(bso)) {
+            if (value >= BITSET_MIN && value <= BITSET_MAX)
+                return value;
+        }
+        else if (value >= 0 && value <= BIGBITSET_MAX)
+            return value;
+    }
+
+    bitset_set_range_error(bso);
+    return -1;
+}
+
+static int
+bitset_add_member(bitset_BitsetObject *bso, Py_ssize_t v)
 {
-    bitset_Bitset_iterobject *bi = PyObject_GC_New(bitset_Bitset_iterobject, &bitset_Bitset_iter_Type);
-    if (bi == NULL)
-        return NULL;
+    if (bitset_grow(bso, BITSET_WORD_INDEX(v) + 1))
+        return -1;
 
-    Py_INCREF(bso);
-    bi->bi_bitset = bso;
-    bi->bi_state = bso->bits;
+    bso->words[BITSET_WORD_INDEX(v)] |= BITSET_WORD_MASK(v);
+    bitset_changed(bso);
+    return 0;
+}
 
-    return (PyObject *)bi;
+static int
+bitset_has_member(bitset_BitsetObject *bso, Py_ssize_t v)
+{
+    if (v < 0 || BITSET_WORD_INDEX(v) >= bso->nwords)
+        return 0;
+
+    return (bso->words[BITSET_WORD_INDEX(v)] & BITSET_WORD_MASK(v)) != 0;
 }
 
-/***** Sequence methods *****/
+static int bitset_add_range(bitset_BitsetObject *bso, Py_ssize_t lo, Py_ssize_t hi);
 
+/* Converts item i of a sequence to a member of bso, or returns -1 */
 static Py_ssize_t
-bitset_Bitset_len(PyObject *bso)
+bitset_item_member(bitset_BitsetObject *bso, PyObject *seq, Py_ssize_t i)
 {
-    unsigned int c;
-    unsigned int v = ((bitset_BitsetObject *)bso)->bits;
+    PyObject *key = PySequence_GetItem(seq, i);
+    Py_ssize_t value;
 
-    /* http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetParallel */
-    v = v - ((v >> 1) & 0x55555555);                    // reuse input as temporary
-    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);     // temp
-    c = (((v + (v >> 4)) & 0xF0F0F0F) * 0x1010101) >> 24; // count
-    return c;
+    if (key == NULL)
+        return -1;
+
+    value = bitset_member((PyObject *)bso, key);
+    Py_DECREF(key);
+    return value;
 }
 
+/* Adds the members of a range, which is all of them when step is 1 */
 static int
-bitset_Bitset_contains(bitset_BitsetObject *bso, PyObject *key)
+bitset_read_range(bitset_BitsetObject *bso, PyObject *range)
 {
-    if (!PyInt_Check(key)) {
-        PyErr_SetString(PyExc_TypeError, "bitsets can only contain integers [1..32]");
+    Py_ssize_t n, first, last, step, v;
+
+    n = PySequence_Size(range);
+    if (n <= 0)
+        return (int)n;
+
+    /* the ends bound the rest, so only they need checking */
+    if ((first = bitset_item_member(bso, range, 0)) < 0 ||
+        (last = bitset_item_member(bso, range, n - 1)) < 0)
         return -1;
-    }
 
-    return (bso->bits & (1 << (PyInt_AsLong(key) - 1))) != 0;
-}
+    if (first > last) {
+        v = first;
+        first = last;
+        last = v;
+    }
 
-static PyMethodDef bitset_methods[] = {
-    {NULL, NULL, 0, NULL}        /* Sentinel */
-};
+    step = n > 1 ? (last - first) / (n - 1) : 1;
+    if (step == 1)
+        return bitset_add_range(bso, first, last + 1);
 
-static PySequenceMethods bitset_as_sequence = {
-    bitset_Bitset_len,                  /* sq_length */
-    0,                                  /* sq_concat */
-    0,                                  /* sq_repeat */
-    0,                                  /* sq_item */
-    0,                                  /* sq_slice */
-    0,                                  /* sq_ass_item */
-    0,                                  /* sq_ass_slice */
-    (objobjproc)bitset_Bitset_contains, /* sq_contains */
-};
+    if (bitset_grow(bso, BITSET_WORD_INDEX(last) + 1))
+        return -1;
 
-/***** bitset methods *****/
+    for (v = first; v <= last; v += step)
+        bso->words[BITSET_WORD_INDEX(v)] |= BITSET_WORD_MASK(v);
+    bitset_changed(bso);
+    return 0;
+}
 
-static PyObject *
-bitset_Bitset_add(bitset_BitsetObject *bso, PyObject *key)
+/* Adds the members of a list or tuple without an iterator */
+static int
+bitset_read_items(bitset_BitsetObject *bso, PyObject *seq)
 {
-    if (!PyInt_Check(key) || PyInt_AsLong(key) > 32) {
-        PyErr_SetString(PyExc_TypeError, "bitsets can only contain integers [1..32]");
-        return NULL;
+    /* converting an item never runs Python code, so seq can't change */
+    PyObject **items = PySequence_Fast_ITEMS(seq);
+    Py_ssize_t i, n = PySequence_Fast_GET_SIZE(seq), value;
+    Py_ssize_t lo = bitset_Bitset_Check(bso) ? BITSET_MIN : 0;
+    Py_ssize_t hi = bitset_Bitset_Check(bso) ? BITSET_MAX : BIGBITSET_MAX;
+
+    bitset_changed(bso);
+    for (i = 0; i < n; i++) {
+        if (bitset_key_value(items[i], &value) || value < lo || value > hi) {
+            bitset_set_range_error((PyObject *)bso);
+            return -1;
+        }
+        if (BITSET_WORD_INDEX(value) >= bso->nwords &&
+            bitset_grow(bso, BITSET_WORD_INDEX(value) + 1))
+            return -1;
+        bso->words[BITSET_WORD_INDEX(value)] |= BITSET_WORD_MASK(value);
     }
 
-    bso->bits |= 1 << (PyInt_AsLong(key) - 1);
-    Py_RETURN_NONE;
+    return 0;
 }
 
-PyDoc_STRVAR(add_doc,
-"Add an element to a Bitset.\n\
-\n\
+/*
+ * Adds the members of a buffer of integers of the given C type.  Every item
+ * is checked, in a loop the compiler can vectorise, before any is added.
+ */
+#define BITSET_READ_BUFFER(name, type)                                      \
+static int                                                                  \
+bitset_read_##name(bitset_BitsetObject *bso, const type *items, Py_ssize_t n) \
+{                                                                           \
+    type lo, hi;                                                            \
+    Py_ssize_t i;                                                           \
+                                                                            \
+    if (n == 0)                                                             \
+        return 0;                                                           \
+                                                                            \
+    lo = hi = items[0];                                                     \
+    for (i = 1; i < n; i++) {                                               \
+        lo = items[i] < lo ? items[i] : lo;                                 \
+        hi = items[i] > hi ? items[i] : hi;                                 \
+    }                                                                       \
+                                                                            \
+    if (lo < (type)(bitset_Bitset_Check(bso) ? BITSET_MIN : 0) ||           \
+        (unsigned PY_LONG_LONG)hi >                                         \
+        (unsigned PY_LONG_LONG)(bitset_Bitset_Check(bso) ? BITSET_MAX : BIGBITSET_MAX)) { \
+        bitset_set_range_error((PyObject *)bso);                            \
+        return -1;                                                          \
+    }                                                                       \
+                                                                            \
+    if (bitset_grow(bso, BITSET_WORD_INDEX((Py_ssize_t)hi) + 1))            \
+        return -1;                                                          \
+                                                                            \
+    for (i = 0; i < n; i++)                                                 \
+        bso->words[BITSET_WORD_INDEX(items[i])] |= BITSET_WORD_MASK(items[i]); \
+    bitset_changed(bso);                                                    \
+    return 0;                                                               \
+}
+
+BITSET_READ_BUFFER(schar, signed char)
+BITSET_READ_BUFFER(uchar, unsigned char)
+BITSET_READ_BUFFER(short, short)
+BITSET_READ_BUFFER(ushort, unsigned short)
+BITSET_READ_BUFFER(int, int)
+BITSET_READ_BUFFER(uint, unsigned int)
+BITSET_READ_BUFFER(long, long)
+BITSET_READ_BUFFER(ulong, unsigned long)
+BITSET_READ_BUFFER(longlong, PY_LONG_LONG)
+BITSET_READ_BUFFER(ulonglong, unsigned PY_LONG_LONG)
+BITSET_READ_BUFFER(ssize_t, Py_ssize_t)
+BITSET_READ_BUFFER(size_t, size_t)
+
+/*
+ * Adds the members of a one dimensional buffer of native integers, such
+ * as an array.array or numpy array.  Returns 1 if obj isn't one.
+ */
+static int
+bitset_read_buffer(bitset_BitsetObject *bso, PyObject *obj)
+{
+    Py_buffer view;
+    const char *format;
+    Py_ssize_t n;
+    int result;
+
+#if PY_MAJOR_VERSION < 3
+    /* 2.x strings iterate as strings, not integers */
+    if (PyBytes_Check(obj) || PyUnicode_Check(obj))
+        return 1;
+#endif
+    if (!PyObject_CheckBuffer(obj))
+        return 1;
+
+    if (PyObject_GetBuffer(obj, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT)) {
+        PyErr_Clear();
+        return 1;
+    }
+
+    format = view.format != NULL ? view.format : "B";
+    if (*format == '@')
+        format++;
+    n = view.itemsize > 0 ? view.len / view.itemsize : 0;
+
+#define BITSET_BUFFER_CASE(code, name, type)                                \
+    case code:                                                              \
+        result = view.itemsize == sizeof(type) ?                            \
+            bitset_read_##name(bso, (const type *)view.buf, n) : 1;         \
+        break;
+
+    if (view.ndim > 1 || format[0] == '\0' || format[1] != '\0') {
+        result = 1;
+    }
+    else {
+        switch (*format) {
+        BITSET_BUFFER_CASE('b', schar, signed char)
+        BITSET_BUFFER_CASE('B', uchar, unsigned char)
+        BITSET_BUFFER_CASE('h', short, short)
+        BITSET_BUFFER_CASE('H', ushort, unsigned short)
+        BITSET_BUFFER_CASE('i', int, int)
+        BITSET_BUFFER_CASE('I', uint, unsigned int)
+        BITSET_BUFFER_CASE('l', long, long)
+        BITSET_BUFFER_CASE('L', ulong, unsigned long)
+        BITSET_BUFFER_CASE('q', longlong, PY_LONG_LONG)
+        BITSET_BUFFER_CASE('Q', ulonglong, unsigned PY_LONG_LONG)
+        BITSET_BUFFER_CASE('n', ssize_t, Py_ssize_t)
+        BITSET_BUFFER_CASE('N', size_t, size_t)
+        default:
+            result = 1;
+        }
+    }
+#undef BITSET_BUFFER_CASE
+
+    PyBuffer_Release(&view);
+    return result;
+}
+
+/*
+ * Adds the members of an iterable.  Ranges, lists, tuples and buffers of
+ * integers are read directly; anything else through its iterator.
+ */
+static int
+bitset_read_bits_from_sequence(PyObject *obj, bitset_BitsetObject *bso)
+{
+    PyObject *key, *it;
+    Py_ssize_t value;
+    int result;
+
+    if (PyRange_Check(obj))
+        return bitset_read_range(bso, obj);
+
+    if (PyList_CheckExact(obj) || PyTuple_CheckExact(obj))
+        return bitset_read_items(bso, obj);
+
+    result = bitset_read_buffer(bso, obj);
+    if (result <= 0)
+        return result;
+
+    BITSET_STAT_ADD(fallbacks, 1);
+    it = PyObject_GetIter(obj);
+    if (it == NULL)
+        return -1;
+
+    while ((key = PyIter_Next(it)) != NULL) {
+        value = bitset_member((PyObject *)bso, key);
+        Py_DECREF(key);
+
+        if (value < 0 || bitset_add_member(bso, value)) {
+            Py_DECREF(it);
+            return -1;
+        }
+    }
+    Py_DECREF(it);
+
+    if (PyErr_Occurred())
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Returns other as a bitset: a new reference to other itself if it is one,
+ * a BigBitset if it is a RoaringBitset, otherwise a new bitset of the given
+ * type read from the iterable.
+ */
+static bitset_BitsetObject *
+bitset_as_bitset_type(PyTypeObject *type, PyObject *other)
+{
+    bitset_BitsetObject *result;
+
+    if (bitset_AnyBitset_Check(other)) {
+        Py_INCREF(other);
+        return (bitset_BitsetObject *)other;
+    }
+
+    if (bitset_Roaring_Check(other))
+        return (bitset_BitsetObject *)bitset_from_roaring(&bitset_BigBitsetType, other);
+
+    result = (bitset_BitsetObject *)Bitset_new(type, NULL, NULL);
+    if (result == NULL)
+        return NULL;
+
+    if (bitset_read_bits_from_sequence(other, result)) {
+        Py_DECREF(result);
+        return NULL;
+    }
+
+    return result;
+}
+
+/* As bitset_as_bitset_type, reading iterables as bitsets of bso's type */
+static bitset_BitsetObject *
+bitset_as_bitset(bitset_BitsetObject *bso, PyObject *other)
+{
+    return bitset_as_bitset_type(bitset_result_type(bso), other);
+}
+
+/* Checks that all members of other are within the range of bso's type */
+static int
+bitset_check_fits(bitset_BitsetObject *bso, bitset_BitsetObject *other)
+{
+    Py_ssize_t n = bitset_used_words(other);
+
+    if (!bitset_Bitset_Check(bso) || n == 0)
+        return 0;
+
+    if (n > 1 || (other->words[0] & ~BITSET_SMALL_MASK)) {
+        bitset_set_range_error((PyObject *)bso);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+bitset_popcount(bitset_word v)
+{
+#if defined(__GNUC__) && defined(__POPCNT__)
+    /* compiled for a CPU with popcnt */
+    return __builtin_popcountll(v);
+#else
+    /* http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetParallel */
+    v = v - ((v >> 1) & (bitset_word)0x5555555555555555ULL);
+    v = (v & (bitset_word)0x3333333333333333ULL) +
+        ((v >> 2) & (bitset_word)0x3333333333333333ULL);
+    v = (v + (v >> 4)) & (bitset_word)0x0F0F0F0F0F0F0F0FULL;
+    return (int)((v * (bitset_word)0x0101010101010101ULL) >> 56);
+#endif
+}
+
+static Py_ssize_t
+bitset_count_scalar(const bitset_word *words, Py_ssize_t n)
+{
+    Py_ssize_t i, c = 0;
+
+    for (i = 0; i < n; i++)
+        c += bitset_popcount(words[i]);
+    return c;
+}
+
+/*
+ * Raw bytes hold member v as bit (v % 8) of byte (v / 8), which is the
+ * layout of the words in memory on little-endian machines.
+ */
+static void
+bitset_words_to_bytes(const bitset_word *words, unsigned char *bytes, Py_ssize_t nbytes)
+{
+#ifdef WORDS_BIGENDIAN
+    Py_ssize_t i;
+
+    for (i = 0; i < nbytes; i++)
+        bytes[i] = (unsigned char)(words[i / sizeof(bitset_word)] >> (8 * (i % sizeof(bitset_word))));
+#else
+    memcpy(bytes, words, nbytes);
+#endif
+}
+
+/* ORs nbytes raw bytes into words, which must have room for them */
+static void
+bitset_words_from_bytes(bitset_word *words, const unsigned char *bytes, Py_ssize_t nbytes)
+{
+    Py_ssize_t i;
+
+#ifdef WORDS_BIGENDIAN
+    for (i = 0; i < nbytes; i++)
+        words[i / sizeof(bitset_word)] |= (bitset_word)bytes[i] << (8 * (i % sizeof(bitset_word)));
+#else
+    unsigned char *dest = (unsigned char *)words;
+
+    for (i = 0; i < nbytes; i++)
+        dest[i] |= bytes[i];
+#endif
+}
+
+/* The bits of the word holding first from first up, and of the word
+   holding last up to last */
+#define BITSET_HEAD_MASK(first) (~(bitset_word)0 << ((first) % BITSET_WORD_BITS))
+#define BITSET_TAIL_MASK(last) \
+    (~(bitset_word)0 >> (BITSET_WORD_BITS - 1 - (last) % BITSET_WORD_BITS))
+
+/* Sets bits first..last, inclusive */
+static void
+bitset_set_bits(bitset_word *words, Py_ssize_t first, Py_ssize_t last)
+{
+    Py_ssize_t i = BITSET_WORD_INDEX(first), j = BITSET_WORD_INDEX(last);
+    bitset_word head = BITSET_HEAD_MASK(first), tail = BITSET_TAIL_MASK(last);
+
+    if (i == j) {
+        words[i] |= head & tail;
+        return;
+    }
+
+    words[i] |= head;
+    memset(words + i + 1, 0xFF, (j - i - 1) * sizeof(bitset_word));
+    words[j] |= tail;
+}
+
+/* Clears bits first..last, inclusive */
+static void
+bitset_clear_bits(bitset_word *words, Py_ssize_t first, Py_ssize_t last)
+{
+    Py_ssize_t i = BITSET_WORD_INDEX(first), j = BITSET_WORD_INDEX(last);
+    bitset_word head = BITSET_HEAD_MASK(first), tail = BITSET_TAIL_MASK(last);
+
+    if (i == j) {
+        words[i] &= ~(head & tail);
+        return;
+    }
+
+    words[i] &= ~head;
+    memset(words + i + 1, 0, (j - i - 1) * sizeof(bitset_word));
+    words[j] &= ~tail;
+}
+
+/* Inverts bits first..last, inclusive */
+static void
+bitset_flip_bits(bitset_word *words, Py_ssize_t first, Py_ssize_t last)
+{
+    Py_ssize_t i = BITSET_WORD_INDEX(first), j = BITSET_WORD_INDEX(last);
+    bitset_word head = BITSET_HEAD_MASK(first), tail = BITSET_TAIL_MASK(last);
+
+    if (i == j) {
+        words[i] ^= head & tail;
+        return;
+    }
+
+    words[i++] ^= head;
+    while (i < j)
+        words[i++] ^= ~(bitset_word)0;
+    words[j] ^= tail;
+}
+
+/***** Word kernels *****/
+
+/*
+ * Each operation has a kernel applying it in place (dst = dst op src) and
+ * a fused kernel returning popcount(a op b) without storing the result.
+ * The widest versions the CPU supports are chosen when the module is
+ * initialised; set_simd_level() can select narrower ones.
+ */
+typedef void (*bitset_op_kernel)(bitset_word *dst, const bitset_word *src, Py_ssize_t n);
+typedef Py_ssize_t (*bitset_count_kernel)(const bitset_word *a, const bitset_word *b, Py_ssize_t n);
+typedef Py_ssize_t (*bitset_popcount_kernel)(const bitset_word *words, Py_ssize_t n);
+
+typedef struct {
+    bitset_popcount_kernel count;
+    bitset_op_kernel and_;
+    bitset_op_kernel or_;
+    bitset_op_kernel xor_;
+    bitset_op_kernel andnot;
+    bitset_count_kernel and_count;
+    bitset_count_kernel or_count;
+    bitset_count_kernel xor_count;
+    bitset_count_kernel andnot_count;
+} bitset_kernel_table;
+
+#define BITSET_OP_AND(a, b) ((a) & (b))
+#define BITSET_OP_OR(a, b) ((a) | (b))
+#define BITSET_OP_XOR(a, b) ((a) ^ (b))
+#define BITSET_OP_ANDNOT(a, b) ((a) & ~(b))
+
+#define BITSET_SCALAR_KERNELS(name, op)                                     \
+static void                                                                 \
+bitset_##name##_scalar(bitset_word *dst, const bitset_word *src, Py_ssize_t n) \
+{                                                                           \
+    Py_ssize_t i;                                                           \
+    for (i = 0; i < n; i++)                                                 \
+        dst[i] = op(dst[i], src[i]);                                        \
+}                                                                           \
+                                                                            \
+static Py_ssize_t                                                           \
+bitset_##name##_count_scalar(const bitset_word *a, const bitset_word *b, Py_ssize_t n) \
+{                                                                           \
+    Py_ssize_t i, c = 0;                                                    \
+    for (i = 0; i < n; i++)                                                 \
+        c += bitset_popcount(op(a[i], b[i]));                               \
+    return c;                                                               \
+}
+
+BITSET_SCALAR_KERNELS(and, BITSET_OP_AND)
+BITSET_SCALAR_KERNELS(or, BITSET_OP_OR)
+BITSET_SCALAR_KERNELS(xor, BITSET_OP_XOR)
+BITSET_SCALAR_KERNELS(andnot, BITSET_OP_ANDNOT)
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BITSET_X86_KERNELS 1
+#if defined(__clang__) ? __clang_major__ >= 6 : __GNUC__ >= 8
+#define BITSET_AVX512_KERNELS 1
+#endif
+#endif
+
+#ifdef BITSET_X86_KERNELS
+#include <immintrin.h>
+
+/* Scalar kernels using the popcnt instruction, for CPUs without AVX2 */
+__attribute__((target("popcnt"))) static Py_ssize_t
+bitset_count_popcnt(const bitset_word *words, Py_ssize_t n)
+{
+    Py_ssize_t i, c = 0;
+
+    for (i = 0; i < n; i++)
+        c += __builtin_popcountll(words[i]);
+    return c;
+}
+
+#define BITSET_POPCNT_COUNT_KERNEL(name, op)                                \
+__attribute__((target("popcnt"))) static Py_ssize_t                         \
+bitset_##name##_count_popcnt(const bitset_word *a, const bitset_word *b, Py_ssize_t n) \
+{                                                                           \
+    Py_ssize_t i, c = 0;                                                    \
+    for (i = 0; i < n; i++)                                                 \
+        c += __builtin_popcountll(op(a[i], b[i]));                          \
+    return c;                                                               \
+}
+
+BITSET_POPCNT_COUNT_KERNEL(and, BITSET_OP_AND)
+BITSET_POPCNT_COUNT_KERNEL(or, BITSET_OP_OR)
+BITSET_POPCNT_COUNT_KERNEL(xor, BITSET_OP_XOR)
+BITSET_POPCNT_COUNT_KERNEL(andnot, BITSET_OP_ANDNOT)
+
+/* Vector kernels work on whole vectors, leaving any tail to the scalar ones */
+#define BITSET_VECTOR_KERNEL(name, suffix, isa, vec, load, store, op)       \
+__attribute__((target(isa))) static void                                    \
+bitset_##name##_##suffix(bitset_word *dst, const bitset_word *src, Py_ssize_t n) \
+{                                                                           \
+    const Py_ssize_t step = sizeof(vec) / sizeof(bitset_word);              \
+    Py_ssize_t i;                                                           \
+    for (i = 0; i + step <= n; i += step)                                   \
+        store((vec *)(dst + i), op(load((const vec *)(dst + i)),            \
+                                   load((const vec *)(src + i))));          \
+    bitset_##name##_scalar(dst + i, src + i, n - i);                        \
+}
+
+/* andnot intrinsics compute ~a & b */
+#define BITSET_SSE2_ANDNOT(a, b) _mm_andnot_si128((b), (a))
+#define BITSET_AVX2_ANDNOT(a, b) _mm256_andnot_si256((b), (a))
+
+BITSET_VECTOR_KERNEL(and, sse2, "sse2", __m128i, _mm_loadu_si128, _mm_storeu_si128, _mm_and_si128)
+BITSET_VECTOR_KERNEL(or, sse2, "sse2", __m128i, _mm_loadu_si128, _mm_storeu_si128, _mm_or_si128)
+BITSET_VECTOR_KERNEL(xor, sse2, "sse2", __m128i, _mm_loadu_si128, _mm_storeu_si128, _mm_xor_si128)
+BITSET_VECTOR_KERNEL(andnot, sse2, "sse2", __m128i, _mm_loadu_si128, _mm_storeu_si128, BITSET_SSE2_ANDNOT)
+
+BITSET_VECTOR_KERNEL(and, avx2, "avx2", __m256i, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_and_si256)
+BITSET_VECTOR_KERNEL(or, avx2, "avx2", __m256i, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_or_si256)
+BITSET_VECTOR_KERNEL(xor, avx2, "avx2", __m256i, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_xor_si256)
+BITSET_VECTOR_KERNEL(andnot, avx2, "avx2", __m256i, _mm256_loadu_si256, _mm256_storeu_si256, BITSET_AVX2_ANDNOT)
+
+/* Per 64 bit lane popcounts, using the nibble lookup from Mula et al,
+   "Faster Population Counts Using AVX2 Instructions" */
+__attribute__((target("avx2"))) static __inline __m256i
+bitset_popcount_avx2(__m256i v)
+{
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v, low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                     _mm256_shuffle_epi8(lookup, hi));
+
+    return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+}
+
+/* Carry-save adder: h:l = a + b + c, bitwise */
+#define BITSET_CSA(h, l, a, b, c) do {                                      \
+        __m256i u_ = _mm256_xor_si256((a), (b));                            \
+        (h) = _mm256_or_si256(_mm256_and_si256((a), (b)),                   \
+                              _mm256_and_si256(u_, (c)));                   \
+        (l) = _mm256_xor_si256(u_, (c));                                    \
+    } while (0)
+
+#define BITSET_LOAD256(i) _mm256_loadu_si256(data + (i))
+
+/*
+ * Harley-Seal population count, from Mula, Kurz & Lemire, "Faster
+ * Population Counts Using AVX2 Instructions".  Sixteen vectors are reduced
+ * through a tree of carry-save adders so that only one vector popcount is
+ * needed per 512 bytes.
+ */
+__attribute__((target("avx2"))) static Py_ssize_t
+bitset_count_avx2(const bitset_word *words, Py_ssize_t n)
+{
+    const __m256i *data = (const __m256i *)words;
+    __m256i total = _mm256_setzero_si256();
+    __m256i ones = _mm256_setzero_si256(), twos = _mm256_setzero_si256();
+    __m256i fours = _mm256_setzero_si256(), eights = _mm256_setzero_si256();
+    __m256i sixteens, twos_a, twos_b, fours_a, fours_b, eights_a, eights_b;
+    Py_ssize_t i, nvectors = n / 4;
+
+    for (i = 0; i + 16 <= nvectors; i += 16) {
+        BITSET_CSA(twos_a, ones, ones, BITSET_LOAD256(i), BITSET_LOAD256(i + 1));
+        BITSET_CSA(twos_b, ones, ones, BITSET_LOAD256(i + 2), BITSET_LOAD256(i + 3));
+        BITSET_CSA(fours_a, twos, twos, twos_a, twos_b);
+        BITSET_CSA(twos_a, ones, ones, BITSET_LOAD256(i + 4), BITSET_LOAD256(i + 5));
+        BITSET_CSA(twos_b, ones, ones, BITSET_LOAD256(i + 6), BITSET_LOAD256(i + 7));
+        BITSET_CSA(fours_b, twos, twos, twos_a, twos_b);
+        BITSET_CSA(eights_a, fours, fours, fours_a, fours_b);
+        BITSET_CSA(twos_a, ones, ones, BITSET_LOAD256(i + 8), BITSET_LOAD256(i + 9));
+        BITSET_CSA(twos_b, ones, ones, BITSET_LOAD256(i + 10), BITSET_LOAD256(i + 11));
+        BITSET_CSA(fours_a, twos, twos, twos_a, twos_b);
+        BITSET_CSA(twos_a, ones, ones, BITSET_LOAD256(i + 12), BITSET_LOAD256(i + 13));
+        BITSET_CSA(twos_b, ones, ones, BITSET_LOAD256(i + 14), BITSET_LOAD256(i + 15));
+        BITSET_CSA(fours_b, twos, twos, twos_a, twos_b);
+        BITSET_CSA(eights_b, fours, fours, fours_a, fours_b);
+        BITSET_CSA(sixteens, eights, eights, eights_a, eights_b);
+        total = _mm256_add_epi64(total, bitset_popcount_avx2(sixteens));
+    }
+
+    total = _mm256_slli_epi64(total, 4);
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(bitset_popcount_avx2(eights), 3));
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(bitset_popcount_avx2(fours), 2));
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(bitset_popcount_avx2(twos), 1));
+    total = _mm256_add_epi64(total, bitset_popcount_avx2(ones));
+
+    for (; i < nvectors; i++)
+        total = _mm256_add_epi64(total, bitset_popcount_avx2(BITSET_LOAD256(i)));
+
+    return (Py_ssize_t)(_mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+                        _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3)) +
+        bitset_count_scalar(words + nvectors * 4, n - nvectors * 4);
+}
+
+#define BITSET_AVX2_COUNT_KERNEL(name, op)                                  \
+__attribute__((target("avx2"))) static Py_ssize_t                           \
+bitset_##name##_count_avx2(const bitset_word *a, const bitset_word *b, Py_ssize_t n) \
+{                                                                           \
+    __m256i acc = _mm256_setzero_si256();                                   \
+    Py_ssize_t i;                                                           \
+    for (i = 0; i + 4 <= n; i += 4)                                         \
+        acc = _mm256_add_epi64(acc, bitset_popcount_avx2(                   \
+            op(_mm256_loadu_si256((const __m256i *)(a + i)),                \
+               _mm256_loadu_si256((const __m256i *)(b + i)))));             \
+    return (Py_ssize_t)(_mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) + \
+                        _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3)) + \
+        bitset_##name##_count_scalar(a + i, b + i, n - i);                  \
+}
+
+BITSET_AVX2_COUNT_KERNEL(and, _mm256_and_si256)
+BITSET_AVX2_COUNT_KERNEL(or, _mm256_or_si256)
+BITSET_AVX2_COUNT_KERNEL(xor, _mm256_xor_si256)
+BITSET_AVX2_COUNT_KERNEL(andnot, BITSET_AVX2_ANDNOT)
+
+#ifdef BITSET_AVX512_KERNELS
+#define BITSET_AVX512_ANDNOT(a, b) _mm512_andnot_si512((b), (a))
+
+BITSET_VECTOR_KERNEL(and, avx512, "avx512f", __m512i, _mm512_loadu_si512, _mm512_storeu_si512, _mm512_and_si512)
+BITSET_VECTOR_KERNEL(or, avx512, "avx512f", __m512i, _mm512_loadu_si512, _mm512_storeu_si512, _mm512_or_si512)
+BITSET_VECTOR_KERNEL(xor, avx512, "avx512f", __m512i, _mm512_loadu_si512, _mm512_storeu_si512, _mm512_xor_si512)
+BITSET_VECTOR_KERNEL(andnot, avx512, "avx512f", __m512i, _mm512_loadu_si512, _mm512_storeu_si512, BITSET_AVX512_ANDNOT)
+
+/* Counts need VPOPCNTDQ; without it the AVX2 ones are used */
+__attribute__((target("avx512f,avx512vpopcntdq"))) static Py_ssize_t
+bitset_count_avx512(const bitset_word *words, Py_ssize_t n)
+{
+    __m512i acc = _mm512_setzero_si512();
+    Py_ssize_t i;
+
+    for (i = 0; i + 8 <= n; i += 8)
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(
+            _mm512_loadu_si512((const void *)(words + i))));
+    return (Py_ssize_t)_mm512_reduce_add_epi64(acc) + bitset_count_scalar(words + i, n - i);
+}
+
+#define BITSET_AVX512_COUNT_KERNEL(name, op)                                \
+__attribute__((target("avx512f,avx512vpopcntdq"))) static Py_ssize_t       \
+bitset_##name##_count_avx512(const bitset_word *a, const bitset_word *b, Py_ssize_t n) \
+{                                                                           \
+    __m512i acc = _mm512_setzero_si512();                                   \
+    Py_ssize_t i;                                                           \
+    for (i = 0; i + 8 <= n; i += 8)                                         \
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(                    \
+            op(_mm512_loadu_si512((const void *)(a + i)),                   \
+               _mm512_loadu_si512((const void *)(b + i)))));                \
+    return (Py_ssize_t)_mm512_reduce_add_epi64(acc) +                       \
+        bitset_##name##_count_scalar(a + i, b + i, n - i);                  \
+}
+
+BITSET_AVX512_COUNT_KERNEL(and, _mm512_and_si512)
+BITSET_AVX512_COUNT_KERNEL(or, _mm512_or_si512)
+BITSET_AVX512_COUNT_KERNEL(xor, _mm512_xor_si512)
+BITSET_AVX512_COUNT_KERNEL(andnot, BITSET_AVX512_ANDNOT)
+#endif /* BITSET_AVX512_KERNELS */
+#endif /* BITSET_X86_KERNELS */
+
+enum {
+    BITSET_SIMD_SCALAR,
+    BITSET_SIMD_SSE2,
+    BITSET_SIMD_AVX2,
+    BITSET_SIMD_AVX512,
+    BITSET_SIMD_LEVELS
+};
+
+static const char *bitset_simd_names[BITSET_SIMD_LEVELS] = {
+    "scalar", "sse2", "avx2", "avx512"
+};
+
+static int bitset_simd_supported[BITSET_SIMD_LEVELS] = {1, 0, 0, 0};
+static int bitset_simd_popcnt = 0;      /* popcnt instruction available */
+static int bitset_simd_popcnt512 = 0;   /* AVX-512 VPOPCNTDQ available */
+static int bitset_simd_level = BITSET_SIMD_SCALAR;
+
+static bitset_kernel_table bitset_kernels = {
+    bitset_count_scalar,
+    bitset_and_scalar, bitset_or_scalar, bitset_xor_scalar, bitset_andnot_scalar,
+    bitset_and_count_scalar, bitset_or_count_scalar,
+    bitset_xor_count_scalar, bitset_andnot_count_scalar
+};
+
+static void
+bitset_select_kernels(int level)
+{
+    bitset_kernel_table k = {
+        bitset_count_scalar,
+        bitset_and_scalar, bitset_or_scalar, bitset_xor_scalar, bitset_andnot_scalar,
+        bitset_and_count_scalar, bitset_or_count_scalar,
+        bitset_xor_count_scalar, bitset_andnot_count_scalar
+    };
+
+#ifdef BITSET_X86_KERNELS
+    if (level >= BITSET_SIMD_SSE2) {
+        k.and_ = bitset_and_sse2;
+        k.or_ = bitset_or_sse2;
+        k.xor_ = bitset_xor_sse2;
+        k.andnot = bitset_andnot_sse2;
+        if (bitset_simd_popcnt) {
+            k.count = bitset_count_popcnt;
+            k.and_count = bitset_and_count_popcnt;
+            k.or_count = bitset_or_count_popcnt;
+            k.xor_count = bitset_xor_count_popcnt;
+            k.andnot_count = bitset_andnot_count_popcnt;
+        }
+    }
+    if (level >= BITSET_SIMD_AVX2) {
+        k.and_ = bitset_and_avx2;
+        k.or_ = bitset_or_avx2;
+        k.xor_ = bitset_xor_avx2;
+        k.andnot = bitset_andnot_avx2;
+        k.count = bitset_count_avx2;
+        k.and_count = bitset_and_count_avx2;
+        k.or_count = bitset_or_count_avx2;
+        k.xor_count = bitset_xor_count_avx2;
+        k.andnot_count = bitset_andnot_count_avx2;
+    }
+#ifdef BITSET_AVX512_KERNELS
+    if (level >= BITSET_SIMD_AVX512) {
+        k.and_ = bitset_and_avx512;
+        k.or_ = bitset_or_avx512;
+        k.xor_ = bitset_xor_avx512;
+        k.andnot = bitset_andnot_avx512;
+        if (bitset_simd_popcnt512) {
+            k.count = bitset_count_avx512;
+            k.and_count = bitset_and_count_avx512;
+            k.or_count = bitset_or_count_avx512;
+            k.xor_count = bitset_xor_count_avx512;
+            k.andnot_count = bitset_andnot_count_avx512;
+        }
+    }
+#endif
+#endif
+
+    bitset_kernels = k;
+    bitset_simd_level = level;
+}
+
+/* Detects the available instruction sets and selects the widest kernels */
+static void
+bitset_init_kernels(void)
+{
+    int level;
+
+#ifdef BITSET_X86_KERNELS
+    __builtin_cpu_init();
+    bitset_simd_supported[BITSET_SIMD_SSE2] = __builtin_cpu_supports("sse2");
+    bitset_simd_popcnt = __builtin_cpu_supports("popcnt");
+    bitset_simd_supported[BITSET_SIMD_AVX2] = __builtin_cpu_supports("avx2");
+#ifdef BITSET_AVX512_KERNELS
+    bitset_simd_supported[BITSET_SIMD_AVX512] = __builtin_cpu_supports("avx512f");
+    bitset_simd_popcnt512 = __builtin_cpu_supports("avx512vpopcntdq");
+#endif
+#endif
+
+    for (level = BITSET_SIMD_LEVELS - 1; !bitset_simd_supported[level]; level--)
+        ;
+    bitset_select_kernels(level);
+}
+
+/***** Parallel execution *****/
+
+/*
+ * Operations on at least BITSET_NOGIL_WORDS words run with the GIL
+ * released.  Those on at least BITSET_PARALLEL_WORDS words are also split
+ * into ranges shared between the calling thread and a pool of worker
+ * threads, once set_threads() has asked for more than one thread.  The
+ * bitsets involved are pinned while the GIL is released, as they are by a
+ * buffer export, so that no other thread can move their words.
+ */
+#ifndef BITSET_NOGIL_WORDS
+#define BITSET_NOGIL_WORDS 4096
+#endif
+#ifndef BITSET_PARALLEL_WORDS
+#define BITSET_PARALLEL_WORDS 65536
+#endif
+#define BITSET_MAX_THREADS 1024
+
+/* Works on words [start, end), returning a count if the operation makes one */
+typedef Py_ssize_t (*bitset_range_func)(void *arg, Py_ssize_t start, Py_ssize_t end);
+
+/* Threads per operation, including the caller.  Written under
+   bitset_pool_lock when built with threads */
+static int bitset_nthreads = 1;
+
+#define bitset_pin(bso) ((bso)->exports++)
+#define bitset_unpin(bso) ((bso)->exports--)
+
+#ifdef BITSET_THREADS
+typedef struct {
+    bitset_range_func func;
+    void *arg;
+    Py_ssize_t nwords;
+    Py_ssize_t step;            /* words in each range */
+    Py_ssize_t next;            /* start of the first range not yet taken */
+    Py_ssize_t count;           /* sum of the counts of finished ranges */
+    int running;                /* threads working on ranges */
+} bitset_job;
+
+/* Everything below is guarded by bitset_pool_lock */
+static pthread_mutex_t bitset_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bitset_pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t bitset_pool_done = PTHREAD_COND_INITIALIZER;
+static pthread_t *bitset_pool_workers = NULL;
+static int bitset_pool_size = 0;        /* workers started */
+static int bitset_pool_stopping = 0;
+static bitset_job *bitset_pool_job = NULL;
+static unsigned long bitset_pool_jobs = 0;      /* jobs posted */
+
+/* Takes ranges of job until there are none left; called with the lock held */
+static void
+bitset_job_work(bitset_job *job)
+{
+    Py_ssize_t start, end, count = 0;
+
+    job->running++;
+    while (job->next < job->nwords) {
+        start = job->next;
+        end = Py_MIN(start + job->step, job->nwords);
+        job->next = end;
+
+        pthread_mutex_unlock(&bitset_pool_lock);
+        count += job->func(job->arg, start, end);
+        pthread_mutex_lock(&bitset_pool_lock);
+    }
+
+    job->count += count;
+    if (--job->running == 0)
+        pthread_cond_broadcast(&bitset_pool_done);
+}
+
+static void *
+bitset_pool_worker(void *unused)
+{
+    unsigned long seen;
+
+    pthread_mutex_lock(&bitset_pool_lock);
+    seen = bitset_pool_jobs;
+    for (;;) {
+        while (!bitset_pool_stopping &&
+               (bitset_pool_job == NULL || bitset_pool_jobs == seen))
+            pthread_cond_wait(&bitset_pool_work, &bitset_pool_lock);
+        if (bitset_pool_stopping)
+            break;
+
+        seen = bitset_pool_jobs;
+        bitset_job_work(bitset_pool_job);
+    }
+    pthread_mutex_unlock(&bitset_pool_lock);
+
+    return NULL;
+}
+
+/*
+ * Runs func over words [0, nwords) on the pool, returning -1 without
+ * running it if the pool is in use by another thread or being stopped.
+ * Called without the GIL.
+ */
+static Py_ssize_t
+bitset_pool_run(bitset_range_func func, void *arg, Py_ssize_t nwords)
+{
+    bitset_job job;
+    int nthreads;
+
+    pthread_mutex_lock(&bitset_pool_lock);
+    nthreads = bitset_nthreads;
+    if (bitset_pool_job != NULL || bitset_pool_stopping || nthreads < 2) {
+        pthread_mutex_unlock(&bitset_pool_lock);
+        return -1;
+    }
+
+    /* workers are started on first use, and again after a fork */
+    while (bitset_pool_size < nthreads - 1 &&
+           pthread_create(&bitset_pool_workers[bitset_pool_size], NULL,
+                          bitset_pool_worker, NULL) == 0)
+        bitset_pool_size++;
+
+    job.func = func;
+    job.arg = arg;
+    job.nwords = nwords;
+    /* several ranges per thread balance the load, and whole cache lines
+       keep threads from writing to the same one */
+    job.step = (nwords / (4 * (Py_ssize_t)nthreads) + 63) & ~(Py_ssize_t)63;
+    job.next = 0;
+    job.count = 0;
+    job.running = 0;
+
+    bitset_pool_job = &job;
+    bitset_pool_jobs++;
+    pthread_cond_broadcast(&bitset_pool_work);
+
+    bitset_job_work(&job);
+    while (job.running > 0)
+        pthread_cond_wait(&bitset_pool_done, &bitset_pool_lock);
+
+    bitset_pool_job = NULL;
+    pthread_cond_broadcast(&bitset_pool_done);
+    pthread_mutex_unlock(&bitset_pool_lock);
+
+    return job.count;
+}
+
+/*
+ * Stops and joins the workers, then makes workers (room for n - 1) the
+ * pool's array and n the number of threads, returning the old array.  The
+ * pool stays stopped until both are swapped, so bitset_pool_run never sees
+ * one without the other.  Called with the GIL, which the workers never take.
+ */
+static pthread_t *
+bitset_pool_resize(pthread_t *workers, int n)
+{
+    pthread_t *old = bitset_pool_workers;
+    int i;
+
+    pthread_mutex_lock(&bitset_pool_lock);
+    while (bitset_pool_job != NULL)
+        pthread_cond_wait(&bitset_pool_done, &bitset_pool_lock);
+    bitset_pool_stopping = 1;
+    pthread_cond_broadcast(&bitset_pool_work);
+    pthread_mutex_unlock(&bitset_pool_lock);
+
+    for (i = 0; i < bitset_pool_size; i++)
+        pthread_join(bitset_pool_workers[i], NULL);
+
+    pthread_mutex_lock(&bitset_pool_lock);
+    bitset_pool_workers = workers;
+    bitset_nthreads = n;
+    bitset_pool_size = 0;
+    bitset_pool_stopping = 0;
+    pthread_mutex_unlock(&bitset_pool_lock);
+    return old;
+}
+
+/* Only the forking thread survives in the child, so forget the workers */
+static void
+bitset_pool_atfork_child(void)
+{
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+    bitset_pool_lock = lock;
+    bitset_pool_work = cond;
+    bitset_pool_done = cond;
+    bitset_pool_size = 0;
+    bitset_pool_stopping = 0;
+    bitset_pool_job = NULL;
+}
+#endif
+
+/*
+ * Runs func over words [0, nwords) and returns the sum of its counts.  The
+ * caller must pin any bitsets that func uses.
+ */
+static Py_ssize_t
+bitset_run_ranges(bitset_range_func func, void *arg, Py_ssize_t nwords)
+{
+    Py_ssize_t count = -1;
+
+    BITSET_STAT_ADD(words, nwords);
+    if (nwords < BITSET_NOGIL_WORDS)
+        return func(arg, 0, nwords);
+
+    Py_BEGIN_ALLOW_THREADS
+#ifdef BITSET_THREADS
+    if (bitset_nthreads > 1 && nwords >= BITSET_PARALLEL_WORDS)
+        count = bitset_pool_run(func, arg, nwords);
+#endif
+    if (count < 0)
+        count = func(arg, 0, nwords);
+    Py_END_ALLOW_THREADS
+
+    return count;
+}
+
+typedef struct {
+    bitset_op_kernel op;
+    bitset_count_kernel count2;
+    bitset_popcount_kernel count1;
+    bitset_word *dst;
+    const bitset_word *a;
+    const bitset_word *b;
+} bitset_kernel_args;
+
+static Py_ssize_t
+bitset_op_range(void *arg, Py_ssize_t start, Py_ssize_t end)
+{
+    bitset_kernel_args *k = (bitset_kernel_args *)arg;
+
+    k->op(k->dst + start, k->a + start, end - start);
+    return 0;
+}
+
+static Py_ssize_t
+bitset_count_range(void *arg, Py_ssize_t start, Py_ssize_t end)
+{
+    bitset_kernel_args *k = (bitset_kernel_args *)arg;
+
+    if (k->b == NULL)
+        return k->count1(k->a + start, end - start);
+    return k->count2(k->a + start, k->b + start, end - start);
+}
+
+/* Applies dst = dst op src to n words, which the caller must keep in place */
+static void
+bitset_run_words(bitset_op_kernel op, bitset_word *dst, const bitset_word *src, Py_ssize_t n)
+{
+    bitset_kernel_args k;
+
+    k.op = op;
+    k.dst = dst;
+    k.a = src;
+    bitset_run_ranges(bitset_op_range, &k, n);
+}
+
+/* Applies dst = dst op src to the first n words */
+static void
+bitset_run_op(bitset_op_kernel op, bitset_BitsetObject *dst, bitset_BitsetObject *src,
+              Py_ssize_t n)
+{
+    bitset_pin(dst);
+    bitset_pin(src);
+    bitset_run_words(op, dst->words, src->words, n);
+    bitset_unpin(dst);
+    bitset_unpin(src);
+}
+
+/* Returns count(a, b) over n words, or popcount(a) if b is NULL */
+static Py_ssize_t
+bitset_run_count(bitset_count_kernel count, const bitset_word *a, const bitset_word *b,
+                 Py_ssize_t n)
+{
+    bitset_kernel_args k;
+
+    if (n <= 0)
+        return 0;
+
+    k.count2 = count;
+    k.count1 = bitset_kernels.count;
+    k.a = a;
+    k.b = b;
+    return bitset_run_ranges(bitset_count_range, &k, n);
+}
+
+typedef struct {
+    bitset_word *words;
+    unsigned char *bytes;
+    Py_ssize_t nbytes;
+} bitset_bytes_args;
+
+static Py_ssize_t
+bitset_to_bytes_range(void *arg, Py_ssize_t start, Py_ssize_t end)
+{
+    bitset_bytes_args *a = (bitset_bytes_args *)arg;
+    Py_ssize_t first = start * (Py_ssize_t)sizeof(bitset_word);
+
+    bitset_words_to_bytes(a->words + start, a->bytes + first,
+                          Py_MIN(end * (Py_ssize_t)sizeof(bitset_word), a->nbytes) - first);
+    return 0;
+}
+
+static Py_ssize_t
+bitset_from_bytes_range(void *arg, Py_ssize_t start, Py_ssize_t end)
+{
+    bitset_bytes_args *a = (bitset_bytes_args *)arg;
+    Py_ssize_t first = start * (Py_ssize_t)sizeof(bitset_word);
+
+    bitset_words_from_bytes(a->words + start, a->bytes + first,
+                            Py_MIN(end * (Py_ssize_t)sizeof(bitset_word), a->nbytes) - first);
+    return 0;
+}
+
+/* Copies the first nbytes bytes of bso's words to bytes, as raw bytes */
+static void
+bitset_export_bytes(bitset_BitsetObject *bso, unsigned char *bytes, Py_ssize_t nbytes)
+{
+    bitset_bytes_args a;
+
+    a.words = bso->words;
+    a.bytes = bytes;
+    a.nbytes = nbytes;
+
+    bitset_pin(bso);
+    bitset_run_ranges(bitset_to_bytes_range, &a,
+                      (nbytes + sizeof(bitset_word) - 1) / sizeof(bitset_word));
+    bitset_unpin(bso);
+}
+
+/* ORs nbytes raw bytes into bso's words, which must have room for them */
+static void
+bitset_import_bytes(bitset_BitsetObject *bso, const unsigned char *bytes, Py_ssize_t nbytes)
+{
+    bitset_bytes_args a;
+
+    a.words = bso->words;
+    a.bytes = (unsigned char *)bytes;
+    a.nbytes = nbytes;
+    bitset_changed(bso);
+
+    bitset_pin(bso);
+    bitset_run_ranges(bitset_from_bytes_range, &a,
+                      (nbytes + sizeof(bitset_word) - 1) / sizeof(bitset_word));
+    bitset_unpin(bso);
+}
+
+/***** Word operations *****/
+
+static int
+bitset_or_words(bitset_BitsetObject *bso, bitset_BitsetObject *other)
+{
+    Py_ssize_t n = bitset_used_words(other);
+
+    if (bitset_grow(bso, n))
+        return -1;
+
+    bitset_changed(bso);
+    if (n == 1)
+        bso->words[0] |= other->words[0];
+    else
+        bitset_run_op(bitset_kernels.or_, bso, other, n);
+    return 0;
+}
+
+static int
+bitset_xor_words(bitset_BitsetObject *bso, bitset_BitsetObject *other)
+{
+    Py_ssize_t n = bitset_used_words(other);
+
+    if (bitset_grow(bso, n))
+        return -1;
+
+    bitset_changed(bso);
+    if (n == 1)
+        bso->words[0] ^= other->words[0];
+    else
+        bitset_run_op(bitset_kernels.xor_, bso, other, n);
+    return 0;
+}
+
+static void
+bitset_and_words(bitset_BitsetObject *bso, bitset_BitsetObject *other)
+{
+    Py_ssize_t n = Py_MIN(bso->nwords, other->nwords);
+
+    bitset_changed(bso);
+    if (n == 1)
+        bso->words[0] &= other->words[0];
+    else
+        bitset_run_op(bitset_kernels.and_, bso, other, n);
+    bitset_truncate(bso, n);
+}
+
+static void
+bitset_sub_words(bitset_BitsetObject *bso, bitset_BitsetObject *other)
+{
+    Py_ssize_t n = Py_MIN(bso->nwords, other->nwords);
+
+    bitset_changed(bso);
+    if (n == 1)
+        bso->words[0] &= ~other->words[0];
+    else
+        bitset_run_op(bitset_kernels.andnot, bso, other, n);
+}
+
+/*
+ * Returns the popcount of kernel(a, b) over the words they share, adding
+ * the popcount of the rest of a if tail_a and of b if tail_b
+ */
+static Py_ssize_t
+bitset_fused_count(bitset_count_kernel kernel, bitset_BitsetObject *a,
+                   bitset_BitsetObject *b, int tail_a, int tail_b)
+{
+    Py_ssize_t n = Py_MIN(a->nwords, b->nwords), count;
+
+    bitset_pin(a);
+    bitset_pin(b);
+    count = bitset_run_count(kernel, a->words, b->words, n);
+    if (tail_a)
+        count += bitset_run_count(NULL, a->words + n, NULL, a->nwords - n);
+    if (tail_b)
+        count += bitset_run_count(NULL, b->words + n, NULL, b->nwords - n);
+    bitset_unpin(a);
+    bitset_unpin(b);
+
+    return count;
+}
+
+/* Returns len(a & b) */
+static Py_ssize_t
+bitset_and_count(bitset_BitsetObject *a, bitset_BitsetObject *b)
+{
+    return bitset_fused_count(bitset_kernels.and_count, a, b, 0, 0);
+}
+
+/* Returns len(a | b) */
+static Py_ssize_t
+bitset_or_count(bitset_BitsetObject *a, bitset_BitsetObject *b)
+{
+    return bitset_fused_count(bitset_kernels.or_count, a, b, 1, 1);
+}
+
+/* Returns len(a ^ b) */
+static Py_ssize_t
+bitset_xor_count(bitset_BitsetObject *a, bitset_BitsetObject *b)
+{
+    return bitset_fused_count(bitset_kernels.xor_count, a, b, 1, 1);
+}
+
+/* Returns len(a - b) */
+static Py_ssize_t
+bitset_sub_count(bitset_BitsetObject *a, bitset_BitsetObject *b)
+{
+    return bitset_fused_count(bitset_kernels.andnot_count, a, b, 1, 0);
+}
+
+static int
+bitset_words_equal(bitset_BitsetObject *a, bitset_BitsetObject *b)
+{
+    Py_ssize_t n = bitset_used_words(a);
+
+    if (n != bitset_used_words(b))
+        return 0;
+
+    return memcmp(a->words, b->words, n * sizeof(bitset_word)) == 0;
+}
+
+/* Returns true if every member of a is also in b */
+static int
+bitset_words_subset(bitset_BitsetObject *a, bitset_BitsetObject *b)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < a->nwords; i++) {
+        if (a->words[i] & ~(i < b->nwords ? b->words[i] : 0))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Returns true if a is a subset of b with fewer members, in one pass */
+static int
+bitset_words_proper_subset(bitset_BitsetObject *a, bitset_BitsetObject *b)
+{
+    Py_ssize_t i;
+    bitset_word w;
+    int proper = 0;
+
+    for (i = 0; i < a->nwords; i++) {
+        w = i < b->nwords ? b->words[i] : 0;
+        if (a->words[i] & ~w)
+            return 0;
+        proper |= a->words[i] != w;
+    }
+    for (; i < b->nwords && !proper; i++)
+        proper = b->words[i] != 0;
+
+    return proper;
+}
+
+/*
+ * Orders the used words of two bitsets as the integers sum(2**x for x in
+ * bitset), comparing from the highest word down and stopping at the first
+ * that differs.  Returns -1, 0 or 1.
+ */
+static int
+bitset_words_cmp(const bitset_word *a, Py_ssize_t na, const bitset_word *b, Py_ssize_t nb)
+{
+    if (na != nb)
+        return na < nb ? -1 : 1;
+
+    while (--na >= 0) {
+        if (a[na] != b[na])
+            return a[na] < b[na] ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/* Returns true if a and b have a member in common */
+static int
+bitset_words_intersect(bitset_BitsetObject *a, bitset_BitsetObject *b)
+{
+    Py_ssize_t i, n = Py_MIN(a->nwords, b->nwords);
+
+    for (i = 0; i < n; i++) {
+        if (a->words[i] & b->words[i])
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Returns true if a & b has the same members as target */
+static int
+bitset_words_and_equal(bitset_BitsetObject *a, bitset_BitsetObject *b,
+                       bitset_BitsetObject *target)
+{
+    Py_ssize_t i, n = Py_MIN(a->nwords, b->nwords);
+
+    for (i = 0; i < target->nwords; i++) {
+        if ((i < n ? a->words[i] & b->words[i] : 0) != target->words[i])
+            return 0;
+    }
+    for (; i < n; i++) {
+        if (a->words[i] & b->words[i])
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Returns the position of the rightmost set bit in *bits, and unsets that bit.
+   *bits must not be zero. */
+static int
+bitset_pop(bitset_word *bits)
+{
+    int c;     // c will be the number of zero bits on the right
+
+#if defined(__GNUC__)
+    /* a single bsf, or tzcnt when compiled for BMI */
+    c = __builtin_ctzll(*bits);
+#else
+    bitset_word v = *bits;
+
+    /* http://graphics.stanford.edu/~seander/bithacks.html#ZerosOnRightBinSearch */
+    if (v & 0x1) {
+        // special case for odd v (assumed to happen half of the time)
+        c = 0;
+    }
+    else {
+        c = 1;
+        if ((v & 0xffffffff) == 0) {
+            v >>= 32;
+            c += 32;
+        }
+        if ((v & 0xffff) == 0) {
+            v >>= 16;
+            c += 16;
+        }
+        if ((v & 0xff) == 0) {
+            v >>= 8;
+            c += 8;
+        }
+        if ((v & 0xf) == 0) {
+            v >>= 4;
+            c += 4;
+        }
+        if ((v & 0x3) == 0) {
+            v >>= 2;
+            c += 2;
+        }
+        c -= (int)(v & 0x1);
+    }
+#endif
+
+    (*bits) &= (*bits) - 1;
+    return c;
+}
+
+/***** Rank and select *****/
+
+/*
+ * rank(), select(), nextset() and prevset() on a large bitset use a rank
+ * directory: the number of members before each block of
+ * BITSET_RANK_BLOCK_WORDS words.  It is built by the first query after a
+ * change, so a rank costs a lookup and the popcount of less than a block,
+ * a select a binary search, and nextset() and prevset() skip empty blocks.
+ */
+#define BITSET_RANK_BLOCK_WORDS 64
+#define BITSET_RANK_MIN_WORDS (2 * BITSET_RANK_BLOCK_WORDS)
+
+/* Returns the position of the leftmost set bit in bits, which must not be zero */
+static int
+bitset_highest(bitset_word bits)
+{
+#if defined(__GNUC__)
+    return BITSET_WORD_BITS - 1 - __builtin_clzll(bits);
+#else
+    int c = 0;
+
+    while (bits >>= 1)
+        c++;
+    return c;
+#endif
+}
+
+/* Returns the position of the set bit in bits with k set bits below it */
+static int
+bitset_select_bit(bitset_word bits, Py_ssize_t k)
+{
+    while (k-- > 0)
+        bits &= bits - 1;
+    return bitset_pop(&bits);
+}
+
+/*
+ * Returns bso's rank directory, building it if it is out of date, or NULL
+ * if the bitset is too small to need one.  The directory isn't used while
+ * the words are exported, as they may be written through the export.
+ */
+static const Py_ssize_t *
+bitset_ranks(bitset_BitsetObject *bso)
+{
+    Py_ssize_t i, nblocks, *ranks;
+
+    if (bso->nwords < BITSET_RANK_MIN_WORDS || bso->exports > 0)
+        return NULL;
+    if (bso->nranks > 0)
+        return bso->ranks;
+
+    nblocks = (bso->nwords + BITSET_RANK_BLOCK_WORDS - 1) / BITSET_RANK_BLOCK_WORDS;
+    ranks = (Py_ssize_t *)PyMem_Realloc(bso->ranks, (nblocks + 1) * sizeof(Py_ssize_t));
+    if (ranks == NULL)
+        return NULL;    /* queries can do without it */
+    bso->ranks = ranks;
+
+    ranks[0] = 0;
+    for (i = 0; i < nblocks; i++)
+        ranks[i + 1] = ranks[i] + bitset_kernels.count(
+            bso->words + i * BITSET_RANK_BLOCK_WORDS,
+            Py_MIN(BITSET_RANK_BLOCK_WORDS, bso->nwords - i * BITSET_RANK_BLOCK_WORDS));
+    bso->nranks = nblocks + 1;
+
+    return ranks;
+}
+
+/* Returns the number of members of bso less than x */
+static Py_ssize_t
+bitset_rank(bitset_BitsetObject *bso, Py_ssize_t x)
+{
+    const Py_ssize_t *ranks = bitset_ranks(bso);
+    Py_ssize_t i, start = 0, count = 0;
+
+    if (x <= 0)
+        return 0;
+
+    i = BITSET_WORD_INDEX(x);
+    if (i >= bso->nwords) {
+        if (ranks != NULL)
+            return ranks[bso->nranks - 1];
+        i = bso->nwords;
+    }
+
+    if (ranks != NULL) {
+        start = i - i % BITSET_RANK_BLOCK_WORDS;
+        count = ranks[i / BITSET_RANK_BLOCK_WORDS];
+    }
+
+    count += bitset_kernels.count(bso->words + start, i - start);
+    if (i < bso->nwords)
+        count += bitset_popcount(bso->words[i] & (BITSET_WORD_MASK(x) - 1));
+    return count;
+}
+
+/* Returns the member of bso with k members less than it, or -1 if k >= len(bso) */
+static Py_ssize_t
+bitset_select(bitset_BitsetObject *bso, Py_ssize_t k)
+{
+    const Py_ssize_t *ranks = bitset_ranks(bso);
+    Py_ssize_t i = 0, lo, hi, mid, c;
+
+    if (ranks != NULL) {
+        if (k >= ranks[bso->nranks - 1])
+            return -1;
+
+        /* find the last block starting with at most k members before it */
+        lo = 0;
+        hi = bso->nranks - 2;
+        while (lo < hi) {
+            mid = (lo + hi + 1) / 2;
+            if (ranks[mid] <= k)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        i = lo * BITSET_RANK_BLOCK_WORDS;
+        k -= ranks[lo];
+    }
+
+    for (; i < bso->nwords; i++) {
+        c = bitset_popcount(bso->words[i]);
+        if (k < c)
+            return i * BITSET_WORD_BITS + bitset_select_bit(bso->words[i], k);
+        k -= c;
+    }
+    return -1;
+}
+
+/* Returns true if the block holding word i is empty according to ranks */
+#define BITSET_EMPTY_BLOCK(ranks, i) \
+    ((ranks) != NULL && \
+     (ranks)[(i) / BITSET_RANK_BLOCK_WORDS] == (ranks)[(i) / BITSET_RANK_BLOCK_WORDS + 1])
+
+/* Returns the smallest member of bso not less than x, or -1 if there is none */
+static Py_ssize_t
+bitset_next(bitset_BitsetObject *bso, Py_ssize_t x)
+{
+    const Py_ssize_t *ranks = bitset_ranks(bso);
+    Py_ssize_t i;
+    bitset_word w;
+
+    if (x < 0)
+        x = 0;
+
+    i = BITSET_WORD_INDEX(x);
+    if (i >= bso->nwords)
+        return -1;
+
+    w = bso->words[i] & ~(BITSET_WORD_MASK(x) - 1);
+    while (w == 0) {
+        if (++i >= bso->nwords)
+            return -1;
+        if (i % BITSET_RANK_BLOCK_WORDS == 0) {
+            while (i < bso->nwords && BITSET_EMPTY_BLOCK(ranks, i))
+                i += BITSET_RANK_BLOCK_WORDS;
+            if (i >= bso->nwords)
+                return -1;
+        }
+        w = bso->words[i];
+    }
+
+    return i * BITSET_WORD_BITS + bitset_pop(&w);
+}
+
+/* Returns the largest member of bso not greater than x, or -1 if there is none */
+static Py_ssize_t
+bitset_prev(bitset_BitsetObject *bso, Py_ssize_t x)
+{
+    const Py_ssize_t *ranks = bitset_ranks(bso);
+    Py_ssize_t i;
+    bitset_word w;
+
+    if (x < 0 || bso->nwords == 0)
+        return -1;
+
+    i = BITSET_WORD_INDEX(x);
+    if (i >= bso->nwords) {
+        i = bso->nwords - 1;
+        w = bso->words[i];
+    }
+    else {
+        /* bits 0..x % 64 inclusive */
+        w = bso->words[i] & (BITSET_WORD_MASK(x) | (BITSET_WORD_MASK(x) - 1));
+    }
+
+    while (w == 0) {
+        if (i-- == 0)
+            return -1;
+        if (i % BITSET_RANK_BLOCK_WORDS == BITSET_RANK_BLOCK_WORDS - 1) {
+            while (i >= 0 && BITSET_EMPTY_BLOCK(ranks, i))
+                i -= BITSET_RANK_BLOCK_WORDS;
+            if (i < 0)
+                return -1;
+        }
+        w = bso->words[i];
+    }
+
+    return i * BITSET_WORD_BITS + bitset_highest(w);
+}
+
+/* Returns a new bitset of the given type with the same members as bso */
+static PyObject *
+bitset_copy_as(PyTypeObject *type, bitset_BitsetObject *bso)
+{
+    Py_ssize_t n = bitset_used_words(bso);
+    bitset_BitsetObject *result = (bitset_BitsetObject *)Bitset_new(type, NULL, NULL);
+
+    if (result == NULL)
+        return NULL;
+
+    if (bitset_grow(result, n)) {
+        Py_DECREF(result);
+        return NULL;
+    }
+
+    memcpy(result->words, bso->words, n * sizeof(bitset_word));
+    BITSET_STAT_ADD(words, n);
+    return (PyObject *)result;
+}
+
+static PyObject *
+bitset_Bitset_copy(bitset_BitsetObject *bso)
+{
+    return bitset_copy_as(bitset_result_type(bso), bso);
+}
+
+PyDoc_STRVAR(copy_doc, "Return a copy of a bitset.");
+
+/* Frozen bitsets are immutable, so a copy can be the same object */
+static PyObject *
+bitset_FrozenBitset_copy(bitset_BitsetObject *bso)
+{
+    if (bitset_FrozenBitset_CheckExact(bso)) {
+        Py_INCREF(bso);
+        return (PyObject *)bso;
+    }
+    return bitset_Bitset_copy(bso);
+}
+
+/***** Bitset iterator type ***********************************************/
+
+typedef struct {
+    PyObject_HEAD
+    bitset_BitsetObject *bi_bitset; /* Set to NULL when iterator is exhausted */
+    Py_ssize_t bi_pos;              /* index of the word being iterated */
+    bitset_word bi_state;           /* members of that word not yet returned */
+} bitset_Bitset_iterobject;
+
+#ifndef BITSET_ITER_MAXFREELIST
+#define BITSET_ITER_MAXFREELIST 80
+#endif
+static bitset_Bitset_iterobject *bitset_iter_free_list[BITSET_ITER_MAXFREELIST];
+static int bitset_iter_numfree = 0;
+static Py_ssize_t bitset_iter_free_list_hits = 0;
+static Py_ssize_t bitset_iter_free_list_misses = 0;
+
+static void
+bitset_Bitset_iter_dealloc(bitset_Bitset_iterobject *bsi)
+{
+    Py_XDECREF(bsi->bi_bitset);
+    if (bitset_iter_numfree < BITSET_ITER_MAXFREELIST)
+        bitset_iter_free_list[bitset_iter_numfree++] = bsi;
+    else
+        PyObject_Del(bsi);
+}
+
+static PyMethodDef bitset_Bitset_iter_methods[] = {
+    /*    {"__length_hint__", (PyCFunction)setiter_len, METH_NOARGS, length_hint_doc},*/
+     {NULL,        NULL}        /* sentinel */
+};
+
+static PyObject *bitset_Bitset_iter_iternext(bitset_Bitset_iterobject *bi)
+{
+    bitset_BitsetObject *bso = bi->bi_bitset;
+
+    if (bso == NULL)
+        return NULL;
+    assert (bitset_AnyBitset_Check(bso));
+
+    while (bi->bi_state == 0) {
+        if (++bi->bi_pos >= bso->nwords) {
+            Py_DECREF(bso);
+            bi->bi_bitset = NULL;
+            return NULL;
+        }
+        bi->bi_state = bso->words[bi->bi_pos];
+    }
+
+    return PyInt_FromSsize_t(bi->bi_pos * BITSET_WORD_BITS + bitset_pop(&(bi->bi_state)));
+}
+
+static PyTypeObject bitset_Bitset_iter_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "Bitset_iterator",                         /* tp_name */
+    sizeof(bitset_Bitset_iterobject),          /* tp_basicsize */
+    0,                                         /* tp_itemsize */
+    /* methods */
+    (destructor)bitset_Bitset_iter_dealloc,    /* tp_dealloc */
+    0,                                         /* tp_print */
+    0,                                         /* tp_getattr */
+    0,                                         /* tp_setattr */
+    0,                                         /* tp_compare */
+    0,                                         /* tp_repr */
+    0,                                         /* tp_as_number */
+    0,                                         /* tp_as_sequence */
+    0,                                         /* tp_as_mapping */
+    0,                                         /* tp_hash */
+    0,                                         /* tp_call */
+    0,                                         /* tp_str */
+    PyObject_GenericGetAttr,                   /* tp_getattro */
+    0,                                         /* tp_setattro */
+    0,                                         /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                        /* tp_flags */
+    0,                                         /* tp_doc */
+    0,                                         /* tp_traverse */
+    0,                                         /* tp_clear */
+    0,                                         /* tp_richcompare */
+    0,                                         /* tp_weaklistoffset */
+    PyObject_SelfIter,                         /* tp_iter */
+    (iternextfunc)bitset_Bitset_iter_iternext, /* tp_iternext */
+    bitset_Bitset_iter_methods,                /* tp_methods */
+    0,
+};
+
+static PyObject *
+bitset_Bitset_iter(bitset_BitsetObject *bso)
+{
+    bitset_Bitset_iterobject *bi;
+
+    if (bitset_iter_numfree > 0) {
+        bi = bitset_iter_free_list[--bitset_iter_numfree];
+        (void)PyObject_INIT(bi, &bitset_Bitset_iter_Type);
+        bitset_iter_free_list_hits++;
+    }
+    else {
+        bi = PyObject_New(bitset_Bitset_iterobject, &bitset_Bitset_iter_Type);
+        if (bi == NULL)
+            return NULL;
+        bitset_iter_free_list_misses++;
+    }
+
+    Py_INCREF(bso);
+    bi->bi_bitset = bso;
+    bi->bi_pos = 0;
+    bi->bi_state = bso->nwords > 0 ? bso->words[0] : 0;
+
+    return (PyObject *)bi;
+}
+
+/***** Sequence methods *****/
+
+static Py_ssize_t
+bitset_Bitset_len(PyObject *bso)
+{
+    bitset_BitsetObject *b = (bitset_BitsetObject *)bso;
+
+    Py_ssize_t count;
+
+    if (b->nwords == 1)
+        return bitset_popcount(b->words[0]);
+    if (b->nranks > 0 && b->exports == 0)
+        return b->ranks[b->nranks - 1];
+
+    bitset_pin(b);
+    count = bitset_run_count(NULL, b->words, NULL, b->nwords);
+    bitset_unpin(b);
+    return count;
+}
+
+static int
+bitset_Bitset_contains(bitset_BitsetObject *bso, PyObject *key)
+{
+    Py_ssize_t value;
+
+    if (bitset_key_value(key, &value)) {
+        bitset_set_range_error((PyObject *)bso);
+        return -1;
+    }
+
+    return bitset_has_member(bso, value);
+}
+
+static PyObject *
+bitset_simd_level_get(PyObject *self)
+{
+    return PyString_FromString(bitset_simd_names[bitset_simd_level]);
+}
+
+PyDoc_STRVAR(simd_level_doc,
+"simd_level() -> str\n\
+\n\
+Return the name of the instruction set used for bulk word operations.");
+
+static PyObject *
+bitset_simd_level_set(PyObject *self, PyObject *args)
+{
+    const char *name;
+    int level;
+
+    if (!PyArg_ParseTuple(args, "s:set_simd_level", &name))
+        return NULL;
+
+    for (level = 0; level < BITSET_SIMD_LEVELS; level++) {
+        if (strcmp(name, bitset_simd_names[level]) == 0)
+            break;
+    }
+
+    if (level == BITSET_SIMD_LEVELS || !bitset_simd_supported[level]) {
+        PyErr_Format(PyExc_ValueError, "SIMD level '%s' is not supported", name);
+        return NULL;
+    }
+
+    bitset_select_kernels(level);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(set_simd_level_doc,
+"set_simd_level(name)\n\
+\n\
+Use the kernels for the named instruction set: one of 'scalar', 'sse2',\n\
+'avx2' or 'avx512'.  Raises ValueError if the CPU doesn't support it.");
+
+static PyObject *
+bitset_threads_get(PyObject *self)
+{
+    return PyInt_FromLong(bitset_nthreads);
+}
+
+PyDoc_STRVAR(threads_doc,
+"threads() -> int\n\
+\n\
+Return the number of threads each large operation is split across.");
+
+static PyObject *
+bitset_threads_set(PyObject *self, PyObject *args)
+{
+    int n;
+
+    if (!PyArg_ParseTuple(args, "i:set_threads", &n))
+        return NULL;
+
+    if (n < 1 || n > BITSET_MAX_THREADS) {
+        PyErr_Format(PyExc_ValueError, "number of threads must be in [1..%d]",
+                     BITSET_MAX_THREADS);
+        return NULL;
+    }
+
+#ifdef BITSET_THREADS
+    if (n != bitset_nthreads) {
+        pthread_t *workers = PyMem_New(pthread_t, n);
+
+        if (workers == NULL)
+            return PyErr_NoMemory();
+
+        PyMem_Free(bitset_pool_resize(workers, n));
+    }
+#else
+    if (n > 1) {
+        PyErr_SetString(PyExc_ValueError, "bitset was built without thread support");
+        return NULL;
+    }
+    bitset_nthreads = n;
+#endif
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(set_threads_doc,
+"set_threads(n)\n\
+\n\
+Split operations on large bitsets across n threads: the calling thread and\n\
+a pool of n - 1 workers, started when first needed.  The default is 1.\n\
+Operations on large bitsets release the GIL whatever the setting.");
+
+static PyObject *
+bitset_freelist_stats(PyObject *self)
+{
+    return Py_BuildValue("{s:i,s:n,s:n,s:i,s:n,s:n}",
+                         "bitset_free", bitset_numfree,
+                         "bitset_reused", bitset_free_list_hits,
+                         "bitset_allocated", bitset_free_list_misses,
+                         "iterator_free", bitset_iter_numfree,
+                         "iterator_reused", bitset_iter_free_list_hits,
+                         "iterator_allocated", bitset_iter_free_list_misses);
+}
+
+PyDoc_STRVAR(freelist_stats_doc,
+"freelist_stats() -> dict\n\
+\n\
+Return the number of bitset and iterator objects held for reuse, and how\n\
+many objects have been reused or newly allocated since the last call to\n\
+clear_freelists().");
+
+static PyObject *
+bitset_clear_freelists(PyObject *self)
+{
+    bitset_BitsetObject *bso;
+    bitset_Bitset_iterobject *bi;
+    Py_ssize_t freed = bitset_numfree + bitset_iter_numfree;
+
+    while (bitset_numfree > 0) {
+        bso = bitset_free_list[--bitset_numfree];
+        Py_TYPE(bso)->tp_free((PyObject *)bso);
+    }
+
+    while (bitset_iter_numfree > 0) {
+        bi = bitset_iter_free_list[--bitset_iter_numfree];
+        PyObject_Del(bi);
+    }
+
+    bitset_free_list_hits = bitset_free_list_misses = 0;
+    bitset_iter_free_list_hits = bitset_iter_free_list_misses = 0;
+
+    return PyInt_FromSsize_t(freed);
+}
+
+PyDoc_STRVAR(clear_freelists_doc,
+"clear_freelists() -> int\n\
+\n\
+Free the objects held for reuse and reset the counts reported by\n\
+freelist_stats().  Returns the number of objects freed.");
+
+static PyObject *
+bitset_stats_get(PyObject *self)
+{
+    PyObject *result = PyDict_New();
+#ifdef BITSET_STATS
+    PyObject *stat;
+    int i, err;
+#ifdef BITSET_STATS_CYCLES
+    PyObject *cycles;
+    int n, j;
+#endif
+
+    if (result == NULL)
+        return NULL;
+
+    for (i = 0; i < BITSET_NSTATS; i++) {
+        stat = Py_BuildValue("{s:n,s:n,s:n,s:n}",
+                             "calls", bitset_stats[i].calls,
+                             "fallbacks", bitset_stats[i].fallbacks,
+                             "allocations", bitset_stats[i].allocations,
+                             "words", bitset_stats[i].words);
+        if (stat == NULL)
+            goto error;
+#ifdef BITSET_STATS_CYCLES
+        for (n = BITSET_CYCLE_BUCKETS; n > 0 && bitset_stats[i].cycles[n - 1] == 0; n--)
+            ;
+        cycles = PyList_New(n);
+        if (cycles == NULL) {
+            Py_DECREF(stat);
+            goto error;
+        }
+        for (j = 0; j < n; j++) {
+            PyObject *count = PyInt_FromSsize_t(bitset_stats[i].cycles[j]);
+
+            if (count == NULL) {
+                Py_DECREF(cycles);
+                Py_DECREF(stat);
+                goto error;
+            }
+            PyList_SET_ITEM(cycles, j, count);
+        }
+        err = PyDict_SetItemString(stat, "cycles", cycles);
+        Py_DECREF(cycles);
+        if (err) {
+            Py_DECREF(stat);
+            goto error;
+        }
+#endif
+        err = PyDict_SetItemString(result, bitset_op_names[i], stat);
+        Py_DECREF(stat);
+        if (err)
+            goto error;
+    }
+    return result;
+
+error:
+    Py_DECREF(result);
+    return NULL;
+#else
+    return result;
+#endif
+}
+
+PyDoc_STRVAR(stats_doc,
+"stats() -> dict\n\
+\n\
+Return the counts kept for each operation when the module is built with\n\
+BITSET_STATS: calls, iterables read a member at a time (fallbacks), bitset\n\
+and word allocations, and words processed, plus with BITSET_STATS_CYCLES\n\
+a list of calls by duration, item k counting those of [2**k, 2**(k+1))\n\
+cycles.  The dict is empty otherwise.");
+
+static PyObject *
+bitset_stats_reset(PyObject *self)
+{
+#ifdef BITSET_STATS
+    memset(bitset_stats, 0, sizeof(bitset_stats));
+#endif
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(reset_stats_doc,
+"reset_stats()\n\
+\n\
+Set the counts reported by stats() to zero.");
+
+/***** Multi-operand operations *****/
+
+/*
+ * union_all(), intersect_all() and count_intersection() work through all
+ * their operands a block of words at a time, so each block of the result
+ * stays in cache while every operand is applied to it, and allocate only
+ * the result.  An intersection stops reading operands for a block once the
+ * block is empty.  RoaringBitsets are merged a container at a time, and
+ * when mixed with bitsets applied to the bitsets' result afterwards.
+ */
+#define BITSET_BLOCK_WORDS 512
+
+/*
+ * Reads the operands from iterable into a new array of new references,
+ * converting other iterables to BigBitsets.  If roaring is set the
+ * RoaringBitsets are kept, after the bitsets, and otherwise converted too.
+ * *nflat is set to the number of bitsets, and *type to the type the result
+ * should have: that of the first operand, or BigBitset if it isn't a
+ * bitset.
+ */
+static PyObject **
+bitset_read_operands(PyObject *iterable, const char *name, int roaring, Py_ssize_t *n,
+                     Py_ssize_t *nflat, PyTypeObject **type)
+{
+    PyObject *seq, *item, **operands;
+    Py_ssize_t i, last;
+
+    seq = PySequence_Fast(iterable, "argument must be iterable");
+    if (seq == NULL)
+        return NULL;
+
+    *n = PySequence_Fast_GET_SIZE(seq);
+    operands = PyMem_New(PyObject *, *n ? *n : 1);
+    if (operands == NULL) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    *nflat = 0;
+    last = *n;
+    for (i = 0; i < *n; i++) {
+        item = PySequence_Fast_GET_ITEM(seq, i);
+        if (roaring && bitset_Roaring_Check(item)) {
+            Py_INCREF(item);
+            operands[--last] = item;
+            continue;
+        }
+
+        operands[*nflat] = (PyObject *)bitset_as_bitset_type(&bitset_BigBitsetType, item);
+        if (operands[*nflat] == NULL) {
+            for (i = 0; i < *nflat; i++)
+                Py_DECREF(operands[i]);
+            for (i = last; i < *n; i++)
+                Py_DECREF(operands[i]);
+            PyMem_Free(operands);
+            Py_DECREF(seq);
+            return NULL;
+        }
+        ++*nflat;
+    }
+
+    *type = &bitset_BigBitsetType;
+    if (*n > 0 && bitset_BitsetLike_Check(PySequence_Fast_GET_ITEM(seq, 0)))
+        *type = bitset_result_type(PySequence_Fast_GET_ITEM(seq, 0));
+    Py_DECREF(seq);
+
+    if (*n == 0 && name != NULL) {
+        PyErr_Format(PyExc_ValueError, "%s() arg is an empty iterable", name);
+        PyMem_Free(operands);
+        return NULL;
+    }
+
+    return operands;
+}
+
+static void
+bitset_free_operands(PyObject **operands, Py_ssize_t n)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < n; i++)
+        Py_XDECREF(operands[i]);
+    PyMem_Free(operands);
+}
+
+static void
+bitset_pin_operands(bitset_BitsetObject **operands, Py_ssize_t n, int pin)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < n; i++)
+        operands[i]->exports += pin ? 1 : -1;
+}
+
+typedef struct {
+    bitset_BitsetObject **operands;
+    Py_ssize_t n;
+    bitset_word *dst;
+} bitset_operands_args;
+
+/* Returns true if none of the n words are set */
+static int
+bitset_words_empty(const bitset_word *words, Py_ssize_t n)
+{
+    bitset_word any = 0;
+    Py_ssize_t i;
+
+    for (i = 0; i < n; i++)
+        any |= words[i];
+    return any == 0;
+}
+
+/* Returns the number of words the intersection of the operands can use */
+static Py_ssize_t
+bitset_intersection_words(bitset_BitsetObject **operands, Py_ssize_t n)
+{
+    Py_ssize_t i, nwords = bitset_used_words(operands[0]);
+
+    for (i = 1; i < n && nwords > 0; i++)
+        nwords = Py_MIN(nwords, operands[i]->nwords);
+    return nwords;
+}
+
+/*
+ * Writes the intersection of words start..start + len of the operands to
+ * dst, returning early once it is empty.  Every operand must have at least
+ * start + len words.
+ */
+static void
+bitset_and_block(bitset_word *dst, bitset_BitsetObject **operands, Py_ssize_t n,
+                 Py_ssize_t start, Py_ssize_t len)
+{
+    Py_ssize_t i;
+
+    memcpy(dst, operands[0]->words + start, len * sizeof(bitset_word));
+    for (i = 1; i < n; i++) {
+        bitset_kernels.and_(dst, operands[i]->words + start, len);
+        if (bitset_words_empty(dst, len)) {
+            memset(dst, 0, len * sizeof(bitset_word));
+            return;
+        }
+    }
+}
+
+static Py_ssize_t
+bitset_union_range(void *arg, Py_ssize_t first, Py_ssize_t end)
+{
+    bitset_operands_args *a = (bitset_operands_args *)arg;
+    Py_ssize_t i, start, len, m;
+
+    for (start = first; start < end; start += BITSET_BLOCK_WORDS) {
+        len = Py_MIN(BITSET_BLOCK_WORDS, end - start);
+        for (i = 0; i < a->n; i++) {
+            m = Py_MIN(len, a->operands[i]->nwords - start);
+            if (m > 0)
+                bitset_kernels.or_(a->dst + start, a->operands[i]->words + start, m);
+        }
+    }
+    return 0;
+}
+
+static Py_ssize_t
+bitset_intersection_range(void *arg, Py_ssize_t first, Py_ssize_t end)
+{
+    bitset_operands_args *a = (bitset_operands_args *)arg;
+    Py_ssize_t start;
+
+    for (start = first; start < end; start += BITSET_BLOCK_WORDS)
+        bitset_and_block(a->dst + start, a->operands, a->n, start,
+                         Py_MIN(BITSET_BLOCK_WORDS, end - start));
+    return 0;
+}
+
+static Py_ssize_t
+bitset_count_intersection_range(void *arg, Py_ssize_t first, Py_ssize_t end)
+{
+    bitset_operands_args *a = (bitset_operands_args *)arg;
+    bitset_word block[BITSET_BLOCK_WORDS];
+    Py_ssize_t start, len, count = 0;
+
+    for (start = first; start < end; start += BITSET_BLOCK_WORDS) {
+        len = Py_MIN(BITSET_BLOCK_WORDS, end - start);
+        bitset_and_block(block, a->operands, a->n, start, len);
+        count += bitset_kernels.count(block, len);
+    }
+    return count;
+}
+
+/*
+ * Runs func over the first nwords words of the operands, writing to
+ * result unless it is NULL, with all of them pinned
+ */
+static Py_ssize_t
+bitset_run_operands(bitset_range_func func, bitset_BitsetObject **operands, Py_ssize_t n,
+                    bitset_BitsetObject *result, Py_ssize_t nwords)
+{
+    bitset_operands_args a;
+    Py_ssize_t count;
+
+    a.operands = operands;
+    a.n = n;
+    a.dst = result != NULL ? result->words : NULL;
+
+    bitset_pin_operands(operands, n, 1);
+    if (result != NULL)
+        bitset_pin(result);
+    count = bitset_run_ranges(func, &a, nwords);
+    if (result != NULL)
+        bitset_unpin(result);
+    bitset_pin_operands(operands, n, 0);
+
+    return count;
+}
+
+/*
+ * Converts a new result of a multi-operand operation to type, which is a
+ * bitset type or RoaringBitset, stealing it.
+ */
+static PyObject *
+bitset_operands_result(PyTypeObject *type, bitset_BitsetObject *result)
+{
+    if (result == NULL || !PyType_IsSubtype(type, &bitset_RoaringBitsetType))
+        return (PyObject *)result;
+
+    return bitset_roaring_from_bitset(type, (PyObject *)result);
+}
+
+/* Applies result = result op r for the RoaringBitsets after the bitsets */
+static int
+bitset_roaring_operands(bitset_BitsetObject *result, PyObject **operands, Py_ssize_t n,
+                        Py_ssize_t nflat, int op)
+{
+    Py_ssize_t i;
+
+    for (i = nflat; i < n; i++) {
+        if (bitset_roaring_words_op(result, operands[i], op))
+            return -1;
+    }
+    return 0;
+}
+
+/* Returns a new bitset of type holding the intersection of the n bitsets */
+static bitset_BitsetObject *
+bitset_intersect_operands(PyTypeObject *type, bitset_BitsetObject **operands, Py_ssize_t n)
+{
+    bitset_BitsetObject *result;
+    Py_ssize_t nwords = bitset_intersection_words(operands, n);
+
+    result = (bitset_BitsetObject *)Bitset_new(type, NULL, NULL);
+    if (result == NULL || bitset_grow(result, nwords)) {
+        Py_XDECREF(result);
+        return NULL;
+    }
+
+    bitset_run_operands(bitset_intersection_range, operands, n, result, nwords);
+    return result;
+}
+
+static PyObject *
+bitset_union_all(PyObject *self, PyObject *iterable)
+{
+    bitset_BitsetObject **flat, *result;
+    PyObject **operands, *r;
+    PyTypeObject *type;
+    Py_ssize_t n, nflat, i, nwords = 0;
+
+    operands = bitset_read_operands(iterable, NULL, 1, &n, &nflat, &type);
+    if (operands == NULL)
+        return NULL;
+    flat = (bitset_BitsetObject **)operands;
+
+    /* a RoaringBitset result is merged from the operands as RoaringBitsets */
+    if (PyType_IsSubtype(type, &bitset_RoaringBitsetType)) {
+        for (i = 0; i < nflat; i++) {
+            operands[i] = bitset_roaring_from_bitset(&bitset_RoaringBitsetType, operands[i]);
+            if (operands[i] == NULL) {
+                bitset_free_operands(operands, n);
+                return NULL;
+            }
+        }
+        r = bitset_roaring_union_all(type, operands, n);
+        bitset_free_operands(operands, n);
+        return r;
+    }
+
+    for (i = 0; i < nflat; i++)
+        nwords = Py_MAX(nwords, bitset_used_words(flat[i]));
+
+    result = (bitset_BitsetObject *)Bitset_new(type, NULL, NULL);
+    if (result == NULL || bitset_grow(result, nwords)) {
+        Py_XDECREF(result);
+        bitset_free_operands(operands, n);
+        return NULL;
+    }
+
+    bitset_run_operands(bitset_union_range, flat, nflat, result, nwords);
+    if (bitset_check_fits(result, result) ||
+        bitset_roaring_operands(result, operands, n, nflat, ROARING_OR))
+        Py_CLEAR(result);
+    bitset_free_operands(operands, n);
+
+    return (PyObject *)result;
+}
+
+PyDoc_STRVAR(union_all_doc,
+"union_all(iterable) -> bitset\n\
+\n\
+Return the union of all the bitsets in iterable, with the type of the first.\n\
+Other iterables of integers are read as BigBitsets.  The result is built in\n\
+one pass over the operands.");
+
+static PyObject *
+bitset_intersect_all(PyObject *self, PyObject *iterable)
+{
+    bitset_BitsetObject *result;
+    PyObject **operands, *r;
+    PyTypeObject *type;
+    Py_ssize_t n, nflat;
+
+    operands = bitset_read_operands(iterable, "intersect_all", 1, &n, &nflat, &type);
+    if (operands == NULL)
+        return NULL;
+
+    if (nflat == 0) {
+        r = bitset_roaring_intersect_all(type, operands, n);
+        bitset_free_operands(operands, n);
+        return r;
+    }
+
+    /* the bitsets bound the result, so the RoaringBitsets are applied to theirs */
+    result = bitset_intersect_operands(
+        PyType_IsSubtype(type, &bitset_RoaringBitsetType) ? &bitset_BigBitsetType : type,
+        (bitset_BitsetObject **)operands, nflat);
+    if (result != NULL && bitset_roaring_operands(result, operands, n, nflat, ROARING_AND))
+        Py_CLEAR(result);
+    bitset_free_operands(operands, n);
+
+    return bitset_operands_result(type, result);
+}
+
+PyDoc_STRVAR(intersect_all_doc,
+"intersect_all(iterable) -> bitset\n\
+\n\
+Return the intersection of all the bitsets in iterable, with the type of\n\
+the first.  Other iterables of integers are read as BigBitsets.  Raises\n\
+ValueError if iterable is empty.");
+
+static PyObject *
+bitset_count_intersection(PyObject *self, PyObject *iterable)
+{
+    bitset_BitsetObject **flat, *result;
+    PyObject **operands;
+    PyTypeObject *type;
+    Py_ssize_t n, nflat, nwords, count;
+
+    operands = bitset_read_operands(iterable, "count_intersection", 1, &n, &nflat, &type);
+    if (operands == NULL)
+        return NULL;
+    flat = (bitset_BitsetObject **)operands;
+
+    if (nflat == 0)
+        count = bitset_roaring_count_all(operands, n);
+    else if (nflat < n) {
+        /* the last RoaringBitset is counted against the rest's intersection */
+        result = bitset_intersect_operands(&bitset_BigBitsetType, flat, nflat);
+        if (result == NULL ||
+            bitset_roaring_operands(result, operands, n - 1, nflat, ROARING_AND)) {
+            Py_XDECREF(result);
+            bitset_free_operands(operands, n);
+            return NULL;
+        }
+        count = bitset_roaring_and_count_words(result, operands[n - 1], 0);
+        Py_DECREF(result);
+    }
+    else if (n == 2)
+        count = bitset_and_count(flat[0], flat[1]);
+    else {
+        nwords = bitset_intersection_words(flat, n);
+        count = bitset_run_operands(bitset_count_intersection_range, flat, n, NULL, nwords);
+    }
+    bitset_free_operands(operands, n);
+
+    return PyInt_FromSsize_t(count);
+}
+
+PyDoc_STRVAR(count_intersection_doc,
+"count_intersection(iterable) -> int\n\
+\n\
+Return the size of the intersection of all the bitsets in iterable without\n\
+building it.  Raises ValueError if iterable is empty.");
+
+/*
+ * sort_bitsets() and unique_bitsets() use a stable merge sort.  The used
+ * words of all the bitsets are first copied into one block, so comparisons
+ * read neighbouring memory rather than chasing each bitset's pointers, and
+ * the highest word of each is kept with it, which settles most comparisons
+ * of distinct bitsets.
+ */
+typedef struct {
+    const bitset_word *words;
+    Py_ssize_t nwords;
+    bitset_word top;
+    Py_ssize_t index;           /* in the operands */
+} bitset_sort_item;
+
+static int
+bitset_sort_less(const bitset_sort_item *a, const bitset_sort_item *b)
+{
+    if (a->nwords != b->nwords)
+        return a->nwords < b->nwords;
+    if (a->top != b->top)
+        return a->top < b->top;
+    return bitset_words_cmp(a->words, a->nwords - 1, b->words, b->nwords - 1) < 0;
+}
+
+#define BITSET_SORT_RUN 16
+
+/* Sorts the n items, using tmp as scratch space of the same size */
+static void
+bitset_sort_items(bitset_sort_item *items, bitset_sort_item *tmp, Py_ssize_t n)
+{
+    Py_ssize_t i, j, k, mid;
+    bitset_sort_item x;
+
+    if (n <= BITSET_SORT_RUN) {
+        for (i = 1; i < n; i++) {
+            x = items[i];
+            for (j = i; j > 0 && bitset_sort_less(&x, &items[j - 1]); j--)
+                items[j] = items[j - 1];
+            items[j] = x;
+        }
+        return;
+    }
+
+    mid = n / 2;
+    bitset_sort_items(items, tmp, mid);
+    bitset_sort_items(items + mid, tmp, n - mid);
+    if (!bitset_sort_less(&items[mid], &items[mid - 1]))
+        return;
+
+    memcpy(tmp, items, mid * sizeof(bitset_sort_item));
+    for (i = 0, j = mid, k = 0; i < mid && j < n; k++)
+        items[k] = bitset_sort_less(&items[j], &tmp[i]) ? items[j++] : tmp[i++];
+    while (i < mid)
+        items[k++] = tmp[i++];
+}
+
+/* Returns a list of the bitsets in iterable in order, without duplicates if unique */
+static PyObject *
+bitset_sorted(PyObject *iterable, int unique)
+{
+    bitset_BitsetObject **operands;
+    bitset_sort_item *items = NULL;
+    bitset_word *words = NULL, *p;
+    PyTypeObject *type;
+    PyObject *result = NULL, *item;
+    Py_ssize_t n, nflat, i, m = 0, total = 0;
+
+    operands = (bitset_BitsetObject **)bitset_read_operands(iterable, NULL, 0, &n, &nflat,
+                                                            &type);
+    if (operands == NULL)
+        return NULL;
+
+    /* the second half is scratch space for the merges */
+    items = PyMem_New(bitset_sort_item, 2 * n + 1);
+    if (items == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (i = 0; i < n; i++) {
+        items[i].nwords = bitset_used_words(operands[i]);
+        items[i].index = i;
+        total += items[i].nwords;
+    }
+
+    words = p = PyMem_New(bitset_word, total ? total : 1);
+    if (words == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (i = 0; i < n; i++) {
+        memcpy(p, operands[i]->words, items[i].nwords * sizeof(bitset_word));
+        items[i].words = p;
+        items[i].top = items[i].nwords ? p[items[i].nwords - 1] : 0;
+        p += items[i].nwords;
+    }
+
+    bitset_sort_items(items, items + n, n);
+
+    for (i = 0; i < n; i++) {
+        if (!unique || m == 0 ||
+            bitset_words_cmp(items[m - 1].words, items[m - 1].nwords,
+                             items[i].words, items[i].nwords) != 0)
+            items[m++] = items[i];
+    }
+
+    result = PyList_New(m);
+    if (result != NULL) {
+        for (i = 0; i < m; i++) {
+            item = (PyObject *)operands[items[i].index];
+            Py_INCREF(item);
+            PyList_SET_ITEM(result, i, item);
+        }
+    }
+
+done:
+    PyMem_Free(words);
+    PyMem_Free(items);
+    bitset_free_operands((PyObject **)operands, n);
+    return result;
+}
+
+static PyObject *
+bitset_sort_bitsets(PyObject *self, PyObject *iterable)
+{
+    return bitset_sorted(iterable, 0);
+}
+
+PyDoc_STRVAR(sort_bitsets_doc,
+"sort_bitsets(iterable) -> list\n\
+\n\
+Return a new list of the bitsets in iterable in the order of their\n\
+cmp_key(), as sorted(iterable, key=lambda b: b.cmp_key()) would, without\n\
+building the keys.  RoaringBitsets and other iterables are read as\n\
+BigBitsets.");
+
+static PyObject *
+bitset_unique_bitsets(PyObject *self, PyObject *iterable)
+{
+    return bitset_sorted(iterable, 1);
+}
+
+PyDoc_STRVAR(unique_bitsets_doc,
+"unique_bitsets(iterable) -> list\n\
+\n\
+Return a new list of the distinct bitsets in iterable, the first of each\n\
+set of equal ones, in the order of sort_bitsets().");
+
+/* defined with the serialization code below */
+static PyObject *bitset_dumps(PyObject *module, PyObject *obj);
+static PyObject *bitset_loads(PyObject *module, PyObject *obj);
+/* and with the lazy expressions */
+static PyObject *bitset_lazy(PyObject *module, PyObject *obj);
+PyDoc_STRVAR(dumps_doc,
+"dumps(bitset) -> bytes\n\
+\n\
+Return the serialized form of a Bitset, BigBitset, FrozenBitset or\n\
+RoaringBitset, a versioned and checksummed format independent of the\n\
+machine's byte order.");
+PyDoc_STRVAR(loads_doc,
+"loads(bytes) -> bitset\n\
+\n\
+Return the bitset serialized by dumps() or a BitsetWriter, of the type\n\
+it was serialized from.  Raises ValueError if the data is invalid.");
+PyDoc_STRVAR(lazy_doc,
+"lazy(bitset) -> LazyBitset\n\
+\n\
+Return a LazyBitset for a bitset or iterable, whose operators build an\n\
+expression to evaluate in one pass.");
+
+/* Module functions counted as operations of their own */
+#ifdef BITSET_STATS
+#define BITSET_STAT_WRAP(name, op)                                      \
+static PyObject *                                                       \
+name##_stat(PyObject *module, PyObject *arg)                            \
+{                                                                       \
+    PyObject *result;                                                   \
+                                                                        \
+    BITSET_STAT_CALL(op, result, name(module, arg));                    \
+    return result;                                                      \
+}
+#define BITSET_STAT_FN(name) name##_stat
+#else
+#define BITSET_STAT_WRAP(name, op)
+#define BITSET_STAT_FN(name) name
+#endif
+
+BITSET_STAT_WRAP(bitset_count_intersection, BITSET_STAT_COUNT_INTERSECTION)
+BITSET_STAT_WRAP(bitset_dumps, BITSET_STAT_DUMPS)
+BITSET_STAT_WRAP(bitset_intersect_all, BITSET_STAT_INTERSECT_ALL)
+BITSET_STAT_WRAP(bitset_loads, BITSET_STAT_LOADS)
+BITSET_STAT_WRAP(bitset_union_all, BITSET_STAT_UNION_ALL)
+
+static PyMethodDef bitset_methods[] = {
+    {"clear_freelists", (PyCFunction)bitset_clear_freelists,
+     METH_NOARGS, clear_freelists_doc},
+    {"count_intersection", (PyCFunction)BITSET_STAT_FN(bitset_count_intersection),
+     METH_O, count_intersection_doc},
+    {"dumps",           (PyCFunction)BITSET_STAT_FN(bitset_dumps),
+     METH_O, dumps_doc},
+    {"freelist_stats",  (PyCFunction)bitset_freelist_stats,
+     METH_NOARGS, freelist_stats_doc},
+    {"intersect_all",   (PyCFunction)BITSET_STAT_FN(bitset_intersect_all),
+     METH_O, intersect_all_doc},
+    {"lazy",            (PyCFunction)bitset_lazy,
+     METH_O, lazy_doc},
+    {"loads",           (PyCFunction)BITSET_STAT_FN(bitset_loads),
+     METH_O, loads_doc},
+    {"reset_stats",     (PyCFunction)bitset_stats_reset,
+     METH_NOARGS, reset_stats_doc},
+    {"simd_level",      (PyCFunction)bitset_simd_level_get,
+     METH_NOARGS, simd_level_doc},
+    {"set_simd_level",  (PyCFunction)bitset_simd_level_set,
+     METH_VARARGS, set_simd_level_doc},
+    {"set_threads",     (PyCFunction)bitset_threads_set,
+     METH_VARARGS, set_threads_doc},
+    {"sort_bitsets",    (PyCFunction)bitset_sort_bitsets,
+     METH_O, sort_bitsets_doc},
+    {"stats",           (PyCFunction)bitset_stats_get,
+     METH_NOARGS, stats_doc},
+    {"threads",         (PyCFunction)bitset_threads_get,
+     METH_NOARGS, threads_doc},
+    {"unique_bitsets",  (PyCFunction)bitset_unique_bitsets,
+     METH_O, unique_bitsets_doc},
+    {"union_all",       (PyCFunction)BITSET_STAT_FN(bitset_union_all),
+     METH_O, union_all_doc},
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static PySequenceMethods bitset_as_sequence = {
+    bitset_Bitset_len,                  /* sq_length */
+    0,                                  /* sq_concat */
+    0,                                  /* sq_repeat */
+    0,                                  /* sq_item */
+    0,                                  /* sq_slice */
+    0,                                  /* sq_ass_item */
+    0,                                  /* sq_ass_slice */
+    (objobjproc)bitset_Bitset_contains, /* sq_contains */
+};
+
+/***** Ranges *****/
+
+/*
+ * The range methods take a half-open range lo <= x < hi, as range() does.
+ * Those that add members reject a range reaching outside the type's
+ * limits; the others clip the range to the words in use.
+ */
+
+/* Returns the number of bits set in first..last, inclusive */
+static Py_ssize_t
+bitset_count_bits(const bitset_word *words, Py_ssize_t first, Py_ssize_t last)
+{
+    Py_ssize_t i = BITSET_WORD_INDEX(first), j = BITSET_WORD_INDEX(last);
+    bitset_word head = BITSET_HEAD_MASK(first), tail = BITSET_TAIL_MASK(last);
+
+    if (i == j)
+        return bitset_popcount(words[i] & head & tail);
+
+    return bitset_popcount(words[i] & head) +
+        bitset_kernels.count(words + i + 1, j - i - 1) +
+        bitset_popcount(words[j] & tail);
+}
+
+/* Returns true if any of bits first..last, inclusive, is set */
+static int
+bitset_any_bits(const bitset_word *words, Py_ssize_t first, Py_ssize_t last)
+{
+    Py_ssize_t i = BITSET_WORD_INDEX(first), j = BITSET_WORD_INDEX(last);
+    bitset_word head = BITSET_HEAD_MASK(first), tail = BITSET_TAIL_MASK(last);
+
+    if (i == j)
+        return (words[i] & head & tail) != 0;
+
+    return (words[i] & head) != 0 || !bitset_words_empty(words + i + 1, j - i - 1) ||
+        (words[j] & tail) != 0;
+}
+
+/* Returns true if all of bits first..last, inclusive, are set */
+static int
+bitset_all_bits(const bitset_word *words, Py_ssize_t first, Py_ssize_t last)
+{
+    Py_ssize_t i = BITSET_WORD_INDEX(first), j = BITSET_WORD_INDEX(last);
+    bitset_word head = BITSET_HEAD_MASK(first), tail = BITSET_TAIL_MASK(last);
+
+    if (i == j)
+        return (~words[i] & head & tail) == 0;
+
+    if ((~words[i] & head) != 0 || (~words[j] & tail) != 0)
+        return 0;
+    while (++i < j)
+        if (~words[i] != 0)
+            return 0;
+    return 1;
+}
+
+/* Converts an integer argument, clamping values beyond a Py_ssize_t */
+static int
+bitset_index_arg(PyObject *arg, Py_ssize_t *value)
+{
+    *value = PyNumber_AsSsize_t(arg, NULL);
+    return *value == -1 && PyErr_Occurred() ? -1 : 0;
+}
+
+/* Parses the (lo, hi) arguments of the range methods, clamping both */
+static int
+bitset_range_args(PyObject *args, const char *name, Py_ssize_t *lo, Py_ssize_t *hi)
+{
+    PyObject *loobj, *hiobj;
+
+    if (!PyArg_UnpackTuple(args, name, 2, 2, &loobj, &hiobj))
+        return -1;
+    return bitset_index_arg(loobj, lo) || bitset_index_arg(hiobj, hi) ? -1 : 0;
+}
+
+/* Checks that lo..hi - 1 can be added to bso, for add_range() and flip() */
+static int
+bitset_check_range(bitset_BitsetObject *bso, Py_ssize_t lo, Py_ssize_t hi)
+{
+    if (bitset_Bitset_Check(bso) ? lo >= BITSET_MIN && hi - 1 <= BITSET_MAX :
+        lo >= 0 && hi - 1 <= BIGBITSET_MAX)
+        return 0;
+
+    bitset_set_range_error((PyObject *)bso);
+    return -1;
+}
+
+/* Clips lo..hi - 1 to the bits in use, returning 0 if nothing is left */
+static int
+bitset_clip_range(bitset_BitsetObject *bso, Py_ssize_t *lo, Py_ssize_t *hi)
+{
+    *lo = Py_MAX(*lo, 0);
+    *hi = Py_MIN(*hi, bso->nwords * BITSET_WORD_BITS);
+    return *lo < *hi;
+}
+
+static int
+bitset_add_range(bitset_BitsetObject *bso, Py_ssize_t lo, Py_ssize_t hi)
+{
+    if (lo >= hi)
+        return 0;
+    if (bitset_check_range(bso, lo, hi) || bitset_grow(bso, BITSET_WORD_INDEX(hi - 1) + 1))
+        return -1;
+
+    bitset_set_bits(bso->words, lo, hi - 1);
+    bitset_changed(bso);
+    return 0;
+}
+
+static int
+bitset_flip_range(bitset_BitsetObject *bso, Py_ssize_t lo, Py_ssize_t hi)
+{
+    if (lo >= hi)
+        return 0;
+    if (bitset_check_range(bso, lo, hi) || bitset_grow(bso, BITSET_WORD_INDEX(hi - 1) + 1))
+        return -1;
+
+    bitset_flip_bits(bso->words, lo, hi - 1);
+    bitset_changed(bso);
+    return 0;
+}
+
+static void
+bitset_discard_range(bitset_BitsetObject *bso, Py_ssize_t lo, Py_ssize_t hi)
+{
+    if (!bitset_clip_range(bso, &lo, &hi))
+        return;
+
+    bitset_clear_bits(bso->words, lo, hi - 1);
+    bitset_changed(bso);
+}
+
+static Py_ssize_t
+bitset_count_in_range(bitset_BitsetObject *bso, Py_ssize_t lo, Py_ssize_t hi)
+{
+    return bitset_clip_range(bso, &lo, &hi) ? bitset_count_bits(bso->words, lo, hi - 1) : 0;
+}
+
+static int
+bitset_any_in_range(bitset_BitsetObject *bso, Py_ssize_t lo, Py_ssize_t hi)
+{
+    return bitset_clip_range(bso, &lo, &hi) && bitset_any_bits(bso->words, lo, hi - 1);
+}
+
+static int
+bitset_all_in_range(bitset_BitsetObject *bso, Py_ssize_t lo, Py_ssize_t hi)
+{
+    if (lo >= hi)
+        return 1;
+    if (lo < 0 || hi > bso->nwords * BITSET_WORD_BITS)
+        return 0;
+    return bitset_all_bits(bso->words, lo, hi - 1);
+}
+
+/***** bitset methods *****/
+
+static PyObject *
+bitset_Bitset_add(bitset_BitsetObject *bso, PyObject *key)
+{
+    Py_ssize_t value = bitset_member((PyObject *)bso, key);
+
+    if (value < 0 || bitset_add_member(bso, value))
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(add_doc,
+"Add an element to a Bitset.\n\
+\n\
 This has no effect if the element is already present.");
 
 static PyObject *
-bitset_Bitset_clear(bitset_BitsetObject *bso)
+bitset_Bitset_clear(bitset_BitsetObject *bso)
+{
+    if (bso->words != &bso->smallword && bso->exports == 0) {
+        PyMem_Free(bso->words);
+        bso->words = &bso->smallword;
+        bso->allocated = 1;
+    }
+    PyMem_Free(bso->ranks);
+    bso->ranks = NULL;
+    bitset_truncate(bso, 0);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(clear_doc, "Remove all elements from this Bitset.");
+
+static PyObject *
+bitset_Bitset_update(bitset_BitsetObject *bso, PyObject *other)
+{
+    bitset_BitsetObject *otherbs;
+    int error;
+
+    if (bitset_Roaring_Check(other)) {
+        if (bitset_roaring_words_op(bso, other, ROARING_OR))
+            return NULL;
+        Py_RETURN_NONE;
+    }
+
+    otherbs = bitset_as_bitset(bso, other);
+    if (otherbs == NULL)
+        return NULL;
+
+    error = bitset_check_fits(bso, otherbs) || bitset_or_words(bso, otherbs);
+    Py_DECREF(otherbs);
+    if (error)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(update_doc,
+"Update a bitset with the union of itself and others.");
+
+static PyObject *
+bitset_Bitset_remove(bitset_BitsetObject *bso, PyObject *key)
+{
+    Py_ssize_t value = bitset_member((PyObject *)bso, key);
+
+    if (value < 0)
+        return NULL;
+
+    if (!bitset_has_member(bso, value)) {
+        PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
+    }
+
+    bso->words[BITSET_WORD_INDEX(value)] &= ~BITSET_WORD_MASK(value);
+    bitset_changed(bso);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(remove_doc,
+"Remove an element from a bitset; it must be a member.\n\
+\n\
+If the element is not a member, raise a KeyError.");
+
+
+static PyObject *
+bitset_Bitset_discard(bitset_BitsetObject *bso, PyObject *key)
+{
+    Py_ssize_t value = bitset_member((PyObject *)bso, key);
+
+    if (value < 0)
+        return NULL;
+
+    if (bitset_has_member(bso, value)) {
+        bso->words[BITSET_WORD_INDEX(value)] &= ~BITSET_WORD_MASK(value);
+        bitset_changed(bso);
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(discard_doc,
+"Remove an element from a bitset if it is a member.\n\
+\n\
+If the element is not a member, do nothing.");
+
+static PyObject *
+bitset_Bitset_pop(bitset_BitsetObject *bso)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < bso->nwords; i++) {
+        if (bso->words[i] != 0) {
+            bitset_changed(bso);
+            return PyInt_FromSsize_t(i * BITSET_WORD_BITS + bitset_pop(&(bso->words[i])));
+        }
+    }
+
+    PyErr_SetString(PyExc_KeyError, "pop from an empty bitset");
+    return NULL;
+}
+
+PyDoc_STRVAR(pop_doc, "Remove and return an arbitrary bitset element.");
+
+static PyObject *
+bitset_select_result(Py_ssize_t value)
+{
+    if (value < 0) {
+        PyErr_SetString(PyExc_IndexError, "select index out of range");
+        return NULL;
+    }
+    return PyInt_FromSsize_t(value);
+}
+
+static PyObject *
+bitset_Bitset_rank(bitset_BitsetObject *bso, PyObject *arg)
+{
+    Py_ssize_t x;
+
+    if (bitset_index_arg(arg, &x))
+        return NULL;
+    return PyInt_FromSsize_t(bitset_rank(bso, x));
+}
+
+PyDoc_STRVAR(rank_doc,
+"rank(x) -> int\n\
+\n\
+Return the number of members less than x.");
+
+static PyObject *
+bitset_Bitset_select(bitset_BitsetObject *bso, PyObject *arg)
+{
+    Py_ssize_t k;
+
+    if (bitset_index_arg(arg, &k))
+        return NULL;
+    return bitset_select_result(k < 0 ? -1 : bitset_select(bso, k));
+}
+
+PyDoc_STRVAR(select_doc,
+"select(k) -> int\n\
+\n\
+Return the member with k members less than it, so that select(0) is the\n\
+smallest.  Raises IndexError unless 0 <= k < len(self).");
+
+static PyObject *
+bitset_Bitset_nextset(bitset_BitsetObject *bso, PyObject *arg)
+{
+    Py_ssize_t x;
+
+    if (bitset_index_arg(arg, &x))
+        return NULL;
+    return PyInt_FromSsize_t(bitset_next(bso, x));
+}
+
+PyDoc_STRVAR(nextset_doc,
+"nextset(x) -> int\n\
+\n\
+Return the smallest member not less than x, or -1 if there is none.");
+
+static PyObject *
+bitset_Bitset_prevset(bitset_BitsetObject *bso, PyObject *arg)
+{
+    Py_ssize_t x;
+
+    if (bitset_index_arg(arg, &x))
+        return NULL;
+    return PyInt_FromSsize_t(bitset_prev(bso, x));
+}
+
+PyDoc_STRVAR(prevset_doc,
+"prevset(x) -> int\n\
+\n\
+Return the largest member not greater than x, or -1 if there is none.");
+
+static PyObject *
+bitset_Bitset_add_range(bitset_BitsetObject *bso, PyObject *args)
+{
+    Py_ssize_t lo, hi;
+
+    if (bitset_range_args(args, "add_range", &lo, &hi) || bitset_add_range(bso, lo, hi))
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(add_range_doc,
+"add_range(lo, hi)\n\
+\n\
+Add the integers lo <= x < hi to a bitset.");
+
+static PyObject *
+bitset_Bitset_discard_range(bitset_BitsetObject *bso, PyObject *args)
+{
+    Py_ssize_t lo, hi;
+
+    if (bitset_range_args(args, "discard_range", &lo, &hi))
+        return NULL;
+
+    bitset_discard_range(bso, lo, hi);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(discard_range_doc,
+"discard_range(lo, hi)\n\
+\n\
+Remove any members lo <= x < hi from a bitset.");
+
+static PyObject *
+bitset_Bitset_flip(bitset_BitsetObject *bso, PyObject *args)
+{
+    Py_ssize_t lo, hi;
+
+    if (bitset_range_args(args, "flip", &lo, &hi) || bitset_flip_range(bso, lo, hi))
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(flip_doc,
+"flip(lo, hi)\n\
+\n\
+Remove the members lo <= x < hi from a bitset and add the non-members.");
+
+static PyObject *
+bitset_Bitset_count(bitset_BitsetObject *bso, PyObject *args)
+{
+    Py_ssize_t lo, hi;
+
+    if (bitset_range_args(args, "count", &lo, &hi))
+        return NULL;
+
+    return PyInt_FromSsize_t(bitset_count_in_range(bso, lo, hi));
+}
+
+PyDoc_STRVAR(count_doc,
+"count(lo, hi) -> int\n\
+\n\
+Return the number of members lo <= x < hi.");
+
+static PyObject *
+bitset_Bitset_any_in_range(bitset_BitsetObject *bso, PyObject *args)
+{
+    Py_ssize_t lo, hi;
+
+    if (bitset_range_args(args, "any_in_range", &lo, &hi))
+        return NULL;
+
+    return PyBool_FromLong(bitset_any_in_range(bso, lo, hi));
+}
+
+PyDoc_STRVAR(any_in_range_doc,
+"any_in_range(lo, hi) -> bool\n\
+\n\
+Return True if any integer lo <= x < hi is a member.");
+
+static PyObject *
+bitset_Bitset_all_in_range(bitset_BitsetObject *bso, PyObject *args)
+{
+    Py_ssize_t lo, hi;
+
+    if (bitset_range_args(args, "all_in_range", &lo, &hi))
+        return NULL;
+
+    return PyBool_FromLong(bitset_all_in_range(bso, lo, hi));
+}
+
+PyDoc_STRVAR(all_in_range_doc,
+"all_in_range(lo, hi) -> bool\n\
+\n\
+Return True if every integer lo <= x < hi is a member.");
+
+static PyObject *
+bitset_Bitset_issuperset(bitset_BitsetObject *bso, PyObject *other)
+{
+    bitset_BitsetObject *otherbs;
+    int result;
+
+    if (bitset_Roaring_Check(other))
+        return PyBool_FromLong(bitset_roaring_and_count_words(bso, other, 0) == bitset_Roaring_len(other));
+
+    otherbs = bitset_as_bitset(bso, other);
+    if (otherbs == NULL)
+        return NULL;
+
+    result = bitset_words_subset(otherbs, bso);
+    Py_DECREF(otherbs);
+
+    return PyBool_FromLong(result);
+}
+
+PyDoc_STRVAR(issuperset_doc, "Report whether this bitset contains another bitset.");
+
+/*
+ * The key is the number of used words and then the words from the highest
+ * down, all big-endian, so that comparing keys as bytes orders bitsets as
+ * bitset_words_cmp() does.
+ */
+static PyObject *
+bitset_Bitset_cmp_key(bitset_BitsetObject *bso)
+{
+    Py_ssize_t n = bitset_used_words(bso), i;
+    PyObject *result;
+    unsigned char *p;
+    int j;
+
+    result = PyBytes_FromStringAndSize(NULL, (n + 1) * sizeof(bitset_word));
+    if (result == NULL)
+        return NULL;
+
+    p = (unsigned char *)PyBytes_AS_STRING(result);
+    for (j = 0; j < 8; j++)
+        *p++ = (unsigned char)((bitset_word)n >> (56 - 8 * j));
+    for (i = n - 1; i >= 0; i--) {
+        for (j = 0; j < 8; j++)
+            *p++ = (unsigned char)(bso->words[i] >> (56 - 8 * j));
+    }
+
+    return result;
+}
+
+PyDoc_STRVAR(cmp_key_doc,
+"cmp_key() -> bytes\n\
+\n\
+Return a key ordering bitsets totally, as the integers sum(2**x for x in\n\
+bitset), for sorted() and the like.  Bitsets with the same members have\n\
+equal keys whatever their type.");
+
+static PyObject *
+bitset_Bitset_issubset(bitset_BitsetObject *bso, PyObject *other)
+{
+    bitset_BitsetObject *otherbs;
+    int result;
+
+    if (bitset_Roaring_Check(other))
+        return PyBool_FromLong(bitset_roaring_and_count_words(bso, other, 0) ==
+                               bitset_Bitset_len((PyObject *)bso));
+
+    otherbs = bitset_as_bitset(bso, other);
+    if (otherbs == NULL)
+        return NULL;
+
+    result = bitset_words_subset(bso, otherbs);
+    Py_DECREF(otherbs);
+
+    return PyBool_FromLong(result);
+}
+
+PyDoc_STRVAR(issubset_doc, "Report whether another bitset contains this bitset.");
+
+static PyObject *
+bitset_Bitset_isdisjoint(bitset_BitsetObject *bso, PyObject *other)
+{
+    bitset_BitsetObject *otherbs;
+    int result;
+
+    if (bitset_Roaring_Check(other))
+        return PyBool_FromLong(bitset_roaring_and_count_words(bso, other, 1) == 0);
+
+    otherbs = bitset_as_bitset(bso, other);
+    if (otherbs == NULL)
+        return NULL;
+
+    result = !bitset_words_intersect(bso, otherbs);
+    Py_DECREF(otherbs);
+
+    return PyBool_FromLong(result);
+}
+
+PyDoc_STRVAR(isdisjoint_doc,
+"Return True if two bitsets have a null intersection.");
+
+static PyObject *
+bitset_Bitset_difference_update(bitset_BitsetObject *bso, PyObject *other)
+{
+    bitset_BitsetObject *otherbs;
+
+    if (bitset_Roaring_Check(other)) {
+        if (bitset_roaring_words_op(bso, other, ROARING_ANDNOT))
+            return NULL;
+        Py_RETURN_NONE;
+    }
+
+    otherbs = bitset_as_bitset(bso, other);
+    if (otherbs == NULL)
+        return NULL;
+
+    bitset_sub_words(bso, otherbs);
+    Py_DECREF(otherbs);
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(difference_update_doc,
+"Remove all elements of other bitsets from this bitset.");
+
+static PyObject *
+bitset_Bitset_difference(bitset_BitsetObject *bso, PyObject *other)
+{
+    bitset_BitsetObject *result;
+
+    result = (bitset_BitsetObject *)bitset_Bitset_copy(bso);
+    if (result == NULL)
+        return NULL;
+
+    if (bitset_Bitset_difference_update(result, other) == NULL) {
+        Py_DECREF(result);
+        return NULL;
+    }
+
+    return (PyObject *)result;
+}
+
+PyDoc_STRVAR(difference_doc,
+"Return the difference of two or more bitsets as a new bitset.\n\
+\n\
+(i.e. all elements that are in this bitset but not the others.)");
+
+static PyObject *
+bitset_Bitset_symmetric_difference_update(bitset_BitsetObject *bso, PyObject *other)
+{
+    bitset_BitsetObject *otherbs;
+    int error;
+
+    if (bitset_Roaring_Check(other)) {
+        if (bitset_roaring_words_op(bso, other, ROARING_XOR))
+            return NULL;
+        Py_RETURN_NONE;
+    }
+
+    otherbs = bitset_as_bitset(bso, other);
+    if (otherbs == NULL)
+        return NULL;
+
+    error = bitset_check_fits(bso, otherbs) || bitset_xor_words(bso, otherbs);
+    Py_DECREF(otherbs);
+    if (error)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(symmetric_difference_update_doc,
+"Update a bitset with the symmetric difference of itself and another.");
+
+static PyObject *
+bitset_Bitset_symmetric_difference(bitset_BitsetObject *bso, PyObject *other)
+{
+    bitset_BitsetObject *result;
+
+    result = (bitset_BitsetObject *)bitset_Bitset_copy(bso);
+    if (result == NULL)
+        return NULL;
+
+    if (bitset_Bitset_symmetric_difference_update(result, other) == NULL) {
+        Py_DECREF(result);
+        return NULL;
+    }
+
+    return (PyObject *)result;
+}
+
+PyDoc_STRVAR(symmetric_difference_doc,
+"Return the symmetric difference of two bitsets as a new bitset.\n\
+\n\
+(i.e. all elements that are in exactly one of the bitsets.)");
+
+static PyObject *
+bitset_Bitset_union(bitset_BitsetObject *bso, PyObject *other)
+{
+    bitset_BitsetObject *result;
+
+    result = (bitset_BitsetObject *)bitset_Bitset_copy(bso);
+    if (result == NULL)
+        return NULL;
+
+    if (bitset_Bitset_update(result, other) == NULL) {
+        Py_DECREF(result);
+        return NULL;
+    }
+
+    return (PyObject *)result;
+}
+
+PyDoc_STRVAR(union_doc,
+ "Return the union of bitsets as a new bitset.\n\
+\n\
+(i.e. all elements that are in any of the bitsets.)");
+
+static PyObject *
+bitset_Bitset_intersection_update(bitset_BitsetObject *bso, PyObject *other)
+{
+    bitset_BitsetObject *otherbs;
+
+    if (bitset_Roaring_Check(other)) {
+        if (bitset_roaring_words_op(bso, other, ROARING_AND))
+            return NULL;
+        Py_RETURN_NONE;
+    }
+
+    otherbs = bitset_as_bitset(bso, other);
+    if (otherbs == NULL)
+        return NULL;
+
+    bitset_and_words(bso, otherbs);
+    Py_DECREF(otherbs);
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(intersection_update_doc,
+"Update a bitset with the intersection of itself and others.");
+
+static PyObject *
+bitset_Bitset_intersection(bitset_BitsetObject *bso, PyObject *other)
+{
+    bitset_BitsetObject *result;
+
+    result = (bitset_BitsetObject *)bitset_Bitset_copy(bso);
+    if (result == NULL)
+        return NULL;
+
+    if (bitset_Bitset_intersection_update(result, other) == NULL) {
+        Py_DECREF(result);
+        return NULL;
+    }
+
+    return (PyObject *)result;
+}
+
+PyDoc_STRVAR(intersection_doc,
+"Return the intersection of two or more bitsets as a new bitset.\n\
+\n\
+(i.e. all elements that are in all of the bitsets.)");
+
+/*
+ * union(), intersection() and difference() and their in place versions
+ * take any number of others, as set's do, and fold them all into one
+ * result in a single call.  With METH_FASTCALL the others arrive as an
+ * array rather than a tuple.
+ */
+#ifdef BITSET_FASTCALL
+#define BITSET_METH_OTHERS METH_FASTCALL
+#define BITSET_OTHERS_PARAMS PyObject *const *args, Py_ssize_t nargs
+#define BITSET_OTHERS_ARGS args, nargs
+#else
+#define BITSET_METH_OTHERS METH_VARARGS
+#define BITSET_OTHERS_PARAMS PyObject *args
+#define BITSET_OTHERS_ARGS &PyTuple_GET_ITEM(args, 0), PyTuple_GET_SIZE(args)
+#endif
+
+/* Calls update(self, other) for each of the others */
+static PyObject *
+bitset_update_each(PyObject *self, PyObject *const *others, Py_ssize_t n,
+                   binaryfunc update)
+{
+    PyObject *status;
+    Py_ssize_t i;
+
+    for (i = 0; i < n; i++) {
+        status = update(self, others[i]);
+        if (status == NULL)
+            return NULL;
+        Py_DECREF(status);
+    }
+
+    Py_RETURN_NONE;
+}
+
+/* Returns a copy of self updated with each of the others */
+static PyObject *
+bitset_fold_each(PyObject *self, PyObject *const *others, Py_ssize_t n,
+                 unaryfunc copy, binaryfunc update)
+{
+    PyObject *result, *status;
+
+    result = copy(self);
+    if (result == NULL)
+        return NULL;
+
+    status = bitset_update_each(result, others, n, update);
+    if (status == NULL) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    Py_DECREF(status);
+
+    return result;
+}
+
+/* The methods taking *others, counted as operation op */
+static PyObject *
+bitset_update_others(PyObject *self, PyObject *const *others, Py_ssize_t n,
+                     binaryfunc update, int op)
+{
+    PyObject *result;
+
+    BITSET_STAT_CALL(op, result, bitset_update_each(self, others, n, update));
+    return result;
+}
+
+static PyObject *
+bitset_fold_others(PyObject *self, PyObject *const *others, Py_ssize_t n,
+                   unaryfunc copy, binaryfunc update, int op)
+{
+    PyObject *result;
+
+    BITSET_STAT_CALL(op, result, bitset_fold_each(self, others, n, copy, update));
+    return result;
+}
+
+static PyObject *
+bitset_Bitset_union_others(PyObject *bso, BITSET_OTHERS_PARAMS)
+{
+    return bitset_fold_others(bso, BITSET_OTHERS_ARGS, (unaryfunc)bitset_Bitset_copy,
+                              (binaryfunc)bitset_Bitset_update,
+                              BITSET_STAT_UNION);
+}
+
+static PyObject *
+bitset_Bitset_intersection_others(PyObject *bso, BITSET_OTHERS_PARAMS)
+{
+    return bitset_fold_others(bso, BITSET_OTHERS_ARGS, (unaryfunc)bitset_Bitset_copy,
+                              (binaryfunc)bitset_Bitset_intersection_update,
+                              BITSET_STAT_INTERSECTION);
+}
+
+static PyObject *
+bitset_Bitset_difference_others(PyObject *bso, BITSET_OTHERS_PARAMS)
+{
+    return bitset_fold_others(bso, BITSET_OTHERS_ARGS, (unaryfunc)bitset_Bitset_copy,
+                              (binaryfunc)bitset_Bitset_difference_update,
+                              BITSET_STAT_DIFFERENCE);
+}
+
+static PyObject *
+bitset_Bitset_update_others(PyObject *bso, BITSET_OTHERS_PARAMS)
+{
+    return bitset_update_others(bso, BITSET_OTHERS_ARGS,
+                                (binaryfunc)bitset_Bitset_update,
+                                BITSET_STAT_UPDATE);
+}
+
+static PyObject *
+bitset_Bitset_intersection_update_others(PyObject *bso, BITSET_OTHERS_PARAMS)
+{
+    return bitset_update_others(bso, BITSET_OTHERS_ARGS,
+                                (binaryfunc)bitset_Bitset_intersection_update,
+                                BITSET_STAT_INTERSECTION_UPDATE);
+}
+
+static PyObject *
+bitset_Bitset_difference_update_others(PyObject *bso, BITSET_OTHERS_PARAMS)
+{
+    return bitset_update_others(bso, BITSET_OTHERS_ARGS,
+                                (binaryfunc)bitset_Bitset_difference_update,
+                                BITSET_STAT_DIFFERENCE_UPDATE);
+}
+
+/*
+ * The *_count methods return the size of the corresponding operation's
+ * result using the fused kernels, without building it.
+ */
+static PyObject *
+bitset_count_with(bitset_BitsetObject *bso, PyObject *other,
+                  Py_ssize_t (*count)(bitset_BitsetObject *, bitset_BitsetObject *), int op)
+{
+    bitset_BitsetObject *otherbs;
+    Py_ssize_t result, both, a, b;
+
+    /* a RoaringBitset's counts follow from the size of the intersection */
+    if (bitset_Roaring_Check(other)) {
+        both = bitset_roaring_and_count_words(bso, other, 0);
+        a = bitset_Bitset_len((PyObject *)bso) - both;
+        b = bitset_Roaring_len(other) - both;
+        switch (op) {
+        case ROARING_AND:
+            return PyInt_FromSsize_t(both);
+        case ROARING_OR:
+            return PyInt_FromSsize_t(a + both + b);
+        case ROARING_XOR:
+            return PyInt_FromSsize_t(a + b);
+        default:
+            return PyInt_FromSsize_t(a);
+        }
+    }
+
+    otherbs = bitset_as_bitset(bso, other);
+    if (otherbs == NULL)
+        return NULL;
+
+    result = count(bso, otherbs);
+    Py_DECREF(otherbs);
+
+    return PyInt_FromSsize_t(result);
+}
+
+static PyObject *
+bitset_Bitset_intersection_count(bitset_BitsetObject *bso, PyObject *other)
+{
+    return bitset_count_with(bso, other, bitset_and_count, ROARING_AND);
+}
+
+PyDoc_STRVAR(intersection_count_doc,
+"Return len(self & other) without building the intersection.");
+
+static PyObject *
+bitset_Bitset_union_count(bitset_BitsetObject *bso, PyObject *other)
+{
+    return bitset_count_with(bso, other, bitset_or_count, ROARING_OR);
+}
+
+PyDoc_STRVAR(union_count_doc,
+"Return len(self | other) without building the union.");
+
+static PyObject *
+bitset_Bitset_difference_count(bitset_BitsetObject *bso, PyObject *other)
+{
+    return bitset_count_with(bso, other, bitset_sub_count, ROARING_ANDNOT);
+}
+
+PyDoc_STRVAR(difference_count_doc,
+"Return len(self - other) without building the difference.");
+
+static PyObject *
+bitset_Bitset_symmetric_difference_count(bitset_BitsetObject *bso, PyObject *other)
+{
+    return bitset_count_with(bso, other, bitset_xor_count, ROARING_XOR);
+}
+
+PyDoc_STRVAR(symmetric_difference_count_doc,
+"Return len(self ^ other) without building the symmetric difference.");
+
+static PyObject *
+bitset_Bitset_intersects(bitset_BitsetObject *bso, PyObject *other)
+{
+    bitset_BitsetObject *otherbs;
+    int result;
+
+    if (bitset_Roaring_Check(other))
+        return PyBool_FromLong(bitset_roaring_and_count_words(bso, other, 1) != 0);
+
+    otherbs = bitset_as_bitset(bso, other);
+    if (otherbs == NULL)
+        return NULL;
+
+    result = bitset_words_intersect(bso, otherbs);
+    Py_DECREF(otherbs);
+
+    return PyBool_FromLong(result);
+}
+
+PyDoc_STRVAR(intersects_doc,
+"Return True if two bitsets have a member in common, stopping at the first.");
+
+static PyObject *
+bitset_Bitset_jaccard(bitset_BitsetObject *bso, PyObject *other)
+{
+    bitset_BitsetObject *otherbs;
+    Py_ssize_t both, either;
+
+    if (bitset_Roaring_Check(other)) {
+        both = bitset_roaring_and_count_words(bso, other, 0);
+        either = bitset_Bitset_len((PyObject *)bso) + bitset_Roaring_len(other) - both;
+        return PyFloat_FromDouble(either ? (double)both / either : 1.0);
+    }
+
+    otherbs = bitset_as_bitset(bso, other);
+    if (otherbs == NULL)
+        return NULL;
+
+    both = bitset_and_count(bso, otherbs);
+    either = bitset_Bitset_len((PyObject *)bso) + bitset_Bitset_len((PyObject *)otherbs) - both;
+    Py_DECREF(otherbs);
+
+    return PyFloat_FromDouble(either ? (double)both / either : 1.0);
+}
+
+PyDoc_STRVAR(jaccard_doc,
+"jaccard(other) -> float\n\
+\n\
+Return len(self & other) / len(self | other), the Jaccard similarity of two\n\
+bitsets, without building either.  Two empty bitsets have a similarity of 1.0.");
+
+/* Returns bso == target for a bitset or iterable target, or -1 */
+static int
+bitset_equal_to(bitset_BitsetObject *bso, PyObject *target)
+{
+    bitset_BitsetObject *targetbs;
+    Py_ssize_t n;
+    int result;
+
+    if (bitset_Roaring_Check(target)) {
+        n = bitset_Roaring_len(target);
+        return bitset_Bitset_len((PyObject *)bso) == n &&
+            bitset_roaring_and_count_words(bso, target, 0) == n;
+    }
+
+    targetbs = bitset_as_bitset(bso, target);
+    if (targetbs == NULL)
+        return -1;
+
+    result = bitset_words_equal(bso, targetbs);
+    Py_DECREF(targetbs);
+    return result;
+}
+
+static PyObject *
+bitset_Bitset_intersection_equals(bitset_BitsetObject *bso, PyObject *args)
+{
+    PyObject *other, *target;
+    bitset_BitsetObject *otherbs, *targetbs;
+    int result;
+
+    if (!PyArg_UnpackTuple(args, "intersection_equals", 2, 2, &other, &target))
+        return NULL;
+
+    /* self & other is no larger than self, so with a RoaringBitset build it */
+    if (bitset_Roaring_Check(other) || bitset_Roaring_Check(target)) {
+        otherbs = (bitset_BitsetObject *)bitset_Bitset_intersection(bso, other);
+        if (otherbs == NULL)
+            return NULL;
+        result = bitset_equal_to(otherbs, target);
+        Py_DECREF(otherbs);
+        return result < 0 ? NULL : PyBool_FromLong(result);
+    }
+
+    otherbs = bitset_as_bitset(bso, other);
+    if (otherbs == NULL)
+        return NULL;
+
+    targetbs = bitset_as_bitset(bso, target);
+    if (targetbs == NULL) {
+        Py_DECREF(otherbs);
+        return NULL;
+    }
+
+    result = bitset_words_and_equal(bso, otherbs, targetbs);
+    Py_DECREF(otherbs);
+    Py_DECREF(targetbs);
+
+    return PyBool_FromLong(result);
+}
+
+PyDoc_STRVAR(intersection_equals_doc,
+"intersection_equals(other, target) -> bool\n\
+\n\
+Return (self & other) == target without building the intersection, stopping\n\
+at the first word that differs.");
+
+/* Gets a contiguous buffer from obj, which 2.x objects such as
+   array.array may only provide through the old buffer interface */
+static int
+bitset_get_buffer(PyObject *obj, Py_buffer *view, int flags)
+{
+#if PY_MAJOR_VERSION < 3
+    const void *buf;
+    Py_ssize_t len;
+
+    if (!PyObject_CheckBuffer(obj) && PyObject_CheckReadBuffer(obj)) {
+        if (PyObject_AsReadBuffer(obj, &buf, &len))
+            return -1;
+        return PyBuffer_FillInfo(view, obj, (void *)buf, len, 1, flags);
+    }
+#endif
+    return PyObject_GetBuffer(obj, view, flags);
+}
+
+/* Returns a new bitset of the given type holding nbytes raw bytes */
+static PyObject *
+bitset_from_bytes(PyTypeObject *type, const unsigned char *bytes, Py_ssize_t nbytes)
+{
+    bitset_BitsetObject *result;
+
+    result = (bitset_BitsetObject *)Bitset_new(type, NULL, NULL);
+    if (result == NULL)
+        return NULL;
+
+    if (bitset_grow(result, (nbytes + sizeof(bitset_word) - 1) / sizeof(bitset_word)) ||
+        (bitset_import_bytes(result, bytes, nbytes),
+         bitset_check_fits(result, result))) {
+        Py_DECREF(result);
+        return NULL;
+    }
+
+    return (PyObject *)result;
+}
+
+static PyObject *
+bitset_Bitset_from_buffer(PyTypeObject *type, PyObject *obj)
+{
+    bitset_BitsetObject *result = NULL;
+    Py_buffer view;
+
+    if (bitset_get_buffer(obj, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT))
+        return NULL;
+
+    if (view.itemsize == 1) {
+        result = (bitset_BitsetObject *)bitset_from_bytes(type, view.buf, view.len);
+    }
+    else if (view.itemsize == sizeof(bitset_word)) {
+        result = (bitset_BitsetObject *)Bitset_new(type, NULL, NULL);
+        if (result != NULL &&
+            (bitset_grow(result, view.len / sizeof(bitset_word)) ||
+             (memcpy(result->words, view.buf, view.len),
+              bitset_check_fits(result, result)))) {
+            Py_CLEAR(result);
+        }
+    }
+    else {
+        PyErr_SetString(PyExc_ValueError, "buffer items must be 1 or 8 bytes");
+    }
+
+    PyBuffer_Release(&view);
+    return (PyObject *)result;
+}
+
+PyDoc_STRVAR(from_buffer_doc,
+"from_buffer(buffer) -> new bitset\n\
+\n\
+Build a bitset by copying the words from an object supporting the buffer\n\
+protocol.  Buffers of 8 byte items, such as a numpy uint64 array, hold\n\
+native words with member v as bit (v % 64) of word (v / 64); buffers of\n\
+bytes are read as by frombytes().");
+
+static PyObject *
+bitset_Bitset_frombytes(PyTypeObject *type, PyObject *obj)
+{
+    PyObject *result;
+    Py_buffer view;
+
+    if (bitset_get_buffer(obj, &view, PyBUF_SIMPLE))
+        return NULL;
+
+    result = bitset_from_bytes(type, view.buf, view.len);
+    PyBuffer_Release(&view);
+    return result;
+}
+
+PyDoc_STRVAR(frombytes_doc,
+"frombytes(bytes) -> new bitset\n\
+\n\
+Build a bitset from raw bytes, member v being bit (v % 8) of byte (v / 8).");
+
+/*
+ * Bitsets pickle as a call to loads() with their serialized form.
+ * __setstate__ reads the states pickled by earlier versions: an int with
+ * one bit per member, member v being bit v - 1 for a Bitset and bit v
+ * otherwise, or on Python 3 the raw bytes of a BigBitset.
+ */
+static PyObject *
+bitset_Bitset_reduce(bitset_BitsetObject *bso)
+{
+    return bitset_reduce_serialized((PyObject *)bso);
+}
+
+PyDoc_STRVAR(reduce_doc, "Return state information for pickling.");
+
+/* A MappedBitset's words belong to its store, so aren't counted */
+static PyObject *
+bitset_Bitset_sizeof(bitset_BitsetObject *bso)
+{
+    Py_ssize_t n = Py_TYPE(bso)->tp_basicsize + bso->nranks * sizeof(Py_ssize_t);
+
+    if (bso->words != &bso->smallword && bso->base == NULL)
+        n += bso->allocated * sizeof(bitset_word);
+    return PyInt_FromSsize_t(n);
+}
+
+PyDoc_STRVAR(sizeof_doc, "Return the memory used by a bitset in bytes.");
+
+static PyObject *
+bitset_Bitset_setstate(bitset_BitsetObject *bso, PyObject *state)
+{
+    PyObject *value;
+    unsigned char *bytes;
+    Py_ssize_t n;
+    int error;
+
+    if (bitset_check_resizable(bso))
+        return NULL;
+
+    if (bitset_Bitset_Check(bso)) {
+        if (!PyInt_Check(state) || PyInt_AsLong(state) < 0 ||
+            PyInt_AsLong(state) > 0xFFFFFFFFL) {
+            PyErr_SetString(PyExc_TypeError, "Invalid state in __setstate__");
+            return NULL;
+        }
+
+        if (bitset_grow(bso, 1))
+            return NULL;
+        bso->words[0] = (bitset_word)PyInt_AsLong(state) << BITSET_MIN;
+        bitset_changed(bso);
+        Py_RETURN_NONE;
+    }
+
+    if (PyBytes_Check(state)) {
+        n = PyBytes_GET_SIZE(state);
+        bitset_truncate(bso, 0);
+        if (bitset_grow(bso, (n + sizeof(bitset_word) - 1) / sizeof(bitset_word)))
+            return NULL;
+        bitset_import_bytes(bso, (unsigned char *)PyBytes_AS_STRING(state), n);
+        Py_RETURN_NONE;
+    }
+
+    if (!PyInt_Check(state) && !PyLong_Check(state)) {
+        PyErr_SetString(PyExc_TypeError, "Invalid state in __setstate__");
+        return NULL;
+    }
+
+    value = PyNumber_Long(state);
+    if (value == NULL)
+        return NULL;
+
+    if (_PyLong_Sign(value) < 0) {
+        Py_DECREF(value);
+        PyErr_SetString(PyExc_TypeError, "Invalid state in __setstate__");
+        return NULL;
+    }
+
+    n = (_PyLong_NumBits(value) + BITSET_WORD_BITS - 1) / BITSET_WORD_BITS;
+    bytes = (unsigned char *)PyMem_Malloc(n > 0 ? n * sizeof(bitset_word) : 1);
+    if (bytes == NULL) {
+        Py_DECREF(value);
+        return PyErr_NoMemory();
+    }
+
+#if PY_VERSION_HEX >= 0x030D0000
+    error = _PyLong_AsByteArray((PyLongObject *)value, bytes,
+                                n * sizeof(bitset_word), 1, 0, 1);
+#else
+    error = _PyLong_AsByteArray((PyLongObject *)value, bytes,
+                                n * sizeof(bitset_word), 1, 0);
+#endif
+    Py_DECREF(value);
+
+    if (!error) {
+        bitset_truncate(bso, 0);
+        error = bitset_grow(bso, n);
+    }
+
+    if (!error)
+        bitset_import_bytes(bso, bytes, n * sizeof(bitset_word));
+
+    PyMem_Free(bytes);
+    if (error)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(setstate_doc, "Sets state information.");
+
+/* defined with the batch membership and extraction code below */
+static PyObject *bitset_Bitset_contains_many(bitset_BitsetObject *bso, PyObject *obj);
+static PyObject *bitset_Bitset_filter(bitset_BitsetObject *bso, PyObject *obj);
+PyDoc_STRVAR(contains_many_doc,
+"contains_many(items) -> bytearray\n\
+\n\
+Return a bytearray with a 1 for each of items that is a member and a 0\n\
+for each that isn't.  items is a buffer of native integers, such as an\n\
+array.array or numpy array, or any iterable of integers.");
+PyDoc_STRVAR(filter_doc,
+"filter(items) -> array.array\n\
+\n\
+Return an array.array of the items that are members, in order, of the\n\
+same integer type as items if it is a buffer.");
+static PyObject *bitset_Bitset_into(bitset_BitsetObject *bso, PyObject *obj);
+static PyObject *bitset_Bitset_to_array(bitset_BitsetObject *bso, PyObject *args);
+PyDoc_STRVAR(into_doc,
+"into(buffer) -> int\n\
+\n\
+Write the members in order to a writable buffer of native integers, such\n\
+as an array.array or numpy array, and return their number.  Raises\n\
+ValueError if the buffer has too few items, and OverflowError if a member\n\
+doesn't fit in one.");
+PyDoc_STRVAR(to_array_doc,
+"to_array([typecode]) -> array.array\n\
+\n\
+Return an array.array of the members in order, of the given integer\n\
+typecode, by default that of a signed integer the size of a pointer.");
+
+static PyMethodDef bitset_Bitset_methods[] = {
+    {"add",                         (PyCFunction)bitset_Bitset_add,
+     METH_O, add_doc},
+    {"add_range",                   (PyCFunction)bitset_Bitset_add_range,
+     METH_VARARGS, add_range_doc},
+    {"all_in_range",                (PyCFunction)bitset_Bitset_all_in_range,
+     METH_VARARGS, all_in_range_doc},
+    {"any_in_range",                (PyCFunction)bitset_Bitset_any_in_range,
+     METH_VARARGS, any_in_range_doc},
+    {"clear",                       (PyCFunction)bitset_Bitset_clear,
+     METH_NOARGS, clear_doc},
+/*     {"__contains__",                (PyCFunction)bitset_Bitset_direct_contains, */
+/*      METH_O | METH_COEXIST, contains_doc}, */
+    {"cmp_key",                     (PyCFunction)bitset_Bitset_cmp_key,
+     METH_NOARGS, cmp_key_doc},
+    {"contains_many",               (PyCFunction)bitset_Bitset_contains_many,
+     METH_O, contains_many_doc},
+    {"copy",                        (PyCFunction)bitset_Bitset_copy,
+     METH_NOARGS, copy_doc},
+    {"count",                       (PyCFunction)bitset_Bitset_count,
+     METH_VARARGS, count_doc},
+    {"discard",                     (PyCFunction)bitset_Bitset_discard,
+     METH_O, discard_doc},
+    {"discard_range",               (PyCFunction)bitset_Bitset_discard_range,
+     METH_VARARGS, discard_range_doc},
+    {"flip",                        (PyCFunction)bitset_Bitset_flip,
+     METH_VARARGS, flip_doc},
+    {"filter",                      (PyCFunction)bitset_Bitset_filter,
+     METH_O, filter_doc},
+    {"from_buffer",                 (PyCFunction)bitset_Bitset_from_buffer,
+     METH_O | METH_CLASS, from_buffer_doc},
+    {"frombytes",                   (PyCFunction)bitset_Bitset_frombytes,
+     METH_O | METH_CLASS, frombytes_doc},
+    {"difference",                  (PyCFunction)bitset_Bitset_difference_others,
+     BITSET_METH_OTHERS, difference_doc},
+    {"difference_count",            (PyCFunction)bitset_Bitset_difference_count,
+     METH_O, difference_count_doc},
+    {"difference_update",           (PyCFunction)bitset_Bitset_difference_update_others,
+     BITSET_METH_OTHERS, difference_update_doc},
+    {"intersection",                (PyCFunction)bitset_Bitset_intersection_others,
+     BITSET_METH_OTHERS, intersection_doc},
+    {"intersection_count",          (PyCFunction)bitset_Bitset_intersection_count,
+     METH_O, intersection_count_doc},
+    {"intersection_equals",         (PyCFunction)bitset_Bitset_intersection_equals,
+     METH_VARARGS, intersection_equals_doc},
+    {"intersection_update",         (PyCFunction)bitset_Bitset_intersection_update_others,
+     BITSET_METH_OTHERS, intersection_update_doc},
+    {"intersects",                  (PyCFunction)bitset_Bitset_intersects,
+     METH_O, intersects_doc},
+    {"into",                        (PyCFunction)bitset_Bitset_into,
+     METH_O, into_doc},
+    {"isdisjoint",                  (PyCFunction)bitset_Bitset_isdisjoint,
+     METH_O, isdisjoint_doc},
+    {"issubset",                    (PyCFunction)bitset_Bitset_issubset,
+     METH_O, issubset_doc},
+    {"issuperset",                  (PyCFunction)bitset_Bitset_issuperset,
+     METH_O, issuperset_doc},
+    {"jaccard",                     (PyCFunction)bitset_Bitset_jaccard,
+     METH_O, jaccard_doc},
+    {"nextset",                     (PyCFunction)bitset_Bitset_nextset,
+     METH_O, nextset_doc},
+    {"pop",                         (PyCFunction)bitset_Bitset_pop,
+     METH_NOARGS, pop_doc},
+    {"prevset",                     (PyCFunction)bitset_Bitset_prevset,
+     METH_O, prevset_doc},
+    {"rank",                        (PyCFunction)bitset_Bitset_rank,
+     METH_O, rank_doc},
+    {"__reduce__",                  (PyCFunction)bitset_Bitset_reduce,
+     METH_NOARGS, reduce_doc},
+    {"remove",                      (PyCFunction)bitset_Bitset_remove,
+     METH_O, remove_doc},
+    {"select",                      (PyCFunction)bitset_Bitset_select,
+     METH_O, select_doc},
+    {"__setstate__",                (PyCFunction)bitset_Bitset_setstate,
+     METH_O, setstate_doc},
+    {"__sizeof__",                  (PyCFunction)bitset_Bitset_sizeof,
+     METH_NOARGS, sizeof_doc},
+    {"symmetric_difference",        (PyCFunction)bitset_Bitset_symmetric_difference,
+     METH_O, symmetric_difference_doc},
+    {"symmetric_difference_count",  (PyCFunction)bitset_Bitset_symmetric_difference_count,
+     METH_O, symmetric_difference_count_doc},
+    {"symmetric_difference_update", (PyCFunction)bitset_Bitset_symmetric_difference_update,
+     METH_O, symmetric_difference_update_doc},
+/* #ifdef Py_DEBUG */
+/*     {"test_c_api",                  (PyCFunction)test_c_api,                                 */
+/*      METH_NOARGS, test_c_api_doc}, */
+/* #endif */
+    {"to_array",                    (PyCFunction)bitset_Bitset_to_array,
+     METH_VARARGS, to_array_doc},
+    {"union",                       (PyCFunction)bitset_Bitset_union_others,
+     BITSET_METH_OTHERS, union_doc},
+    {"union_count",                 (PyCFunction)bitset_Bitset_union_count,
+     METH_O, union_count_doc},
+    {"update",                      (PyCFunction)bitset_Bitset_update_others,
+     BITSET_METH_OTHERS, update_doc},
+    {NULL,        NULL}                /* sentinel */
+};
+
+static PyMethodDef bitset_FrozenBitset_methods[] = {
+    {"all_in_range",                (PyCFunction)bitset_Bitset_all_in_range,
+     METH_VARARGS, all_in_range_doc},
+    {"any_in_range",                (PyCFunction)bitset_Bitset_any_in_range,
+     METH_VARARGS, any_in_range_doc},
+    {"cmp_key",                     (PyCFunction)bitset_Bitset_cmp_key,
+     METH_NOARGS, cmp_key_doc},
+    {"contains_many",               (PyCFunction)bitset_Bitset_contains_many,
+     METH_O, contains_many_doc},
+    {"copy",                        (PyCFunction)bitset_FrozenBitset_copy,
+     METH_NOARGS, copy_doc},
+    {"count",                       (PyCFunction)bitset_Bitset_count,
+     METH_VARARGS, count_doc},
+    {"difference",                  (PyCFunction)bitset_Bitset_difference_others,
+     BITSET_METH_OTHERS, difference_doc},
+    {"difference_count",            (PyCFunction)bitset_Bitset_difference_count,
+     METH_O, difference_count_doc},
+    {"filter",                      (PyCFunction)bitset_Bitset_filter,
+     METH_O, filter_doc},
+    {"from_buffer",                 (PyCFunction)bitset_Bitset_from_buffer,
+     METH_O | METH_CLASS, from_buffer_doc},
+    {"frombytes",                   (PyCFunction)bitset_Bitset_frombytes,
+     METH_O | METH_CLASS, frombytes_doc},
+    {"intersection",                (PyCFunction)bitset_Bitset_intersection_others,
+     BITSET_METH_OTHERS, intersection_doc},
+    {"intersection_count",          (PyCFunction)bitset_Bitset_intersection_count,
+     METH_O, intersection_count_doc},
+    {"intersection_equals",         (PyCFunction)bitset_Bitset_intersection_equals,
+     METH_VARARGS, intersection_equals_doc},
+    {"intersects",                  (PyCFunction)bitset_Bitset_intersects,
+     METH_O, intersects_doc},
+    {"into",                        (PyCFunction)bitset_Bitset_into,
+     METH_O, into_doc},
+    {"isdisjoint",                  (PyCFunction)bitset_Bitset_isdisjoint,
+     METH_O, isdisjoint_doc},
+    {"issubset",                    (PyCFunction)bitset_Bitset_issubset,
+     METH_O, issubset_doc},
+    {"issuperset",                  (PyCFunction)bitset_Bitset_issuperset,
+     METH_O, issuperset_doc},
+    {"jaccard",                     (PyCFunction)bitset_Bitset_jaccard,
+     METH_O, jaccard_doc},
+    {"nextset",                     (PyCFunction)bitset_Bitset_nextset,
+     METH_O, nextset_doc},
+    {"prevset",                     (PyCFunction)bitset_Bitset_prevset,
+     METH_O, prevset_doc},
+    {"rank",                        (PyCFunction)bitset_Bitset_rank,
+     METH_O, rank_doc},
+    {"__reduce__",                  (PyCFunction)bitset_Bitset_reduce,
+     METH_NOARGS, reduce_doc},
+    {"select",                      (PyCFunction)bitset_Bitset_select,
+     METH_O, select_doc},
+    {"__sizeof__",                  (PyCFunction)bitset_Bitset_sizeof,
+     METH_NOARGS, sizeof_doc},
+    {"symmetric_difference",        (PyCFunction)bitset_Bitset_symmetric_difference,
+     METH_O, symmetric_difference_doc},
+    {"symmetric_difference_count",  (PyCFunction)bitset_Bitset_symmetric_difference_count,
+     METH_O, symmetric_difference_count_doc},
+    {"to_array",                    (PyCFunction)bitset_Bitset_to_array,
+     METH_VARARGS, to_array_doc},
+    {"union",                       (PyCFunction)bitset_Bitset_union_others,
+     BITSET_METH_OTHERS, union_doc},
+    {"union_count",                 (PyCFunction)bitset_Bitset_union_count,
+     METH_O, union_count_doc},
+    {NULL,        NULL}                /* sentinel */
+};
+
+/***** number methods *****/
+
+/* The operators take any bitset, converting a RoaringBitset through
+   bitset_as_bitset as the methods do */
+#define BITSET_BINARY(name, method, stat)                               \
+static PyObject *                                                       \
+name(PyObject *bso, PyObject *other)                                    \
+{                                                                       \
+    PyObject *result;                                                   \
+                                                                        \
+    if (!bitset_AnyBitset_Check(bso) || !bitset_BitsetLike_Check(other)) { \
+        Py_INCREF(Py_NotImplemented);                                   \
+        return Py_NotImplemented;                                       \
+    }                                                                   \
+    BITSET_STAT_CALL(stat, result, method((bitset_BitsetObject *)bso, other)); \
+    return result;                                                      \
+}
+
+#define BITSET_INPLACE(name, method, stat)                              \
+static PyObject *                                                       \
+name(PyObject *bso, PyObject *other)                                    \
+{                                                                       \
+    PyObject *status;                                                   \
+                                                                        \
+    if (!bitset_AnyBitset_Check(bso) || !bitset_BitsetLike_Check(other)) { \
+        Py_INCREF(Py_NotImplemented);                                   \
+        return Py_NotImplemented;                                       \
+    }                                                                   \
+    BITSET_STAT_CALL(stat, status, method((bitset_BitsetObject *)bso, other)); \
+    if (status == NULL)                                                 \
+        return NULL;                                                    \
+    Py_DECREF(status);                                                  \
+    Py_INCREF(bso);                                                     \
+    return bso;                                                         \
+}
+
+BITSET_BINARY(bitset_Bitset_sub, bitset_Bitset_difference, BITSET_STAT_SUB)
+BITSET_BINARY(bitset_Bitset_and, bitset_Bitset_intersection, BITSET_STAT_AND)
+BITSET_BINARY(bitset_Bitset_xor, bitset_Bitset_symmetric_difference, BITSET_STAT_XOR)
+BITSET_BINARY(bitset_Bitset_or, bitset_Bitset_union, BITSET_STAT_OR)
+BITSET_INPLACE(bitset_Bitset_isub, bitset_Bitset_difference_update, BITSET_STAT_ISUB)
+BITSET_INPLACE(bitset_Bitset_iand, bitset_Bitset_intersection_update, BITSET_STAT_IAND)
+BITSET_INPLACE(bitset_Bitset_ixor, bitset_Bitset_symmetric_difference_update, BITSET_STAT_IXOR)
+BITSET_INPLACE(bitset_Bitset_ior, bitset_Bitset_update, BITSET_STAT_IOR)
+
+static PyNumberMethods bitset_as_number = {
+    0,                              /* nb_add */
+    (binaryfunc)bitset_Bitset_sub,    /* nb_subtract */
+    0,                              /* nb_multiply */
+#if PY_MAJOR_VERSION < 3
+    0,                              /* nb_divide */
+#endif
+    0,                              /* nb_remainder */
+    0,                              /* nb_divmod */
+    0,                              /* nb_power */
+    0,                              /* nb_negative */
+    0,                              /* nb_positive */
+    0,                              /* nb_absolute */
+    0,                              /* nb_nonzero */
+    0,                              /* nb_invert */
+    0,                              /* nb_lshift */
+    0,                              /* nb_rshift */
+    (binaryfunc)bitset_Bitset_and,    /* nb_and */
+     (binaryfunc)bitset_Bitset_xor,    /* nb_xor */
+    (binaryfunc)bitset_Bitset_or,    /* nb_or */
+#if PY_MAJOR_VERSION < 3
+    0,                              /* nb_coerce */
+#endif
+    0,                              /* nb_int */
+    0,                              /* nb_long */
+    0,                              /* nb_float */
+#if PY_MAJOR_VERSION < 3
+    0,                              /* nb_oct */
+    0,                              /* nb_hex */
+#endif
+    0,                              /* nb_inplace_add */
+    (binaryfunc)bitset_Bitset_isub, /* nb_inplace_subtract */
+    0,                              /* nb_inplace_multiply */
+#if PY_MAJOR_VERSION < 3
+    0,                              /* nb_inplace_divide */
+#endif
+    0,                              /* nb_inplace_remainder */
+    0,                              /* nb_inplace_power */
+    0,                              /* nb_inplace_lshift */
+    0,                              /* nb_inplace_rshift */
+    (binaryfunc)bitset_Bitset_iand, /* nb_inplace_and */
+    (binaryfunc)bitset_Bitset_ixor, /* nb_inplace_xor */
+    (binaryfunc)bitset_Bitset_ior,    /* nb_inplace_or */
+};
+
+/* As bitset_as_number, but without the in place operators, so that
+   a &= b rebinds a to a new FrozenBitset */
+static PyNumberMethods bitset_frozen_as_number = {
+    0,                              /* nb_add */
+    (binaryfunc)bitset_Bitset_sub,    /* nb_subtract */
+    0,                              /* nb_multiply */
+#if PY_MAJOR_VERSION < 3
+    0,                              /* nb_divide */
+#endif
+    0,                              /* nb_remainder */
+    0,                              /* nb_divmod */
+    0,                              /* nb_power */
+    0,                              /* nb_negative */
+    0,                              /* nb_positive */
+    0,                              /* nb_absolute */
+    0,                              /* nb_nonzero */
+    0,                              /* nb_invert */
+    0,                              /* nb_lshift */
+    0,                              /* nb_rshift */
+    (binaryfunc)bitset_Bitset_and,    /* nb_and */
+    (binaryfunc)bitset_Bitset_xor,    /* nb_xor */
+    (binaryfunc)bitset_Bitset_or,    /* nb_or */
+};
+
+/* The constructors take at most one positional argument, as set() does */
+static int
+bitset_check_no_keywords(PyTypeObject *type, Py_ssize_t nkw)
+{
+    if (nkw > 0) {
+        PyErr_Format(PyExc_TypeError, "%.200s() takes no keyword arguments",
+                     type->tp_name);
+        return -1;
+    }
+    return 0;
+}
+
+/* Reads the constructor's argument into a new bitset */
+static int
+bitset_read_init(bitset_BitsetObject *self, PyObject *arg)
+{
+    PyObject *status;
+
+    /* other bitsets are copied by word rather than member by member */
+    if (bitset_BitsetLike_Check(arg)) {
+        status = bitset_Bitset_update(self, arg);
+        if (status == NULL)
+            return -1;
+        Py_DECREF(status);
+        return 0;
+    }
+
+    if (bitset_read_bits_from_sequence(arg, self)) {
+        bitset_truncate(self, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+bitset_init_from(bitset_BitsetObject *self, PyObject *arg)
+{
+    int error;
+
+    BITSET_STAT_CALL(BITSET_STAT_CONSTRUCT, error, bitset_read_init(self, arg));
+    return error;
+}
+
+static int
+Bitset_init(bitset_BitsetObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *arg = NULL;
+
+    if (bitset_check_no_keywords(Py_TYPE(self), kwds != NULL ? PyDict_Size(kwds) : 0) ||
+        !PyArg_ParseTuple(args, "|O", &arg))
+        return -1;
+
+    if (arg == NULL)
+        return 0;
+
+    return bitset_init_from(self, arg);
+}
+
+/***** Buffer interface *****/
+
+/*
+ * The words are exported as native unsigned 64 bit integers (format 'Q')
+ * to consumers that ask for a format, and as plain bytes otherwise.  The
+ * bitset can't change size while exported, so the shape can point at
+ * nwords.  A Bitset is exported read-only, as writing its word could add
+ * members outside [1..32].
+ */
+static int
+bitset_Bitset_getbuffer(bitset_BitsetObject *bso, Py_buffer *view, int flags)
+{
+    int readonly = bitset_FrozenBitset_Check(bso) || bitset_Bitset_Check(bso);
+
+    if ((flags & PyBUF_WRITABLE) && readonly) {
+        PyErr_Format(PyExc_BufferError, "%s is not writable", Py_TYPE(bso)->tp_name);
+        view->obj = NULL;
+        return -1;
+    }
+
+    view->obj = (PyObject *)bso;
+    view->buf = bso->words;
+    view->len = bso->nwords * sizeof(bitset_word);
+    view->readonly = readonly;
+    view->ndim = 1;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+
+    if (flags & PyBUF_FORMAT) {
+        view->format = "Q";
+        view->itemsize = sizeof(bitset_word);
+        view->shape = &bso->nwords;
+    }
+    else {
+        view->format = NULL;
+        view->itemsize = 1;
+        view->shape = (flags & PyBUF_ND) ? &view->len : NULL;
+    }
+    view->strides = (flags & PyBUF_STRIDES) ? &view->itemsize : NULL;
+
+    Py_INCREF(bso);
+    bso->exports++;
+    return 0;
+}
+
+static void
+bitset_Bitset_releasebuffer(bitset_BitsetObject *bso, Py_buffer *view)
+{
+    /* the words may have been written through the view */
+    if (!view->readonly)
+        bitset_changed(bso);
+    bso->exports--;
+}
+
+static PyBufferProcs bitset_as_buffer = {
+#if PY_MAJOR_VERSION < 3
+    0,                                          /* bf_getreadbuffer */
+    0,                                          /* bf_getwritebuffer */
+    0,                                          /* bf_getsegcount */
+    0,                                          /* bf_getcharbuffer */
+#endif
+    (getbufferproc)bitset_Bitset_getbuffer,     /* bf_getbuffer */
+    (releasebufferproc)bitset_Bitset_releasebuffer, /* bf_releasebuffer */
+};
+
+/* FrozenBitsets get their members in tp_new, as they can't change later */
+static PyObject *
+bitset_frozen_read(PyTypeObject *type, PyObject *arg)
+{
+    bitset_BitsetObject *result;
+    PyObject *status;
+
+    if (arg != NULL && bitset_FrozenBitset_CheckExact(arg) &&
+        type == &bitset_FrozenBitsetType) {
+        Py_INCREF(arg);
+        return arg;
+    }
+
+    result = (bitset_BitsetObject *)Bitset_new(type, NULL, NULL);
+    if (result == NULL || arg == NULL)
+        return (PyObject *)result;
+
+    status = bitset_Bitset_update(result, arg);
+    if (status == NULL) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    Py_DECREF(status);
+
+    return (PyObject *)result;
+}
+
+static PyObject *
+bitset_frozen_from(PyTypeObject *type, PyObject *arg)
+{
+    PyObject *result;
+
+    BITSET_STAT_CALL(BITSET_STAT_CONSTRUCT, result, bitset_frozen_read(type, arg));
+    return result;
+}
+
+static PyObject *
+FrozenBitset_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *arg = NULL;
+
+    if (bitset_check_no_keywords(type, kwds != NULL ? PyDict_Size(kwds) : 0) ||
+        !PyArg_ParseTuple(args, "|O:FrozenBitset", &arg))
+        return NULL;
+
+    return bitset_frozen_from(type, arg);
+}
+
+#ifdef BITSET_VECTORCALL
+/*
+ * Calling a bitset type through vectorcall skips building the argument
+ * tuple, and for Bitset and BigBitset the separate tp_init call.
+ */
+static int
+bitset_vectorcall_check(PyObject *type, size_t nargsf, PyObject *kwnames)
+{
+    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+
+    if (bitset_check_no_keywords((PyTypeObject *)type,
+                                 kwnames != NULL ? PyTuple_GET_SIZE(kwnames) : 0))
+        return -1;
+
+    if (nargs > 1) {
+        PyErr_Format(PyExc_TypeError, "%.200s() takes at most 1 argument (%zd given)",
+                     ((PyTypeObject *)type)->tp_name, nargs);
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+Bitset_vectorcall(PyObject *type, PyObject *const *args, size_t nargsf, PyObject *kwnames)
+{
+    PyObject *self;
+
+    if (bitset_vectorcall_check(type, nargsf, kwnames))
+        return NULL;
+
+    self = Bitset_new((PyTypeObject *)type, NULL, NULL);
+    if (self != NULL && PyVectorcall_NARGS(nargsf) == 1 &&
+        bitset_init_from((bitset_BitsetObject *)self, args[0]))
+        Py_CLEAR(self);
+    return self;
+}
+
+static PyObject *
+FrozenBitset_vectorcall(PyObject *type, PyObject *const *args, size_t nargsf, PyObject *kwnames)
+{
+    if (bitset_vectorcall_check(type, nargsf, kwnames))
+        return NULL;
+
+    return bitset_frozen_from((PyTypeObject *)type,
+                              PyVectorcall_NARGS(nargsf) == 1 ? args[0] : NULL);
+}
+#endif
+
+/*
+ * Hashes the words up to the last non-zero one, so equal FrozenBitsets
+ * hash equal however many trailing zero words they carry.  Each word is
+ * mixed in FNV-1a style, and the result finished with the splitmix64
+ * avalanche so that low members affect all the bits.
+ */
+static Py_hash_t
+bitset_FrozenBitset_hash(bitset_BitsetObject *bso)
+{
+    Py_ssize_t i, n;
+    bitset_word h;
+
+    if (bso->hash != -1)
+        return bso->hash;
+
+    n = bitset_used_words(bso);
+    h = (bitset_word)0xcbf29ce484222325ULL ^ (bitset_word)n;
+    for (i = 0; i < n; i++)
+        h = (h ^ bso->words[i]) * (bitset_word)0x100000001b3ULL;
+
+    h ^= h >> 30;
+    h *= (bitset_word)0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= (bitset_word)0x94d049bb133111ebULL;
+    h ^= h >> 31;
+
+    bso->hash = (Py_hash_t)h;
+    if (bso->hash == -1)
+        bso->hash = -2;
+    return bso->hash;
+}
+
+static PyObject *
+Bitset_repr(bitset_BitsetObject *bso)
+{
+    PyObject *keys, *result=NULL, *listrepr;
+    int status = Py_ReprEnter((PyObject*)bso);
+
+    if (status != 0) {
+        if (status < 0)
+            return NULL;
+        return PyString_FromFormat("%s(...)", Py_TYPE(bso)->tp_name);
+    }
+
+    keys = PySequence_List((PyObject *)bso);
+    if (keys == NULL)
+        goto done;
+    listrepr = PyObject_Repr(keys);
+    Py_DECREF(keys);
+    if (listrepr == NULL)
+        goto done;
+
+#if PY_MAJOR_VERSION >= 3
+    result = PyUnicode_FromFormat("%s(%U)", Py_TYPE(bso)->tp_name, listrepr);
+#else
+    result = PyString_FromFormat("%s(%s)", Py_TYPE(bso)->tp_name,
+        PyString_AS_STRING(listrepr));
+#endif
+    Py_DECREF(listrepr);
+done:
+    Py_ReprLeave((PyObject*)bso);
+    return result;
+}
+
+/* The comparisons with a RoaringBitset, from the size of the intersection */
+static PyObject *
+bitset_compare_roaring(bitset_BitsetObject *v, PyObject *w, int op)
+{
+    Py_ssize_t both = bitset_roaring_and_count_words(v, w, 0);
+    Py_ssize_t a = bitset_Bitset_len((PyObject *)v), b = bitset_Roaring_len(w);
+
+    switch (op) {
+    case Py_EQ:
+        return PyBool_FromLong(a == both && b == both);
+    case Py_NE:
+        return PyBool_FromLong(a != both || b != both);
+    case Py_LT:
+        return PyBool_FromLong(a == both && b > both);
+    case Py_LE:
+        return PyBool_FromLong(a == both);
+    case Py_GT:
+        return PyBool_FromLong(b == both && a > both);
+    default:
+        return PyBool_FromLong(b == both);
+    }
+}
+
+static PyObject *
+bitset_Bitset_richcompare(bitset_BitsetObject *v, PyObject *w, int op)
+{
+    bitset_BitsetObject *wbs;
+    int result;
+
+    if (!bitset_BitsetLike_Check(w)) {
+        if (op == Py_EQ)
+            Py_RETURN_FALSE;
+        if (op == Py_NE)
+            Py_RETURN_TRUE;
+        PyErr_SetString(PyExc_TypeError, "can only compare to a bitset");
+
+        return NULL;
+    }
+
+    if (bitset_Roaring_Check(w))
+        return bitset_compare_roaring(v, w, op);
+
+    wbs = bitset_as_bitset(v, w);
+    if (wbs == NULL)
+        return NULL;
+
+    switch (op) {
+    case Py_EQ:
+        result = bitset_words_equal(v, wbs);
+        break;
+    case Py_NE:
+        result = !bitset_words_equal(v, wbs);
+        break;
+    case Py_LT:
+        result = bitset_words_proper_subset(v, wbs);
+        break;
+    case Py_LE:
+        result = bitset_words_subset(v, wbs);
+        break;
+    case Py_GT:
+        result = bitset_words_proper_subset(wbs, v);
+        break;
+    default:
+        result = bitset_words_subset(wbs, v);
+    }
+
+    Py_DECREF(wbs);
+    return PyBool_FromLong(result);
+}
+
+#if PY_MAJOR_VERSION < 3
+static int
+bitset_Bitset_nocmp(PyObject *self, PyObject *other)
+{
+    PyErr_SetString(PyExc_TypeError, "cannot compare bitsets using cmp()");
+    return -1;
+}
+#define BITSET_NOCMP bitset_Bitset_nocmp
+#else
+#define BITSET_NOCMP 0
+#endif
+
+PyDoc_STRVAR(bitset_Bitset_doc,
+"Bitset(iterable) --> Bitset object\n\
+\n\
+Build an unordered set of integers in the range [1,32].");
+
+PyTypeObject bitset_BitsetType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "bitset.Bitset",                        /* tp_name */
+    sizeof(bitset_BitsetObject),            /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)Bitset_dealloc,             /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    BITSET_NOCMP,                           /* tp_compare */
+    (reprfunc)Bitset_repr,                  /* tp_repr */
+    &bitset_as_number,                      /* tp_as_number */
+    &bitset_as_sequence,                    /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    (hashfunc)PyObject_HashNotImplemented,  /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    &bitset_as_buffer,                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_CHECKTYPES | Py_TPFLAGS_HAVE_NEWBUFFER, /* tp_flags */
+    bitset_Bitset_doc,                      /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    (richcmpfunc)bitset_Bitset_richcompare, /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    (getiterfunc)bitset_Bitset_iter,        /* tp_iter */
+    0,                                      /* tp_iternext */
+    bitset_Bitset_methods,                  /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    (initproc)Bitset_init,                  /* tp_init */
+    0,                                      /* tp_alloc */
+    Bitset_new,                             /* tp_new */
+};
+
+PyDoc_STRVAR(bitset_BigBitset_doc,
+"BigBitset(iterable) --> BigBitset object\n\
+\n\
+Build an unordered set of non-negative integers, which grows as\n\
+larger members are added.");
+
+PyTypeObject bitset_BigBitsetType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "bitset.BigBitset",                     /* tp_name */
+    sizeof(bitset_BitsetObject),            /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)Bitset_dealloc,             /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    BITSET_NOCMP,                           /* tp_compare */
+    (reprfunc)Bitset_repr,                  /* tp_repr */
+    &bitset_as_number,                      /* tp_as_number */
+    &bitset_as_sequence,                    /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    (hashfunc)PyObject_HashNotImplemented,  /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    &bitset_as_buffer,                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_CHECKTYPES | Py_TPFLAGS_HAVE_NEWBUFFER, /* tp_flags */
+    bitset_BigBitset_doc,                   /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    (richcmpfunc)bitset_Bitset_richcompare, /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    (getiterfunc)bitset_Bitset_iter,        /* tp_iter */
+    0,                                      /* tp_iternext */
+    bitset_Bitset_methods,                  /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    (initproc)Bitset_init,                  /* tp_init */
+    0,                                      /* tp_alloc */
+    Bitset_new,                             /* tp_new */
+};
+
+PyDoc_STRVAR(bitset_FrozenBitset_doc,
+"FrozenBitset(iterable) --> FrozenBitset object\n\
+\n\
+Build an immutable, hashable, unordered set of non-negative integers.");
+
+PyTypeObject bitset_FrozenBitsetType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "bitset.FrozenBitset",                  /* tp_name */
+    sizeof(bitset_BitsetObject),            /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)Bitset_dealloc,             /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    BITSET_NOCMP,                           /* tp_compare */
+    (reprfunc)Bitset_repr,                  /* tp_repr */
+    &bitset_frozen_as_number,               /* tp_as_number */
+    &bitset_as_sequence,                    /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    (hashfunc)bitset_FrozenBitset_hash,     /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    &bitset_as_buffer,                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_CHECKTYPES | Py_TPFLAGS_HAVE_NEWBUFFER, /* tp_flags */
+    bitset_FrozenBitset_doc,                /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    (richcmpfunc)bitset_Bitset_richcompare, /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    (getiterfunc)bitset_Bitset_iter,        /* tp_iter */
+    0,                                      /* tp_iternext */
+    bitset_FrozenBitset_methods,            /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    0,                                      /* tp_init */
+    0,                                      /* tp_alloc */
+    FrozenBitset_new,                       /* tp_new */
+};
+
+/***** RoaringBitset ******************************************************/
+
+/*
+ * A compressed set of integers in [0, 2**32), laid out as in Chambi, Lemire
+ * et al., "Better bitmap performance with Roaring bitmaps".  Members are
+ * grouped into chunks by their high 16 bits, kept sorted by that key, and
+ * each chunk holds the low 16 bits of its members in one of three
+ * containers:
+ *
+ *   array   up to 4096 sorted values
+ *   bitmap  1024 words, laid out as a BigBitset's words are
+ *   run     sorted, disjoint runs of consecutive values
+ *
+ * add() and remove() keep arrays and bitmaps within their limits; optimize()
+ * and the operators, which build new containers, choose whichever of the
+ * three encodings is smallest.
+ */
+#if SIZEOF_SIZE_T > 4
+#define ROARING_MAX ((Py_ssize_t)0xFFFFFFFF)
+#else
+#define ROARING_MAX PY_SSIZE_T_MAX
+#endif
+#define ROARING_CHUNK_WORDS 1024
+#define ROARING_CHUNK_BYTES (ROARING_CHUNK_WORDS * sizeof(bitset_word))
+#define ROARING_ARRAY_MAX 4096
+
+#define ROARING_ARRAY 0
+#define ROARING_BITMAP 1
+#define ROARING_RUN 2
+
+typedef struct {
+    unsigned short start;
+    unsigned short length;      /* the run covers start .. start + length */
+} bitset_run;
+
+typedef struct {
+    unsigned short key;         /* high 16 bits of the members */
+    unsigned char type;         /* ROARING_ARRAY, ROARING_BITMAP or ROARING_RUN */
+    int card;                   /* number of members */
+    int size;                   /* values in an array, or runs */
+    int allocated;              /* room at data, in values or runs */
+    union {
+        void *ptr;
+        unsigned short *array;
+        bitset_word *bitmap;
+        bitset_run *runs;
+    } data;
+} bitset_container;
+
+typedef struct {
+    PyObject_HEAD
+    Py_ssize_t nchunks;
+    Py_ssize_t allocated;
+    bitset_container *chunks;   /* sorted by key */
+} bitset_RoaringObject;
+
+static void
+bitset_roaring_range_error(void)
+{
+    PyErr_Format(PyExc_TypeError, "RoaringBitset can only contain integers [0..%zd]",
+                 ROARING_MAX);
+}
+
+/* Converts key to a member, or returns -1 with TypeError set */
+static Py_ssize_t
+bitset_roaring_member(PyObject *key)
+{
+    Py_ssize_t value;
+
+    if (bitset_key_value(key, &value) == 0 && value >= 0 && value <= ROARING_MAX)
+        return value;
+
+    bitset_roaring_range_error();
+    return -1;
+}
+
+/* Returns the bytes used by the data of c */
+static size_t
+bitset_container_bytes(const bitset_container *c, int n)
+{
+    switch (c->type) {
+    case ROARING_ARRAY:
+        return n * sizeof(unsigned short);
+    case ROARING_BITMAP:
+        return ROARING_CHUNK_BYTES;
+    default:
+        return n * sizeof(bitset_run);
+    }
+}
+
+/* Makes room for n values or runs in an array or run container */
+static int
+bitset_container_reserve(bitset_container *c, int n)
+{
+    int allocated;
+    void *data;
+
+    if (n <= c->allocated)
+        return 0;
+
+    allocated = n + (n >> 1) + 4;
+    if (c->type == ROARING_ARRAY && allocated > ROARING_ARRAY_MAX)
+        allocated = Py_MAX(n, ROARING_ARRAY_MAX);
+
+    data = PyMem_Realloc(c->data.ptr, bitset_container_bytes(c, allocated));
+    if (data == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    c->data.ptr = data;
+    c->allocated = allocated;
+    return 0;
+}
+
+/* Returns the index of v in a sorted array, or -(insertion point) - 1 */
+static int
+bitset_array_search(const unsigned short *array, int n, unsigned short v)
+{
+    int lo = 0, hi = n - 1, mid;
+
+    while (lo <= hi) {
+        mid = (lo + hi) >> 1;
+        if (array[mid] < v)
+            lo = mid + 1;
+        else if (array[mid] > v)
+            hi = mid - 1;
+        else
+            return mid;
+    }
+    return -lo - 1;
+}
+
+/* Returns the index of the last run starting at or before v, or -1 */
+static int
+bitset_run_search(const bitset_run *runs, int n, unsigned short v)
+{
+    int lo = 0, hi = n - 1, mid;
+
+    while (lo <= hi) {
+        mid = (lo + hi) >> 1;
+        if (runs[mid].start <= v)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return lo - 1;
+}
+
+static int
+bitset_container_contains(const bitset_container *c, unsigned short v)
+{
+    int i;
+
+    switch (c->type) {
+    case ROARING_ARRAY:
+        return bitset_array_search(c->data.array, c->size, v) >= 0;
+    case ROARING_BITMAP:
+        return (c->data.bitmap[BITSET_WORD_INDEX(v)] & BITSET_WORD_MASK(v)) != 0;
+    default:
+        i = bitset_run_search(c->data.runs, c->size, v);
+        return i >= 0 && v - c->data.runs[i].start <= c->data.runs[i].length;
+    }
+}
+
+/* ORs the members of c into a bitmap of ROARING_CHUNK_WORDS words */
+static void
+bitset_container_or_into(const bitset_container *c, bitset_word *bits)
+{
+    int i;
+
+    switch (c->type) {
+    case ROARING_ARRAY:
+        for (i = 0; i < c->size; i++)
+            bits[BITSET_WORD_INDEX(c->data.array[i])] |= BITSET_WORD_MASK(c->data.array[i]);
+        break;
+    case ROARING_BITMAP:
+        bitset_kernels.or_(bits, c->data.bitmap, ROARING_CHUNK_WORDS);
+        break;
+    default:
+        for (i = 0; i < c->size; i++)
+            bitset_set_bits(bits, c->data.runs[i].start,
+                            c->data.runs[i].start + c->data.runs[i].length);
+    }
+}
+
+/* Returns the members of c as a bitmap, using scratch unless c is one */
+static const bitset_word *
+bitset_container_bitmap(const bitset_container *c, bitset_word *scratch)
+{
+    if (c->type == ROARING_BITMAP)
+        return c->data.bitmap;
+
+    memset(scratch, 0, ROARING_CHUNK_BYTES);
+    bitset_container_or_into(c, scratch);
+    return scratch;
+}
+
+/* Returns the number of runs of set bits in a chunk's bitmap */
+static int
+bitset_bitmap_runs(const bitset_word *bits)
+{
+    bitset_word w, carry = 0;
+    int i, runs = 0;
+
+    for (i = 0; i < ROARING_CHUNK_WORDS; i++) {
+        w = bits[i];
+        runs += bitset_popcount(w & ~((w << 1) | carry));
+        carry = w >> (BITSET_WORD_BITS - 1);
+    }
+    return runs;
+}
+
+/* Writes the runs of set bits in a chunk's bitmap to runs */
+static void
+bitset_bitmap_to_runs(const bitset_word *bits, bitset_run *runs)
+{
+    int i = 0, n = 0, start, end;
+    bitset_word w = bits[0], t;
+
+    for (;;) {
+        while (w == 0 && i < ROARING_CHUNK_WORDS - 1)
+            w = bits[++i];
+        if (w == 0)
+            break;
+
+        t = w;
+        start = i * BITSET_WORD_BITS + bitset_pop(&t);
+
+        /* fill in the zeros below the run, then look for its end */
+        w |= w - 1;
+        while (w == ~(bitset_word)0 && i < ROARING_CHUNK_WORDS - 1)
+            w = bits[++i];
+        if (w == ~(bitset_word)0) {
+            runs[n].start = (unsigned short)start;
+            runs[n].length = (unsigned short)(ROARING_CHUNK_WORDS * BITSET_WORD_BITS - 1 - start);
+            break;
+        }
+
+        t = ~w;
+        end = i * BITSET_WORD_BITS + bitset_pop(&t);
+        runs[n].start = (unsigned short)start;
+        runs[n].length = (unsigned short)(end - 1 - start);
+        n++;
+
+        /* clear the run's bits */
+        w &= w + 1;
+    }
+}
+
+/*
+ * Makes c, whose key is set, hold the card members of bits in its smallest
+ * encoding.  bits must be a PyMem block of ROARING_CHUNK_WORDS words, which
+ * c either keeps as its bitmap or frees.  If there's no memory for a
+ * smaller encoding the bitmap is kept, so this can't fail.
+ */
+static void
+bitset_container_from_bitmap(bitset_container *c, bitset_word *bits, int card)
+{
+    int i, n = 0, nruns = bitset_bitmap_runs(bits);
+    size_t arraybytes = card <= ROARING_ARRAY_MAX ?
+        card * sizeof(unsigned short) : ROARING_CHUNK_BYTES;
+    size_t runbytes = nruns * sizeof(bitset_run);
+    bitset_word w;
+
+    c->card = card;
+    c->type = ROARING_BITMAP;
+    if (runbytes < arraybytes && runbytes < ROARING_CHUNK_BYTES) {
+        c->type = ROARING_RUN;
+        c->size = nruns;
+    }
+    else if (card <= ROARING_ARRAY_MAX) {
+        c->type = ROARING_ARRAY;
+        c->size = card;
+    }
+
+    c->data.ptr = NULL;
+    if (c->type != ROARING_BITMAP)
+        c->data.ptr = PyMem_Malloc(bitset_container_bytes(c, c->size));
+
+    if (c->data.ptr == NULL) {
+        c->type = ROARING_BITMAP;
+        c->data.bitmap = bits;
+        c->size = c->allocated = 0;
+        return;
+    }
+
+    if (c->type == ROARING_RUN) {
+        bitset_bitmap_to_runs(bits, c->data.runs);
+    }
+    else {
+        for (i = 0; i < ROARING_CHUNK_WORDS; i++) {
+            for (w = bits[i]; w != 0; )
+                c->data.array[n++] = (unsigned short)(i * BITSET_WORD_BITS + bitset_pop(&w));
+        }
+    }
+
+    c->allocated = c->size;
+    PyMem_Free(bits);
+}
+
+/* Converts c to a bitmap container */
+static int
+bitset_container_to_bitmap(bitset_container *c)
+{
+    bitset_word *bits = (bitset_word *)PyMem_Malloc(ROARING_CHUNK_BYTES);
+
+    if (bits == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    memset(bits, 0, ROARING_CHUNK_BYTES);
+    bitset_container_or_into(c, bits);
+    PyMem_Free(c->data.ptr);
+    c->type = ROARING_BITMAP;
+    c->data.bitmap = bits;
+    c->size = c->allocated = 0;
+    return 0;
+}
+
+/* Re-encodes c in its smallest encoding */
+static int
+bitset_container_optimize(bitset_container *c)
+{
+    bitset_word *bits = (bitset_word *)PyMem_Malloc(ROARING_CHUNK_BYTES);
+
+    if (bits == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    memset(bits, 0, ROARING_CHUNK_BYTES);
+    bitset_container_or_into(c, bits);
+    PyMem_Free(c->data.ptr);
+    bitset_container_from_bitmap(c, bits, c->card);
+    return 0;
+}
+
+/* Adds v to c, returning 1 if it was added, 0 if it was present or -1 on error */
+static int
+bitset_container_add(bitset_container *c, unsigned short v)
+{
+    bitset_run *runs;
+    int i;
+
+    switch (c->type) {
+    case ROARING_ARRAY:
+        i = bitset_array_search(c->data.array, c->size, v);
+        if (i >= 0)
+            return 0;
+
+        if (c->size == ROARING_ARRAY_MAX) {
+            if (bitset_container_to_bitmap(c))
+                return -1;
+            return bitset_container_add(c, v);
+        }
+
+        if (bitset_container_reserve(c, c->size + 1))
+            return -1;
+
+        i = -i - 1;
+        memmove(c->data.array + i + 1, c->data.array + i,
+                (c->size - i) * sizeof(unsigned short));
+        c->data.array[i] = v;
+        c->size++;
+        break;
+
+    case ROARING_BITMAP:
+        if (c->data.bitmap[BITSET_WORD_INDEX(v)] & BITSET_WORD_MASK(v))
+            return 0;
+        c->data.bitmap[BITSET_WORD_INDEX(v)] |= BITSET_WORD_MASK(v);
+        break;
+
+    default:
+        runs = c->data.runs;
+        i = bitset_run_search(runs, c->size, v);
+        if (i >= 0 && v - runs[i].start <= runs[i].length)
+            return 0;
+
+        if (i >= 0 && v - runs[i].start == runs[i].length + 1) {
+            /* extend run i, joining it to the next if they now touch */
+            runs[i].length++;
+            if (i + 1 < c->size && runs[i + 1].start == v + 1) {
+                runs[i].length += runs[i + 1].length + 1;
+                memmove(runs + i + 1, runs + i + 2,
+                        (c->size - i - 2) * sizeof(bitset_run));
+                c->size--;
+            }
+        }
+        else if (i + 1 < c->size && runs[i + 1].start == v + 1) {
+            runs[i + 1].start--;
+            runs[i + 1].length++;
+        }
+        else {
+            if (bitset_container_reserve(c, c->size + 1))
+                return -1;
+
+            runs = c->data.runs;
+            memmove(runs + i + 2, runs + i + 1,
+                    (c->size - i - 1) * sizeof(bitset_run));
+            runs[i + 1].start = v;
+            runs[i + 1].length = 0;
+            c->size++;
+        }
+    }
+
+    c->card++;
+    return 1;
+}
+
+/* Removes v from c, returning 1 if it was removed, 0 if it was absent or -1 on error */
+static int
+bitset_container_remove(bitset_container *c, unsigned short v)
+{
+    bitset_run *runs;
+    int i, end;
+
+    switch (c->type) {
+    case ROARING_ARRAY:
+        i = bitset_array_search(c->data.array, c->size, v);
+        if (i < 0)
+            return 0;
+
+        memmove(c->data.array + i, c->data.array + i + 1,
+                (c->size - i - 1) * sizeof(unsigned short));
+        c->size--;
+        break;
+
+    case ROARING_BITMAP:
+        if (!(c->data.bitmap[BITSET_WORD_INDEX(v)] & BITSET_WORD_MASK(v)))
+            return 0;
+
+        c->data.bitmap[BITSET_WORD_INDEX(v)] &= ~BITSET_WORD_MASK(v);
+        c->card--;
+
+        /* an array is smaller from here down */
+        if (c->card <= ROARING_ARRAY_MAX)
+            bitset_container_from_bitmap(c, c->data.bitmap, c->card);
+        return 1;
+
+    default:
+        runs = c->data.runs;
+        i = bitset_run_search(runs, c->size, v);
+        if (i < 0 || v - runs[i].start > runs[i].length)
+            return 0;
+
+        end = runs[i].start + runs[i].length;
+        if (runs[i].length == 0) {
+            memmove(runs + i, runs + i + 1, (c->size - i - 1) * sizeof(bitset_run));
+            c->size--;
+        }
+        else if (v == runs[i].start) {
+            runs[i].start++;
+            runs[i].length--;
+        }
+        else if (v == end) {
+            runs[i].length--;
+        }
+        else {
+            /* split run i around v */
+            if (bitset_container_reserve(c, c->size + 1))
+                return -1;
+
+            runs = c->data.runs;
+            memmove(runs + i + 2, runs + i + 1,
+                    (c->size - i - 1) * sizeof(bitset_run));
+            runs[i + 1].start = v + 1;
+            runs[i + 1].length = (unsigned short)(end - v - 1);
+            runs[i].length = (unsigned short)(v - runs[i].start - 1);
+            c->size++;
+        }
+    }
+
+    c->card--;
+    return 1;
+}
+
+/* Returns the smallest member of c, which must not be empty */
+static int
+bitset_container_min(const bitset_container *c)
+{
+    bitset_word w;
+    int i;
+
+    switch (c->type) {
+    case ROARING_ARRAY:
+        return c->data.array[0];
+    case ROARING_BITMAP:
+        for (i = 0; c->data.bitmap[i] == 0; i++)
+            ;
+        w = c->data.bitmap[i];
+        return i * BITSET_WORD_BITS + bitset_pop(&w);
+    default:
+        return c->data.runs[0].start;
+    }
+}
+
+/* Returns the largest member of c, which must not be empty */
+static int
+bitset_container_max(const bitset_container *c)
+{
+    bitset_word w;
+    int i, v;
+
+    switch (c->type) {
+    case ROARING_ARRAY:
+        return c->data.array[c->size - 1];
+    case ROARING_BITMAP:
+        for (i = ROARING_CHUNK_WORDS - 1; c->data.bitmap[i] == 0; i--)
+            ;
+        for (w = c->data.bitmap[i], v = 0; w != 0; )
+            v = bitset_pop(&w);
+        return i * BITSET_WORD_BITS + v;
+    default:
+        return c->data.runs[c->size - 1].start + c->data.runs[c->size - 1].length;
+    }
+}
+
+/* Returns the number of members of c less than v */
+static int
+bitset_container_rank(const bitset_container *c, unsigned short v)
+{
+    int i, n = 0;
+
+    switch (c->type) {
+    case ROARING_ARRAY:
+        i = bitset_array_search(c->data.array, c->size, v);
+        return i >= 0 ? i : -i - 1;
+    case ROARING_BITMAP:
+        i = BITSET_WORD_INDEX(v);
+        return (int)bitset_kernels.count(c->data.bitmap, i) +
+            bitset_popcount(c->data.bitmap[i] & (BITSET_WORD_MASK(v) - 1));
+    default:
+        for (i = 0; i < c->size && c->data.runs[i].start < v; i++)
+            n += Py_MIN(c->data.runs[i].length + 1, v - c->data.runs[i].start);
+        return n;
+    }
+}
+
+/* Returns the member of c with k members less than it, where k < c->card */
+static int
+bitset_container_select(const bitset_container *c, int k)
+{
+    int i, n;
+
+    switch (c->type) {
+    case ROARING_ARRAY:
+        return c->data.array[k];
+    case ROARING_BITMAP:
+        for (i = 0; k >= (n = bitset_popcount(c->data.bitmap[i])); i++)
+            k -= n;
+        return i * BITSET_WORD_BITS + bitset_select_bit(c->data.bitmap[i], k);
+    default:
+        for (i = 0; k > c->data.runs[i].length; i++)
+            k -= c->data.runs[i].length + 1;
+        return c->data.runs[i].start + k;
+    }
+}
+
+/* Returns the smallest member of c not less than v, or -1 */
+static int
+bitset_container_next(const bitset_container *c, unsigned short v)
+{
+    bitset_word w;
+    int i;
+
+    switch (c->type) {
+    case ROARING_ARRAY:
+        i = bitset_array_search(c->data.array, c->size, v);
+        if (i < 0)
+            i = -i - 1;
+        return i < c->size ? c->data.array[i] : -1;
+    case ROARING_BITMAP:
+        i = BITSET_WORD_INDEX(v);
+        for (w = c->data.bitmap[i] & ~(BITSET_WORD_MASK(v) - 1); w == 0; w = c->data.bitmap[i])
+            if (++i == ROARING_CHUNK_WORDS)
+                return -1;
+        return i * BITSET_WORD_BITS + bitset_pop(&w);
+    default:
+        i = bitset_run_search(c->data.runs, c->size, v);
+        if (i >= 0 && v - c->data.runs[i].start <= c->data.runs[i].length)
+            return v;
+        return ++i < c->size ? c->data.runs[i].start : -1;
+    }
+}
+
+/* Returns the largest member of c not greater than v, or -1 */
+static int
+bitset_container_prev(const bitset_container *c, unsigned short v)
+{
+    bitset_word w;
+    int i;
+
+    switch (c->type) {
+    case ROARING_ARRAY:
+        i = bitset_array_search(c->data.array, c->size, v);
+        if (i >= 0)
+            return v;
+        i = -i - 2;
+        return i >= 0 ? c->data.array[i] : -1;
+    case ROARING_BITMAP:
+        i = BITSET_WORD_INDEX(v);
+        for (w = c->data.bitmap[i] & ((BITSET_WORD_MASK(v) << 1) - 1); w == 0; w = c->data.bitmap[i])
+            if (--i < 0)
+                return -1;
+        return i * BITSET_WORD_BITS + bitset_highest(w);
+    default:
+        i = bitset_run_search(c->data.runs, c->size, v);
+        if (i < 0)
+            return -1;
+        return Py_MIN(v, c->data.runs[i].start + c->data.runs[i].length);
+    }
+}
+
+static int
+bitset_container_copy(bitset_container *dst, const bitset_container *src)
+{
+    size_t n = bitset_container_bytes(src, src->size);
+
+    *dst = *src;
+    dst->allocated = src->size;
+    dst->data.ptr = PyMem_Malloc(n > 0 ? n : 1);
+    if (dst->data.ptr == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    memcpy(dst->data.ptr, src->data.ptr, n);
+    return 0;
+}
+
+/* Merges two sorted arrays under op into out, returning the number of values */
+static int
+bitset_array_merge(unsigned short *out, const unsigned short *a, int na,
+                   const unsigned short *b, int nb, int op)
+{
+    int i = 0, j = 0, n = 0;
+    int keep_a = op != ROARING_AND, keep_b = op == ROARING_OR || op == ROARING_XOR;
+    int keep_both = op == ROARING_AND || op == ROARING_OR;
+
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) {
+            if (keep_a)
+                out[n++] = a[i];
+            i++;
+        }
+        else if (a[i] > b[j]) {
+            if (keep_b)
+                out[n++] = b[j];
+            j++;
+        }
+        else {
+            if (keep_both)
+                out[n++] = a[i];
+            i++;
+            j++;
+        }
+    }
+
+    while (keep_a && i < na)
+        out[n++] = a[i++];
+    while (keep_b && j < nb)
+        out[n++] = b[j++];
+    return n;
+}
+
+/* Returns len(a & b) for two containers */
+static int
+bitset_container_and_count(const bitset_container *a, const bitset_container *b)
+{
+    bitset_word scratch_a[ROARING_CHUNK_WORDS], scratch_b[ROARING_CHUNK_WORDS];
+    const bitset_container *t;
+    int i, j, count = 0;
+
+    if (a->type == ROARING_ARRAY && b->type == ROARING_ARRAY) {
+        for (i = j = 0; i < a->size && j < b->size; ) {
+            if (a->data.array[i] < b->data.array[j])
+                i++;
+            else if (a->data.array[i] > b->data.array[j])
+                j++;
+            else {
+                count++;
+                i++;
+                j++;
+            }
+        }
+        return count;
+    }
+
+    if (b->type == ROARING_ARRAY) {
+        t = a;
+        a = b;
+        b = t;
+    }
+
+    if (a->type == ROARING_ARRAY) {
+        for (i = 0; i < a->size; i++)
+            count += bitset_container_contains(b, a->data.array[i]);
+        return count;
+    }
+
+    return (int)bitset_kernels.and_count(bitset_container_bitmap(a, scratch_a),
+                                         bitset_container_bitmap(b, scratch_b),
+                                         ROARING_CHUNK_WORDS);
+}
+
+/*
+ * Sets out, whose key is set, to a op b.  Arrays are merged or filtered
+ * directly; anything else goes through the word kernels on bitmaps.  An
+ * empty result is left with card 0 and no data.
+ */
+static int
+bitset_container_op(bitset_container *out, const bitset_container *a,
+                    const bitset_container *b, int op)
+{
+    bitset_word scratch[ROARING_CHUNK_WORDS], *bits;
+    const bitset_container *t;
+    int i, n = 0;
+
+    out->card = out->size = out->allocated = 0;
+    out->data.ptr = NULL;
+
+    if (op == ROARING_AND && a->type != ROARING_ARRAY && b->type == ROARING_ARRAY) {
+        t = a;
+        a = b;
+        b = t;
+    }
+
+    if (a->type == ROARING_ARRAY &&
+        (op == ROARING_AND || op == ROARING_ANDNOT || b->type == ROARING_ARRAY) &&
+        (op == ROARING_AND || op == ROARING_ANDNOT || a->size + b->size <= ROARING_ARRAY_MAX)) {
+        out->type = ROARING_ARRAY;
+        out->data.array = (unsigned short *)PyMem_Malloc(
+            (a->size + (b->type == ROARING_ARRAY ? b->size : 0)) * sizeof(unsigned short));
+        if (out->data.array == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+
+        if (b->type == ROARING_ARRAY) {
+            n = bitset_array_merge(out->data.array, a->data.array, a->size,
+                                   b->data.array, b->size, op);
+        }
+        else {
+            for (i = 0; i < a->size; i++) {
+                if (bitset_container_contains(b, a->data.array[i]) == (op == ROARING_AND))
+                    out->data.array[n++] = a->data.array[i];
+            }
+        }
+
+        if (n == 0) {
+            PyMem_Free(out->data.ptr);
+            out->data.ptr = NULL;
+        }
+        out->card = out->size = out->allocated = n;
+        return 0;
+    }
+
+    bits = (bitset_word *)PyMem_Malloc(ROARING_CHUNK_BYTES);
+    if (bits == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    memset(bits, 0, ROARING_CHUNK_BYTES);
+    bitset_container_or_into(a, bits);
+    switch (op) {
+    case ROARING_AND:
+        bitset_kernels.and_(bits, bitset_container_bitmap(b, scratch), ROARING_CHUNK_WORDS);
+        break;
+    case ROARING_OR:
+        bitset_container_or_into(b, bits);
+        break;
+    case ROARING_XOR:
+        bitset_kernels.xor_(bits, bitset_container_bitmap(b, scratch), ROARING_CHUNK_WORDS);
+        break;
+    default:
+        bitset_kernels.andnot(bits, bitset_container_bitmap(b, scratch), ROARING_CHUNK_WORDS);
+    }
+
+    n = (int)bitset_kernels.count(bits, ROARING_CHUNK_WORDS);
+    if (n == 0)
+        PyMem_Free(bits);
+    else
+        bitset_container_from_bitmap(out, bits, n);
+    return 0;
+}
+
+/***** RoaringBitset storage *****/
+
+static void
+bitset_roaring_clear_chunks(bitset_RoaringObject *r)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < r->nchunks; i++)
+        PyMem_Free(r->chunks[i].data.ptr);
+    r->nchunks = 0;
+}
+
+static void
+Roaring_dealloc(bitset_RoaringObject *self)
+{
+    bitset_roaring_clear_chunks(self);
+    PyMem_Free(self->chunks);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *
+Roaring_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    bitset_RoaringObject *self = (bitset_RoaringObject *)type->tp_alloc(type, 0);
+
+    if (self != NULL) {
+        self->nchunks = 0;
+        self->allocated = 0;
+        self->chunks = NULL;
+    }
+
+    return (PyObject *)self;
+}
+
+/* Makes room for at least n chunks */
+static int
+bitset_roaring_reserve(bitset_RoaringObject *r, Py_ssize_t n)
+{
+    bitset_container *chunks;
+    Py_ssize_t allocated;
+
+    if (n <= r->allocated)
+        return 0;
+
+    allocated = n + (n >> 3) + (n < 9 ? 3 : 6);
+    chunks = (bitset_container *)PyMem_Realloc(r->chunks,
+                                               allocated * sizeof(bitset_container));
+    if (chunks == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    r->chunks = chunks;
+    r->allocated = allocated;
+    return 0;
+}
+
+/* Returns the index of the chunk with the given key, or -(insertion point) - 1 */
+static Py_ssize_t
+bitset_roaring_find(bitset_RoaringObject *r, unsigned short key)
+{
+    Py_ssize_t lo = 0, hi = r->nchunks - 1, mid;
+
+    /* members are often added in order, so try the last chunk first */
+    if (hi >= 0 && r->chunks[hi].key <= key)
+        return r->chunks[hi].key == key ? hi : -r->nchunks - 1;
+
+    while (lo <= hi) {
+        mid = (lo + hi) >> 1;
+        if (r->chunks[mid].key < key)
+            lo = mid + 1;
+        else if (r->chunks[mid].key > key)
+            hi = mid - 1;
+        else
+            return mid;
+    }
+    return -lo - 1;
+}
+
+static void
+bitset_roaring_remove_chunk(bitset_RoaringObject *r, Py_ssize_t i)
+{
+    PyMem_Free(r->chunks[i].data.ptr);
+    memmove(r->chunks + i, r->chunks + i + 1,
+            (r->nchunks - i - 1) * sizeof(bitset_container));
+    r->nchunks--;
+}
+
+static int
+bitset_roaring_add_member(bitset_RoaringObject *r, Py_ssize_t v)
+{
+    unsigned short key = (unsigned short)(v >> 16);
+    Py_ssize_t i = bitset_roaring_find(r, key);
+    bitset_container *c;
+
+    if (i < 0) {
+        if (bitset_roaring_reserve(r, r->nchunks + 1))
+            return -1;
+
+        i = -i - 1;
+        memmove(r->chunks + i + 1, r->chunks + i,
+                (r->nchunks - i) * sizeof(bitset_container));
+        r->nchunks++;
+
+        c = &r->chunks[i];
+        c->key = key;
+        c->type = ROARING_ARRAY;
+        c->card = c->size = c->allocated = 0;
+        c->data.ptr = NULL;
+    }
+
+    c = &r->chunks[i];
+    if (bitset_container_add(c, (unsigned short)v) < 0) {
+        if (c->card == 0)
+            bitset_roaring_remove_chunk(r, i);
+        return -1;
+    }
+    return 0;
+}
+
+/* Removes v, returning 1 if it was a member, 0 if not or -1 on error */
+static int
+bitset_roaring_remove_member(bitset_RoaringObject *r, Py_ssize_t v)
+{
+    Py_ssize_t i = bitset_roaring_find(r, (unsigned short)(v >> 16));
+    int result;
+
+    if (i < 0)
+        return 0;
+
+    result = bitset_container_remove(&r->chunks[i], (unsigned short)v);
+    if (r->chunks[i].card == 0)
+        bitset_roaring_remove_chunk(r, i);
+    return result;
+}
+
+static int
+bitset_roaring_has_member(bitset_RoaringObject *r, Py_ssize_t v)
+{
+    Py_ssize_t i;
+
+    if (v < 0 || v > ROARING_MAX)
+        return 0;
+
+    i = bitset_roaring_find(r, (unsigned short)(v >> 16));
+    return i >= 0 && bitset_container_contains(&r->chunks[i], (unsigned short)v);
+}
+
+static Py_ssize_t
+bitset_roaring_len(bitset_RoaringObject *r)
+{
+    Py_ssize_t i, n = 0;
+
+    for (i = 0; i < r->nchunks; i++)
+        n += r->chunks[i].card;
+    return n;
+}
+
+/* Returns the number of members of r less than x */
+static Py_ssize_t
+bitset_roaring_rank(bitset_RoaringObject *r, Py_ssize_t x)
+{
+    unsigned short key = (unsigned short)(x >> 16);
+    Py_ssize_t i, n = 0;
+
+    if (x <= 0)
+        return 0;
+    if (x > ROARING_MAX)
+        return bitset_roaring_len(r);
+
+    for (i = 0; i < r->nchunks && r->chunks[i].key < key; i++)
+        n += r->chunks[i].card;
+    if (i < r->nchunks && r->chunks[i].key == key)
+        n += bitset_container_rank(&r->chunks[i], (unsigned short)x);
+    return n;
+}
+
+/* Returns the member of r with k members less than it, or -1 if k >= len(r) */
+static Py_ssize_t
+bitset_roaring_select(bitset_RoaringObject *r, Py_ssize_t k)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < r->nchunks; i++) {
+        if (k < r->chunks[i].card)
+            return ((Py_ssize_t)r->chunks[i].key << 16) +
+                bitset_container_select(&r->chunks[i], (int)k);
+        k -= r->chunks[i].card;
+    }
+    return -1;
+}
+
+/* Returns the smallest member of r not less than x, or -1 */
+static Py_ssize_t
+bitset_roaring_next(bitset_RoaringObject *r, Py_ssize_t x)
+{
+    Py_ssize_t i;
+    int v;
+
+    if (x > ROARING_MAX)
+        return -1;
+    if (x < 0)
+        x = 0;
+
+    i = bitset_roaring_find(r, (unsigned short)(x >> 16));
+    if (i >= 0) {
+        v = bitset_container_next(&r->chunks[i], (unsigned short)x);
+        if (v >= 0)
+            return ((Py_ssize_t)r->chunks[i].key << 16) + v;
+        i++;
+    }
+    else
+        i = -i - 1;
+
+    if (i == r->nchunks)
+        return -1;
+    return ((Py_ssize_t)r->chunks[i].key << 16) + bitset_container_min(&r->chunks[i]);
+}
+
+/* Returns the largest member of r not greater than x, or -1 */
+static Py_ssize_t
+bitset_roaring_prev(bitset_RoaringObject *r, Py_ssize_t x)
+{
+    Py_ssize_t i;
+    int v;
+
+    if (x < 0)
+        return -1;
+    if (x > ROARING_MAX)
+        x = ROARING_MAX;
+
+    i = bitset_roaring_find(r, (unsigned short)(x >> 16));
+    if (i >= 0) {
+        v = bitset_container_prev(&r->chunks[i], (unsigned short)x);
+        if (v >= 0)
+            return ((Py_ssize_t)r->chunks[i].key << 16) + v;
+    }
+    else
+        i = -i - 1;
+
+    if (--i < 0)
+        return -1;
+    return ((Py_ssize_t)r->chunks[i].key << 16) + bitset_container_max(&r->chunks[i]);
+}
+
+/* Appends the members of nwords bitset words to an empty RoaringBitset */
+static int
+bitset_roaring_read_words(bitset_RoaringObject *r, const bitset_word *words, Py_ssize_t nwords)
+{
+    Py_ssize_t base, n;
+    bitset_word *bits;
+    bitset_container *c;
+    int card;
+
+    if (nwords > ROARING_MAX / BITSET_WORD_BITS + 1) {
+        bitset_roaring_range_error();
+        return -1;
+    }
+
+    for (base = 0; base < nwords; base += ROARING_CHUNK_WORDS) {
+        n = Py_MIN(ROARING_CHUNK_WORDS, nwords - base);
+        card = (int)bitset_kernels.count(words + base, n);
+        if (card == 0)
+            continue;
+
+        bits = (bitset_word *)PyMem_Malloc(ROARING_CHUNK_BYTES);
+        if (bits == NULL || bitset_roaring_reserve(r, r->nchunks + 1)) {
+            PyMem_Free(bits);
+            if (!PyErr_Occurred())
+                PyErr_NoMemory();
+            return -1;
+        }
+
+        memcpy(bits, words + base, n * sizeof(bitset_word));
+        memset(bits + n, 0, (ROARING_CHUNK_WORDS - n) * sizeof(bitset_word));
+
+        c = &r->chunks[r->nchunks++];
+        c->key = (unsigned short)(base / ROARING_CHUNK_WORDS);
+        bitset_container_from_bitmap(c, bits, card);
+    }
+
+    return 0;
+}
+
+/* Re-encodes every chunk in its smallest encoding */
+static int
+bitset_roaring_optimize(bitset_RoaringObject *r)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < r->nchunks; i++) {
+        if (bitset_container_optimize(&r->chunks[i]))
+            return -1;
+    }
+    return 0;
+}
+
+/* Reads the members of obj into an empty RoaringBitset */
+static int
+bitset_roaring_read(bitset_RoaringObject *r, PyObject *obj)
+{
+    bitset_RoaringObject *other;
+    PyObject *key, *it;
+    Py_ssize_t i, value;
+
+    if (bitset_AnyBitset_Check(obj)) {
+        return bitset_roaring_read_words(r, ((bitset_BitsetObject *)obj)->words,
+                                         bitset_used_words((bitset_BitsetObject *)obj));
+    }
+
+    if (bitset_Roaring_Check(obj)) {
+        other = (bitset_RoaringObject *)obj;
+        if (bitset_roaring_reserve(r, other->nchunks))
+            return -1;
+        for (i = 0; i < other->nchunks; i++) {
+            if (bitset_container_copy(&r->chunks[i], &other->chunks[i]))
+                return -1;
+            r->nchunks++;
+        }
+        return 0;
+    }
+
+    BITSET_STAT_ADD(fallbacks, 1);
+    it = PyObject_GetIter(obj);
+    if (it == NULL)
+        return -1;
+
+    while ((key = PyIter_Next(it)) != NULL) {
+        value = bitset_roaring_member(key);
+        Py_DECREF(key);
+
+        if (value < 0 || bitset_roaring_add_member(r, value)) {
+            Py_DECREF(it);
+            return -1;
+        }
+    }
+    Py_DECREF(it);
+
+    if (PyErr_Occurred())
+        return -1;
+
+    return bitset_roaring_optimize(r);
+}
+
+/*
+ * Returns other as a RoaringBitset: a new reference to other itself if it
+ * is one, otherwise a new RoaringBitset of its members.
+ */
+static bitset_RoaringObject *
+bitset_as_roaring(PyObject *other)
+{
+    bitset_RoaringObject *result;
+
+    if (bitset_Roaring_Check(other)) {
+        Py_INCREF(other);
+        return (bitset_RoaringObject *)other;
+    }
+
+    result = (bitset_RoaringObject *)Roaring_new(&bitset_RoaringBitsetType, NULL, NULL);
+    if (result != NULL && bitset_roaring_read(result, other))
+        Py_CLEAR(result);
+    return result;
+}
+
+/* Returns the number of words a bitset needs to hold the members of r */
+static Py_ssize_t
+bitset_roaring_words(bitset_RoaringObject *r)
+{
+    bitset_container *c;
+
+    if (r->nchunks == 0)
+        return 0;
+
+    c = &r->chunks[r->nchunks - 1];
+    return (Py_ssize_t)c->key * ROARING_CHUNK_WORDS +
+        BITSET_WORD_INDEX(bitset_container_max(c)) + 1;
+}
+
+/* Returns a new bitset of the given type with the members of a RoaringBitset */
+static PyObject *
+bitset_from_roaring(PyTypeObject *type, PyObject *obj)
+{
+    bitset_RoaringObject *r = (bitset_RoaringObject *)obj;
+    bitset_BitsetObject *result;
+    bitset_container *c;
+    bitset_word *words;
+    Py_ssize_t i, n = 0;
+
+    result = (bitset_BitsetObject *)Bitset_new(type, NULL, NULL);
+    if (result == NULL || r->nchunks == 0)
+        return (PyObject *)result;
+
+    n = bitset_roaring_words(r);
+
+    /* don't allocate for members a Bitset can't hold anyway */
+    if (bitset_Bitset_Check(result) && n > 1) {
+        bitset_set_range_error((PyObject *)result);
+        Py_DECREF(result);
+        return NULL;
+    }
+
+    if (bitset_grow(result, n)) {
+        Py_DECREF(result);
+        return NULL;
+    }
+
+    for (i = 0; i < r->nchunks; i++) {
+        c = &r->chunks[i];
+        words = result->words + (Py_ssize_t)c->key * ROARING_CHUNK_WORDS;
+        if (c->type == ROARING_BITMAP)
+            memcpy(words, c->data.bitmap,
+                   Py_MIN(ROARING_CHUNK_WORDS, n - (words - result->words)) * sizeof(bitset_word));
+        else
+            bitset_container_or_into(c, words);
+    }
+
+    if (bitset_check_fits(result, result)) {
+        Py_DECREF(result);
+        return NULL;
+    }
+
+    return (PyObject *)result;
+}
+
+/***** Mixed operations *****/
+
+/*
+ * Operations between a bitset and a RoaringBitset walk the containers
+ * against the bitset's words a chunk at a time, so they take time and
+ * memory in proportion to the bitset and the containers rather than to
+ * the RoaringBitset's largest member.
+ */
+
+/* ORs words [first, first + n) of the chunk of c into out */
+static void
+bitset_container_or_window(const bitset_container *c, Py_ssize_t first, Py_ssize_t n,
+                           bitset_word *out)
+{
+    Py_ssize_t lo = first * BITSET_WORD_BITS, hi = (first + n) * BITSET_WORD_BITS - 1;
+    Py_ssize_t start, end;
+    int i;
+
+    switch (c->type) {
+    case ROARING_ARRAY:
+        for (i = 0; i < c->size && c->data.array[i] <= hi; i++) {
+            if (c->data.array[i] >= lo)
+                out[BITSET_WORD_INDEX(c->data.array[i] - lo)] |=
+                    BITSET_WORD_MASK(c->data.array[i]);
+        }
+        break;
+    case ROARING_BITMAP:
+        bitset_kernels.or_(out, c->data.bitmap + first, n);
+        break;
+    default:
+        for (i = 0; i < c->size && c->data.runs[i].start <= hi; i++) {
+            start = Py_MAX(c->data.runs[i].start, lo);
+            end = Py_MIN(c->data.runs[i].start + c->data.runs[i].length, hi);
+            if (start <= end)
+                bitset_set_bits(out, start - lo, end - lo);
+        }
+    }
+}
+
+/*
+ * Writes words [start, start + n) of a bitset holding the members of r to
+ * out.  It only reads r, so it can run without the GIL.
+ */
+static void
+bitset_roaring_window(bitset_RoaringObject *r, Py_ssize_t start, Py_ssize_t n,
+                      bitset_word *out)
+{
+    Py_ssize_t i, base, first, end = start + n;
+
+    memset(out, 0, n * sizeof(bitset_word));
+    if (start / ROARING_CHUNK_WORDS > 0xFFFF)
+        return;
+
+    i = bitset_roaring_find(r, (unsigned short)(start / ROARING_CHUNK_WORDS));
+    if (i < 0)
+        i = -i - 1;
+
+    for (; i < r->nchunks; i++) {
+        base = (Py_ssize_t)r->chunks[i].key * ROARING_CHUNK_WORDS;
+        if (base >= end)
+            break;
+        first = Py_MAX(start, base);
+        bitset_container_or_window(&r->chunks[i], first - base,
+                                   Py_MIN(end, base + ROARING_CHUNK_WORDS) - first,
+                                   out + (first - start));
+    }
+}
+
+/* Returns the words of container c clipped to n, as a bitmap or in scratch */
+static const bitset_word *
+bitset_container_words(const bitset_container *c, Py_ssize_t n, bitset_word *scratch)
+{
+    if (c->type == ROARING_BITMAP)
+        return c->data.bitmap;
+
+    memset(scratch, 0, n * sizeof(bitset_word));
+    bitset_container_or_window(c, 0, n, scratch);
+    return scratch;
+}
+
+/*
+ * Replaces the words of bso with bso op r.  Only a union or symmetric
+ * difference grows bso to the size of r, as its result must hold r's
+ * members.
+ */
+static int
+bitset_roaring_words_op(bitset_BitsetObject *bso, PyObject *obj, int op)
+{
+    bitset_RoaringObject *r = (bitset_RoaringObject *)obj;
+    bitset_word scratch[ROARING_CHUNK_WORDS];
+    const bitset_word *bits;
+    bitset_op_kernel kernel;
+    Py_ssize_t i, base, n, done = 0;
+
+    if (op == ROARING_OR || op == ROARING_XOR) {
+        n = bitset_roaring_words(r);
+        if (bitset_Bitset_Check(bso) && n > 0) {
+            bitset_roaring_window(r, 0, 1, scratch);
+            if (n > 1 || (scratch[0] & ~BITSET_SMALL_MASK)) {
+                bitset_set_range_error((PyObject *)bso);
+                return -1;
+            }
+        }
+        if (bitset_grow(bso, n))
+            return -1;
+    }
+
+    switch (op) {
+    case ROARING_AND:
+        kernel = bitset_kernels.and_;
+        break;
+    case ROARING_OR:
+        kernel = bitset_kernels.or_;
+        break;
+    case ROARING_XOR:
+        kernel = bitset_kernels.xor_;
+        break;
+    default:
+        kernel = bitset_kernels.andnot;
+    }
+
+    bitset_changed(bso);
+    for (i = 0; i < r->nchunks; i++) {
+        base = (Py_ssize_t)r->chunks[i].key * ROARING_CHUNK_WORDS;
+        if (base >= bso->nwords)
+            break;
+
+        /* an intersection keeps nothing between the chunks */
+        if (op == ROARING_AND)
+            memset(bso->words + done, 0, (base - done) * sizeof(bitset_word));
+
+        n = Py_MIN(ROARING_CHUNK_WORDS, bso->nwords - base);
+        bits = bitset_container_words(&r->chunks[i], n, scratch);
+        kernel(bso->words + base, bits, n);
+        done = base + n;
+    }
+
+    if (op == ROARING_AND)
+        bitset_truncate(bso, done);
+    return 0;
+}
+
+/* Returns len(bso & r), or with stop, stops at the first chunk they share a member in */
+static Py_ssize_t
+bitset_roaring_and_count_words(bitset_BitsetObject *bso, PyObject *obj, int stop)
+{
+    bitset_RoaringObject *r = (bitset_RoaringObject *)obj;
+    bitset_word scratch[ROARING_CHUNK_WORDS];
+    const bitset_word *bits;
+    Py_ssize_t i, base, n, count = 0;
+
+    for (i = 0; i < r->nchunks && !(stop && count); i++) {
+        base = (Py_ssize_t)r->chunks[i].key * ROARING_CHUNK_WORDS;
+        if (base >= bso->nwords)
+            break;
+
+        n = Py_MIN(ROARING_CHUNK_WORDS, bso->nwords - base);
+        bits = bitset_container_words(&r->chunks[i], n, scratch);
+        count += bitset_kernels.and_count(bso->words + base, bits, n);
+    }
+    return count;
+}
+
+/***** RoaringBitset operations *****/
+
+/* Returns a new RoaringBitset holding a op b */
+static bitset_RoaringObject *
+bitset_roaring_op(bitset_RoaringObject *a, bitset_RoaringObject *b, int op)
+{
+    bitset_RoaringObject *result;
+    bitset_container *ca, *cb, out;
+    Py_ssize_t i = 0, j = 0;
+
+    result = (bitset_RoaringObject *)Roaring_new(Py_TYPE(a), NULL, NULL);
+    if (result == NULL || bitset_roaring_reserve(result, a->nchunks + b->nchunks)) {
+        Py_XDECREF(result);
+        return NULL;
+    }
+
+    while (i < a->nchunks || j < b->nchunks) {
+        ca = i < a->nchunks ? &a->chunks[i] : NULL;
+        cb = j < b->nchunks ? &b->chunks[j] : NULL;
+
+        if (cb == NULL || (ca != NULL && ca->key < cb->key)) {
+            i++;
+            if (op == ROARING_AND)
+                continue;
+            if (bitset_container_copy(&out, ca))
+                goto error;
+        }
+        else if (ca == NULL || cb->key < ca->key) {
+            j++;
+            if (op == ROARING_AND || op == ROARING_ANDNOT)
+                continue;
+            if (bitset_container_copy(&out, cb))
+                goto error;
+        }
+        else {
+            i++;
+            j++;
+            out.key = ca->key;
+            if (bitset_container_op(&out, ca, cb, op))
+                goto error;
+            if (out.card == 0)
+                continue;
+        }
+
+        result->chunks[result->nchunks++] = out;
+    }
+
+    return result;
+
+error:
+    Py_DECREF(result);
+    return NULL;
+}
+
+/* Exchanges the members of a and b */
+static void
+bitset_roaring_swap(bitset_RoaringObject *a, bitset_RoaringObject *b)
+{
+    bitset_container *chunks = a->chunks;
+    Py_ssize_t n;
+
+    a->chunks = b->chunks;
+    b->chunks = chunks;
+    n = a->nchunks;
+    a->nchunks = b->nchunks;
+    b->nchunks = n;
+    n = a->allocated;
+    a->allocated = b->allocated;
+    b->allocated = n;
+}
+
+/* Replaces the members of r with r op other */
+static int
+bitset_roaring_inplace(bitset_RoaringObject *r, PyObject *other, int op)
+{
+    bitset_RoaringObject *otherr, *result;
+
+    otherr = bitset_as_roaring(other);
+    if (otherr == NULL)
+        return -1;
+
+    result = bitset_roaring_op(r, otherr, op);
+    Py_DECREF(otherr);
+    if (result == NULL)
+        return -1;
+
+    bitset_roaring_swap(r, result);
+    Py_DECREF(result);
+    return 0;
+}
+
+/* Returns a new RoaringBitset holding first..last, inclusive, as a run per chunk */
+static bitset_RoaringObject *
+bitset_roaring_from_range(Py_ssize_t first, Py_ssize_t last)
+{
+    bitset_RoaringObject *result;
+    bitset_container *c;
+    Py_ssize_t key;
+
+    result = (bitset_RoaringObject *)Roaring_new(&bitset_RoaringBitsetType, NULL, NULL);
+    if (result == NULL || bitset_roaring_reserve(result, (last >> 16) - (first >> 16) + 1)) {
+        Py_XDECREF(result);
+        return NULL;
+    }
+
+    for (key = first >> 16; key <= last >> 16; key++) {
+        c = &result->chunks[result->nchunks];
+        c->data.runs = (bitset_run *)PyMem_Malloc(sizeof(bitset_run));
+        if (c->data.runs == NULL) {
+            Py_DECREF(result);
+            PyErr_NoMemory();
+            return NULL;
+        }
+
+        c->key = (unsigned short)key;
+        c->type = ROARING_RUN;
+        c->size = c->allocated = 1;
+        c->data.runs[0].start = key == first >> 16 ? (unsigned short)first : 0;
+        c->data.runs[0].length = (key == last >> 16 ? (unsigned short)last : 0xFFFF) -
+            c->data.runs[0].start;
+        c->card = c->data.runs[0].length + 1;
+        result->nchunks++;
+    }
+
+    return result;
+}
+
+/* Replaces the members of r with r op first..last, inclusive */
+static int
+bitset_roaring_range_op(bitset_RoaringObject *r, Py_ssize_t first, Py_ssize_t last, int op)
+{
+    bitset_RoaringObject *range, *result;
+
+    range = bitset_roaring_from_range(first, last);
+    if (range == NULL)
+        return -1;
+
+    result = bitset_roaring_op(r, range, op);
+    Py_DECREF(range);
+    if (result == NULL)
+        return -1;
+
+    bitset_roaring_swap(r, result);
+    Py_DECREF(result);
+    return 0;
+}
+
+/* Returns len(a & b) */
+static Py_ssize_t
+bitset_roaring_and_count(bitset_RoaringObject *a, bitset_RoaringObject *b)
+{
+    Py_ssize_t i = 0, j = 0, count = 0;
+
+    while (i < a->nchunks && j < b->nchunks) {
+        if (a->chunks[i].key < b->chunks[j].key)
+            i++;
+        else if (a->chunks[i].key > b->chunks[j].key)
+            j++;
+        else
+            count += bitset_container_and_count(&a->chunks[i++], &b->chunks[j++]);
+    }
+    return count;
+}
+
+/* Returns true if every member of a is also in b */
+static int
+bitset_roaring_subset(bitset_RoaringObject *a, bitset_RoaringObject *b)
+{
+    Py_ssize_t i, j = 0;
+
+    if (a->nchunks > b->nchunks)
+        return 0;
+
+    for (i = 0; i < a->nchunks; i++) {
+        while (j < b->nchunks && b->chunks[j].key < a->chunks[i].key)
+            j++;
+        if (j == b->nchunks || b->chunks[j].key != a->chunks[i].key ||
+            a->chunks[i].card > b->chunks[j].card ||
+            bitset_container_and_count(&a->chunks[i], &b->chunks[j]) != a->chunks[i].card)
+            return 0;
+    }
+    return 1;
+}
+
+static int
+bitset_roaring_equal(bitset_RoaringObject *a, bitset_RoaringObject *b)
+{
+    Py_ssize_t i;
+
+    if (a->nchunks != b->nchunks)
+        return 0;
+
+    for (i = 0; i < a->nchunks; i++) {
+        if (a->chunks[i].key != b->chunks[i].key || a->chunks[i].card != b->chunks[i].card)
+            return 0;
+    }
+    return bitset_roaring_subset(a, b);
+}
+
+/*
+ * union_all(), intersect_all() and count_intersection() of RoaringBitsets
+ * merge the containers of each key from all the operands at once, in a
+ * bitmap, rather than folding the operands a pair at a time.
+ */
+static int
+bitset_container_key_cmp(const void *a, const void *b)
+{
+    return (int)(*(const bitset_container *const *)a)->key -
+        (int)(*(const bitset_container *const *)b)->key;
+}
+
+/* Returns a new RoaringBitset of type holding the union of the n RoaringBitsets */
+static PyObject *
+bitset_roaring_union_all(PyTypeObject *type, PyObject **operands, Py_ssize_t n)
+{
+    bitset_RoaringObject *result, *r;
+    const bitset_container **items;
+    bitset_container *out;
+    bitset_word *bits;
+    Py_ssize_t i, j, k, total = 0;
+
+    for (i = 0; i < n; i++)
+        total += ((bitset_RoaringObject *)operands[i])->nchunks;
+
+    result = (bitset_RoaringObject *)Roaring_new(type, NULL, NULL);
+    items = PyMem_New(const bitset_container *, total > 0 ? total : 1);
+    if (result == NULL || items == NULL ||
+        bitset_roaring_reserve(result, Py_MIN(total, 0x10000))) {
+        if (items == NULL)
+            PyErr_NoMemory();
+        goto error;
+    }
+
+    for (i = k = 0; i < n; i++) {
+        r = (bitset_RoaringObject *)operands[i];
+        for (j = 0; j < r->nchunks; j++)
+            items[k++] = &r->chunks[j];
+    }
+    qsort((void *)items, total, sizeof(*items), bitset_container_key_cmp);
+
+    for (i = 0; i < total; i = j) {
+        for (j = i + 1; j < total && items[j]->key == items[i]->key; j++)
+            ;
+
+        out = &result->chunks[result->nchunks];
+        if (j == i + 1) {
+            if (bitset_container_copy(out, items[i]))
+                goto error;
+        }
+        else {
+            bits = (bitset_word *)PyMem_Malloc(ROARING_CHUNK_BYTES);
+            if (bits == NULL) {
+                PyErr_NoMemory();
+                goto error;
+            }
+            memset(bits, 0, ROARING_CHUNK_BYTES);
+            for (k = i; k < j; k++)
+                bitset_container_or_into(items[k], bits);
+            out->key = items[i]->key;
+            bitset_container_from_bitmap(out, bits,
+                                         (int)bitset_kernels.count(bits, ROARING_CHUNK_WORDS));
+        }
+        result->nchunks++;
+    }
+
+    PyMem_Free((void *)items);
+    return (PyObject *)result;
+
+error:
+    PyMem_Free((void *)items);
+    Py_XDECREF(result);
+    return NULL;
+}
+
+/*
+ * Returns the size of the intersection of the n RoaringBitsets, adding
+ * its containers to result unless it is NULL, or -1 on error.  Only the
+ * keys of the operand with the fewest chunks are looked up in the others.
+ */
+static Py_ssize_t
+bitset_roaring_and_all(PyObject **operands, Py_ssize_t n, bitset_RoaringObject *result)
+{
+    bitset_word acc[ROARING_CHUNK_WORDS], scratch[ROARING_CHUNK_WORDS], *bits;
+    bitset_RoaringObject *small = (bitset_RoaringObject *)operands[0], *r;
+    const bitset_container *c;
+    bitset_container *out;
+    Py_ssize_t i, j, found, count = 0;
+    int card;
+
+    for (i = 1; i < n; i++) {
+        if (((bitset_RoaringObject *)operands[i])->nchunks < small->nchunks)
+            small = (bitset_RoaringObject *)operands[i];
+    }
+    if (result != NULL && bitset_roaring_reserve(result, small->nchunks))
+        return -1;
+
+    for (i = 0; i < small->nchunks; i++) {
+        c = &small->chunks[i];
+        memset(acc, 0, ROARING_CHUNK_BYTES);
+        bitset_container_or_into(c, acc);
+
+        for (j = 0; j < n; j++) {
+            r = (bitset_RoaringObject *)operands[j];
+            if (r == small)
+                continue;
+            found = bitset_roaring_find(r, c->key);
+            if (found < 0) {
+                memset(acc, 0, ROARING_CHUNK_BYTES);
+                break;
+            }
+            bitset_kernels.and_(acc, bitset_container_bitmap(&r->chunks[found], scratch),
+                                ROARING_CHUNK_WORDS);
+            if (bitset_words_empty(acc, ROARING_CHUNK_WORDS))
+                break;
+        }
+
+        card = (int)bitset_kernels.count(acc, ROARING_CHUNK_WORDS);
+        if (card == 0)
+            continue;
+        count += card;
+
+        if (result != NULL) {
+            bits = (bitset_word *)PyMem_Malloc(ROARING_CHUNK_BYTES);
+            if (bits == NULL) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            memcpy(bits, acc, ROARING_CHUNK_BYTES);
+            out = &result->chunks[result->nchunks++];
+            out->key = c->key;
+            bitset_container_from_bitmap(out, bits, card);
+        }
+    }
+
+    return count;
+}
+
+/* Returns a new RoaringBitset of type holding the intersection of the n RoaringBitsets */
+static PyObject *
+bitset_roaring_intersect_all(PyTypeObject *type, PyObject **operands, Py_ssize_t n)
+{
+    bitset_RoaringObject *result;
+
+    result = (bitset_RoaringObject *)Roaring_new(type, NULL, NULL);
+    if (result != NULL && bitset_roaring_and_all(operands, n, result) < 0)
+        Py_CLEAR(result);
+    return (PyObject *)result;
+}
+
+/* Returns the size of the intersection of the n RoaringBitsets */
+static Py_ssize_t
+bitset_roaring_count_all(PyObject **operands, Py_ssize_t n)
+{
+    if (n == 2)
+        return bitset_roaring_and_count((bitset_RoaringObject *)operands[0],
+                                        (bitset_RoaringObject *)operands[1]);
+    return bitset_roaring_and_all(operands, n, NULL);
+}
+
+/***** RoaringBitset iterator type *****/
+
+typedef struct {
+    PyObject_HEAD
+    bitset_RoaringObject *ri_bitset;  /* Set to NULL when iterator is exhausted */
+    Py_ssize_t ri_chunk;              /* index of the chunk being iterated */
+    int ri_pos;                       /* next value, word or run in that chunk */
+    int ri_offset;                    /* how far into the current run */
+    bitset_word ri_state;             /* members of the current word not yet returned */
+} bitset_Roaring_iterobject;
+
+static void
+bitset_Roaring_iter_dealloc(bitset_Roaring_iterobject *ri)
+{
+    Py_XDECREF(ri->ri_bitset);
+    PyObject_Del(ri);
+}
+
+static PyObject *
+bitset_Roaring_iter_iternext(bitset_Roaring_iterobject *ri)
+{
+    bitset_RoaringObject *r = ri->ri_bitset;
+    bitset_container *c;
+    bitset_run *run;
+    Py_ssize_t base;
+
+    if (r == NULL)
+        return NULL;
+
+    /* positions are checked against the chunk on each call, so mutating
+       the set while iterating can't read past its containers */
+    while (ri->ri_chunk < r->nchunks) {
+        c = &r->chunks[ri->ri_chunk];
+        base = (Py_ssize_t)c->key << 16;
+
+        switch (c->type) {
+        case ROARING_ARRAY:
+            if (ri->ri_pos < c->size)
+                return PyInt_FromSsize_t(base + c->data.array[ri->ri_pos++]);
+            break;
+
+        case ROARING_BITMAP:
+            while (ri->ri_state == 0 && ri->ri_pos < ROARING_CHUNK_WORDS)
+                ri->ri_state = c->data.bitmap[ri->ri_pos++];
+            if (ri->ri_state != 0)
+                return PyInt_FromSsize_t(base + (ri->ri_pos - 1) * BITSET_WORD_BITS +
+                                         bitset_pop(&ri->ri_state));
+            break;
+
+        default:
+            if (ri->ri_pos < c->size) {
+                run = &c->data.runs[ri->ri_pos];
+                base += run->start + ri->ri_offset;
+                if (ri->ri_offset++ >= run->length) {
+                    ri->ri_pos++;
+                    ri->ri_offset = 0;
+                }
+                return PyInt_FromSsize_t(base);
+            }
+        }
+
+        ri->ri_chunk++;
+        ri->ri_pos = ri->ri_offset = 0;
+        ri->ri_state = 0;
+    }
+
+    Py_DECREF(r);
+    ri->ri_bitset = NULL;
+    return NULL;
+}
+
+static PyTypeObject bitset_Roaring_iter_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "RoaringBitset_iterator",                   /* tp_name */
+    sizeof(bitset_Roaring_iterobject),          /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    /* methods */
+    (destructor)bitset_Roaring_iter_dealloc,    /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    0,                                          /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    PyObject_SelfIter,                          /* tp_iter */
+    (iternextfunc)bitset_Roaring_iter_iternext, /* tp_iternext */
+    0,
+};
+
+static PyObject *
+bitset_Roaring_iter(bitset_RoaringObject *r)
+{
+    bitset_Roaring_iterobject *ri;
+
+    ri = PyObject_New(bitset_Roaring_iterobject, &bitset_Roaring_iter_Type);
+    if (ri == NULL)
+        return NULL;
+
+    Py_INCREF(r);
+    ri->ri_bitset = r;
+    ri->ri_chunk = 0;
+    ri->ri_pos = ri->ri_offset = 0;
+    ri->ri_state = 0;
+
+    return (PyObject *)ri;
+}
+
+/***** RoaringBitset methods *****/
+
+static Py_ssize_t
+bitset_Roaring_len(PyObject *r)
+{
+    return bitset_roaring_len((bitset_RoaringObject *)r);
+}
+
+static int
+bitset_Roaring_contains(bitset_RoaringObject *r, PyObject *key)
+{
+    Py_ssize_t value;
+
+    if (bitset_key_value(key, &value)) {
+        bitset_roaring_range_error();
+        return -1;
+    }
+
+    return bitset_roaring_has_member(r, value);
+}
+
+static PySequenceMethods bitset_roaring_as_sequence = {
+    bitset_Roaring_len,                     /* sq_length */
+    0,                                      /* sq_concat */
+    0,                                      /* sq_repeat */
+    0,                                      /* sq_item */
+    0,                                      /* sq_slice */
+    0,                                      /* sq_ass_item */
+    0,                                      /* sq_ass_slice */
+    (objobjproc)bitset_Roaring_contains,    /* sq_contains */
+};
+
+static PyObject *
+bitset_Roaring_add(bitset_RoaringObject *r, PyObject *key)
+{
+    Py_ssize_t value = bitset_roaring_member(key);
+
+    if (value < 0 || bitset_roaring_add_member(r, value))
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+bitset_Roaring_clear(bitset_RoaringObject *r)
+{
+    bitset_roaring_clear_chunks(r);
+    PyMem_Free(r->chunks);
+    r->chunks = NULL;
+    r->allocated = 0;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+bitset_Roaring_copy(bitset_RoaringObject *r)
+{
+    bitset_RoaringObject *result;
+
+    result = (bitset_RoaringObject *)Roaring_new(Py_TYPE(r), NULL, NULL);
+    if (result != NULL && bitset_roaring_read(result, (PyObject *)r))
+        Py_CLEAR(result);
+    return (PyObject *)result;
+}
+
+static PyObject *
+bitset_Roaring_remove(bitset_RoaringObject *r, PyObject *key)
+{
+    Py_ssize_t value = bitset_roaring_member(key);
+    int status;
+
+    if (value < 0)
+        return NULL;
+
+    status = bitset_roaring_remove_member(r, value);
+    if (status < 0)
+        return NULL;
+
+    if (status == 0) {
+        PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+bitset_Roaring_discard(bitset_RoaringObject *r, PyObject *key)
+{
+    Py_ssize_t value = bitset_roaring_member(key);
+
+    if (value < 0 || bitset_roaring_remove_member(r, value) < 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+bitset_Roaring_pop(bitset_RoaringObject *r)
+{
+    Py_ssize_t value;
+
+    if (r->nchunks == 0) {
+        PyErr_SetString(PyExc_KeyError, "pop from an empty bitset");
+        return NULL;
+    }
+
+    value = ((Py_ssize_t)r->chunks[0].key << 16) + bitset_container_min(&r->chunks[0]);
+    if (bitset_roaring_remove_member(r, value) < 0)
+        return NULL;
+
+    return PyInt_FromSsize_t(value);
+}
+
+static PyObject *
+bitset_Roaring_rank(bitset_RoaringObject *r, PyObject *arg)
+{
+    Py_ssize_t x;
+
+    if (bitset_index_arg(arg, &x))
+        return NULL;
+    return PyInt_FromSsize_t(bitset_roaring_rank(r, x));
+}
+
+static PyObject *
+bitset_Roaring_select(bitset_RoaringObject *r, PyObject *arg)
+{
+    Py_ssize_t k;
+
+    if (bitset_index_arg(arg, &k))
+        return NULL;
+    return bitset_select_result(k < 0 ? -1 : bitset_roaring_select(r, k));
+}
+
+static PyObject *
+bitset_Roaring_nextset(bitset_RoaringObject *r, PyObject *arg)
+{
+    Py_ssize_t x;
+
+    if (bitset_index_arg(arg, &x))
+        return NULL;
+    return PyInt_FromSsize_t(bitset_roaring_next(r, x));
+}
+
+static PyObject *
+bitset_Roaring_prevset(bitset_RoaringObject *r, PyObject *arg)
+{
+    Py_ssize_t x;
+
+    if (bitset_index_arg(arg, &x))
+        return NULL;
+    return PyInt_FromSsize_t(bitset_roaring_prev(r, x));
+}
+
+/* Applies op with lo..hi - 1, which must lie within the members allowed */
+static PyObject *
+bitset_Roaring_add_range_with(bitset_RoaringObject *r, PyObject *args, const char *name, int op)
+{
+    Py_ssize_t lo, hi;
+
+    if (bitset_range_args(args, name, &lo, &hi))
+        return NULL;
+
+    if (lo < hi) {
+        if (lo < 0 || hi - 1 > ROARING_MAX) {
+            bitset_roaring_range_error();
+            return NULL;
+        }
+        if (bitset_roaring_range_op(r, lo, hi - 1, op))
+            return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+bitset_Roaring_add_range(bitset_RoaringObject *r, PyObject *args)
+{
+    return bitset_Roaring_add_range_with(r, args, "add_range", ROARING_OR);
+}
+
+static PyObject *
+bitset_Roaring_flip(bitset_RoaringObject *r, PyObject *args)
+{
+    return bitset_Roaring_add_range_with(r, args, "flip", ROARING_XOR);
+}
+
+static PyObject *
+bitset_Roaring_discard_range(bitset_RoaringObject *r, PyObject *args)
+{
+    Py_ssize_t lo, hi;
+
+    if (bitset_range_args(args, "discard_range", &lo, &hi))
+        return NULL;
+
+    lo = Py_MAX(lo, 0);
+    if (lo < hi && lo <= ROARING_MAX &&
+        bitset_roaring_range_op(r, lo, Py_MIN(hi - 1, ROARING_MAX), ROARING_ANDNOT))
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+bitset_Roaring_count(bitset_RoaringObject *r, PyObject *args)
+{
+    Py_ssize_t lo, hi;
+
+    if (bitset_range_args(args, "count", &lo, &hi))
+        return NULL;
+
+    if (lo >= hi)
+        return PyInt_FromLong(0);
+    return PyInt_FromSsize_t(bitset_roaring_rank(r, hi) - bitset_roaring_rank(r, lo));
+}
+
+static PyObject *
+bitset_Roaring_any_in_range(bitset_RoaringObject *r, PyObject *args)
+{
+    Py_ssize_t lo, hi, next;
+
+    if (bitset_range_args(args, "any_in_range", &lo, &hi))
+        return NULL;
+
+    next = lo < hi ? bitset_roaring_next(r, lo) : -1;
+    return PyBool_FromLong(next >= 0 && next < hi);
+}
+
+static PyObject *
+bitset_Roaring_all_in_range(bitset_RoaringObject *r, PyObject *args)
+{
+    Py_ssize_t lo, hi;
+
+    if (bitset_range_args(args, "all_in_range", &lo, &hi))
+        return NULL;
+
+    if (lo >= hi)
+        Py_RETURN_TRUE;
+    if (lo < 0 || hi - 1 > ROARING_MAX)
+        Py_RETURN_FALSE;
+    return PyBool_FromLong(bitset_roaring_rank(r, hi) - bitset_roaring_rank(r, lo) == hi - lo);
+}
+
+static PyObject *
+bitset_Roaring_optimize(bitset_RoaringObject *r)
+{
+    if (bitset_roaring_optimize(r))
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(optimize_doc,
+"Re-encode each chunk as an array, bitmap or runs, whichever is smallest.\n\
+\n\
+add() and remove() never convert to runs, so call this after building a\n\
+set of long runs one member at a time.");
+
+static PyObject *
+bitset_Roaring_sizeof(bitset_RoaringObject *r)
+{
+    Py_ssize_t i, n;
+
+    n = Py_TYPE(r)->tp_basicsize + r->allocated * sizeof(bitset_container);
+    for (i = 0; i < r->nchunks; i++)
+        n += bitset_container_bytes(&r->chunks[i], r->chunks[i].allocated);
+
+    return PyInt_FromSsize_t(n);
+}
+
+/* Applies op in place for the *_update methods and in place operators */
+static PyObject *
+bitset_Roaring_update_with(bitset_RoaringObject *r, PyObject *other, int op)
+{
+    if (bitset_roaring_inplace(r, other, op))
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+/* Returns r op other as a new RoaringBitset */
+static PyObject *
+bitset_Roaring_op_with(bitset_RoaringObject *r, PyObject *other, int op)
+{
+    bitset_RoaringObject *otherr, *result;
+
+    otherr = bitset_as_roaring(other);
+    if (otherr == NULL)
+        return NULL;
+
+    result = bitset_roaring_op(r, otherr, op);
+    Py_DECREF(otherr);
+    return (PyObject *)result;
+}
+
+static PyObject *
+bitset_Roaring_update(bitset_RoaringObject *r, PyObject *other)
+{
+    return bitset_Roaring_update_with(r, other, ROARING_OR);
+}
+
+static PyObject *
+bitset_Roaring_intersection_update(bitset_RoaringObject *r, PyObject *other)
+{
+    return bitset_Roaring_update_with(r, other, ROARING_AND);
+}
+
+static PyObject *
+bitset_Roaring_difference_update(bitset_RoaringObject *r, PyObject *other)
+{
+    return bitset_Roaring_update_with(r, other, ROARING_ANDNOT);
+}
+
+static PyObject *
+bitset_Roaring_symmetric_difference_update(bitset_RoaringObject *r, PyObject *other)
+{
+    return bitset_Roaring_update_with(r, other, ROARING_XOR);
+}
+
+static PyObject *
+bitset_Roaring_symmetric_difference(bitset_RoaringObject *r, PyObject *other)
+{
+    return bitset_Roaring_op_with(r, other, ROARING_XOR);
+}
+
+static PyObject *
+bitset_Roaring_union_others(PyObject *r, BITSET_OTHERS_PARAMS)
+{
+    return bitset_fold_others(r, BITSET_OTHERS_ARGS, (unaryfunc)bitset_Roaring_copy,
+                              (binaryfunc)bitset_Roaring_update,
+                              BITSET_STAT_UNION);
+}
+
+static PyObject *
+bitset_Roaring_intersection_others(PyObject *r, BITSET_OTHERS_PARAMS)
+{
+    return bitset_fold_others(r, BITSET_OTHERS_ARGS, (unaryfunc)bitset_Roaring_copy,
+                              (binaryfunc)bitset_Roaring_intersection_update,
+                              BITSET_STAT_INTERSECTION);
+}
+
+static PyObject *
+bitset_Roaring_difference_others(PyObject *r, BITSET_OTHERS_PARAMS)
+{
+    return bitset_fold_others(r, BITSET_OTHERS_ARGS, (unaryfunc)bitset_Roaring_copy,
+                              (binaryfunc)bitset_Roaring_difference_update,
+                              BITSET_STAT_DIFFERENCE);
+}
+
+static PyObject *
+bitset_Roaring_update_others(PyObject *r, BITSET_OTHERS_PARAMS)
+{
+    return bitset_update_others(r, BITSET_OTHERS_ARGS,
+                                (binaryfunc)bitset_Roaring_update,
+                                BITSET_STAT_UPDATE);
+}
+
+static PyObject *
+bitset_Roaring_intersection_update_others(PyObject *r, BITSET_OTHERS_PARAMS)
+{
+    return bitset_update_others(r, BITSET_OTHERS_ARGS,
+                                (binaryfunc)bitset_Roaring_intersection_update,
+                                BITSET_STAT_INTERSECTION_UPDATE);
+}
+
+static PyObject *
+bitset_Roaring_difference_update_others(PyObject *r, BITSET_OTHERS_PARAMS)
+{
+    return bitset_update_others(r, BITSET_OTHERS_ARGS,
+                                (binaryfunc)bitset_Roaring_difference_update,
+                                BITSET_STAT_DIFFERENCE_UPDATE);
+}
+
+/*
+ * The counts are all derived from the size of the intersection, which is
+ * counted chunk by chunk without building any containers.
+ */
+static PyObject *
+bitset_Roaring_count_with(bitset_RoaringObject *r, PyObject *other, int op)
+{
+    bitset_RoaringObject *otherr;
+    Py_ssize_t both, a, b, result;
+
+    otherr = bitset_as_roaring(other);
+    if (otherr == NULL)
+        return NULL;
+
+    both = bitset_roaring_and_count(r, otherr);
+    a = bitset_roaring_len(r);
+    b = bitset_roaring_len(otherr);
+    Py_DECREF(otherr);
+
+    switch (op) {
+    case ROARING_AND:
+        result = both;
+        break;
+    case ROARING_OR:
+        result = a + b - both;
+        break;
+    case ROARING_XOR:
+        result = a + b - 2 * both;
+        break;
+    default:
+        result = a - both;
+    }
+
+    return PyInt_FromSsize_t(result);
+}
+
+static PyObject *
+bitset_Roaring_intersection_count(bitset_RoaringObject *r, PyObject *other)
+{
+    return bitset_Roaring_count_with(r, other, ROARING_AND);
+}
+
+static PyObject *
+bitset_Roaring_union_count(bitset_RoaringObject *r, PyObject *other)
+{
+    return bitset_Roaring_count_with(r, other, ROARING_OR);
+}
+
+static PyObject *
+bitset_Roaring_difference_count(bitset_RoaringObject *r, PyObject *other)
+{
+    return bitset_Roaring_count_with(r, other, ROARING_ANDNOT);
+}
+
+static PyObject *
+bitset_Roaring_symmetric_difference_count(bitset_RoaringObject *r, PyObject *other)
+{
+    return bitset_Roaring_count_with(r, other, ROARING_XOR);
+}
+
+static PyObject *
+bitset_Roaring_issubset(bitset_RoaringObject *r, PyObject *other)
+{
+    bitset_RoaringObject *otherr;
+    int result;
+
+    otherr = bitset_as_roaring(other);
+    if (otherr == NULL)
+        return NULL;
+
+    result = bitset_roaring_subset(r, otherr);
+    Py_DECREF(otherr);
+
+    return PyBool_FromLong(result);
+}
+
+static PyObject *
+bitset_Roaring_issuperset(bitset_RoaringObject *r, PyObject *other)
+{
+    bitset_RoaringObject *otherr;
+    int result;
+
+    otherr = bitset_as_roaring(other);
+    if (otherr == NULL)
+        return NULL;
+
+    result = bitset_roaring_subset(otherr, r);
+    Py_DECREF(otherr);
+
+    return PyBool_FromLong(result);
+}
+
+/* Returns true if a and b have a member in common */
+static int
+bitset_roaring_intersects(bitset_RoaringObject *a, bitset_RoaringObject *b)
+{
+    Py_ssize_t i = 0, j = 0;
+
+    while (i < a->nchunks && j < b->nchunks) {
+        if (a->chunks[i].key < b->chunks[j].key)
+            i++;
+        else if (a->chunks[i].key > b->chunks[j].key)
+            j++;
+        else if (bitset_container_and_count(&a->chunks[i++], &b->chunks[j++]) != 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+static PyObject *
+bitset_Roaring_isdisjoint(bitset_RoaringObject *r, PyObject *other)
+{
+    bitset_RoaringObject *otherr;
+    int result;
+
+    otherr = bitset_as_roaring(other);
+    if (otherr == NULL)
+        return NULL;
+
+    result = !bitset_roaring_intersects(r, otherr);
+    Py_DECREF(otherr);
+
+    return PyBool_FromLong(result);
+}
+
+static PyObject *
+bitset_Roaring_intersects(bitset_RoaringObject *r, PyObject *other)
+{
+    bitset_RoaringObject *otherr;
+    int result;
+
+    otherr = bitset_as_roaring(other);
+    if (otherr == NULL)
+        return NULL;
+
+    result = bitset_roaring_intersects(r, otherr);
+    Py_DECREF(otherr);
+
+    return PyBool_FromLong(result);
+}
+
+static PyObject *
+bitset_Roaring_jaccard(bitset_RoaringObject *r, PyObject *other)
+{
+    bitset_RoaringObject *otherr;
+    Py_ssize_t both, either;
+
+    otherr = bitset_as_roaring(other);
+    if (otherr == NULL)
+        return NULL;
+
+    both = bitset_roaring_and_count(r, otherr);
+    either = bitset_roaring_len(r) + bitset_roaring_len(otherr) - both;
+    Py_DECREF(otherr);
+
+    return PyFloat_FromDouble(either ? (double)both / either : 1.0);
+}
+
+/*
+ * target is r & other if it's a subset of both and the same size as the
+ * intersection, which the subset tests usually settle in the first chunk.
+ */
+static PyObject *
+bitset_Roaring_intersection_equals(bitset_RoaringObject *r, PyObject *args)
+{
+    PyObject *other, *target;
+    bitset_RoaringObject *otherr, *targetr;
+    int result;
+
+    if (!PyArg_UnpackTuple(args, "intersection_equals", 2, 2, &other, &target))
+        return NULL;
+
+    otherr = bitset_as_roaring(other);
+    if (otherr == NULL)
+        return NULL;
+
+    targetr = bitset_as_roaring(target);
+    if (targetr == NULL) {
+        Py_DECREF(otherr);
+        return NULL;
+    }
+
+    result = bitset_roaring_subset(targetr, r) && bitset_roaring_subset(targetr, otherr) &&
+        bitset_roaring_len(targetr) == bitset_roaring_and_count(r, otherr);
+    Py_DECREF(otherr);
+    Py_DECREF(targetr);
+
+    return PyBool_FromLong(result);
+}
+
+/* Converts a new bitset from one of the bitset constructors, stealing it */
+static PyObject *
+bitset_roaring_from_bitset(PyTypeObject *type, PyObject *bso)
+{
+    bitset_RoaringObject *result;
+
+    if (bso == NULL)
+        return NULL;
+
+    result = (bitset_RoaringObject *)Roaring_new(type, NULL, NULL);
+    if (result != NULL && bitset_roaring_read(result, bso))
+        Py_CLEAR(result);
+    Py_DECREF(bso);
+    return (PyObject *)result;
+}
+
+static PyObject *
+bitset_Roaring_from_buffer(PyTypeObject *type, PyObject *obj)
+{
+    return bitset_roaring_from_bitset(
+        type, bitset_Bitset_from_buffer(&bitset_BigBitsetType, obj));
+}
+
+static PyObject *
+bitset_Roaring_frombytes(PyTypeObject *type, PyObject *obj)
+{
+    return bitset_roaring_from_bitset(
+        type, bitset_Bitset_frombytes(&bitset_BigBitsetType, obj));
+}
+
+/*
+ * The state of a RoaringBitset, which is the payload of its serialized
+ * form, is little-endian chunks, each an 8 byte header (key: 2 bytes,
+ * type: 1, padding: 1, size: 4) followed by size values of 2 bytes, size
+ * runs of 4 bytes or a bitmap of 8192 bytes.
+ */
+#define ROARING_HEADER_BYTES 8
+
+static void
+bitset_put_le(unsigned char *p, bitset_word v, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static bitset_word
+bitset_get_le(const unsigned char *p, int n)
+{
+    bitset_word v = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        v |= (bitset_word)p[i] << (8 * i);
+    return v;
+}
+
+/* Returns the bytes the state of r takes */
+static Py_ssize_t
+bitset_roaring_state_size(bitset_RoaringObject *r)
+{
+    Py_ssize_t i, n = 0;
+
+    for (i = 0; i < r->nchunks; i++)
+        n += ROARING_HEADER_BYTES + bitset_container_bytes(&r->chunks[i], r->chunks[i].size);
+    return n;
+}
+
+/* Writes the state of r to p, which must have room for it */
+static void
+bitset_roaring_write_state(bitset_RoaringObject *r, unsigned char *p)
+{
+    bitset_container *c;
+    Py_ssize_t i;
+    int j;
+
+    for (i = 0; i < r->nchunks; i++) {
+        c = &r->chunks[i];
+        bitset_put_le(p, c->key, 2);
+        p[2] = c->type;
+        p[3] = 0;
+        bitset_put_le(p + 4, c->type == ROARING_BITMAP ? ROARING_CHUNK_WORDS : c->size, 4);
+        p += ROARING_HEADER_BYTES;
+
+        switch (c->type) {
+        case ROARING_ARRAY:
+            for (j = 0; j < c->size; j++, p += 2)
+                bitset_put_le(p, c->data.array[j], 2);
+            break;
+        case ROARING_BITMAP:
+            bitset_words_to_bytes(c->data.bitmap, p, ROARING_CHUNK_BYTES);
+            p += ROARING_CHUNK_BYTES;
+            break;
+        default:
+            for (j = 0; j < c->size; j++, p += 4) {
+                bitset_put_le(p, c->data.runs[j].start, 2);
+                bitset_put_le(p + 2, c->data.runs[j].length, 2);
+            }
+        }
+    }
+}
+
+static PyObject *
+bitset_Roaring_reduce(bitset_RoaringObject *r)
+{
+    return bitset_reduce_serialized((PyObject *)r);
+}
+
+/* Reads one chunk of pickled state into c, returning the bytes used or -1 */
+static Py_ssize_t
+bitset_roaring_read_chunk(bitset_container *c, const unsigned char *p, Py_ssize_t len)
+{
+    Py_ssize_t size, n;
+    int j, prev = -1;
+
+    if (len < ROARING_HEADER_BYTES || p[2] > ROARING_RUN)
+        return -1;
+
+    c->key = (unsigned short)bitset_get_le(p, 2);
+    c->type = p[2];
+    size = (Py_ssize_t)bitset_get_le(p + 4, 4);
+    if (size < 1 || size > ROARING_CHUNK_WORDS * BITSET_WORD_BITS ||
+        (c->type == ROARING_ARRAY && size > ROARING_ARRAY_MAX) ||
+        (c->type == ROARING_BITMAP && size != ROARING_CHUNK_WORDS))
+        return -1;
+
+    n = bitset_container_bytes(c, (int)size);
+    if (len - ROARING_HEADER_BYTES < n)
+        return -1;
+
+    c->size = c->allocated = c->type == ROARING_BITMAP ? 0 : (int)size;
+    c->data.ptr = PyMem_Malloc(n);
+    if (c->data.ptr == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    p += ROARING_HEADER_BYTES;
+    c->card = 0;
+    switch (c->type) {
+    case ROARING_ARRAY:
+        for (j = 0; j < size; j++, p += 2) {
+            c->data.array[j] = (unsigned short)bitset_get_le(p, 2);
+            if (c->data.array[j] <= prev)
+                break;
+            prev = c->data.array[j];
+        }
+        c->card = j == size ? (int)size : 0;
+        break;
+    case ROARING_BITMAP:
+        memset(c->data.bitmap, 0, ROARING_CHUNK_BYTES);
+        bitset_words_from_bytes(c->data.bitmap, p, ROARING_CHUNK_BYTES);
+        c->card = (int)bitset_kernels.count(c->data.bitmap, ROARING_CHUNK_WORDS);
+        break;
+    default:
+        for (j = 0; j < size; j++, p += 4) {
+            c->data.runs[j].start = (unsigned short)bitset_get_le(p, 2);
+            c->data.runs[j].length = (unsigned short)bitset_get_le(p + 2, 2);
+            if (c->data.runs[j].start <= prev ||
+                c->data.runs[j].start + c->data.runs[j].length >= ROARING_CHUNK_WORDS * BITSET_WORD_BITS)
+                break;
+            prev = c->data.runs[j].start + c->data.runs[j].length;
+            c->card += c->data.runs[j].length + 1;
+        }
+        if (j < size)
+            c->card = 0;
+    }
+
+    if (c->card == 0) {
+        PyMem_Free(c->data.ptr);
+        return -1;
+    }
+    return ROARING_HEADER_BYTES + n;
+}
+
+/*
+ * Reads len bytes of state into r, which must be empty.  Returns 0, or -1
+ * with an error set, or -1 without one if the state is invalid.
+ */
+static int
+bitset_roaring_read_state(bitset_RoaringObject *r, const unsigned char *p, Py_ssize_t len)
+{
+    Py_ssize_t n;
+
+    while (len > 0) {
+        if (bitset_roaring_reserve(r, r->nchunks + 1))
+            return -1;
+
+        n = bitset_roaring_read_chunk(&r->chunks[r->nchunks], p, len);
+        if (n < 0 || (r->nchunks > 0 &&
+                      r->chunks[r->nchunks].key <= r->chunks[r->nchunks - 1].key)) {
+            if (n >= 0)
+                PyMem_Free(r->chunks[r->nchunks].data.ptr);
+            return -1;
+        }
+
+        r->nchunks++;
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Reads the state pickled by versions before RoaringBitsets were pickled
+   with loads() */
+static PyObject *
+bitset_Roaring_setstate(bitset_RoaringObject *r, PyObject *state)
+{
+    bitset_RoaringObject *tmp;
+
+    if (!PyBytes_Check(state)) {
+        PyErr_SetString(PyExc_TypeError, "Invalid state in __setstate__");
+        return NULL;
+    }
+
+    tmp = (bitset_RoaringObject *)Roaring_new(Py_TYPE(r), NULL, NULL);
+    if (tmp == NULL)
+        return NULL;
+
+    if (bitset_roaring_read_state(tmp, (const unsigned char *)PyBytes_AS_STRING(state),
+                                  PyBytes_GET_SIZE(state))) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_TypeError, "Invalid state in __setstate__");
+        Py_DECREF(tmp);
+        return NULL;
+    }
+
+    bitset_roaring_swap(r, tmp);
+    Py_DECREF(tmp);
+    Py_RETURN_NONE;
+}
+
+/* defined with the batch membership and extraction code below */
+static PyObject *bitset_Roaring_contains_many(bitset_RoaringObject *r, PyObject *obj);
+static PyObject *bitset_Roaring_filter(bitset_RoaringObject *r, PyObject *obj);
+static PyObject *bitset_Roaring_into(bitset_RoaringObject *r, PyObject *obj);
+static PyObject *bitset_Roaring_to_array(bitset_RoaringObject *r, PyObject *args);
+
+static PyMethodDef bitset_Roaring_methods[] = {
+    {"add",                         (PyCFunction)bitset_Roaring_add,
+     METH_O, add_doc},
+    {"add_range",                   (PyCFunction)bitset_Roaring_add_range,
+     METH_VARARGS, add_range_doc},
+    {"all_in_range",                (PyCFunction)bitset_Roaring_all_in_range,
+     METH_VARARGS, all_in_range_doc},
+    {"any_in_range",                (PyCFunction)bitset_Roaring_any_in_range,
+     METH_VARARGS, any_in_range_doc},
+    {"clear",                       (PyCFunction)bitset_Roaring_clear,
+     METH_NOARGS, clear_doc},
+    {"contains_many",               (PyCFunction)bitset_Roaring_contains_many,
+     METH_O, contains_many_doc},
+    {"copy",                        (PyCFunction)bitset_Roaring_copy,
+     METH_NOARGS, copy_doc},
+    {"count",                       (PyCFunction)bitset_Roaring_count,
+     METH_VARARGS, count_doc},
+    {"discard",                     (PyCFunction)bitset_Roaring_discard,
+     METH_O, discard_doc},
+    {"discard_range",               (PyCFunction)bitset_Roaring_discard_range,
+     METH_VARARGS, discard_range_doc},
+    {"flip",                        (PyCFunction)bitset_Roaring_flip,
+     METH_VARARGS, flip_doc},
+    {"filter",                      (PyCFunction)bitset_Roaring_filter,
+     METH_O, filter_doc},
+    {"from_buffer",                 (PyCFunction)bitset_Roaring_from_buffer,
+     METH_O | METH_CLASS, from_buffer_doc},
+    {"frombytes",                   (PyCFunction)bitset_Roaring_frombytes,
+     METH_O | METH_CLASS, frombytes_doc},
+    {"difference",                  (PyCFunction)bitset_Roaring_difference_others,
+     BITSET_METH_OTHERS, difference_doc},
+    {"difference_count",            (PyCFunction)bitset_Roaring_difference_count,
+     METH_O, difference_count_doc},
+    {"difference_update",           (PyCFunction)bitset_Roaring_difference_update_others,
+     BITSET_METH_OTHERS, difference_update_doc},
+    {"intersection",                (PyCFunction)bitset_Roaring_intersection_others,
+     BITSET_METH_OTHERS, intersection_doc},
+    {"intersection_count",          (PyCFunction)bitset_Roaring_intersection_count,
+     METH_O, intersection_count_doc},
+    {"intersection_equals",         (PyCFunction)bitset_Roaring_intersection_equals,
+     METH_VARARGS, intersection_equals_doc},
+    {"intersection_update",         (PyCFunction)bitset_Roaring_intersection_update_others,
+     BITSET_METH_OTHERS, intersection_update_doc},
+    {"intersects",                  (PyCFunction)bitset_Roaring_intersects,
+     METH_O, intersects_doc},
+    {"into",                        (PyCFunction)bitset_Roaring_into,
+     METH_O, into_doc},
+    {"isdisjoint",                  (PyCFunction)bitset_Roaring_isdisjoint,
+     METH_O, isdisjoint_doc},
+    {"issubset",                    (PyCFunction)bitset_Roaring_issubset,
+     METH_O, issubset_doc},
+    {"issuperset",                  (PyCFunction)bitset_Roaring_issuperset,
+     METH_O, issuperset_doc},
+    {"jaccard",                     (PyCFunction)bitset_Roaring_jaccard,
+     METH_O, jaccard_doc},
+    {"nextset",                     (PyCFunction)bitset_Roaring_nextset,
+     METH_O, nextset_doc},
+    {"optimize",                    (PyCFunction)bitset_Roaring_optimize,
+     METH_NOARGS, optimize_doc},
+    {"pop",                         (PyCFunction)bitset_Roaring_pop,
+     METH_NOARGS, pop_doc},
+    {"prevset",                     (PyCFunction)bitset_Roaring_prevset,
+     METH_O, prevset_doc},
+    {"rank",                        (PyCFunction)bitset_Roaring_rank,
+     METH_O, rank_doc},
+    {"__reduce__",                  (PyCFunction)bitset_Roaring_reduce,
+     METH_NOARGS, reduce_doc},
+    {"remove",                      (PyCFunction)bitset_Roaring_remove,
+     METH_O, remove_doc},
+    {"select",                      (PyCFunction)bitset_Roaring_select,
+     METH_O, select_doc},
+    {"__setstate__",                (PyCFunction)bitset_Roaring_setstate,
+     METH_O, setstate_doc},
+    {"__sizeof__",                  (PyCFunction)bitset_Roaring_sizeof,
+     METH_NOARGS, sizeof_doc},
+    {"symmetric_difference",        (PyCFunction)bitset_Roaring_symmetric_difference,
+     METH_O, symmetric_difference_doc},
+    {"symmetric_difference_count",  (PyCFunction)bitset_Roaring_symmetric_difference_count,
+     METH_O, symmetric_difference_count_doc},
+    {"symmetric_difference_update", (PyCFunction)bitset_Roaring_symmetric_difference_update,
+     METH_O, symmetric_difference_update_doc},
+    {"to_array",                    (PyCFunction)bitset_Roaring_to_array,
+     METH_VARARGS, to_array_doc},
+    {"union",                       (PyCFunction)bitset_Roaring_union_others,
+     BITSET_METH_OTHERS, union_doc},
+    {"union_count",                 (PyCFunction)bitset_Roaring_union_count,
+     METH_O, union_count_doc},
+    {"update",                      (PyCFunction)bitset_Roaring_update_others,
+     BITSET_METH_OTHERS, update_doc},
+    {NULL,        NULL}                /* sentinel */
+};
+
+/***** RoaringBitset number methods *****/
+
+#define BITSET_ROARING_BINARY(name, op, stat)                           \
+static PyObject *                                                       \
+name(PyObject *r, PyObject *other)                                      \
+{                                                                       \
+    PyObject *result;                                                   \
+                                                                        \
+    if (!bitset_Roaring_Check(r) || !bitset_BitsetLike_Check(other)) {  \
+        Py_INCREF(Py_NotImplemented);                                   \
+        return Py_NotImplemented;                                       \
+    }                                                                   \
+    BITSET_STAT_CALL(stat, result,                                      \
+                     bitset_Roaring_op_with((bitset_RoaringObject *)r, other, op)); \
+    return result;                                                      \
+}
+
+#define BITSET_ROARING_INPLACE(name, op, stat)                          \
+static PyObject *                                                       \
+name(PyObject *r, PyObject *other)                                      \
+{                                                                       \
+    int error;                                                          \
+                                                                        \
+    if (!bitset_Roaring_Check(r) || !bitset_BitsetLike_Check(other)) {  \
+        Py_INCREF(Py_NotImplemented);                                   \
+        return Py_NotImplemented;                                       \
+    }                                                                   \
+    BITSET_STAT_CALL(stat, error,                                       \
+                     bitset_roaring_inplace((bitset_RoaringObject *)r, other, op)); \
+    if (error)                                                          \
+        return NULL;                                                    \
+    Py_INCREF(r);                                                       \
+    return r;                                                           \
+}
+
+BITSET_ROARING_BINARY(bitset_Roaring_sub, ROARING_ANDNOT, BITSET_STAT_SUB)
+BITSET_ROARING_BINARY(bitset_Roaring_and, ROARING_AND, BITSET_STAT_AND)
+BITSET_ROARING_BINARY(bitset_Roaring_xor, ROARING_XOR, BITSET_STAT_XOR)
+BITSET_ROARING_BINARY(bitset_Roaring_or, ROARING_OR, BITSET_STAT_OR)
+BITSET_ROARING_INPLACE(bitset_Roaring_isub, ROARING_ANDNOT, BITSET_STAT_ISUB)
+BITSET_ROARING_INPLACE(bitset_Roaring_iand, ROARING_AND, BITSET_STAT_IAND)
+BITSET_ROARING_INPLACE(bitset_Roaring_ixor, ROARING_XOR, BITSET_STAT_IXOR)
+BITSET_ROARING_INPLACE(bitset_Roaring_ior, ROARING_OR, BITSET_STAT_IOR)
+
+static PyNumberMethods bitset_roaring_as_number = {
+    0,                              /* nb_add */
+    bitset_Roaring_sub,             /* nb_subtract */
+    0,                              /* nb_multiply */
+#if PY_MAJOR_VERSION < 3
+    0,                              /* nb_divide */
+#endif
+    0,                              /* nb_remainder */
+    0,                              /* nb_divmod */
+    0,                              /* nb_power */
+    0,                              /* nb_negative */
+    0,                              /* nb_positive */
+    0,                              /* nb_absolute */
+    0,                              /* nb_nonzero */
+    0,                              /* nb_invert */
+    0,                              /* nb_lshift */
+    0,                              /* nb_rshift */
+    bitset_Roaring_and,             /* nb_and */
+    bitset_Roaring_xor,             /* nb_xor */
+    bitset_Roaring_or,              /* nb_or */
+#if PY_MAJOR_VERSION < 3
+    0,                              /* nb_coerce */
+#endif
+    0,                              /* nb_int */
+    0,                              /* nb_long */
+    0,                              /* nb_float */
+#if PY_MAJOR_VERSION < 3
+    0,                              /* nb_oct */
+    0,                              /* nb_hex */
+#endif
+    0,                              /* nb_inplace_add */
+    bitset_Roaring_isub,            /* nb_inplace_subtract */
+    0,                              /* nb_inplace_multiply */
+#if PY_MAJOR_VERSION < 3
+    0,                              /* nb_inplace_divide */
+#endif
+    0,                              /* nb_inplace_remainder */
+    0,                              /* nb_inplace_power */
+    0,                              /* nb_inplace_lshift */
+    0,                              /* nb_inplace_rshift */
+    bitset_Roaring_iand,            /* nb_inplace_and */
+    bitset_Roaring_ixor,            /* nb_inplace_xor */
+    bitset_Roaring_ior,             /* nb_inplace_or */
+};
+
+/* bitset_roaring_read for the constructor */
+static int
+bitset_roaring_init_from(bitset_RoaringObject *r, PyObject *arg)
+{
+    int error;
+
+    BITSET_STAT_CALL(BITSET_STAT_CONSTRUCT, error, bitset_roaring_read(r, arg));
+    return error;
+}
+
+static int
+Roaring_init(bitset_RoaringObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *arg = NULL;
+
+    if (bitset_check_no_keywords(Py_TYPE(self), kwds != NULL ? PyDict_Size(kwds) : 0) ||
+        !PyArg_ParseTuple(args, "|O:RoaringBitset", &arg))
+        return -1;
+
+    bitset_roaring_clear_chunks(self);
+    if (arg == NULL)
+        return 0;
+
+    if (bitset_roaring_init_from(self, arg)) {
+        bitset_roaring_clear_chunks(self);
+        return -1;
+    }
+
+    return 0;
+}
+
+#ifdef BITSET_VECTORCALL
+static PyObject *
+Roaring_vectorcall(PyObject *type, PyObject *const *args, size_t nargsf, PyObject *kwnames)
+{
+    PyObject *self;
+
+    if (bitset_vectorcall_check(type, nargsf, kwnames))
+        return NULL;
+
+    self = Roaring_new((PyTypeObject *)type, NULL, NULL);
+    if (self != NULL && PyVectorcall_NARGS(nargsf) == 1 &&
+        bitset_roaring_init_from((bitset_RoaringObject *)self, args[0]))
+        Py_CLEAR(self);
+    return self;
+}
+#endif
+
+static PyObject *
+bitset_Roaring_richcompare(bitset_RoaringObject *v, PyObject *w, int op)
+{
+    bitset_RoaringObject *wr;
+    int result;
+
+    if (!bitset_BitsetLike_Check(w)) {
+        if (op == Py_EQ)
+            Py_RETURN_FALSE;
+        if (op == Py_NE)
+            Py_RETURN_TRUE;
+        PyErr_SetString(PyExc_TypeError, "can only compare to a bitset");
+        return NULL;
+    }
+
+    wr = bitset_as_roaring(w);
+    if (wr == NULL)
+        return NULL;
+
+    switch (op) {
+    case Py_EQ:
+        result = bitset_roaring_equal(v, wr);
+        break;
+    case Py_NE:
+        result = !bitset_roaring_equal(v, wr);
+        break;
+    case Py_LT:
+        result = !bitset_roaring_equal(v, wr) && bitset_roaring_subset(v, wr);
+        break;
+    case Py_LE:
+        result = bitset_roaring_subset(v, wr);
+        break;
+    case Py_GT:
+        result = !bitset_roaring_equal(v, wr) && bitset_roaring_subset(wr, v);
+        break;
+    default:
+        result = bitset_roaring_subset(wr, v);
+    }
+
+    Py_DECREF(wr);
+    return PyBool_FromLong(result);
+}
+
+PyDoc_STRVAR(bitset_RoaringBitset_doc,
+"RoaringBitset(iterable) --> RoaringBitset object\n\
+\n\
+Build an unordered set of integers in the range [0,2**32), compressed\n\
+for sparse or clustered members.");
+
+PyTypeObject bitset_RoaringBitsetType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "bitset.RoaringBitset",                 /* tp_name */
+    sizeof(bitset_RoaringObject),           /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)Roaring_dealloc,            /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    BITSET_NOCMP,                           /* tp_compare */
+    (reprfunc)Bitset_repr,                  /* tp_repr */
+    &bitset_roaring_as_number,              /* tp_as_number */
+    &bitset_roaring_as_sequence,            /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    (hashfunc)PyObject_HashNotImplemented,  /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_CHECKTYPES, /* tp_flags */
+    bitset_RoaringBitset_doc,               /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    (richcmpfunc)bitset_Roaring_richcompare, /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    (getiterfunc)bitset_Roaring_iter,       /* tp_iter */
+    0,                                      /* tp_iternext */
+    bitset_Roaring_methods,                 /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    (initproc)Roaring_init,                 /* tp_init */
+    0,                                      /* tp_alloc */
+    Roaring_new,                            /* tp_new */
+};
+
+/***** Batch membership *****/
+
+/*
+ * contains_many() and filter() look up every item of a buffer of native
+ * integers, such as an array.array or numpy array, without making an
+ * object per item.  For the word based bitsets the lookup is branchless,
+ * so it runs at the speed of the loads, and large buffers are looked up
+ * without the GIL, split across the pool for contains_many().  Other
+ * iterables are first read into a buffer of Py_ssize_t.
+ */
+typedef struct bitset_lookup_args bitset_lookup_args;
+typedef Py_ssize_t (*bitset_lookup_func)(bitset_lookup_args *a, Py_ssize_t first,
+                                         Py_ssize_t end);
+
+struct bitset_lookup_args {
+    bitset_lookup_func lookup;
+    const bitset_word *words;
+    Py_ssize_t nwords;
+    bitset_RoaringObject *roaring;  /* or NULL for words */
+    const void *items;
+    unsigned char *flags;           /* one byte per item, or NULL */
+    void *out;                      /* the members, if flags is NULL */
+};
+
+/*
+ * Looks up items [first, end), setting their flags or copying the members
+ * to out, and returns the number of members.  Negative items become large
+ * words, so fall beyond the bitset.
+ */
+#define BITSET_LOOKUP(name, type)                                           \
+static Py_ssize_t                                                           \
+bitset_lookup_##name(bitset_lookup_args *a, Py_ssize_t first, Py_ssize_t end) \
+{                                                                           \
+    const type *items = (const type *)a->items;                             \
+    type *out = (type *)a->out;                                             \
+    bitset_word v, n = (bitset_word)a->nwords, in_range;                    \
+    Py_ssize_t i, count = 0;                                                \
+    int member;                                                             \
+                                                                            \
+    for (i = first; i < end; i++) {                                         \
+        if (a->roaring != NULL) {                                           \
+            member = bitset_roaring_has_member(a->roaring, (Py_ssize_t)items[i]); \
+        }                                                                   \
+        else {                                                              \
+            v = (bitset_word)items[i];                                      \
+            in_range = BITSET_WORD_INDEX(v) < n;                            \
+            member = (int)((a->words[in_range ? BITSET_WORD_INDEX(v) : 0] & \
+                            -in_range) >> (v % BITSET_WORD_BITS)) & 1;      \
+        }                                                                   \
+        if (a->flags != NULL)                                               \
+            a->flags[i] = (unsigned char)member;                            \
+        else {                                                              \
+            out[count] = items[i];                                          \
+            count += member;                                                \
+        }                                                                   \
+    }                                                                       \
+    return count;                                                           \
+}
+
+BITSET_LOOKUP(schar, signed char)
+BITSET_LOOKUP(uchar, unsigned char)
+BITSET_LOOKUP(short, short)
+BITSET_LOOKUP(ushort, unsigned short)
+BITSET_LOOKUP(int, int)
+BITSET_LOOKUP(uint, unsigned int)
+BITSET_LOOKUP(long, long)
+BITSET_LOOKUP(ulong, unsigned long)
+BITSET_LOOKUP(longlong, PY_LONG_LONG)
+BITSET_LOOKUP(ulonglong, unsigned PY_LONG_LONG)
+BITSET_LOOKUP(ssize_t, Py_ssize_t)
+BITSET_LOOKUP(size_t, size_t)
+
+/* The buffer formats looked up, in the order array.array typecodes are
+   chosen for a size */
+static const struct {
+    char code;
+    int is_signed;
+    Py_ssize_t size;
+    bitset_lookup_func lookup;
+} bitset_int_formats[] = {
+    {'b', 1, sizeof(signed char), bitset_lookup_schar},
+    {'B', 0, sizeof(unsigned char), bitset_lookup_uchar},
+    {'h', 1, sizeof(short), bitset_lookup_short},
+    {'H', 0, sizeof(unsigned short), bitset_lookup_ushort},
+    {'i', 1, sizeof(int), bitset_lookup_int},
+    {'I', 0, sizeof(unsigned int), bitset_lookup_uint},
+    {'l', 1, sizeof(long), bitset_lookup_long},
+    {'L', 0, sizeof(unsigned long), bitset_lookup_ulong},
+    {'q', 1, sizeof(PY_LONG_LONG), bitset_lookup_longlong},
+    {'Q', 0, sizeof(unsigned PY_LONG_LONG), bitset_lookup_ulonglong},
+    {'n', 1, sizeof(Py_ssize_t), bitset_lookup_ssize_t},
+    {'N', 0, sizeof(size_t), bitset_lookup_size_t},
+};
+
+#define BITSET_INT_FORMATS ((int)(sizeof(bitset_int_formats) / sizeof(bitset_int_formats[0])))
+
+/* Returns the entry of bitset_int_formats for a buffer, or -1 */
+static int
+bitset_int_format(const Py_buffer *view)
+{
+    const char *format = view->format != NULL ? view->format : "B";
+    int i;
+
+    if (*format == '@')
+        format++;
+    if (view->ndim > 1 || format[0] == '\0' || format[1] != '\0')
+        return -1;
+
+    for (i = 0; i < BITSET_INT_FORMATS; i++) {
+        if (bitset_int_formats[i].code == format[0])
+            return bitset_int_formats[i].size == view->itemsize ? i : -1;
+    }
+    return -1;
+}
+
+/* Returns the array.array typecode for items of a size and signedness */
+static char
+bitset_array_typecode(Py_ssize_t size, int is_signed)
+{
+    int i;
+
+    for (i = 0; i < BITSET_INT_FORMATS; i++) {
+#if PY_MAJOR_VERSION < 3
+        /* 2.x arrays have no long long typecodes */
+        if (bitset_int_formats[i].code == 'q' || bitset_int_formats[i].code == 'Q')
+            continue;
+#endif
+        if (bitset_int_formats[i].code != 'n' && bitset_int_formats[i].code != 'N' &&
+            bitset_int_formats[i].size == size && bitset_int_formats[i].is_signed == is_signed)
+            return bitset_int_formats[i].code;
+    }
+    return 0;
+}
+
+/* Returns the array.array typecode for items of an entry of
+   bitset_int_formats: its own where arrays have it */
+static char
+bitset_format_typecode(int format)
+{
+    char code = bitset_int_formats[format].code;
+
+#if PY_MAJOR_VERSION < 3
+    if (code != 'q' && code != 'Q' && code != 'n' && code != 'N')
+#else
+    if (code != 'n' && code != 'N')
+#endif
+        return code;
+    return bitset_array_typecode(bitset_int_formats[format].size,
+                                 bitset_int_formats[format].is_signed);
+}
+
+/* Returns a new array.array of the given typecode built from init, bytes
+   of native items or an iterable of integers */
+static PyObject *
+bitset_new_array(char typecode, PyObject *init)
+{
+    PyObject *module, *result;
+    char code[2];
+
+    code[0] = typecode;
+    code[1] = '\0';
+    module = PyImport_ImportModule("array");
+    if (module == NULL)
+        return NULL;
+    result = PyObject_CallMethod(module, "array", "sO", code, init);
+    Py_DECREF(module);
+    return result;
+}
+
+/* The items to look up: a buffer, or a copy of an iterable's */
+typedef struct {
+    Py_buffer view;
+    int has_view;
+    Py_ssize_t *copy;
+    const void *items;
+    Py_ssize_t n;
+    int format;                     /* the entry of bitset_int_formats */
+} bitset_lookup_items;
+
+static int
+bitset_get_lookup_items(PyObject *obj, bitset_lookup_items *li)
+{
+    PyObject *seq;
+    Py_ssize_t i;
+
+    li->has_view = 0;
+    li->copy = NULL;
+
+#if PY_MAJOR_VERSION < 3
+    if (!PyBytes_Check(obj) && !PyUnicode_Check(obj) && PyObject_CheckBuffer(obj)) {
+#else
+    if (PyObject_CheckBuffer(obj)) {
+#endif
+        if (PyObject_GetBuffer(obj, &li->view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT))
+            return -1;
+        li->has_view = 1;
+        li->format = bitset_int_format(&li->view);
+        if (li->format < 0) {
+            PyBuffer_Release(&li->view);
+            li->has_view = 0;
+            PyErr_SetString(PyExc_TypeError, "buffer items must be native integers");
+            return -1;
+        }
+        li->items = li->view.buf;
+        li->n = li->view.len / li->view.itemsize;
+        return 0;
+    }
+
+    seq = PySequence_Fast(obj, "argument must be a buffer or iterable of integers");
+    if (seq == NULL)
+        return -1;
+    li->n = PySequence_Fast_GET_SIZE(seq);
+    li->copy = PyMem_New(Py_ssize_t, li->n + 1);
+    if (li->copy == NULL) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < li->n; i++) {
+        li->copy[i] = PyNumber_AsSsize_t(PySequence_Fast_GET_ITEM(seq, i),
+                                         PyExc_OverflowError);
+        if (li->copy[i] == -1 && PyErr_Occurred()) {
+            Py_DECREF(seq);
+            PyMem_Free(li->copy);
+            return -1;
+        }
+    }
+    Py_DECREF(seq);
+
+    for (li->format = 0; bitset_int_formats[li->format].code != 'n'; li->format++)
+        ;
+    li->items = li->copy;
+    return 0;
+}
+
+static void
+bitset_release_lookup_items(bitset_lookup_items *li)
+{
+    if (li->has_view)
+        PyBuffer_Release(&li->view);
+    PyMem_Free(li->copy);
+}
+
+static Py_ssize_t
+bitset_lookup_range(void *arg, Py_ssize_t first, Py_ssize_t end)
+{
+    bitset_lookup_args *a = (bitset_lookup_args *)arg;
+
+    return a->lookup(a, first, end);
+}
+
+/* Sets up a lookup in a bitset of either kind */
+static void
+bitset_lookup_init(bitset_lookup_args *a, PyObject *bs, const bitset_lookup_items *li)
+{
+    if (bitset_Roaring_Check(bs)) {
+        a->roaring = (bitset_RoaringObject *)bs;
+        a->words = NULL;
+        a->nwords = 0;
+    }
+    else {
+        a->roaring = NULL;
+        a->words = ((bitset_BitsetObject *)bs)->words;
+        a->nwords = ((bitset_BitsetObject *)bs)->nwords;
+    }
+    a->lookup = bitset_int_formats[li->format].lookup;
+    a->items = li->items;
+    a->flags = NULL;
+    a->out = NULL;
+}
+
+static PyObject *
+bitset_contains_many(PyObject *bs, PyObject *obj)
+{
+    bitset_lookup_items li;
+    bitset_lookup_args a;
+    PyObject *result;
+
+    if (bitset_get_lookup_items(obj, &li))
+        return NULL;
+
+    result = PyByteArray_FromStringAndSize(NULL, li.n);
+    if (result != NULL && li.n > 0) {
+        bitset_lookup_init(&a, bs, &li);
+        a.flags = (unsigned char *)PyByteArray_AS_STRING(result);
+        if (a.roaring != NULL)
+            bitset_lookup_range(&a, 0, li.n);
+        else {
+            bitset_pin((bitset_BitsetObject *)bs);
+            bitset_run_ranges(bitset_lookup_range, &a, li.n);
+            bitset_unpin((bitset_BitsetObject *)bs);
+        }
+    }
+
+    bitset_release_lookup_items(&li);
+    return result;
+}
+
+static PyObject *
+bitset_filter(PyObject *bs, PyObject *obj)
+{
+    bitset_lookup_items li;
+    bitset_lookup_args a;
+    PyObject *bytes, *result;
+    Py_ssize_t size, count;
+    char typecode, *out;
+
+    if (bitset_get_lookup_items(obj, &li))
+        return NULL;
+
+    size = bitset_int_formats[li.format].size;
+    typecode = bitset_format_typecode(li.format);
+    if (typecode == 0) {
+        bitset_release_lookup_items(&li);
+        PyErr_SetString(PyExc_TypeError, "buffer items have no array typecode");
+        return NULL;
+    }
+
+    /* a bytes object's data isn't aligned for all the types */
+    out = (char *)PyMem_Malloc(li.n * size + 1);
+    if (out == NULL) {
+        bitset_release_lookup_items(&li);
+        return PyErr_NoMemory();
+    }
+
+    bitset_lookup_init(&a, bs, &li);
+    a.out = out;
+    if (a.roaring != NULL || li.n < BITSET_NOGIL_WORDS)
+        count = a.lookup(&a, 0, li.n);
+    else {
+        bitset_pin((bitset_BitsetObject *)bs);
+        Py_BEGIN_ALLOW_THREADS
+        count = a.lookup(&a, 0, li.n);
+        Py_END_ALLOW_THREADS
+        bitset_unpin((bitset_BitsetObject *)bs);
+    }
+    bitset_release_lookup_items(&li);
+
+    bytes = PyBytes_FromStringAndSize(out, count * size);
+    PyMem_Free(out);
+    if (bytes == NULL)
+        return NULL;
+    result = bitset_new_array(typecode, bytes);
+    Py_DECREF(bytes);
+    return result;
+}
+
+static PyObject *
+bitset_Bitset_contains_many(bitset_BitsetObject *bso, PyObject *obj)
+{
+    return bitset_contains_many((PyObject *)bso, obj);
+}
+
+static PyObject *
+bitset_Bitset_filter(bitset_BitsetObject *bso, PyObject *obj)
+{
+    return bitset_filter((PyObject *)bso, obj);
+}
+
+static PyObject *
+bitset_Roaring_contains_many(bitset_RoaringObject *r, PyObject *obj)
+{
+    return bitset_contains_many((PyObject *)r, obj);
+}
+
+static PyObject *
+bitset_Roaring_filter(bitset_RoaringObject *r, PyObject *obj)
+{
+    return bitset_filter((PyObject *)r, obj);
+}
+
+/***** Bulk extraction *****/
+
+/*
+ * to_array() and into() write the members in order to a buffer of native
+ * integers, decoding each word with a count trailing zeros loop and each
+ * RoaringBitset container directly, so no object is made per member.
+ */
+
+/* The index of the lowest bit set in bits, or 63 if there is none */
+static int
+bitset_lowest_or_last(bitset_word bits)
+{
+    bits |= BITSET_WORD_MASK(BITSET_WORD_BITS - 1);
+    return bitset_pop(&bits);
+}
+
+#define BITSET_DECODE(name, itemtype)                                       \
+static Py_ssize_t                                                           \
+bitset_decode_##name(const bitset_word *words, Py_ssize_t nwords, void *buf, \
+                     Py_ssize_t count)                                      \
+{                                                                           \
+    itemtype *out = (itemtype *)buf;                                        \
+    Py_ssize_t i = 0, k = 0, base;                                          \
+    bitset_word w;                                                          \
+    int j, n;                                                               \
+                                                                            \
+    /* while a word's members can't reach the end, write four without       \
+       branching, some of them past its members where later ones go */      \
+    for (; i < nwords && k <= count - BITSET_WORD_BITS; i++) {              \
+        w = words[i];                                                       \
+        n = bitset_popcount(w);                                             \
+        base = i * BITSET_WORD_BITS;                                        \
+        for (j = 0; j < 4; j++) {                                           \
+            out[k + j] = (itemtype)(base + bitset_lowest_or_last(w));       \
+            w &= w - 1;                                                     \
+        }                                                                   \
+        for (; j < n; j++) {                                                \
+            out[k + j] = (itemtype)(base + bitset_lowest_or_last(w));       \
+            w &= w - 1;                                                     \
+        }                                                                   \
+        k += n;                                                             \
+    }                                                                       \
+                                                                            \
+    for (; i < nwords; i++) {                                               \
+        for (w = words[i]; w != 0; k++)                                     \
+            out[k] = (itemtype)(i * BITSET_WORD_BITS + bitset_pop(&w));     \
+    }                                                                       \
+    return k;                                                               \
+}                                                                           \
+static Py_ssize_t                                                           \
+bitset_decode_roaring_##name(bitset_RoaringObject *r, void *buf)            \
+{                                                                           \
+    itemtype *out = (itemtype *)buf;                                        \
+    const bitset_container *c;                                              \
+    Py_ssize_t i, base, k = 0;                                              \
+    bitset_word w;                                                          \
+    int j, v;                                                               \
+                                                                            \
+    for (i = 0; i < r->nchunks; i++) {                                      \
+        c = &r->chunks[i];                                                  \
+        base = (Py_ssize_t)c->key << 16;                                    \
+        switch (c->type) {                                                  \
+        case ROARING_ARRAY:                                                 \
+            for (j = 0; j < c->size; j++)                                   \
+                out[k++] = (itemtype)(base + c->data.array[j]);             \
+            break;                                                          \
+        case ROARING_BITMAP:                                                \
+            for (j = 0; j < ROARING_CHUNK_WORDS; j++) {                     \
+                for (w = c->data.bitmap[j]; w != 0; k++)                    \
+                    out[k] = (itemtype)(base + j * BITSET_WORD_BITS + bitset_pop(&w)); \
+            }                                                               \
+            break;                                                          \
+        default:                                                            \
+            for (j = 0; j < c->size; j++) {                                 \
+                for (v = c->data.runs[j].start;                             \
+                     v <= c->data.runs[j].start + c->data.runs[j].length; v++) \
+                    out[k++] = (itemtype)(base + v);                        \
+            }                                                               \
+        }                                                                   \
+    }                                                                       \
+    return k;                                                               \
+}
+
+BITSET_DECODE(schar, signed char)
+BITSET_DECODE(uchar, unsigned char)
+BITSET_DECODE(short, short)
+BITSET_DECODE(ushort, unsigned short)
+BITSET_DECODE(int, int)
+BITSET_DECODE(uint, unsigned int)
+BITSET_DECODE(long, long)
+BITSET_DECODE(ulong, unsigned long)
+BITSET_DECODE(longlong, PY_LONG_LONG)
+BITSET_DECODE(ulonglong, unsigned PY_LONG_LONG)
+BITSET_DECODE(ssize_t, Py_ssize_t)
+BITSET_DECODE(size_t, size_t)
+
+/* Writes the count members of bs to buf as items of the given format */
+static Py_ssize_t
+bitset_decode(PyObject *bs, int format, void *buf, Py_ssize_t count)
+{
+    bitset_RoaringObject *r = NULL;
+    const bitset_word *words = NULL;
+    Py_ssize_t nwords = 0;
+
+    if (bitset_Roaring_Check(bs))
+        r = (bitset_RoaringObject *)bs;
+    else {
+        words = ((bitset_BitsetObject *)bs)->words;
+        nwords = bitset_used_words((bitset_BitsetObject *)bs);
+    }
+
+#define BITSET_DECODE_CASE(code, name)                                      \
+    case code:                                                              \
+        return r != NULL ? bitset_decode_roaring_##name(r, buf)             \
+                         : bitset_decode_##name(words, nwords, buf, count);
+
+    switch (bitset_int_formats[format].code) {
+    BITSET_DECODE_CASE('b', schar)
+    BITSET_DECODE_CASE('B', uchar)
+    BITSET_DECODE_CASE('h', short)
+    BITSET_DECODE_CASE('H', ushort)
+    BITSET_DECODE_CASE('i', int)
+    BITSET_DECODE_CASE('I', uint)
+    BITSET_DECODE_CASE('l', long)
+    BITSET_DECODE_CASE('L', ulong)
+    BITSET_DECODE_CASE('q', longlong)
+    BITSET_DECODE_CASE('Q', ulonglong)
+    BITSET_DECODE_CASE('n', ssize_t)
+    BITSET_DECODE_CASE('N', size_t)
+    default:
+        return 0;
+    }
+#undef BITSET_DECODE_CASE
+}
+
+/*
+ * Writes the members of bs to the n items at buf, returning their number,
+ * or -1 with an error set if they don't fit.
+ */
+static Py_ssize_t
+bitset_extract(PyObject *bs, void *buf, Py_ssize_t n, int format)
+{
+    bitset_BitsetObject *bso = (bitset_BitsetObject *)bs;
+    bitset_RoaringObject *r = (bitset_RoaringObject *)bs;
+    Py_ssize_t count, used = 0, bits;
+    bitset_word max = 0;
+
+    if (bitset_Roaring_Check(bs)) {
+        count = bitset_roaring_len(r);
+        if (r->nchunks > 0)
+            max = ((bitset_word)r->chunks[r->nchunks - 1].key << 16) +
+                bitset_container_max(&r->chunks[r->nchunks - 1]);
+    }
+    else {
+        count = bitset_Bitset_len(bs);
+        used = bitset_used_words(bso);
+        if (used > 0)
+            max = (used - 1) * BITSET_WORD_BITS + bitset_highest(bso->words[used - 1]);
+    }
+
+    if (count > n) {
+        PyErr_Format(PyExc_ValueError, "buffer has room for %zd members, not %zd", n, count);
+        return -1;
+    }
+    bits = bitset_int_formats[format].size * 8 - bitset_int_formats[format].is_signed;
+    if (bits < BITSET_WORD_BITS && (max >> bits) != 0) {
+        PyErr_SetString(PyExc_OverflowError, "bitset members don't fit in the items");
+        return -1;
+    }
+
+    if (used < BITSET_NOGIL_WORDS)
+        return bitset_decode(bs, format, buf, count);
+
+    bitset_pin(bso);
+    Py_BEGIN_ALLOW_THREADS
+    count = bitset_decode(bs, format, buf, count);
+    Py_END_ALLOW_THREADS
+    bitset_unpin(bso);
+    return count;
+}
+
+static PyObject *
+bitset_into(PyObject *bs, PyObject *obj)
+{
+    Py_buffer view;
+    Py_ssize_t count = -1;
+    int format;
+
+    if (PyObject_GetBuffer(obj, &view, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS | PyBUF_FORMAT))
+        return NULL;
+
+    format = bitset_int_format(&view);
+    if (format < 0)
+        PyErr_SetString(PyExc_TypeError, "buffer items must be native integers");
+    else
+        count = bitset_extract(bs, view.buf, view.len / view.itemsize, format);
+    PyBuffer_Release(&view);
+
+    return count < 0 ? NULL : PyInt_FromSsize_t(count);
+}
+
+static PyObject *
+bitset_to_array(PyObject *bs, PyObject *args)
+{
+    PyObject *init, *one, *result;
+    const char *typecode = NULL;
+    Py_ssize_t count, n;
+    char code[2];
+    void *buf;
+    int format;
+#if PY_MAJOR_VERSION >= 3
+    Py_buffer view;
+#endif
+
+    if (!PyArg_ParseTuple(args, "|s:to_array", &typecode))
+        return NULL;
+    code[0] = typecode != NULL ? typecode[0] :
+        bitset_array_typecode(sizeof(Py_ssize_t), 1);
+    code[1] = '\0';
+
+    for (format = 0; format < BITSET_INT_FORMATS; format++) {
+        if (bitset_int_formats[format].code == code[0] && code[0] != 'n' && code[0] != 'N')
+            break;
+    }
+    if (format == BITSET_INT_FORMATS || (typecode != NULL && typecode[1] != '\0')) {
+        PyErr_SetString(PyExc_ValueError,
+                        "to_array() typecode must be an integer typecode, such as 'l'");
+        return NULL;
+    }
+
+    /* an array of count zeros, written in place */
+    count = bitset_Roaring_Check(bs) ? bitset_roaring_len((bitset_RoaringObject *)bs)
+                                     : bitset_Bitset_len(bs);
+    init = Py_BuildValue("[i]", 0);
+    if (init == NULL)
+        return NULL;
+    one = bitset_new_array(code[0], init);
+    Py_DECREF(init);
+    if (one == NULL)
+        return NULL;
+    result = PySequence_Repeat(one, count);
+    Py_DECREF(one);
+    if (result == NULL)
+        return NULL;
+
+#if PY_MAJOR_VERSION >= 3
+    if (PyObject_GetBuffer(result, &view, PyBUF_WRITABLE)) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    buf = view.buf;
+    n = view.len / bitset_int_formats[format].size;
+    count = bitset_extract(bs, buf, n, format);
+    PyBuffer_Release(&view);
+#else
+    if (PyObject_AsWriteBuffer(result, &buf, &n)) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    n /= bitset_int_formats[format].size;
+    count = bitset_extract(bs, buf, n, format);
+#endif
+
+    if (count < 0)
+        Py_CLEAR(result);
+    return result;
+}
+
+static PyObject *
+bitset_Bitset_into(bitset_BitsetObject *bso, PyObject *obj)
+{
+    return bitset_into((PyObject *)bso, obj);
+}
+
+static PyObject *
+bitset_Bitset_to_array(bitset_BitsetObject *bso, PyObject *args)
+{
+    return bitset_to_array((PyObject *)bso, args);
+}
+
+static PyObject *
+bitset_Roaring_into(bitset_RoaringObject *r, PyObject *obj)
+{
+    return bitset_into((PyObject *)r, obj);
+}
+
+static PyObject *
+bitset_Roaring_to_array(bitset_RoaringObject *r, PyObject *args)
+{
+    return bitset_to_array((PyObject *)r, args);
+}
+
+/***** Serialization *****/
+
+/*
+ * A serialized bitset is a 24 byte header and a payload, little-endian:
+ *
+ *    0  magic, "BSET"
+ *    4  format version, 1
+ *    5  type: 0 Bitset, 1 BigBitset, 2 FrozenBitset, 3 RoaringBitset
+ *    6  payload encoding: 0 raw words, 1 run-length words, 2 roaring chunks
+ *    7  zero
+ *    8  payload length in bytes, 8 bytes
+ *   16  CRC-32 of the payload, as zlib.crc32() computes it, 4 bytes
+ *   20  zero, 4 bytes
+ *
+ * Raw words are 8 bytes each, member v being bit (v % 64) of word
+ * (v / 64), with trailing empty words dropped.  Run-length words are
+ * groups of a marker word and the literal words that follow it: bit 0 of
+ * the marker is a fill bit, bits 1-32 the number of words that are all the
+ * fill bit and bits 33-63 the number of literal words.  Roaring chunks are
+ * the state described with RoaringBitset.  Bitsets, BigBitsets and
+ * FrozenBitsets use whichever of the first two encodings is smaller.
+ *
+ * dumps() and loads() handle one bitset; BitsetWriter and BitsetReader a
+ * stream of them, one after another in a file.
+ */
+#define BITSET_FORMAT_VERSION 1
+#define BITSET_FORMAT_HEADER 24
+
+#define BITSET_FORMAT_BITSET 0
+#define BITSET_FORMAT_BIGBITSET 1
+#define BITSET_FORMAT_FROZENBITSET 2
+#define BITSET_FORMAT_ROARING 3
+
+#define BITSET_ENCODING_RAW 0
+#define BITSET_ENCODING_RLE 1
+#define BITSET_ENCODING_ROARING 2
+
+#define BITSET_RLE_MAX_FILL ((Py_ssize_t)0xFFFFFFFF)
+#define BITSET_RLE_MAX_LITERALS ((Py_ssize_t)0x7FFFFFFF)
+
+/* The stream classes read and write files in blocks of this many bytes */
+#define BITSET_STREAM_BLOCK 65536
+
+static PyObject *bitset_loads_func;
+
+typedef struct {
+    int type;
+    int encoding;
+    Py_ssize_t nwords;          /* words in a raw or run-length payload */
+    Py_ssize_t payload;         /* bytes */
+} bitset_format;
+
+/* Slicing-by-8 tables for the CRC-32 of zlib, filled in on import */
+static PY_UINT32_T bitset_crc_table[8][256];
+
+static void
+bitset_init_crc32(void)
+{
+    PY_UINT32_T c;
+    int i, k;
+
+    for (i = 0; i < 256; i++) {
+        for (c = i, k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ 0xEDB88320U : c >> 1;
+        bitset_crc_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++)
+        for (k = 1; k < 8; k++)
+            bitset_crc_table[k][i] = (bitset_crc_table[k - 1][i] >> 8) ^
+                bitset_crc_table[0][bitset_crc_table[k - 1][i] & 0xFF];
+}
+
+static PY_UINT32_T
+bitset_crc32_bytes(const unsigned char *p, Py_ssize_t n)
+{
+    PY_UINT32_T crc = 0xFFFFFFFFU, lo, hi;
+
+    for (; n >= 8; n -= 8, p += 8) {
+        lo = (PY_UINT32_T)bitset_get_le(p, 4) ^ crc;
+        hi = (PY_UINT32_T)bitset_get_le(p + 4, 4);
+        crc = bitset_crc_table[7][lo & 0xFF] ^ bitset_crc_table[6][(lo >> 8) & 0xFF] ^
+            bitset_crc_table[5][(lo >> 16) & 0xFF] ^ bitset_crc_table[4][lo >> 24] ^
+            bitset_crc_table[3][hi & 0xFF] ^ bitset_crc_table[2][(hi >> 8) & 0xFF] ^
+            bitset_crc_table[1][(hi >> 16) & 0xFF] ^ bitset_crc_table[0][hi >> 24];
+    }
+    while (n-- > 0)
+        crc = (crc >> 8) ^ bitset_crc_table[0][(crc ^ *p++) & 0xFF];
+
+    return crc ^ 0xFFFFFFFFU;
+}
+
+/* As bitset_crc32_bytes, releasing the GIL for large payloads */
+static PY_UINT32_T
+bitset_crc32(const unsigned char *p, Py_ssize_t n)
+{
+    PY_UINT32_T crc;
+
+    if (n < BITSET_NOGIL_WORDS * (Py_ssize_t)sizeof(bitset_word))
+        return bitset_crc32_bytes(p, n);
+
+    Py_BEGIN_ALLOW_THREADS
+    crc = bitset_crc32_bytes(p, n);
+    Py_END_ALLOW_THREADS
+    return crc;
+}
+
+/*
+ * Run-length encodes n words to out, returning the bytes used.  With out
+ * NULL it only returns the bytes the encoding would take.
+ */
+static Py_ssize_t
+bitset_rle_encode(const bitset_word *words, Py_ssize_t n, unsigned char *out)
+{
+    Py_ssize_t i = 0, size = 0, fill, start;
+    bitset_word bit, pattern;
+
+    while (i < n) {
+        bit = words[i] == ~(bitset_word)0;
+        pattern = bit ? ~(bitset_word)0 : 0;
+        for (fill = 0; i < n && fill < BITSET_RLE_MAX_FILL && words[i] == pattern; fill++)
+            i++;
+
+        for (start = i; i < n && i - start < BITSET_RLE_MAX_LITERALS; i++)
+            if (words[i] == 0 || words[i] == ~(bitset_word)0)
+                break;
+
+        if (out != NULL) {
+            bitset_put_le(out + size, bit | (bitset_word)fill << 1 |
+                          (bitset_word)(i - start) << 33, 8);
+            bitset_words_to_bytes(words + start, out + size + 8,
+                                  (i - start) * sizeof(bitset_word));
+        }
+        size += (1 + i - start) * sizeof(bitset_word);
+    }
+
+    return size;
+}
+
+/*
+ * Decodes len bytes of run-length words into bso, which must be empty.
+ * Returns 0, or -1 with an error set, or -1 without one if they're invalid.
+ * A fill is bounded only by BIGBITSET_MAX, so a few bytes can decode to a
+ * bitset of gigabytes: unlike the length in the header, that isn't limited
+ * by the data read.
+ */
+static int
+bitset_rle_decode(bitset_BitsetObject *bso, const unsigned char *p, Py_ssize_t len)
+{
+    Py_ssize_t pos, nwords = 0, fill, literals;
+    bitset_word marker;
+
+    for (pos = 0; pos < len; pos += (1 + literals) * sizeof(bitset_word)) {
+        if (len - pos < (Py_ssize_t)sizeof(bitset_word))
+            return -1;
+        marker = bitset_get_le(p + pos, 8);
+        fill = (Py_ssize_t)((marker >> 1) & 0xFFFFFFFF);
+        literals = (Py_ssize_t)(marker >> 33);
+        if (literals > (len - pos) / (Py_ssize_t)sizeof(bitset_word) - 1 ||
+            nwords > BIGBITSET_MAX / BITSET_WORD_BITS - fill - literals)
+            return -1;
+        nwords += fill + literals;
+    }
+
+    if (bitset_grow(bso, nwords))
+        return -1;
+
+    for (pos = 0, nwords = 0; pos < len; pos += (1 + literals) * sizeof(bitset_word)) {
+        marker = bitset_get_le(p + pos, 8);
+        fill = (Py_ssize_t)((marker >> 1) & 0xFFFFFFFF);
+        literals = (Py_ssize_t)(marker >> 33);
+        if (marker & 1)
+            memset(bso->words + nwords, 0xFF, fill * sizeof(bitset_word));
+        nwords += fill;
+        bitset_words_from_bytes(bso->words + nwords, p + pos + sizeof(bitset_word),
+                                literals * sizeof(bitset_word));
+        nwords += literals;
+    }
+
+    bitset_changed(bso);
+    return 0;
+}
+
+/* Chooses how to serialize obj, which must be a bitset */
+static int
+bitset_format_plan(PyObject *obj, bitset_format *f)
+{
+    bitset_BitsetObject *bso = (bitset_BitsetObject *)obj;
+    Py_ssize_t rle;
+
+    if (bitset_Roaring_Check(obj)) {
+        f->type = BITSET_FORMAT_ROARING;
+        f->encoding = BITSET_ENCODING_ROARING;
+        f->nwords = 0;
+        f->payload = bitset_roaring_state_size((bitset_RoaringObject *)obj);
+        return 0;
+    }
+
+    if (!bitset_AnyBitset_Check(obj)) {
+        PyErr_Format(PyExc_TypeError, "can only serialize bitsets, not %.100s",
+                     Py_TYPE(obj)->tp_name);
+        return -1;
+    }
+
+    f->type = bitset_Bitset_Check(obj) ? BITSET_FORMAT_BITSET :
+        bitset_FrozenBitset_Check(obj) ? BITSET_FORMAT_FROZENBITSET : BITSET_FORMAT_BIGBITSET;
+    f->nwords = bitset_used_words(bso);
+    f->payload = f->nwords * sizeof(bitset_word);
+    f->encoding = BITSET_ENCODING_RAW;
+
+    rle = bitset_rle_encode(bso->words, f->nwords, NULL);
+    if (rle < f->payload) {
+        f->encoding = BITSET_ENCODING_RLE;
+        f->payload = rle;
+    }
+    return 0;
+}
+
+/* Writes obj serialized as planned to out, which must have room for it */
+static void
+bitset_format_write(PyObject *obj, const bitset_format *f, unsigned char *out)
+{
+    unsigned char *payload = out + BITSET_FORMAT_HEADER;
+    bitset_BitsetObject *bso = (bitset_BitsetObject *)obj;
+
+    if (f->encoding == BITSET_ENCODING_ROARING)
+        bitset_roaring_write_state((bitset_RoaringObject *)obj, payload);
+    else if (f->encoding == BITSET_ENCODING_RLE)
+        bitset_rle_encode(bso->words, f->nwords, payload);
+    else
+        bitset_export_bytes(bso, payload, f->payload);
+
+    memcpy(out, "BSET", 4);
+    out[4] = BITSET_FORMAT_VERSION;
+    out[5] = (unsigned char)f->type;
+    out[6] = (unsigned char)f->encoding;
+    out[7] = 0;
+    bitset_put_le(out + 8, (bitset_word)f->payload, 8);
+    bitset_put_le(out + 16, bitset_crc32(payload, f->payload), 4);
+    bitset_put_le(out + 20, 0, 4);
+}
+
+/*
+ * Returns the payload length of the serialized bitset at p, checking its
+ * header, or -1 with ValueError set.
+ */
+static Py_ssize_t
+bitset_format_payload(const unsigned char *p)
+{
+    bitset_word payload = bitset_get_le(p + 8, 8);
+
+    if (memcmp(p, "BSET", 4) != 0) {
+        PyErr_SetString(PyExc_ValueError, "not a serialized bitset");
+        return -1;
+    }
+    if (p[4] != BITSET_FORMAT_VERSION) {
+        PyErr_Format(PyExc_ValueError, "unsupported bitset format version %d", p[4]);
+        return -1;
+    }
+    if (p[5] > BITSET_FORMAT_ROARING || payload > (bitset_word)PY_SSIZE_T_MAX - BITSET_FORMAT_HEADER ||
+        (p[5] == BITSET_FORMAT_ROARING) != (p[6] == BITSET_ENCODING_ROARING) ||
+        p[6] > BITSET_ENCODING_ROARING) {
+        PyErr_SetString(PyExc_ValueError, "invalid serialized bitset header");
+        return -1;
+    }
+    return (Py_ssize_t)payload;
+}
+
+/* Returns a new bitset from the serialized bitset at p, whose header and
+   payload length have been checked */
+static PyObject *
+bitset_format_read(const unsigned char *p)
+{
+    static PyTypeObject *types[] = {
+        &bitset_BitsetType, &bitset_BigBitsetType, &bitset_FrozenBitsetType
+    };
+    Py_ssize_t n = (Py_ssize_t)bitset_get_le(p + 8, 8);
+    const unsigned char *payload = p + BITSET_FORMAT_HEADER;
+    bitset_BitsetObject *bso;
+    PyObject *result;
+    int error;
+
+    if (bitset_crc32(payload, n) != (PY_UINT32_T)bitset_get_le(p + 16, 4)) {
+        PyErr_SetString(PyExc_ValueError, "serialized bitset checksum mismatch");
+        return NULL;
+    }
+
+    if (p[5] == BITSET_FORMAT_ROARING) {
+        result = Roaring_new(&bitset_RoaringBitsetType, NULL, NULL);
+        if (result == NULL)
+            return NULL;
+        error = bitset_roaring_read_state((bitset_RoaringObject *)result, payload, n);
+    }
+    else {
+        result = Bitset_new(types[p[5]], NULL, NULL);
+        if (result == NULL)
+            return NULL;
+        bso = (bitset_BitsetObject *)result;
+
+        if (p[6] == BITSET_ENCODING_RLE) {
+            error = bitset_rle_decode(bso, payload, n);
+        }
+        else {
+            error = n % sizeof(bitset_word) != 0 ? -1 :
+                bitset_grow(bso, n / sizeof(bitset_word));
+            if (!error)
+                bitset_import_bytes(bso, payload, n);
+        }
+        if (!error && bitset_check_fits(bso, bso))
+            error = -1;
+    }
+
+    if (error) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, "invalid serialized bitset payload");
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject *
+bitset_dumps(PyObject *module, PyObject *obj)
+{
+    bitset_format f;
+    PyObject *result;
+
+    if (bitset_format_plan(obj, &f))
+        return NULL;
+
+    result = PyBytes_FromStringAndSize(NULL, BITSET_FORMAT_HEADER + f.payload);
+    if (result != NULL)
+        bitset_format_write(obj, &f, (unsigned char *)PyBytes_AS_STRING(result));
+    return result;
+}
+
+static PyObject *
+bitset_loads(PyObject *module, PyObject *obj)
+{
+    PyObject *result = NULL;
+    Py_buffer view;
+    Py_ssize_t n;
+
+    if (bitset_get_buffer(obj, &view, PyBUF_SIMPLE))
+        return NULL;
+
+    if (view.len < BITSET_FORMAT_HEADER) {
+        PyErr_SetString(PyExc_ValueError, "serialized bitset is truncated");
+    }
+    else if ((n = bitset_format_payload(view.buf)) >= 0) {
+        if (view.len - BITSET_FORMAT_HEADER != n)
+            PyErr_SetString(PyExc_ValueError, view.len - BITSET_FORMAT_HEADER < n ?
+                            "serialized bitset is truncated" :
+                            "extra data after serialized bitset");
+        else
+            result = bitset_format_read(view.buf);
+    }
+
+    PyBuffer_Release(&view);
+    return result;
+}
+
+static PyObject *
+bitset_reduce_serialized(PyObject *obj)
+{
+    PyObject *data = bitset_dumps(NULL, obj);
+
+    if (data == NULL)
+        return NULL;
+    return Py_BuildValue("O(N)", bitset_loads_func, data);
+}
+
+/* BitsetWriter */
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *write;            /* the file's write method */
+    unsigned char *buffer;      /* BITSET_STREAM_BLOCK bytes */
+    Py_ssize_t size;            /* bytes in buffer */
+} bitset_WriterObject;
+
+static int
+bitset_writer_put(bitset_WriterObject *w, const unsigned char *data, Py_ssize_t n)
+{
+    PyObject *bytes, *result;
+
+    bytes = PyBytes_FromStringAndSize((const char *)data, n);
+    if (bytes == NULL)
+        return -1;
+
+    result = PyObject_CallFunctionObjArgs(w->write, bytes, NULL);
+    Py_DECREF(bytes);
+    if (result == NULL)
+        return -1;
+
+    Py_DECREF(result);
+    return 0;
+}
+
+static int
+bitset_writer_flush(bitset_WriterObject *w)
+{
+    Py_ssize_t n = w->size;
+
+    if (n == 0)
+        return 0;
+
+    w->size = 0;
+    return bitset_writer_put(w, w->buffer, n);
+}
+
+static PyObject *
+Writer_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    bitset_WriterObject *w;
+    PyObject *file;
+
+    if (!PyArg_ParseTuple(args, "O:BitsetWriter", &file))
+        return NULL;
+
+    w = (bitset_WriterObject *)type->tp_alloc(type, 0);
+    if (w == NULL)
+        return NULL;
+
+    w->write = PyObject_GetAttrString(file, "write");
+    w->buffer = (unsigned char *)PyMem_Malloc(BITSET_STREAM_BLOCK);
+    w->size = 0;
+    if (w->write == NULL || w->buffer == NULL) {
+        if (w->buffer == NULL && !PyErr_Occurred())
+            PyErr_NoMemory();
+        Py_DECREF(w);
+        return NULL;
+    }
+
+    return (PyObject *)w;
+}
+
+static void
+Writer_dealloc(bitset_WriterObject *w)
+{
+    PyObject *type, *value, *traceback;
+
+    if (w->size > 0 && w->write != NULL) {
+        PyErr_Fetch(&type, &value, &traceback);
+        if (bitset_writer_flush(w))
+            PyErr_WriteUnraisable((PyObject *)w);
+        PyErr_Restore(type, value, traceback);
+    }
+
+    Py_XDECREF(w->write);
+    PyMem_Free(w->buffer);
+    Py_TYPE(w)->tp_free((PyObject *)w);
+}
+
+static PyObject *
+bitset_Writer_write(bitset_WriterObject *w, PyObject *obj)
+{
+    bitset_format f;
+    PyObject *data;
+    Py_ssize_t n;
+    int error;
+
+    /* flushing calls the file's write(), which may change obj, so plan
+       again after it */
+    for (;;) {
+        if (bitset_format_plan(obj, &f))
+            return NULL;
+        n = BITSET_FORMAT_HEADER + f.payload;
+        if (n <= BITSET_STREAM_BLOCK - w->size || w->size == 0)
+            break;
+        if (bitset_writer_flush(w))
+            return NULL;
+    }
+
+    if (n <= BITSET_STREAM_BLOCK) {
+        bitset_format_write(obj, &f, w->buffer + w->size);
+        w->size += n;
+    }
+    else {
+        data = bitset_dumps(NULL, obj);
+        if (data == NULL)
+            return NULL;
+        error = bitset_writer_put(w, (unsigned char *)PyBytes_AS_STRING(data), n);
+        Py_DECREF(data);
+        if (error)
+            return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(writer_write_doc,
+"write(bitset)\n\
+\n\
+Serialize a bitset to the file, as dumps() does.");
+
+static PyObject *
+bitset_Writer_flush(bitset_WriterObject *w)
+{
+    if (bitset_writer_flush(w))
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(writer_flush_doc,
+"flush()\n\
+\n\
+Write any buffered bitsets to the file.  This doesn't flush the file.");
+
+static PyObject *
+bitset_Writer_enter(bitset_WriterObject *w)
+{
+    Py_INCREF(w);
+    return (PyObject *)w;
+}
+
+static PyObject *
+bitset_Writer_exit(bitset_WriterObject *w, PyObject *args)
+{
+    return bitset_Writer_flush(w);
+}
+
+static PyMethodDef bitset_Writer_methods[] = {
+    {"write",           (PyCFunction)bitset_Writer_write,
+     METH_O, writer_write_doc},
+    {"flush",           (PyCFunction)bitset_Writer_flush,
+     METH_NOARGS, writer_flush_doc},
+    {"__enter__",       (PyCFunction)bitset_Writer_enter,
+     METH_NOARGS, NULL},
+    {"__exit__",        (PyCFunction)bitset_Writer_exit,
+     METH_VARARGS, NULL},
+    {NULL,        NULL}                /* sentinel */
+};
+
+PyDoc_STRVAR(bitset_BitsetWriter_doc,
+"BitsetWriter(file)\n\
+\n\
+Serializes bitsets one after another to a binary file, as dumps() does,\n\
+buffering the writes.  Call flush() or use it as a context manager to\n\
+write the last of them; it is also flushed when it is deleted.");
+
+static PyTypeObject bitset_BitsetWriterType = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "bitset.BitsetWriter",                  /* tp_name */
+    sizeof(bitset_WriterObject),            /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)Writer_dealloc,             /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    0,                                      /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    bitset_BitsetWriter_doc,                /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    bitset_Writer_methods,                  /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    0,                                      /* tp_init */
+    0,                                      /* tp_alloc */
+    Writer_new,                             /* tp_new */
+};
+
+/* BitsetReader */
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *read;             /* the file's read method */
+    unsigned char *buffer;
+    Py_ssize_t allocated;
+    Py_ssize_t start;           /* the unread bytes are start .. end */
+    Py_ssize_t end;
+} bitset_ReaderObject;
+
+/*
+ * Reads from the file until n bytes are buffered, returning 1, or 0 if the
+ * file ends first, or -1 on error.  The buffer grows as the data arrives,
+ * so a corrupt length doesn't allocate more than the file holds, though a
+ * run-length payload can still decode to far more (see bitset_rle_decode).
+ */
+static int
+bitset_reader_fill(bitset_ReaderObject *r, Py_ssize_t n)
+{
+    PyObject *data;
+    Py_buffer view;
+    unsigned char *buffer;
+    Py_ssize_t allocated;
+
+    if (r->end - r->start >= n)
+        return 1;
+
+    memmove(r->buffer, r->buffer + r->start, r->end - r->start);
+    r->end -= r->start;
+    r->start = 0;
+
+    while (r->end < n) {
+        allocated = r->allocated;
+        if (r->end == allocated)
+            allocated = Py_MIN(n, allocated < PY_SSIZE_T_MAX / 2 ? allocated * 2 : PY_SSIZE_T_MAX);
+
+        /* read ahead to fill the buffer */
+        data = PyObject_CallFunction(r->read, "n", allocated - r->end);
+        if (data == NULL)
+            return -1;
+        if (bitset_get_buffer(data, &view, PyBUF_SIMPLE)) {
+            Py_DECREF(data);
+            return -1;
+        }
+
+        allocated = Py_MAX(allocated, r->end + view.len);
+        if (allocated > r->allocated) {
+            buffer = (unsigned char *)PyMem_Realloc(r->buffer, allocated);
+            if (buffer == NULL) {
+                PyBuffer_Release(&view);
+                Py_DECREF(data);
+                PyErr_NoMemory();
+                return -1;
+            }
+            r->buffer = buffer;
+            r->allocated = allocated;
+        }
+        memcpy(r->buffer + r->end, view.buf, view.len);
+        r->end += view.len;
+
+        PyBuffer_Release(&view);
+        Py_DECREF(data);
+        if (view.len == 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+static PyObject *
+Reader_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    bitset_ReaderObject *r;
+    PyObject *file;
+
+    if (!PyArg_ParseTuple(args, "O:BitsetReader", &file))
+        return NULL;
+
+    r = (bitset_ReaderObject *)type->tp_alloc(type, 0);
+    if (r == NULL)
+        return NULL;
+
+    r->read = PyObject_GetAttrString(file, "read");
+    r->buffer = (unsigned char *)PyMem_Malloc(BITSET_STREAM_BLOCK);
+    r->allocated = BITSET_STREAM_BLOCK;
+    r->start = r->end = 0;
+    if (r->read == NULL || r->buffer == NULL) {
+        if (r->buffer == NULL && !PyErr_Occurred())
+            PyErr_NoMemory();
+        Py_DECREF(r);
+        return NULL;
+    }
+
+    return (PyObject *)r;
+}
+
+static void
+Reader_dealloc(bitset_ReaderObject *r)
+{
+    Py_XDECREF(r->read);
+    PyMem_Free(r->buffer);
+    Py_TYPE(r)->tp_free((PyObject *)r);
+}
+
+static PyObject *
+bitset_Reader_iternext(bitset_ReaderObject *r)
+{
+    PyObject *result;
+    Py_ssize_t n = 0;
+    int status;
+
+    status = bitset_reader_fill(r, BITSET_FORMAT_HEADER);
+    if (status > 0) {
+        n = bitset_format_payload(r->buffer + r->start);
+        if (n < 0)
+            return NULL;
+        status = bitset_reader_fill(r, BITSET_FORMAT_HEADER + n);
+    }
+    if (status < 0)
+        return NULL;
+    if (status == 0) {
+        /* the file ended, which should be between bitsets */
+        if (r->end > r->start)
+            PyErr_SetString(PyExc_ValueError, "serialized bitset is truncated");
+        return NULL;
+    }
+
+    result = bitset_format_read(r->buffer + r->start);
+    if (result != NULL)
+        r->start += BITSET_FORMAT_HEADER + n;
+    return result;
+}
+
+PyDoc_STRVAR(bitset_BitsetReader_doc,
+"BitsetReader(file)\n\
+\n\
+Iterates over the bitsets serialized to a binary file by a BitsetWriter\n\
+or dumps(), reading the file in blocks.");
+
+static PyTypeObject bitset_BitsetReaderType = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "bitset.BitsetReader",                  /* tp_name */
+    sizeof(bitset_ReaderObject),            /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)Reader_dealloc,             /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    0,                                      /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    bitset_BitsetReader_doc,                /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    PyObject_SelfIter,                      /* tp_iter */
+    (iternextfunc)bitset_Reader_iternext,   /* tp_iternext */
+    0,                                      /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    0,                                      /* tp_init */
+    0,                                      /* tp_alloc */
+    Reader_new,                             /* tp_new */
+};
+
+/***** BitsetStore *****/
+
+/*
+ * A BitsetStore file holds many named bitsets, with their words stored raw
+ * so that they can be used straight from a memory mapping of the file.
+ * All integers are little-endian:
+ *
+ *    0  magic, "BSTO"
+ *    4  format version, 1, 4 bytes
+ *    8  zero, 8 bytes
+ *   16  the words of each bitset in turn, 8 bytes each as in a raw
+ *       serialized bitset, with trailing empty words dropped
+ *    i  the index: for each bitset the file offset of its words, 8 bytes,
+ *       its number of words, 8 bytes, the length of its name, 4 bytes,
+ *       and its name in UTF-8
+ *  end  a 32 byte trailer: the index offset i, 8 bytes, the number of
+ *       bitsets, 8 bytes, the index length, 8 bytes, the CRC-32 of the
+ *       index, 4 bytes, and "BSTO"
+ *
+ * The index comes last so that the file can be written in one pass.  Only
+ * the index is checked when the file is opened; checking the words would
+ * read them all, which is what mapping the file avoids.
+ */
+#define BITSET_STORE_VERSION 1
+#define BITSET_STORE_HEADER 16
+#define BITSET_STORE_TRAILER 32
+#define BITSET_STORE_ENTRY 20
+
+typedef struct {
+    Py_ssize_t offset;          /* of the words in the file */
+    Py_ssize_t nwords;
+} bitset_store_entry;
+
+typedef struct {
+    PyObject_HEAD
+    unsigned char *data;        /* the file, mapped or read into a PyMem block */
+    Py_ssize_t size;
+    int mapped;
+    Py_ssize_t count;
+    bitset_store_entry *entries;
+    PyObject *names;            /* tuple of the names in file order */
+    PyObject *index;            /* dict of name: position in entries */
+} bitset_StoreObject;
+
+/* Opens the file at path with io.open() */
+static PyObject *
+bitset_open_path(PyObject *path, const char *mode)
+{
+    PyObject *io, *file;
+
+    io = PyImport_ImportModule("io");
+    if (io == NULL)
+        return NULL;
+    file = PyObject_CallMethod(io, "open", "Os", path, mode);
+    Py_DECREF(io);
+    return file;
+}
+
+/* Closes file if it was opened from a path, keeping status */
+static int
+bitset_close_opened(PyObject *file, PyObject *arg, int status)
+{
+    PyObject *result;
+
+    if (file == arg)
+        return status;
+
+    result = PyObject_CallMethod(file, "close", NULL);
+    if (result == NULL)
+        status = -1;
+    Py_XDECREF(result);
+    Py_DECREF(file);
+    return status;
+}
+
+/* Appends n bytes to the writer's buffer, flushing it as needed */
+static int
+bitset_writer_append(bitset_WriterObject *w, const unsigned char *data, Py_ssize_t n)
+{
+    if (n > BITSET_STREAM_BLOCK - w->size && bitset_writer_flush(w))
+        return -1;
+
+    if (n > BITSET_STREAM_BLOCK)
+        return bitset_writer_put(w, data, n);
+
+    memcpy(w->buffer + w->size, data, n);
+    w->size += n;
+    return 0;
+}
+
+/* Writes bso's first nwords words as raw bytes */
+static int
+bitset_writer_words(bitset_WriterObject *w, bitset_BitsetObject *bso, Py_ssize_t nwords)
+{
+    Py_ssize_t n = nwords * sizeof(bitset_word);
+    PyObject *data;
+    int error;
+
+    /* the file's write() mustn't resize bso while nwords is in use */
+    if (n > BITSET_STREAM_BLOCK - w->size) {
+        bitset_pin(bso);
+        error = bitset_writer_flush(w);
+        bitset_unpin(bso);
+        if (error)
+            return -1;
+    }
+
+    if (n <= BITSET_STREAM_BLOCK) {
+        bitset_export_bytes(bso, w->buffer + w->size, n);
+        w->size += n;
+        return 0;
+    }
+
+    data = PyBytes_FromStringAndSize(NULL, n);
+    if (data == NULL)
+        return -1;
+    bitset_export_bytes(bso, (unsigned char *)PyBytes_AS_STRING(data), n);
+    error = bitset_writer_put(w, (unsigned char *)PyBytes_AS_STRING(data), n);
+    Py_DECREF(data);
+    return error;
+}
+
+/* Returns a store name as UTF-8 bytes */
+static PyObject *
+bitset_store_name(PyObject *name)
+{
+#if PY_MAJOR_VERSION < 3
+    if (PyString_Check(name)) {
+        Py_INCREF(name);
+        return name;
+    }
+#endif
+    if (PyUnicode_Check(name))
+        return PyUnicode_AsUTF8String(name);
+
+    PyErr_Format(PyExc_TypeError, "BitsetStore names must be strings, not %.100s",
+                 Py_TYPE(name)->tp_name);
+    return NULL;
+}
+
+/* Appends an index entry to the growing index at *index */
+static int
+bitset_store_add_entry(unsigned char **index, Py_ssize_t *size, Py_ssize_t *allocated,
+                       Py_ssize_t offset, Py_ssize_t nwords, PyObject *name)
+{
+    Py_ssize_t n = PyBytes_GET_SIZE(name);
+    unsigned char *p;
+
+    if (n > (Py_ssize_t)0xFFFFFFFF) {
+        PyErr_SetString(PyExc_ValueError, "BitsetStore name is too long");
+        return -1;
+    }
+
+    if (*size + BITSET_STORE_ENTRY + n > *allocated) {
+        if (n > PY_SSIZE_T_MAX / 2 - *size - BITSET_STORE_ENTRY) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        p = (unsigned char *)PyMem_Realloc(*index, 2 * (*size + BITSET_STORE_ENTRY + n));
+        if (p == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        *index = p;
+        *allocated = 2 * (*size + BITSET_STORE_ENTRY + n);
+    }
+
+    p = *index + *size;
+    bitset_put_le(p, (bitset_word)offset, 8);
+    bitset_put_le(p + 8, (bitset_word)nwords, 8);
+    bitset_put_le(p + 16, (bitset_word)n, 4);
+    memcpy(p + BITSET_STORE_ENTRY, PyBytes_AS_STRING(name), n);
+    *size += BITSET_STORE_ENTRY + n;
+    return 0;
+}
+
+/* Writes the (name, bitset) pairs from iter to the BitsetWriter w */
+static int
+bitset_store_write(bitset_WriterObject *w, PyObject *iter)
+{
+    unsigned char header[BITSET_STORE_TRAILER], *index = NULL;
+    Py_ssize_t size = 0, allocated = 0, offset = BITSET_STORE_HEADER, count = 0, nwords;
+    PyObject *seen, *item, *name;
+    bitset_BitsetObject *bso;
+    int error = -1;
+
+    seen = PySet_New(NULL);
+    if (seen == NULL)
+        return -1;
+
+    memcpy(header, "BSTO", 4);
+    bitset_put_le(header + 4, BITSET_STORE_VERSION, 4);
+    bitset_put_le(header + 8, 0, 8);
+    if (bitset_writer_append(w, header, BITSET_STORE_HEADER))
+        goto done;
+
+    while ((item = PyIter_Next(iter)) != NULL) {
+        if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+            PyErr_SetString(PyExc_TypeError,
+                            "BitsetStore.write() needs (name, bitset) pairs");
+            Py_DECREF(item);
+            goto done;
+        }
+
+        name = bitset_store_name(PyTuple_GET_ITEM(item, 0));
+        bso = name == NULL ? NULL :
+            bitset_as_bitset_type(&bitset_BigBitsetType, PyTuple_GET_ITEM(item, 1));
+        Py_DECREF(item);
+        if (bso == NULL) {
+            Py_XDECREF(name);
+            goto done;
+        }
+
+        nwords = bitset_used_words(bso);
+        error = PySet_Contains(seen, name);
+        if (error > 0) {
+            PyErr_SetString(PyExc_ValueError, "duplicate name in BitsetStore");
+            error = -1;
+        }
+        if (error == 0 &&
+            (PySet_Add(seen, name) ||
+             bitset_store_add_entry(&index, &size, &allocated, offset, nwords, name) ||
+             bitset_writer_words(w, bso, nwords)))
+            error = -1;
+        Py_DECREF(name);
+        Py_DECREF(bso);
+        if (error)
+            goto done;
+
+        offset += nwords * sizeof(bitset_word);
+        count++;
+        error = -1;
+    }
+    if (PyErr_Occurred())
+        goto done;
+
+    bitset_put_le(header, (bitset_word)offset, 8);
+    bitset_put_le(header + 8, (bitset_word)count, 8);
+    bitset_put_le(header + 16, (bitset_word)size, 8);
+    bitset_put_le(header + 24, bitset_crc32(index, size), 4);
+    memcpy(header + 28, "BSTO", 4);
+    if (!bitset_writer_append(w, index, size) &&
+        !bitset_writer_append(w, header, BITSET_STORE_TRAILER))
+        error = bitset_writer_flush(w);
+
+done:
+    Py_DECREF(seen);
+    PyMem_Free(index);
+    return error;
+}
+
+static PyObject *
+bitset_Store_write(PyObject *unused, PyObject *args)
+{
+    PyObject *arg, *items, *file, *iter, *writer;
+    int error;
+
+    if (!PyArg_ParseTuple(args, "OO:write", &arg, &items))
+        return NULL;
+
+    if (PyObject_HasAttrString(items, "items"))
+        items = PyObject_CallMethod(items, "items", NULL);
+    else
+        Py_INCREF(items);
+    if (items == NULL)
+        return NULL;
+    iter = PyObject_GetIter(items);
+    Py_DECREF(items);
+    if (iter == NULL)
+        return NULL;
+
+    file = PyBytes_Check(arg) || PyUnicode_Check(arg) ? bitset_open_path(arg, "wb") : arg;
+    if (file == NULL) {
+        Py_DECREF(iter);
+        return NULL;
+    }
+
+    writer = PyObject_CallFunctionObjArgs((PyObject *)&bitset_BitsetWriterType, file, NULL);
+    error = writer == NULL ? -1 : bitset_store_write((bitset_WriterObject *)writer, iter);
+    if (writer != NULL) {
+        /* don't let the writer flush part of a store as it goes */
+        ((bitset_WriterObject *)writer)->size = 0;
+        Py_DECREF(writer);
+    }
+    Py_DECREF(iter);
+
+    if (bitset_close_opened(file, arg, error))
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(store_write_doc,
+"BitsetStore.write(file, items)\n\
+\n\
+Write a BitsetStore file of the bitsets in items, a mapping or an iterable\n\
+of (name, bitset) pairs with string names, to file, a path or a binary\n\
+file object.  Iterables other than bitsets are read as BigBitsets.");
+
+/* Reads the file into s->data, mapping it if it is a regular file */
+static int
+bitset_store_load(bitset_StoreObject *s, PyObject *file)
+{
+    PyObject *data;
+#ifdef BITSET_MMAP
+    struct stat st;
+    void *p;
+    int fd;
+
+    fd = PyObject_AsFileDescriptor(file);
+    if (fd < 0)
+        PyErr_Clear();
+    else if (fstat(fd, &st) != 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    else if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        if ((PY_LONG_LONG)st.st_size > (PY_LONG_LONG)PY_SSIZE_T_MAX) {
+            PyErr_SetString(PyExc_OverflowError, "BitsetStore file is too large to map");
+            return -1;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        Py_END_ALLOW_THREADS
+        if (p == MAP_FAILED) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+        s->data = (unsigned char *)p;
+        s->size = (Py_ssize_t)st.st_size;
+        s->mapped = 1;
+        return 0;
+    }
+#endif
+
+    data = PyObject_CallMethod(file, "read", NULL);
+    if (data == NULL)
+        return -1;
+    if (!PyBytes_Check(data)) {
+        PyErr_SetString(PyExc_TypeError, "BitsetStore needs a binary file");
+        Py_DECREF(data);
+        return -1;
+    }
+
+    s->size = PyBytes_GET_SIZE(data);
+    s->data = (unsigned char *)PyMem_Malloc(s->size > 0 ? s->size : 1);
+    if (s->data == NULL) {
+        Py_DECREF(data);
+        PyErr_NoMemory();
+        return -1;
+    }
+    memcpy(s->data, PyBytes_AS_STRING(data), s->size);
+    Py_DECREF(data);
+    return 0;
+}
+
+static int
+bitset_store_invalid(void)
+{
+    PyErr_SetString(PyExc_ValueError, "invalid BitsetStore index");
+    return -1;
+}
+
+/* Checks the file's index and reads it into s->entries, names and index */
+static int
+bitset_store_read_index(bitset_StoreObject *s)
+{
+    const unsigned char *p = s->data, *trailer, *q, *end;
+    bitset_word first, count, length, offset, nwords, n;
+    PyObject *name, *pos;
+    Py_ssize_t i;
+    int error;
+
+    if (s->size < BITSET_STORE_HEADER + BITSET_STORE_TRAILER ||
+        memcmp(p, "BSTO", 4) != 0 || memcmp(p + s->size - 4, "BSTO", 4) != 0) {
+        PyErr_SetString(PyExc_ValueError, "not a BitsetStore file");
+        return -1;
+    }
+    if (bitset_get_le(p + 4, 4) != BITSET_STORE_VERSION) {
+        PyErr_Format(PyExc_ValueError, "unsupported BitsetStore format version %ld",
+                     (long)bitset_get_le(p + 4, 4));
+        return -1;
+    }
+
+    trailer = p + s->size - BITSET_STORE_TRAILER;
+    first = bitset_get_le(trailer, 8);
+    count = bitset_get_le(trailer + 8, 8);
+    length = bitset_get_le(trailer + 16, 8);
+    if (first < BITSET_STORE_HEADER || first > (bitset_word)(trailer - p) ||
+        length != (bitset_word)(trailer - p) - first || count > length / BITSET_STORE_ENTRY)
+        return bitset_store_invalid();
+    if (bitset_crc32(p + first, (Py_ssize_t)length) != (PY_UINT32_T)bitset_get_le(trailer + 24, 4)) {
+        PyErr_SetString(PyExc_ValueError, "BitsetStore index checksum mismatch");
+        return -1;
+    }
+
+    s->count = (Py_ssize_t)count;
+    s->entries = PyMem_New(bitset_store_entry, s->count > 0 ? s->count : 1);
+    s->names = PyTuple_New(s->count);
+    s->index = PyDict_New();
+    if (s->entries == NULL || s->names == NULL || s->index == NULL) {
+        if (!PyErr_Occurred())
+            PyErr_NoMemory();
+        return -1;
+    }
+
+    q = p + first;
+    end = q + length;
+    for (i = 0; i < s->count; i++) {
+        if (end - q < BITSET_STORE_ENTRY)
+            return bitset_store_invalid();
+        offset = bitset_get_le(q, 8);
+        nwords = bitset_get_le(q + 8, 8);
+        n = bitset_get_le(q + 16, 4);
+        q += BITSET_STORE_ENTRY;
+        if (n > (bitset_word)(end - q) || offset % sizeof(bitset_word) != 0 ||
+            offset < BITSET_STORE_HEADER || offset > first ||
+            nwords > (first - offset) / sizeof(bitset_word))
+            return bitset_store_invalid();
+
+#if PY_MAJOR_VERSION >= 3
+        name = PyUnicode_DecodeUTF8((const char *)q, (Py_ssize_t)n, NULL);
+#else
+        name = PyString_FromStringAndSize((const char *)q, (Py_ssize_t)n);
+#endif
+        if (name == NULL)
+            return -1;
+        PyTuple_SET_ITEM(s->names, i, name);
+        q += n;
+
+        pos = PyInt_FromSsize_t(i);
+        error = pos == NULL || PyDict_SetItem(s->index, name, pos);
+        Py_XDECREF(pos);
+        if (error)
+            return -1;
+        if (PyDict_Size(s->index) != i + 1)
+            return bitset_store_invalid();
+
+        s->entries[i].offset = (Py_ssize_t)offset;
+        s->entries[i].nwords = (Py_ssize_t)nwords;
+    }
+    if (q != end)
+        return bitset_store_invalid();
+
+#ifdef WORDS_BIGENDIAN
+    {
+        /* the file was read rather than mapped, so the words can be
+           put in native order where they are */
+        bitset_word *words = (bitset_word *)(s->data + BITSET_STORE_HEADER);
+
+        for (i = 0; i < (Py_ssize_t)(first - BITSET_STORE_HEADER) / (Py_ssize_t)sizeof(bitset_word); i++)
+            words[i] = bitset_get_le((unsigned char *)&words[i], 8);
+    }
+#endif
+    return 0;
+}
+
+static PyObject *
+Store_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    bitset_StoreObject *s;
+    PyObject *arg, *file;
+    int error;
+
+    if (bitset_check_no_keywords(type, kwds != NULL ? PyDict_Size(kwds) : 0) ||
+        !PyArg_ParseTuple(args, "O:BitsetStore", &arg))
+        return NULL;
+
+    s = (bitset_StoreObject *)type->tp_alloc(type, 0);
+    if (s == NULL)
+        return NULL;
+
+    file = PyBytes_Check(arg) || PyUnicode_Check(arg) ? bitset_open_path(arg, "rb") : arg;
+    error = file == NULL ? -1 : bitset_close_opened(file, arg, bitset_store_load(s, file));
+    if (error || bitset_store_read_index(s)) {
+        Py_DECREF(s);
+        return NULL;
+    }
+
+    return (PyObject *)s;
+}
+
+static void
+Store_dealloc(bitset_StoreObject *s)
+{
+#ifdef BITSET_MMAP
+    if (s->mapped)
+        munmap(s->data, (size_t)s->size);
+    else
+#endif
+        PyMem_Free(s->data);
+    PyMem_Free(s->entries);
+    Py_XDECREF(s->names);
+    Py_XDECREF(s->index);
+    Py_TYPE(s)->tp_free((PyObject *)s);
+}
+
+/* Returns the bitset at position i as a MappedBitset over the file's words */
+static PyObject *
+bitset_store_get(bitset_StoreObject *s, Py_ssize_t i)
+{
+    bitset_BitsetObject *bso;
+
+    bso = (bitset_BitsetObject *)Bitset_new(&bitset_MappedBitsetType, NULL, NULL);
+    if (bso == NULL)
+        return NULL;
+
+    if (s->entries[i].nwords > 0) {
+        bso->words = (bitset_word *)(s->data + s->entries[i].offset);
+        bso->nwords = bso->allocated = s->entries[i].nwords;
+    }
+    Py_INCREF(s);
+    bso->base = (PyObject *)s;
+    return (PyObject *)bso;
+}
+
+static Py_ssize_t
+bitset_Store_len(bitset_StoreObject *s)
+{
+    return s->count;
+}
+
+static PyObject *
+bitset_Store_subscript(bitset_StoreObject *s, PyObject *name)
+{
+    PyObject *pos = PyDict_GetItem(s->index, name), *key;
+
+    if (pos == NULL) {
+        key = PyTuple_Pack(1, name);
+        if (key != NULL) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            Py_DECREF(key);
+        }
+        return NULL;
+    }
+
+    return bitset_store_get(s, PyInt_AsSsize_t(pos));
+}
+
+static int
+bitset_Store_contains(bitset_StoreObject *s, PyObject *name)
+{
+    return PyDict_GetItem(s->index, name) != NULL;
+}
+
+static PyObject *
+bitset_Store_iter(bitset_StoreObject *s)
+{
+    return PyObject_GetIter(s->names);
+}
+
+static PyObject *
+bitset_Store_keys(bitset_StoreObject *s)
+{
+    return PySequence_List(s->names);
+}
+
+PyDoc_STRVAR(store_keys_doc,
+"keys() -> list\n\
+\n\
+Return the names of the bitsets in the store, in file order.");
+
+static PyObject *
+bitset_Store_get(bitset_StoreObject *s, PyObject *args)
+{
+    PyObject *name, *pos, *def = Py_None;
+
+    if (!PyArg_ParseTuple(args, "O|O:get", &name, &def))
+        return NULL;
+
+    pos = PyDict_GetItem(s->index, name);
+    if (pos == NULL) {
+        Py_INCREF(def);
+        return def;
+    }
+    return bitset_store_get(s, PyInt_AsSsize_t(pos));
+}
+
+PyDoc_STRVAR(store_get_doc,
+"get(name[, default]) -> MappedBitset\n\
+\n\
+Return the bitset called name, or default if there isn't one.");
+
+static PyMappingMethods bitset_store_as_mapping = {
+    (lenfunc)bitset_Store_len,              /* mp_length */
+    (binaryfunc)bitset_Store_subscript,     /* mp_subscript */
+    0,                                      /* mp_ass_subscript */
+};
+
+static PySequenceMethods bitset_store_as_sequence = {
+    0,                                      /* sq_length */
+    0,                                      /* sq_concat */
+    0,                                      /* sq_repeat */
+    0,                                      /* sq_item */
+    0,                                      /* sq_slice */
+    0,                                      /* sq_ass_item */
+    0,                                      /* sq_ass_slice */
+    (objobjproc)bitset_Store_contains,      /* sq_contains */
+};
+
+static PyMethodDef bitset_Store_methods[] = {
+    {"get",             (PyCFunction)bitset_Store_get,
+     METH_VARARGS, store_get_doc},
+    {"keys",            (PyCFunction)bitset_Store_keys,
+     METH_NOARGS, store_keys_doc},
+    {"write",           (PyCFunction)bitset_Store_write,
+     METH_VARARGS | METH_STATIC, store_write_doc},
+    {NULL,        NULL}                /* sentinel */
+};
+
+PyDoc_STRVAR(bitset_BitsetStore_doc,
+"BitsetStore(file)\n\
+\n\
+A read-only mapping of names to the bitsets in a file written by\n\
+BitsetStore.write(), given as a path or a binary file object.  The file\n\
+is memory mapped where possible and only its index is read on opening;\n\
+each bitset is a MappedBitset using the words in the mapping, which are\n\
+read from the file as operations touch them.  The mapping lasts as long\n\
+as the store or any bitset from it.");
+
+static PyTypeObject bitset_BitsetStoreType = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "bitset.BitsetStore",                   /* tp_name */
+    sizeof(bitset_StoreObject),             /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)Store_dealloc,              /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    &bitset_store_as_sequence,              /* tp_as_sequence */
+    &bitset_store_as_mapping,               /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    bitset_BitsetStore_doc,                 /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    (getiterfunc)bitset_Store_iter,         /* tp_iter */
+    0,                                      /* tp_iternext */
+    bitset_Store_methods,                   /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    0,                                      /* tp_init */
+    0,                                      /* tp_alloc */
+    Store_new,                              /* tp_new */
+};
+
+/* MappedBitsets only come from a BitsetStore */
+static PyObject *
+MappedBitset_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyErr_SetString(PyExc_TypeError, "MappedBitsets are read from a BitsetStore");
+    return NULL;
+}
+
+PyDoc_STRVAR(bitset_MappedBitset_doc,
+"A FrozenBitset whose words are in a BitsetStore's file mapping.\n\
+Results computed from it are FrozenBitsets, and copy() reads it into\n\
+memory.");
+
+PyTypeObject bitset_MappedBitsetType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "bitset.MappedBitset",                  /* tp_name */
+    sizeof(bitset_BitsetObject),            /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)Bitset_dealloc,             /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    BITSET_NOCMP,                           /* tp_compare */
+    (reprfunc)Bitset_repr,                  /* tp_repr */
+    &bitset_frozen_as_number,               /* tp_as_number */
+    &bitset_as_sequence,                    /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    (hashfunc)bitset_FrozenBitset_hash,     /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    &bitset_as_buffer,                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_CHECKTYPES | Py_TPFLAGS_HAVE_NEWBUFFER, /* tp_flags */
+    bitset_MappedBitset_doc,                /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    (richcmpfunc)bitset_Bitset_richcompare, /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    (getiterfunc)bitset_Bitset_iter,        /* tp_iter */
+    0,                                      /* tp_iternext */
+    0,                                      /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    &bitset_FrozenBitsetType,               /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    0,                                      /* tp_init */
+    0,                                      /* tp_alloc */
+    MappedBitset_new,                       /* tp_new */
+};
+
+/***** BitsetIndex *****/
+
+/*
+ * A BitsetIndex maps each value to a BigBitset, its posting, of the rows
+ * having that value, and keeps a BigBitset of all the rows for "not".
+ * Queries are trees of tuples:
+ *
+ *   ("eq", value)              the rows having value
+ *   ("in", value, ...)         the rows having any of the values
+ *   ("and", query, ...)        the rows matching every query
+ *   ("or", query, ...)         the rows matching any query
+ *   ("not", query)             the rows not matching query
+ *
+ * and are evaluated into plain word buffers with the word kernels, so the
+ * only object made is the result.  "and" reads postings in place rather
+ * than copying them, applies its "not" operands as a difference, and stops
+ * once its result is empty.
+ */
+typedef struct {
+    PyObject_HEAD
+    PyObject *postings;             /* dict of value to BigBitset */
+    bitset_BitsetObject *rows;
+} bitset_IndexObject;
+
+#define BITSET_QUERY_EQ 0
+#define BITSET_QUERY_IN 1
+#define BITSET_QUERY_AND 2
+#define BITSET_QUERY_OR 3
+#define BITSET_QUERY_NOT 4
+
+static const char *bitset_query_ops[] = {"eq", "in", "and", "or", "not"};
+
+/* A query's result, owned by the evaluation */
+typedef struct {
+    bitset_word *words;
+    Py_ssize_t nwords;
+} bitset_query_result;
+
+static int
+bitset_query_invalid(void)
+{
+    PyErr_SetString(PyExc_ValueError,
+                    "BitsetIndex queries are tuples of an operator and its operands, "
+                    "such as ('and', ('eq', x), ('not', ('in', y, z)))");
+    return -1;
+}
+
+/* Returns the operator of query, or -1 with ValueError set */
+static int
+bitset_query_op(PyObject *query)
+{
+    PyObject *op;
+    int i, n;
+
+    if (!PyTuple_Check(query) || PyTuple_GET_SIZE(query) < 1)
+        return bitset_query_invalid();
+
+    op = PyTuple_GET_ITEM(query, 0);
+    n = (int)PyTuple_GET_SIZE(query) - 1;
+    for (i = 0; i < (int)(sizeof(bitset_query_ops) / sizeof(bitset_query_ops[0])); i++) {
+#if PY_MAJOR_VERSION >= 3
+        if (!PyUnicode_Check(op) || PyUnicode_CompareWithASCIIString(op, bitset_query_ops[i]) != 0)
+            continue;
+#else
+        if (!PyString_Check(op) || strcmp(PyString_AS_STRING(op), bitset_query_ops[i]) != 0)
+            continue;
+#endif
+        if ((i == BITSET_QUERY_EQ || i == BITSET_QUERY_NOT) ? n != 1 : n < 1)
+            return bitset_query_invalid();
+        return i;
+    }
+
+    return bitset_query_invalid();
+}
+
+/* Checks the whole of query, since evaluation skips operands once a result
+   is empty, or returns -1 with ValueError set */
+static int
+bitset_query_check(PyObject *query)
+{
+    Py_ssize_t i;
+    int op = bitset_query_op(query);
+
+    if (op < 0)
+        return -1;
+    if (op == BITSET_QUERY_EQ || op == BITSET_QUERY_IN)
+        return 0;
+
+    for (i = 1; i < PyTuple_GET_SIZE(query); i++)
+        if (bitset_query_check(PyTuple_GET_ITEM(query, i)))
+            return -1;
+    return 0;
+}
+
+/* Returns a new reference to the posting of value, or NULL, with an error
+   set if value isn't hashable */
+static bitset_BitsetObject *
+bitset_index_posting(bitset_IndexObject *ix, PyObject *value)
+{
+    PyObject *posting;
+
+    if (PyObject_Hash(value) == -1)
+        return NULL;
+
+    posting = PyDict_GetItem(ix->postings, value);
+    Py_XINCREF(posting);
+    return (bitset_BitsetObject *)posting;
+}
+
+/* Makes r at least n words long, zeroing the new words */
+static int
+bitset_query_grow(bitset_query_result *r, Py_ssize_t n)
+{
+    bitset_word *words;
+
+    if (n <= r->nwords)
+        return 0;
+
+    words = PyMem_Realloc(r->words, n * sizeof(bitset_word));
+    if (words == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(words + r->nwords, 0, (n - r->nwords) * sizeof(bitset_word));
+    r->words = words;
+    r->nwords = n;
+    return 0;
+}
+
+/* Applies r = r op bso, for an op that leaves the words beyond bso's alone */
+static int
+bitset_query_apply(bitset_op_kernel op, bitset_query_result *r, bitset_BitsetObject *bso,
+                   int grow)
+{
+    Py_ssize_t n = bitset_used_words(bso);
+
+    if (grow && bitset_query_grow(r, n))
+        return -1;
+
+    bitset_pin(bso);
+    bitset_run_words(op, r->words, bso->words, Py_MIN(n, r->nwords));
+    bitset_unpin(bso);
+    return 0;
+}
+
+/* Applies r = r & bso, dropping r's words beyond bso's */
+static void
+bitset_query_and(bitset_query_result *r, bitset_BitsetObject *bso)
+{
+    r->nwords = Py_MIN(r->nwords, bitset_used_words(bso));
+    bitset_query_apply(bitset_kernels.and_, r, bso, 0);
+}
+
+static void
+bitset_query_and_words(bitset_query_result *r, const bitset_query_result *other)
+{
+    r->nwords = Py_MIN(r->nwords, other->nwords);
+    bitset_run_words(bitset_kernels.and_, r->words, other->words, r->nwords);
+}
+
+/* Sets r to a copy of the rows */
+static int
+bitset_query_rows(bitset_IndexObject *ix, bitset_query_result *r)
+{
+    r->nwords = 0;
+    return bitset_query_apply(bitset_kernels.or_, r, ix->rows, 1);
+}
+
+static int bitset_index_eval(bitset_IndexObject *ix, PyObject *query,
+                             bitset_query_result *r);
+
+/* Applies one operand of an "and" to r */
+static int
+bitset_query_and_operand(bitset_IndexObject *ix, PyObject *query, int op,
+                         bitset_query_result *r)
+{
+    bitset_query_result other = {NULL, 0};
+    bitset_BitsetObject *posting;
+
+    if (op == BITSET_QUERY_EQ) {
+        posting = bitset_index_posting(ix, PyTuple_GET_ITEM(query, 1));
+        if (posting == NULL) {
+            r->nwords = 0;
+            return PyErr_Occurred() ? -1 : 0;
+        }
+        bitset_query_and(r, posting);
+        Py_DECREF(posting);
+        return 0;
+    }
+
+    if (bitset_index_eval(ix, op == BITSET_QUERY_NOT ? PyTuple_GET_ITEM(query, 1) : query,
+                          &other)) {
+        PyMem_Free(other.words);
+        return -1;
+    }
+    if (op == BITSET_QUERY_NOT)
+        bitset_run_words(bitset_kernels.andnot, r->words, other.words,
+                         Py_MIN(r->nwords, other.nwords));
+    else
+        bitset_query_and_words(r, &other);
+    PyMem_Free(other.words);
+    return 0;
+}
+
+static int
+bitset_query_and_all(bitset_IndexObject *ix, PyObject *query, bitset_query_result *r)
+{
+    Py_ssize_t i, n = PyTuple_GET_SIZE(query), first = 0;
+    PyObject *operand;
+    int op;
+
+    /* start from the first operand that isn't a "not", or else all rows */
+    for (i = 1; i < n && !first; i++) {
+        op = bitset_query_op(PyTuple_GET_ITEM(query, i));
+        if (op < 0)
+            return -1;
+        if (op != BITSET_QUERY_NOT)
+            first = i;
+    }
+    if (first ? bitset_index_eval(ix, PyTuple_GET_ITEM(query, first), r)
+              : bitset_query_rows(ix, r))
+        return -1;
+
+    for (i = 1; i < n; i++) {
+        while (r->nwords > 0 && r->words[r->nwords - 1] == 0)
+            r->nwords--;
+        if (r->nwords == 0)
+            break;
+        if (i == first)
+            continue;
+
+        operand = PyTuple_GET_ITEM(query, i);
+        op = bitset_query_op(operand);
+        if (op < 0 || bitset_query_and_operand(ix, operand, op, r))
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Evaluates query into r, which must be empty; r's words are the caller's
+   to free whether or not this fails */
+static int
+bitset_index_eval(bitset_IndexObject *ix, PyObject *query, bitset_query_result *r)
+{
+    bitset_query_result other;
+    bitset_BitsetObject *posting;
+    Py_ssize_t i, n;
+    int op, error = 0;
+
+    op = bitset_query_op(query);
+    if (op < 0)
+        return -1;
+    n = PyTuple_GET_SIZE(query);
+
+    switch (op) {
+    case BITSET_QUERY_EQ:
+    case BITSET_QUERY_IN:
+        for (i = 1; i < n && !error; i++) {
+            posting = bitset_index_posting(ix, PyTuple_GET_ITEM(query, i));
+            if (posting == NULL) {
+                error = PyErr_Occurred() != NULL;
+                continue;
+            }
+            error = bitset_query_apply(bitset_kernels.or_, r, posting, 1);
+            Py_DECREF(posting);
+        }
+        return error ? -1 : 0;
+
+    case BITSET_QUERY_OR:
+        for (i = 1; i < n && !error; i++) {
+            other.words = NULL;
+            other.nwords = 0;
+            error = bitset_index_eval(ix, PyTuple_GET_ITEM(query, i), &other) ||
+                bitset_query_grow(r, other.nwords);
+            if (!error)
+                bitset_run_words(bitset_kernels.or_, r->words, other.words, other.nwords);
+            PyMem_Free(other.words);
+        }
+        return error ? -1 : 0;
+
+    case BITSET_QUERY_NOT:
+        if (bitset_query_rows(ix, r))
+            return -1;
+        return bitset_query_and_operand(ix, query, op, r);
+
+    default:
+        return bitset_query_and_all(ix, query, r);
+    }
+}
+
+/* Sets row in bso, which must already have room for it */
+static void
+bitset_index_set(bitset_BitsetObject *bso, Py_ssize_t row)
+{
+    bso->words[BITSET_WORD_INDEX(row)] |= BITSET_WORD_MASK(row);
+    bitset_changed(bso);
+}
+
+/*
+ * Adds row to the postings of each of values, leaving the index as it was
+ * if that fails.  The postings are found or made, and grown to hold row,
+ * before any of them changes, so only adding new postings to the dict can
+ * fail after that, and those are taken out again.
+ */
+static int
+bitset_index_add(bitset_IndexObject *ix, PyObject *key, PyObject *values)
+{
+    PyObject *items, *postings = NULL, *added = NULL, *value, *posting;
+    PyObject *type, *exc, *traceback;
+    Py_ssize_t row, i, pos = 0, ninserted = 0;
+    int error = -1;
+
+    row = bitset_member((PyObject *)ix->rows, key);
+    if (row < 0)
+        return -1;
+
+    items = PySequence_List(values);
+    if (items == NULL)
+        return -1;
+    postings = PyList_New(0);
+    added = PyDict_New();
+    if (postings == NULL || added == NULL)
+        goto done;
+
+    for (i = 0; i < PyList_GET_SIZE(items); i++) {
+        value = PyList_GET_ITEM(items, i);
+        posting = (PyObject *)bitset_index_posting(ix, value);
+        if (posting == NULL) {
+            if (PyErr_Occurred())
+                goto done;
+            /* a value repeated in values gets one new posting */
+            posting = PyDict_GetItem(added, value);
+            Py_XINCREF(posting);
+        }
+        if (posting == NULL) {
+            posting = Bitset_new(&bitset_BigBitsetType, NULL, NULL);
+            if (posting == NULL)
+                goto done;
+            if (PyDict_SetItem(added, value, posting)) {
+                Py_DECREF(posting);
+                goto done;
+            }
+        }
+        if (bitset_grow((bitset_BitsetObject *)posting, BITSET_WORD_INDEX(row) + 1) ||
+            PyList_Append(postings, posting)) {
+            Py_DECREF(posting);
+            goto done;
+        }
+        Py_DECREF(posting);
+    }
+    if (bitset_grow(ix->rows, BITSET_WORD_INDEX(row) + 1))
+        goto done;
+
+    while (PyDict_Next(added, &pos, &value, &posting)) {
+        if (PyDict_SetItem(ix->postings, value, posting)) {
+            PyErr_Fetch(&type, &exc, &traceback);
+            for (pos = 0; ninserted > 0 && PyDict_Next(added, &pos, &value, &posting);
+                 ninserted--) {
+                if (PyDict_DelItem(ix->postings, value))
+                    PyErr_Clear();
+            }
+            PyErr_Restore(type, exc, traceback);
+            goto done;
+        }
+        ninserted++;
+    }
+
+    for (i = 0; i < PyList_GET_SIZE(postings); i++)
+        bitset_index_set((bitset_BitsetObject *)PyList_GET_ITEM(postings, i), row);
+    bitset_index_set(ix->rows, row);
+    error = 0;
+
+done:
+    Py_DECREF(items);
+    Py_XDECREF(postings);
+    Py_XDECREF(added);
+    return error;
+}
+
+static PyObject *
+Index_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    bitset_IndexObject *ix;
+    PyObject *arg = NULL, *it, *item;
+    int error = 0;
+
+    if (bitset_check_no_keywords(type, kwds != NULL ? PyDict_Size(kwds) : 0) ||
+        !PyArg_ParseTuple(args, "|O:BitsetIndex", &arg))
+        return NULL;
+
+    ix = (bitset_IndexObject *)type->tp_alloc(type, 0);
+    if (ix == NULL)
+        return NULL;
+
+    ix->postings = PyDict_New();
+    ix->rows = (bitset_BitsetObject *)Bitset_new(&bitset_BigBitsetType, NULL, NULL);
+    if (ix->postings == NULL || ix->rows == NULL) {
+        Py_DECREF(ix);
+        return NULL;
+    }
+    if (arg == NULL)
+        return (PyObject *)ix;
+
+    it = PyObject_GetIter(arg);
+    if (it == NULL) {
+        Py_DECREF(ix);
+        return NULL;
+    }
+    while (!error && (item = PyIter_Next(it)) != NULL) {
+        if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+            PyErr_SetString(PyExc_TypeError, "BitsetIndex() items must be (row, values) pairs");
+            error = -1;
+        }
+        else
+            error = bitset_index_add(ix, PyTuple_GET_ITEM(item, 0), PyTuple_GET_ITEM(item, 1));
+        Py_DECREF(item);
+    }
+    Py_DECREF(it);
+
+    if (error || PyErr_Occurred()) {
+        Py_DECREF(ix);
+        return NULL;
+    }
+    return (PyObject *)ix;
+}
+
+static void
+Index_dealloc(bitset_IndexObject *ix)
+{
+    Py_XDECREF(ix->postings);
+    Py_XDECREF(ix->rows);
+    Py_TYPE(ix)->tp_free((PyObject *)ix);
+}
+
+static PyObject *
+bitset_Index_add(bitset_IndexObject *ix, PyObject *args)
+{
+    PyObject *row, *values;
+
+    if (!PyArg_ParseTuple(args, "OO:add", &row, &values) ||
+        bitset_index_add(ix, row, values))
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(index_add_doc,
+"add(row, values)\n\
+\n\
+Add row, a non-negative integer, to the posting of each of values.");
+
+static PyObject *
+bitset_Index_remove(bitset_IndexObject *ix, PyObject *key)
+{
+    PyObject *value, *posting, *empty;
+    Py_ssize_t row, pos = 0, i;
+    bitset_BitsetObject *bso;
+    int error = 0;
+
+    row = bitset_member((PyObject *)ix->rows, key);
+    if (row < 0)
+        return NULL;
+    if (!bitset_has_member(ix->rows, row)) {
+        PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
+    }
+
+    /* the postings left empty are dropped after the walk over the dict */
+    empty = PyList_New(0);
+    if (empty == NULL)
+        return NULL;
+
+    while (!error && PyDict_Next(ix->postings, &pos, &value, &posting)) {
+        bso = (bitset_BitsetObject *)posting;
+        if (!bitset_has_member(bso, row))
+            continue;
+        bso->words[BITSET_WORD_INDEX(row)] &= ~BITSET_WORD_MASK(row);
+        bitset_changed(bso);
+        if (bitset_used_words(bso) == 0)
+            error = PyList_Append(empty, value);
+    }
+    for (i = 0; i < PyList_GET_SIZE(empty) && !error; i++)
+        error = PyDict_DelItem(ix->postings, PyList_GET_ITEM(empty, i));
+    Py_DECREF(empty);
+    if (error)
+        return NULL;
+
+    ix->rows->words[BITSET_WORD_INDEX(row)] &= ~BITSET_WORD_MASK(row);
+    bitset_changed(ix->rows);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(index_remove_doc,
+"remove(row)\n\
+\n\
+Remove row from the index; raises KeyError if it isn't there.");
+
+static PyObject *
+bitset_Index_query(bitset_IndexObject *ix, PyObject *query)
+{
+    bitset_query_result r = {NULL, 0};
+    bitset_BitsetObject *result;
+
+    if (bitset_query_check(query) || bitset_index_eval(ix, query, &r)) {
+        PyMem_Free(r.words);
+        return NULL;
+    }
+
+    result = (bitset_BitsetObject *)Bitset_new(&bitset_BigBitsetType, NULL, NULL);
+    if (result == NULL || r.nwords == 0) {
+        PyMem_Free(r.words);
+        return (PyObject *)result;
+    }
+    result->words = r.words;
+    result->nwords = result->allocated = r.nwords;
+    return (PyObject *)result;
+}
+
+PyDoc_STRVAR(index_query_doc,
+"query(query) -> BigBitset\n\
+\n\
+Return the rows matching query, a tuple such as\n\
+('and', ('in', 'US', 'CA'), ('not', ('eq', 'churned'))).  The operators\n\
+are ('eq', value), ('in', value, ...), ('and', query, ...),\n\
+('or', query, ...) and ('not', query); values not in the index match no\n\
+rows.");
+
+static PyObject *
+bitset_Index_count(bitset_IndexObject *ix, PyObject *query)
+{
+    bitset_query_result r = {NULL, 0};
+    Py_ssize_t count = -1;
+
+    if (bitset_query_check(query) == 0 && bitset_index_eval(ix, query, &r) == 0)
+        count = bitset_run_count(NULL, r.words, NULL, r.nwords);
+    PyMem_Free(r.words);
+
+    return count < 0 ? NULL : PyInt_FromSsize_t(count);
+}
+
+PyDoc_STRVAR(index_count_doc,
+"count(query) -> int\n\
+\n\
+Return the number of rows matching query, as len(index.query(query)).");
+
+static PyObject *
+bitset_Index_rows(bitset_IndexObject *ix)
+{
+    return bitset_copy_as(&bitset_BigBitsetType, ix->rows);
+}
+
+PyDoc_STRVAR(index_rows_doc,
+"rows() -> BigBitset\n\
+\n\
+Return all the rows in the index.");
+
+static PyObject *
+bitset_Index_keys(bitset_IndexObject *ix)
+{
+    return PyDict_Keys(ix->postings);
+}
+
+PyDoc_STRVAR(index_keys_doc,
+"keys() -> list\n\
+\n\
+Return the values with a non-empty posting.");
+
+static Py_ssize_t
+bitset_Index_len(bitset_IndexObject *ix)
+{
+    return PyDict_Size(ix->postings);
+}
+
+static PyObject *
+bitset_Index_subscript(bitset_IndexObject *ix, PyObject *value)
+{
+    bitset_BitsetObject *posting = bitset_index_posting(ix, value);
+    PyObject *result, *key;
+
+    if (posting == NULL) {
+        if (PyErr_Occurred())
+            return NULL;
+        key = PyTuple_Pack(1, value);
+        if (key != NULL) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            Py_DECREF(key);
+        }
+        return NULL;
+    }
+
+    result = bitset_copy_as(&bitset_FrozenBitsetType, posting);
+    Py_DECREF(posting);
+    return result;
+}
+
+static int
+bitset_Index_contains(bitset_IndexObject *ix, PyObject *value)
+{
+    return PyDict_Contains(ix->postings, value);
+}
+
+static PyObject *
+bitset_Index_iter(bitset_IndexObject *ix)
+{
+    return PyObject_GetIter(ix->postings);
+}
+
+static PyMappingMethods bitset_index_as_mapping = {
+    (lenfunc)bitset_Index_len,              /* mp_length */
+    (binaryfunc)bitset_Index_subscript,     /* mp_subscript */
+    0,                                      /* mp_ass_subscript */
+};
+
+static PySequenceMethods bitset_index_as_sequence = {
+    0,                                      /* sq_length */
+    0,                                      /* sq_concat */
+    0,                                      /* sq_repeat */
+    0,                                      /* sq_item */
+    0,                                      /* sq_slice */
+    0,                                      /* sq_ass_item */
+    0,                                      /* sq_ass_slice */
+    (objobjproc)bitset_Index_contains,      /* sq_contains */
+};
+
+static PyMethodDef bitset_Index_methods[] = {
+    {"add",             (PyCFunction)bitset_Index_add,
+     METH_VARARGS, index_add_doc},
+    {"count",           (PyCFunction)bitset_Index_count,
+     METH_O, index_count_doc},
+    {"keys",            (PyCFunction)bitset_Index_keys,
+     METH_NOARGS, index_keys_doc},
+    {"query",           (PyCFunction)bitset_Index_query,
+     METH_O, index_query_doc},
+    {"remove",          (PyCFunction)bitset_Index_remove,
+     METH_O, index_remove_doc},
+    {"rows",            (PyCFunction)bitset_Index_rows,
+     METH_NOARGS, index_rows_doc},
+    {NULL,        NULL}                /* sentinel */
+};
+
+PyDoc_STRVAR(bitset_BitsetIndex_doc,
+"BitsetIndex([items])\n\
+\n\
+An inverted index from values to the bitsets of rows having them, built\n\
+from (row, values) pairs, where rows are non-negative integers.\n\
+index[value] is a FrozenBitset of the rows having value, and query() and\n\
+count() evaluate boolean queries over the postings in C.");
+
+static PyTypeObject bitset_BitsetIndexType = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "bitset.BitsetIndex",                   /* tp_name */
+    sizeof(bitset_IndexObject),             /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)Index_dealloc,              /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    &bitset_index_as_sequence,              /* tp_as_sequence */
+    &bitset_index_as_mapping,               /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    bitset_BitsetIndex_doc,                 /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    (getiterfunc)bitset_Index_iter,         /* tp_iter */
+    0,                                      /* tp_iternext */
+    bitset_Index_methods,                   /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    0,                                      /* tp_init */
+    0,                                      /* tp_alloc */
+    Index_new,                              /* tp_new */
+};
+
+/***** BitSlicedIndex *****/
+
+/*
+ * A BitSlicedIndex stores an integer column as one BigBitset per bit of
+ * the values, slice i holding the rows whose value has bit i set, and a
+ * BigBitset of the rows having a value.  Comparisons walk the slices from
+ * the top bit down as in O'Neil and Quass's algorithm, keeping, for each
+ * bound, the rows equal to it so far and the rows already known to be
+ * above or below it.  lo <= v <= hi is computed for both bounds in one
+ * pass a block of words at a time, so all of <, <=, ==, >=, > and between
+ * are a single read of the slices.  sum() and top_k() use the slices'
+ * counts in the same way.
+ */
+#define BITSET_SLICES_MAX 63
+
+typedef struct {
+    PyObject_HEAD
+    int nslices;
+    bitset_BitsetObject *slices[BITSET_SLICES_MAX];
+    bitset_BitsetObject *rows;
+} bitset_SlicedObject;
+
+#define BITSET_SLICED_LT 0
+#define BITSET_SLICED_LE 1
+#define BITSET_SLICED_EQ 2
+#define BITSET_SLICED_GE 3
+#define BITSET_SLICED_GT 4
+#define BITSET_SLICED_BETWEEN 5
+
+static void
+bitset_sliced_pin(bitset_SlicedObject *bsi, int pin)
+{
+    int i;
+
+    for (i = 0; i < bsi->nslices; i++)
+        bsi->slices[i]->exports += pin ? 1 : -1;
+    bsi->rows->exports += pin ? 1 : -1;
+}
+
+/*
+ * Converts x to a long long, returning 1 if it is above the range, as
+ * PyLong_AsLongLongAndOverflow would, or -1 with an error set.
+ */
+static int
+bitset_sliced_value(PyObject *x, PY_LONG_LONG *v)
+{
+    PyObject *n = PyNumber_Index(x);
+    int overflow = 0;
+
+    if (n == NULL)
+        return -1;
+#if PY_MAJOR_VERSION < 3
+    if (PyInt_Check(n))
+        *v = PyInt_AS_LONG(n);
+    else
+#endif
+    *v = PyLong_AsLongLongAndOverflow(n, &overflow);
+    Py_DECREF(n);
+
+    if (*v == -1 && PyErr_Occurred())
+        return -1;
+    if (overflow < 0)
+        *v = -1;
+    return overflow > 0;
+}
+
+/* Returns the filter argument as a bitset, or a new reference to the rows */
+static bitset_BitsetObject *
+bitset_sliced_filter(bitset_SlicedObject *bsi, PyObject *filter)
+{
+    bitset_BitsetObject *f;
+
+    if (filter == NULL || filter == Py_None) {
+        Py_INCREF(bsi->rows);
+        return bsi->rows;
+    }
+
+    /* only the rows matter, so a RoaringBitset is read as far as they go */
+    if (bitset_Roaring_Check(filter)) {
+        f = (bitset_BitsetObject *)bitset_Bitset_copy(bsi->rows);
+        if (f != NULL && bitset_roaring_words_op(f, filter, ROARING_AND))
+            Py_CLEAR(f);
+        return f;
+    }
+    return bitset_as_bitset_type(&bitset_BigBitsetType, filter);
+}
+
+typedef struct {
+    const bitset_word *slices[BITSET_SLICES_MAX];
+    Py_ssize_t nwords[BITSET_SLICES_MAX];
+    int nslices;
+    const bitset_word *rows;
+    const bitset_word *filter;      /* or NULL */
+    bitset_word lo, hi;
+    int check_lo, check_hi;
+    bitset_word *dst;
+} bitset_sliced_args;
+
+/* Writes the rows with lo <= value <= hi over [first, end) to dst */
+static Py_ssize_t
+bitset_sliced_range(void *arg, Py_ssize_t first, Py_ssize_t end)
+{
+    bitset_sliced_args *a = (bitset_sliced_args *)arg;
+    bitset_word eqlo[BITSET_BLOCK_WORDS], gtlo[BITSET_BLOCK_WORDS];
+    bitset_word eqhi[BITSET_BLOCK_WORDS], lthi[BITSET_BLOCK_WORDS];
+    bitset_word pad[BITSET_BLOCK_WORDS], *out;
+    const bitset_word *s;
+    Py_ssize_t start, len, n, j;
+    int i;
+
+    for (start = first; start < end; start += BITSET_BLOCK_WORDS) {
+        len = Py_MIN(BITSET_BLOCK_WORDS, end - start);
+        out = a->dst + start;
+        memcpy(out, a->rows + start, len * sizeof(bitset_word));
+        if (a->filter != NULL)
+            bitset_kernels.and_(out, a->filter + start, len);
+        memcpy(eqlo, out, len * sizeof(bitset_word));
+        memcpy(eqhi, out, len * sizeof(bitset_word));
+        memset(gtlo, 0, len * sizeof(bitset_word));
+        memset(lthi, 0, len * sizeof(bitset_word));
+
+        for (i = a->nslices - 1; i >= 0; i--) {
+            n = a->nwords[i] - start;
+            if (n >= len)
+                s = a->slices[i] + start;
+            else {
+                memset(pad, 0, len * sizeof(bitset_word));
+                if (n > 0)
+                    memcpy(pad, a->slices[i] + start, n * sizeof(bitset_word));
+                s = pad;
+            }
+
+            if (a->check_lo) {
+                if ((a->lo >> i) & 1) {
+                    for (j = 0; j < len; j++)
+                        eqlo[j] &= s[j];
+                }
+                else {
+                    for (j = 0; j < len; j++) {
+                        gtlo[j] |= eqlo[j] & s[j];
+                        eqlo[j] &= ~s[j];
+                    }
+                }
+            }
+            if (a->check_hi) {
+                if ((a->hi >> i) & 1) {
+                    for (j = 0; j < len; j++) {
+                        lthi[j] |= eqhi[j] & ~s[j];
+                        eqhi[j] &= s[j];
+                    }
+                }
+                else {
+                    for (j = 0; j < len; j++)
+                        eqhi[j] &= ~s[j];
+                }
+            }
+        }
+
+        for (j = 0; j < len; j++) {
+            if (a->check_lo)
+                out[j] &= gtlo[j] | eqlo[j];
+            if (a->check_hi)
+                out[j] &= lthi[j] | eqhi[j];
+        }
+    }
+
+    return 0;
+}
+
+/* Returns a BigBitset of the rows in filter with lo <= value <= hi */
+static PyObject *
+bitset_sliced_between(bitset_SlicedObject *bsi, PY_LONG_LONG lo, PY_LONG_LONG hi,
+                      PyObject *filter)
+{
+    bitset_BitsetObject *result, *f;
+    bitset_sliced_args a;
+    bitset_word top = bsi->nslices == 0 ? 0 : ((bitset_word)1 << bsi->nslices) - 1;
+    Py_ssize_t n;
+    int i;
+
+    f = bitset_sliced_filter(bsi, filter);
+    if (f == NULL)
+        return NULL;
+    result = (bitset_BitsetObject *)Bitset_new(&bitset_BigBitsetType, NULL, NULL);
+    if (result == NULL) {
+        Py_DECREF(f);
+        return NULL;
+    }
+
+    lo = Py_MAX(lo, 0);
+    if (lo > hi || (bitset_word)lo > top) {
+        Py_DECREF(f);
+        return (PyObject *)result;
+    }
+
+    n = Py_MIN(bitset_used_words(bsi->rows), bitset_used_words(f));
+    if (bitset_grow(result, n)) {
+        Py_DECREF(f);
+        Py_DECREF(result);
+        return NULL;
+    }
+
+    a.nslices = bsi->nslices;
+    for (i = 0; i < bsi->nslices; i++) {
+        a.slices[i] = bsi->slices[i]->words;
+        a.nwords[i] = bsi->slices[i]->nwords;
+    }
+    a.rows = bsi->rows->words;
+    a.filter = f != bsi->rows ? f->words : NULL;
+    a.lo = (bitset_word)lo;
+    a.hi = Py_MIN((bitset_word)hi, top);
+    a.check_lo = a.lo > 0;
+    a.check_hi = a.hi < top;
+    a.dst = result->words;
+
+    bitset_sliced_pin(bsi, 1);
+    bitset_pin(f);
+    bitset_pin(result);
+    bitset_run_ranges(bitset_sliced_range, &a, n);
+    bitset_unpin(result);
+    bitset_unpin(f);
+    bitset_sliced_pin(bsi, 0);
+
+    Py_DECREF(f);
+    return (PyObject *)result;
+}
+
+/* The comparisons, as a range lo <= v <= hi of values */
+static PyObject *
+bitset_sliced_compare(bitset_SlicedObject *bsi, PyObject *args, int op, const char *name)
+{
+    PyObject *x, *y = NULL, *filter = NULL;
+    PY_LONG_LONG v, lo = 0, hi = PY_LLONG_MAX;
+    int above;
+
+    if (op == BITSET_SLICED_BETWEEN) {
+        if (!PyArg_UnpackTuple(args, name, 2, 3, &x, &y, &filter))
+            return NULL;
+    }
+    else if (!PyArg_UnpackTuple(args, name, 1, 2, &x, &filter))
+        return NULL;
+
+    above = bitset_sliced_value(x, &v);
+    if (above < 0)
+        return NULL;
+
+    /* the stored values are in [0, PY_LLONG_MAX] and below v is -1 */
+    switch (op) {
+    case BITSET_SLICED_LT:
+        /* nothing is below 0, and v - 1 would overflow at PY_LLONG_MIN */
+        if (!above)
+            hi = v > 0 ? v - 1 : -1;
+        break;
+    case BITSET_SLICED_LE:
+        if (!above)
+            hi = v;
+        break;
+    case BITSET_SLICED_EQ:
+        lo = hi = v;
+        if (above)
+            hi = -1;
+        break;
+    case BITSET_SLICED_GT:
+        lo = v + (v < PY_LLONG_MAX);
+        if (above || v == PY_LLONG_MAX)
+            hi = -1;
+        break;
+    default:
+        lo = v;
+        if (above)
+            hi = -1;
+    }
+
+    if (op == BITSET_SLICED_BETWEEN) {
+        above = bitset_sliced_value(y, &v);
+        if (above < 0)
+            return NULL;
+        if (!above)
+            hi = Py_MIN(hi, v);
+    }
+
+    return bitset_sliced_between(bsi, lo, hi, filter);
+}
+
+static PyObject *
+bitset_Sliced_lt(bitset_SlicedObject *bsi, PyObject *args)
+{
+    return bitset_sliced_compare(bsi, args, BITSET_SLICED_LT, "lt");
+}
+
+PyDoc_STRVAR(sliced_lt_doc,
+"lt(x[, filter]) -> BigBitset\n\
+\n\
+Return the rows, of those in filter if given, with a value less than x.");
+
+static PyObject *
+bitset_Sliced_le(bitset_SlicedObject *bsi, PyObject *args)
+{
+    return bitset_sliced_compare(bsi, args, BITSET_SLICED_LE, "le");
+}
+
+PyDoc_STRVAR(sliced_le_doc,
+"le(x[, filter]) -> BigBitset\n\
+\n\
+Return the rows, of those in filter if given, with a value at most x.");
+
+static PyObject *
+bitset_Sliced_eq(bitset_SlicedObject *bsi, PyObject *args)
+{
+    return bitset_sliced_compare(bsi, args, BITSET_SLICED_EQ, "eq");
+}
+
+PyDoc_STRVAR(sliced_eq_doc,
+"eq(x[, filter]) -> BigBitset\n\
+\n\
+Return the rows, of those in filter if given, with the value x.");
+
+static PyObject *
+bitset_Sliced_ge(bitset_SlicedObject *bsi, PyObject *args)
+{
+    return bitset_sliced_compare(bsi, args, BITSET_SLICED_GE, "ge");
+}
+
+PyDoc_STRVAR(sliced_ge_doc,
+"ge(x[, filter]) -> BigBitset\n\
+\n\
+Return the rows, of those in filter if given, with a value at least x.");
+
+static PyObject *
+bitset_Sliced_gt(bitset_SlicedObject *bsi, PyObject *args)
+{
+    return bitset_sliced_compare(bsi, args, BITSET_SLICED_GT, "gt");
+}
+
+PyDoc_STRVAR(sliced_gt_doc,
+"gt(x[, filter]) -> BigBitset\n\
+\n\
+Return the rows, of those in filter if given, with a value greater than x.");
+
+static PyObject *
+bitset_Sliced_between(bitset_SlicedObject *bsi, PyObject *args)
+{
+    return bitset_sliced_compare(bsi, args, BITSET_SLICED_BETWEEN, "between");
+}
+
+PyDoc_STRVAR(sliced_between_doc,
+"between(lo, hi[, filter]) -> BigBitset\n\
+\n\
+Return the rows, of those in filter if given, with lo <= value <= hi.");
+
+static PyObject *
+bitset_Sliced_sum(bitset_SlicedObject *bsi, PyObject *args)
+{
+    PyObject *filter = NULL, *total, *term, *shift, *tmp;
+    bitset_BitsetObject *f, *s;
+    Py_ssize_t count;
+    int i;
+
+    if (!PyArg_UnpackTuple(args, "sum", 0, 1, &filter))
+        return NULL;
+    f = bitset_sliced_filter(bsi, filter);
+    if (f == NULL)
+        return NULL;
+
+    total = PyInt_FromLong(0);
+    for (i = bsi->nslices - 1; i >= 0 && total != NULL; i--) {
+        s = bsi->slices[i];
+        bitset_pin(s);
+        bitset_pin(f);
+        count = bitset_run_count(bitset_kernels.and_count, s->words, f->words,
+                                 Py_MIN(bitset_used_words(s), bitset_used_words(f)));
+        bitset_unpin(f);
+        bitset_unpin(s);
+
+        /* total = (total << 1) + count */
+        shift = PyInt_FromLong(1);
+        term = PyInt_FromSsize_t(count);
+        tmp = shift != NULL ? PyNumber_Lshift(total, shift) : NULL;
+        Py_DECREF(total);
+        total = tmp != NULL && term != NULL ? PyNumber_Add(tmp, term) : NULL;
+        Py_XDECREF(tmp);
+        Py_XDECREF(term);
+        Py_XDECREF(shift);
+    }
+
+    Py_DECREF(f);
+    return total;
+}
+
+PyDoc_STRVAR(sliced_sum_doc,
+"sum([filter]) -> int\n\
+\n\
+Return the sum of the values of the rows, or of those in filter, from the\n\
+number of rows in each slice.");
+
+typedef struct {
+    bitset_word *taken;
+    bitset_word *candidates;
+    const bitset_word *slice;
+} bitset_take_args;
+
+/* Moves the candidates in the slice to the taken rows */
+static Py_ssize_t
+bitset_take_range(void *arg, Py_ssize_t first, Py_ssize_t end)
+{
+    bitset_take_args *a = (bitset_take_args *)arg;
+    Py_ssize_t j;
+    bitset_word w;
+
+    for (j = first; j < end; j++) {
+        w = a->candidates[j] & a->slice[j];
+        a->taken[j] |= w;
+        a->candidates[j] ^= w;
+    }
+    return 0;
+}
+
+static PyObject *
+bitset_Sliced_top_k(bitset_SlicedObject *bsi, PyObject *args)
+{
+    PyObject *filter = NULL;
+    bitset_BitsetObject *f, *result;
+    bitset_take_args a;
+    bitset_word *candidates, w, rest;
+    Py_ssize_t k, n, sn, j, taken = 0, count;
+    int i;
+
+    if (!PyArg_ParseTuple(args, "n|O:top_k", &k, &filter))
+        return NULL;
+    if (k < 0) {
+        PyErr_SetString(PyExc_ValueError, "top_k() k must be non-negative");
+        return NULL;
+    }
+    f = bitset_sliced_filter(bsi, filter);
+    if (f == NULL)
+        return NULL;
+
+    n = Py_MIN(bitset_used_words(bsi->rows), bitset_used_words(f));
+    result = (bitset_BitsetObject *)Bitset_new(&bitset_BigBitsetType, NULL, NULL);
+    candidates = PyMem_New(bitset_word, n + 1);
+    if (result == NULL || candidates == NULL || bitset_grow(result, n)) {
+        if (candidates == NULL)
+            PyErr_NoMemory();
+        PyMem_Free(candidates);
+        Py_XDECREF(result);
+        Py_DECREF(f);
+        return NULL;
+    }
+
+    /* the candidates are the rows with values tied so far, highest first */
+    bitset_sliced_pin(bsi, 1);
+    memcpy(candidates, bsi->rows->words, n * sizeof(bitset_word));
+    if (f != bsi->rows) {
+        bitset_pin(f);
+        bitset_run_words(bitset_kernels.and_, candidates, f->words, n);
+        bitset_unpin(f);
+    }
+    Py_DECREF(f);
+
+    a.taken = result->words;
+    a.candidates = candidates;
+    for (i = bsi->nslices - 1; i >= 0 && taken < k; i--) {
+        a.slice = bsi->slices[i]->words;
+        sn = Py_MIN(n, bsi->slices[i]->nwords);
+        count = taken + bitset_run_count(bitset_kernels.and_count, candidates, a.slice, sn);
+        if (count > k) {
+            bitset_run_words(bitset_kernels.and_, candidates, a.slice, sn);
+            memset(candidates + sn, 0, (n - sn) * sizeof(bitset_word));
+        }
+        else {
+            bitset_run_ranges(bitset_take_range, &a, sn);
+            taken = count;
+        }
+    }
+    bitset_sliced_pin(bsi, 0);
+
+    /* the rest are tied, so the lowest rows are taken */
+    for (j = 0; j < n && taken < k; j++) {
+        w = candidates[j];
+        count = bitset_popcount(w);
+        if (count > k - taken) {
+            rest = w;
+            for (count = k - taken; count > 0; count--)
+                rest &= rest - 1;
+            w ^= rest;
+            count = k - taken;
+        }
+        result->words[j] |= w;
+        taken += count;
+    }
+
+    PyMem_Free(candidates);
+    return (PyObject *)result;
+}
+
+PyDoc_STRVAR(sliced_top_k_doc,
+"top_k(k[, filter]) -> BigBitset\n\
+\n\
+Return k rows, of those in filter if given, with the highest values, or\n\
+all of them if there are fewer.  Of rows with equal values, the lowest\n\
+are taken.");
+
+/* Returns row's value, or -1 if it has none */
+static PY_LONG_LONG
+bitset_sliced_get(bitset_SlicedObject *bsi, Py_ssize_t row)
+{
+    PY_LONG_LONG v = 0;
+    int i;
+
+    if (!bitset_has_member(bsi->rows, row))
+        return -1;
+    for (i = 0; i < bsi->nslices; i++) {
+        if (bitset_has_member(bsi->slices[i], row))
+            v |= (PY_LONG_LONG)1 << i;
+    }
+    return v;
+}
+
+/* Clears row's bits in all the slices */
+static void
+bitset_sliced_clear(bitset_SlicedObject *bsi, Py_ssize_t row)
+{
+    int i;
+
+    for (i = 0; i < bsi->nslices; i++) {
+        if (bitset_has_member(bsi->slices[i], row)) {
+            bsi->slices[i]->words[BITSET_WORD_INDEX(row)] &= ~BITSET_WORD_MASK(row);
+            bitset_changed(bsi->slices[i]);
+        }
+    }
+}
+
+/* Sets row's value, replacing any it had */
+static int
+bitset_sliced_add(bitset_SlicedObject *bsi, PyObject *key, PyObject *value)
+{
+    PY_LONG_LONG v;
+    Py_ssize_t row;
+    int i, above;
+
+    row = bitset_member((PyObject *)bsi->rows, key);
+    if (row < 0)
+        return -1;
+    above = bitset_sliced_value(value, &v);
+    if (above < 0)
+        return -1;
+    if (above || v < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "BitSlicedIndex values must be in the range [0, 2**63)");
+        return -1;
+    }
+
+    for (i = bsi->nslices; i < BITSET_SLICES_MAX && (v >> i) != 0; i++) {
+        bsi->slices[i] = (bitset_BitsetObject *)Bitset_new(&bitset_BigBitsetType, NULL, NULL);
+        if (bsi->slices[i] == NULL)
+            return -1;
+        bsi->nslices++;
+    }
+
+    bitset_sliced_clear(bsi, row);
+    for (i = 0; i < bsi->nslices; i++) {
+        if (((v >> i) & 1) && bitset_add_member(bsi->slices[i], row))
+            return -1;
+    }
+    return bitset_add_member(bsi->rows, row);
+}
+
+static PyObject *
+Sliced_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    bitset_SlicedObject *bsi;
+    PyObject *arg = NULL, *it, *item;
+    int error = 0;
+
+    if (bitset_check_no_keywords(type, kwds != NULL ? PyDict_Size(kwds) : 0) ||
+        !PyArg_ParseTuple(args, "|O:BitSlicedIndex", &arg))
+        return NULL;
+
+    bsi = (bitset_SlicedObject *)type->tp_alloc(type, 0);
+    if (bsi == NULL)
+        return NULL;
+
+    bsi->rows = (bitset_BitsetObject *)Bitset_new(&bitset_BigBitsetType, NULL, NULL);
+    if (bsi->rows == NULL) {
+        Py_DECREF(bsi);
+        return NULL;
+    }
+    if (arg == NULL)
+        return (PyObject *)bsi;
+
+    it = PyObject_GetIter(arg);
+    if (it == NULL) {
+        Py_DECREF(bsi);
+        return NULL;
+    }
+    while (!error && (item = PyIter_Next(it)) != NULL) {
+        if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+            PyErr_SetString(PyExc_TypeError, "BitSlicedIndex() items must be (row, value) pairs");
+            error = -1;
+        }
+        else
+            error = bitset_sliced_add(bsi, PyTuple_GET_ITEM(item, 0), PyTuple_GET_ITEM(item, 1));
+        Py_DECREF(item);
+    }
+    Py_DECREF(it);
+
+    if (error || PyErr_Occurred()) {
+        Py_DECREF(bsi);
+        return NULL;
+    }
+    return (PyObject *)bsi;
+}
+
+static void
+Sliced_dealloc(bitset_SlicedObject *bsi)
+{
+    int i;
+
+    for (i = 0; i < bsi->nslices; i++)
+        Py_DECREF(bsi->slices[i]);
+    Py_XDECREF(bsi->rows);
+    Py_TYPE(bsi)->tp_free((PyObject *)bsi);
+}
+
+static PyObject *
+bitset_Sliced_add(bitset_SlicedObject *bsi, PyObject *args)
+{
+    PyObject *row, *value;
+
+    if (!PyArg_ParseTuple(args, "OO:add", &row, &value) ||
+        bitset_sliced_add(bsi, row, value))
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(sliced_add_doc,
+"add(row, value)\n\
+\n\
+Set the value of row, a non-negative integer, replacing any it had.");
+
+static PyObject *
+bitset_Sliced_remove(bitset_SlicedObject *bsi, PyObject *key)
+{
+    Py_ssize_t row;
+
+    row = bitset_member((PyObject *)bsi->rows, key);
+    if (row < 0)
+        return NULL;
+    if (!bitset_has_member(bsi->rows, row)) {
+        PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
+    }
+
+    bitset_sliced_clear(bsi, row);
+    bsi->rows->words[BITSET_WORD_INDEX(row)] &= ~BITSET_WORD_MASK(row);
+    bitset_changed(bsi->rows);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(sliced_remove_doc,
+"remove(row)\n\
+\n\
+Remove row and its value; raises KeyError if it isn't there.");
+
+static PyObject *
+bitset_Sliced_rows(bitset_SlicedObject *bsi)
+{
+    return bitset_copy_as(&bitset_BigBitsetType, bsi->rows);
+}
+
+PyDoc_STRVAR(sliced_rows_doc,
+"rows() -> BigBitset\n\
+\n\
+Return the rows having a value.");
+
+static Py_ssize_t
+bitset_Sliced_len(bitset_SlicedObject *bsi)
+{
+    return bitset_Bitset_len((PyObject *)bsi->rows);
+}
+
+static PyObject *
+bitset_Sliced_subscript(bitset_SlicedObject *bsi, PyObject *key)
+{
+    Py_ssize_t row;
+    PY_LONG_LONG v;
+
+    row = bitset_member((PyObject *)bsi->rows, key);
+    if (row < 0)
+        return NULL;
+    v = bitset_sliced_get(bsi, row);
+    if (v < 0) {
+        key = PyTuple_Pack(1, key);
+        if (key != NULL) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            Py_DECREF(key);
+        }
+        return NULL;
+    }
+    return PyLong_FromLongLong(v);
+}
+
+static int
+bitset_Sliced_contains(bitset_SlicedObject *bsi, PyObject *key)
+{
+    Py_ssize_t row;
+
+    if (bitset_key_value(key, &row) < 0)
+        return 0;
+    return bitset_has_member(bsi->rows, row);
+}
+
+static PyObject *
+bitset_Sliced_iter(bitset_SlicedObject *bsi)
+{
+    PyObject *rows = bitset_Sliced_rows(bsi), *it;
+
+    if (rows == NULL)
+        return NULL;
+    it = PyObject_GetIter(rows);
+    Py_DECREF(rows);
+    return it;
+}
+
+static PyMappingMethods bitset_sliced_as_mapping = {
+    (lenfunc)bitset_Sliced_len,             /* mp_length */
+    (binaryfunc)bitset_Sliced_subscript,    /* mp_subscript */
+    0,                                      /* mp_ass_subscript */
+};
+
+static PySequenceMethods bitset_sliced_as_sequence = {
+    0,                                      /* sq_length */
+    0,                                      /* sq_concat */
+    0,                                      /* sq_repeat */
+    0,                                      /* sq_item */
+    0,                                      /* sq_slice */
+    0,                                      /* sq_ass_item */
+    0,                                      /* sq_ass_slice */
+    (objobjproc)bitset_Sliced_contains,     /* sq_contains */
+};
+
+static PyMethodDef bitset_Sliced_methods[] = {
+    {"add",             (PyCFunction)bitset_Sliced_add,
+     METH_VARARGS, sliced_add_doc},
+    {"between",         (PyCFunction)bitset_Sliced_between,
+     METH_VARARGS, sliced_between_doc},
+    {"eq",              (PyCFunction)bitset_Sliced_eq,
+     METH_VARARGS, sliced_eq_doc},
+    {"ge",              (PyCFunction)bitset_Sliced_ge,
+     METH_VARARGS, sliced_ge_doc},
+    {"gt",              (PyCFunction)bitset_Sliced_gt,
+     METH_VARARGS, sliced_gt_doc},
+    {"le",              (PyCFunction)bitset_Sliced_le,
+     METH_VARARGS, sliced_le_doc},
+    {"lt",              (PyCFunction)bitset_Sliced_lt,
+     METH_VARARGS, sliced_lt_doc},
+    {"remove",          (PyCFunction)bitset_Sliced_remove,
+     METH_O, sliced_remove_doc},
+    {"rows",            (PyCFunction)bitset_Sliced_rows,
+     METH_NOARGS, sliced_rows_doc},
+    {"sum",             (PyCFunction)bitset_Sliced_sum,
+     METH_VARARGS, sliced_sum_doc},
+    {"top_k",           (PyCFunction)bitset_Sliced_top_k,
+     METH_VARARGS, sliced_top_k_doc},
+    {NULL,        NULL}                /* sentinel */
+};
+
+PyDoc_STRVAR(bitset_BitSlicedIndex_doc,
+"BitSlicedIndex([items])\n\
+\n\
+A column of integers in [0, 2**63) stored as one BigBitset per bit,\n\
+built from (row, value) pairs, where rows are non-negative integers.\n\
+index[row] is row's value.  The comparisons, sum() and top_k() take an\n\
+optional bitset of the rows to consider and work a word at a time.");
+
+static PyTypeObject bitset_BitSlicedIndexType = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "bitset.BitSlicedIndex",                /* tp_name */
+    sizeof(bitset_SlicedObject),            /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)Sliced_dealloc,             /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    &bitset_sliced_as_sequence,             /* tp_as_sequence */
+    &bitset_sliced_as_mapping,              /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    bitset_BitSlicedIndex_doc,              /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    (getiterfunc)bitset_Sliced_iter,        /* tp_iter */
+    0,                                      /* tp_iternext */
+    bitset_Sliced_methods,                  /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    0,                                      /* tp_init */
+    0,                                      /* tp_alloc */
+    Sliced_new,                             /* tp_new */
+};
+
+/***** Lazy expressions *****/
+
+/*
+ * bitset.lazy(x) wraps a bitset in a LazyBitset, whose operators build an
+ * expression DAG rather than computing anything.  Operations of one kind
+ * are flattened as they are built, so a | b | c is one node with three
+ * operands.  Evaluating a LazyBitset first plans the DAG into an array of
+ * nodes, children before parents:
+ *
+ *  - a node or bitset the DAG uses more than once becomes one plan node,
+ *    and a block of its result is kept for its other users;
+ *  - each node gets a bound on its used words, 0 if it must be empty, and
+ *    an estimate of its size, by which the operands of an intersection
+ *    are ordered smallest first, with its "~" operands last.
+ *
+ * The plan then runs a block of words at a time, like union_all(), so a
+ * block of every intermediate result stays in cache and the result is
+ * written once.  An intersection stops working on a block once it is
+ * empty, and nothing is computed beyond a node's bound.
+ */
+#define BITSET_LAZY_LEAF 0
+#define BITSET_LAZY_AND 1
+#define BITSET_LAZY_OR 2
+#define BITSET_LAZY_XOR 3
+#define BITSET_LAZY_SUB 4
+#define BITSET_LAZY_NOT 5
+
+typedef struct {
+    PyObject_HEAD
+    int op;
+    PyObject *operands;         /* a leaf's bitset, else a tuple of LazyBitsets */
+} bitset_LazyObject;
+
+static PyTypeObject bitset_LazyBitsetType;
+
+#define bitset_Lazy_Check(ob) (Py_TYPE(ob) == &bitset_LazyBitsetType)
+
+typedef struct {
+    int op;
+    bitset_BitsetObject *leaf;  /* borrowed from the DAG */
+    bitset_RoaringObject *roaring; /* or a copy of a RoaringBitset leaf, read a
+                                      block at a time; owned by the plan */
+    Py_ssize_t *children;       /* indices in the plan */
+    Py_ssize_t nchildren;
+    Py_ssize_t nwords;          /* bound on the used words */
+    Py_ssize_t size;            /* estimated number of members */
+    int shared;                 /* used by more than one node */
+} bitset_lazy_node;
+
+typedef struct {
+    bitset_lazy_node *nodes;
+    Py_ssize_t n;
+    Py_ssize_t allocated;
+    PyObject *built;            /* address of a DAG node or bitset -> plan index */
+} bitset_lazy_plan;
+
+static PyObject *
+bitset_lazy_new(int op, PyObject *operands)
 {
-    bso->bits = 0;
-    Py_RETURN_NONE;
+    bitset_LazyObject *node;
+
+    if (operands == NULL)
+        return NULL;
+
+    node = PyObject_New(bitset_LazyObject, &bitset_LazyBitsetType);
+    if (node == NULL) {
+        Py_DECREF(operands);
+        return NULL;
+    }
+    node->op = op;
+    node->operands = operands;
+    return (PyObject *)node;
 }
 
-PyDoc_STRVAR(clear_doc, "Remove all elements from this Bitset.");
+/* Returns obj as a LazyBitset, reading other iterables as BigBitsets */
+static PyObject *
+bitset_lazy_wrap(PyObject *obj)
+{
+    if (bitset_Lazy_Check(obj)) {
+        Py_INCREF(obj);
+        return obj;
+    }
+
+    if (bitset_Roaring_Check(obj)) {
+        Py_INCREF(obj);
+        return bitset_lazy_new(BITSET_LAZY_LEAF, obj);
+    }
+
+    return bitset_lazy_new(BITSET_LAZY_LEAF,
+                           (PyObject *)bitset_as_bitset_type(&bitset_BigBitsetType, obj));
+}
+
+/* Appends node's operands to list, or node itself if it is another operation */
+static int
+bitset_lazy_flatten(PyObject *list, PyObject *node, int op)
+{
+    PyObject *operands = ((bitset_LazyObject *)node)->operands;
+    Py_ssize_t i;
+
+    if (((bitset_LazyObject *)node)->op != op)
+        return PyList_Append(list, node);
+
+    for (i = 0; i < PyTuple_GET_SIZE(operands); i++) {
+        if (PyList_Append(list, PyTuple_GET_ITEM(operands, i)))
+            return -1;
+    }
+    return 0;
+}
 
 static PyObject *
-bitset_Bitset_update(bitset_BitsetObject *bso, PyObject *other)
+bitset_lazy_binary(int op, PyObject *a, PyObject *b)
 {
-    if (bitset_Bitset_Check(other)) {
-        bso->bits |= ((bitset_BitsetObject *)other)->bits;
-        Py_RETURN_NONE;
+    PyObject *list = NULL, *operands = NULL;
+
+    if (!(bitset_Lazy_Check(a) || bitset_BitsetLike_Check(a)) ||
+        !(bitset_Lazy_Check(b) || bitset_BitsetLike_Check(b))) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
     }
 
-    if (bitset_read_bits_from_sequence(other, &(bso->bits)))
-        return NULL;
+    a = bitset_lazy_wrap(a);
+    b = a != NULL ? bitset_lazy_wrap(b) : NULL;
+    if (b != NULL)
+        list = PyList_New(0);
 
-    Py_RETURN_NONE;
+    /* a difference only takes in the operands of one on its left */
+    if (list != NULL && bitset_lazy_flatten(list, a, op) == 0 &&
+        bitset_lazy_flatten(list, b, op == BITSET_LAZY_SUB ? -1 : op) == 0)
+        operands = PyList_AsTuple(list);
+
+    Py_XDECREF(list);
+    Py_XDECREF(a);
+    Py_XDECREF(b);
+    return bitset_lazy_new(op, operands);
 }
 
-PyDoc_STRVAR(update_doc,
-"Update a bitset with the union of itself and another.");
+static PyObject *
+bitset_Lazy_and(PyObject *a, PyObject *b)
+{
+    return bitset_lazy_binary(BITSET_LAZY_AND, a, b);
+}
 
 static PyObject *
-bitset_Bitset_remove(bitset_BitsetObject *bso, PyObject *key)
+bitset_Lazy_or(PyObject *a, PyObject *b)
 {
-    if (!PyInt_Check(key) || PyInt_AsLong(key) > 32) {
-        PyErr_SetString(PyExc_TypeError, "bitsets can only contain integers [1..32]");
-        return NULL;
+    return bitset_lazy_binary(BITSET_LAZY_OR, a, b);
+}
+
+static PyObject *
+bitset_Lazy_xor(PyObject *a, PyObject *b)
+{
+    return bitset_lazy_binary(BITSET_LAZY_XOR, a, b);
+}
+
+static PyObject *
+bitset_Lazy_sub(PyObject *a, PyObject *b)
+{
+    return bitset_lazy_binary(BITSET_LAZY_SUB, a, b);
+}
+
+static PyObject *
+bitset_Lazy_invert(bitset_LazyObject *node)
+{
+    if (node->op == BITSET_LAZY_NOT) {
+        node = (bitset_LazyObject *)PyTuple_GET_ITEM(node->operands, 0);
+        Py_INCREF(node);
+        return (PyObject *)node;
+    }
+
+    return bitset_lazy_new(BITSET_LAZY_NOT, PyTuple_Pack(1, (PyObject *)node));
+}
+
+static int
+bitset_lazy_not_error(void)
+{
+    PyErr_SetString(PyExc_ValueError,
+                    "~x can only be used as an operand of & with another bitset");
+    return -1;
+}
+
+/* Sets the bound and size of node from its children, ordering an intersection's */
+static int
+bitset_lazy_measure(bitset_lazy_plan *plan, bitset_lazy_node *node)
+{
+    bitset_lazy_node *nodes = plan->nodes, *c;
+    Py_ssize_t i, j, x;
+
+    if (node->op == BITSET_LAZY_AND) {
+        /* insertion sort, "~" operands last */
+        for (i = 1; i < node->nchildren; i++) {
+            x = node->children[i];
+            c = &nodes[x];
+            for (j = i; j > 0; j--) {
+                bitset_lazy_node *p = &nodes[node->children[j - 1]];
+
+                if ((p->op == BITSET_LAZY_NOT) < (c->op == BITSET_LAZY_NOT) ||
+                    ((p->op == BITSET_LAZY_NOT) == (c->op == BITSET_LAZY_NOT) &&
+                     p->size <= c->size))
+                    break;
+                node->children[j] = node->children[j - 1];
+            }
+            node->children[j] = x;
+        }
+        if (nodes[node->children[0]].op == BITSET_LAZY_NOT)
+            return bitset_lazy_not_error();
+    }
+
+    for (i = 0; i < node->nchildren; i++) {
+        c = &nodes[node->children[i]];
+        if (c->op == BITSET_LAZY_NOT && node->op != BITSET_LAZY_AND)
+            return bitset_lazy_not_error();
+
+        if (i == 0) {
+            node->nwords = c->nwords;
+            node->size = c->size;
+        }
+        else if (node->op == BITSET_LAZY_AND) {
+            if (c->op != BITSET_LAZY_NOT) {
+                node->nwords = Py_MIN(node->nwords, c->nwords);
+                node->size = Py_MIN(node->size, c->size);
+            }
+        }
+        else if (node->op != BITSET_LAZY_SUB) {
+            node->nwords = Py_MAX(node->nwords, c->nwords);
+            node->size = c->size > PY_SSIZE_T_MAX - node->size ? PY_SSIZE_T_MAX
+                                                                : node->size + c->size;
+        }
+    }
+
+    return 0;
+}
+
+/* Adds the DAG under obj to the plan, returning its index or -1 */
+static Py_ssize_t
+bitset_lazy_build(bitset_lazy_plan *plan, bitset_LazyObject *obj)
+{
+    bitset_lazy_node node, *nodes;
+    PyObject *key, *pos;
+    Py_ssize_t i, index = -1;
+
+    /* bitsets are planned once however many leaves wrap them */
+    key = PyLong_FromVoidPtr(obj->op == BITSET_LAZY_LEAF ? (void *)obj->operands : (void *)obj);
+    if (key == NULL)
+        return -1;
+    pos = PyDict_GetItem(plan->built, key);
+    if (pos != NULL) {
+        index = PyInt_AsSsize_t(pos);
+        if (plan->nodes[index].op != BITSET_LAZY_LEAF)
+            plan->nodes[index].shared = 1;
+        Py_DECREF(key);
+        return index;
+    }
+    if (Py_EnterRecursiveCall(" while planning a lazy bitset expression")) {
+        Py_DECREF(key);
+        return -1;
+    }
+
+    memset(&node, 0, sizeof(node));
+    node.op = obj->op;
+    if (obj->op == BITSET_LAZY_LEAF && bitset_Roaring_Check(obj->operands)) {
+        /* a RoaringBitset can't be pinned while the plan runs without the
+           GIL, so the plan reads a copy of its value now */
+        node.roaring = (bitset_RoaringObject *)bitset_Roaring_copy(
+            (bitset_RoaringObject *)obj->operands);
+        if (node.roaring == NULL)
+            goto done;
+        node.nwords = bitset_roaring_words(node.roaring);
+        node.size = bitset_roaring_len(node.roaring);
+    }
+    else if (obj->op == BITSET_LAZY_LEAF) {
+        node.leaf = (bitset_BitsetObject *)obj->operands;
+        node.nwords = bitset_used_words(node.leaf);
+        /* assume half the bits are set where the count isn't to hand */
+        node.size = node.leaf->nranks > 0 && node.leaf->exports == 0 ?
+            node.leaf->ranks[node.leaf->nranks - 1] : node.nwords * (BITSET_WORD_BITS / 2);
+    }
+    else {
+        node.nchildren = PyTuple_GET_SIZE(obj->operands);
+        node.children = PyMem_New(Py_ssize_t, node.nchildren);
+        if (node.children == NULL) {
+            PyErr_NoMemory();
+            goto done;
+        }
+        for (i = 0; i < node.nchildren; i++) {
+            node.children[i] = bitset_lazy_build(
+                plan, (bitset_LazyObject *)PyTuple_GET_ITEM(obj->operands, i));
+            if (node.children[i] < 0)
+                goto done;
+        }
+        if (bitset_lazy_measure(plan, &node))
+            goto done;
+    }
+
+    if (plan->n == plan->allocated) {
+        nodes = plan->nodes;
+        plan->allocated = plan->allocated * 2 + 8;
+        PyMem_Resize(nodes, bitset_lazy_node, plan->allocated);
+        if (nodes == NULL) {
+            PyErr_NoMemory();
+            goto done;
+        }
+        plan->nodes = nodes;
+    }
+
+    pos = PyInt_FromSsize_t(plan->n);
+    if (pos == NULL || PyDict_SetItem(plan->built, key, pos)) {
+        Py_XDECREF(pos);
+        goto done;
+    }
+    Py_DECREF(pos);
+    index = plan->n++;
+    plan->nodes[index] = node;
+    node.children = NULL;
+    node.roaring = NULL;
+
+done:
+    PyMem_Free(node.children);
+    Py_XDECREF(node.roaring);
+    Py_LeaveRecursiveCall();
+    Py_DECREF(key);
+    return index;
+}
+
+static void
+bitset_lazy_free_plan(bitset_lazy_plan *plan)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < plan->n; i++) {
+        PyMem_Free(plan->nodes[i].children);
+        Py_XDECREF(plan->nodes[i].roaring);
+    }
+    PyMem_Free(plan->nodes);
+    Py_XDECREF(plan->built);
+}
+
+/* Plans the DAG under root; the root is the last node */
+static int
+bitset_lazy_make_plan(bitset_lazy_plan *plan, bitset_LazyObject *root)
+{
+    memset(plan, 0, sizeof(*plan));
+    plan->built = PyDict_New();
+    if (plan->built == NULL || bitset_lazy_build(plan, root) < 0) {
+        bitset_lazy_free_plan(plan);
+        return -1;
+    }
+    if (root->op == BITSET_LAZY_NOT) {
+        bitset_lazy_free_plan(plan);
+        return bitset_lazy_not_error();
+    }
+    return 0;
+}
+
+static void
+bitset_lazy_pin(bitset_lazy_plan *plan, int pin)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < plan->n; i++) {
+        if (plan->nodes[i].leaf != NULL)
+            plan->nodes[i].leaf->exports += pin ? 1 : -1;
+    }
+}
+
+typedef struct {
+    const bitset_lazy_plan *plan;
+    bitset_word *dst;           /* or NULL to count the result */
+    int failed;
+} bitset_lazy_args;
+
+/* Each range a thread runs has its own scratch blocks, one per node */
+typedef struct {
+    const bitset_lazy_node *nodes;
+    bitset_word *scratch;       /* for evaluating a node's operands */
+    bitset_word *cache;         /* the last block of a shared node */
+    Py_ssize_t *cached;         /* the start of that block, or -1 */
+} bitset_lazy_state;
+
+static void bitset_lazy_block(bitset_lazy_state *st, Py_ssize_t i, Py_ssize_t start,
+                              Py_ssize_t len, bitset_word *out);
+
+/* Applies out = out op child for one of node i's children */
+static void
+bitset_lazy_apply(bitset_lazy_state *st, Py_ssize_t i, Py_ssize_t child, int op,
+                  Py_ssize_t start, Py_ssize_t len, bitset_word *out)
+{
+    const bitset_lazy_node *c = &st->nodes[child];
+    bitset_word *scratch = st->scratch + i * BITSET_BLOCK_WORDS;
+    bitset_op_kernel kernel;
+    Py_ssize_t n;
+
+    if (c->op == BITSET_LAZY_NOT) {
+        child = c->children[0];
+        c = &st->nodes[child];
+        op = BITSET_LAZY_SUB;
+    }
+
+    switch (op) {
+    case BITSET_LAZY_AND:
+        kernel = bitset_kernels.and_;
+        break;
+    case BITSET_LAZY_OR:
+        kernel = bitset_kernels.or_;
+        break;
+    case BITSET_LAZY_XOR:
+        kernel = bitset_kernels.xor_;
+        break;
+    default:
+        kernel = bitset_kernels.andnot;
+    }
+
+    if (start >= c->nwords) {
+        if (op == BITSET_LAZY_AND)
+            memset(out, 0, len * sizeof(bitset_word));
+        return;
+    }
+
+    /* bitsets are read in place */
+    if (c->op == BITSET_LAZY_LEAF && c->leaf != NULL) {
+        n = Py_MIN(len, c->leaf->nwords - start);
+        kernel(out, c->leaf->words + start, n);
+        if (op == BITSET_LAZY_AND)
+            memset(out + n, 0, (len - n) * sizeof(bitset_word));
+        return;
+    }
+
+    bitset_lazy_block(st, child, start, len, scratch);
+    kernel(out, scratch, len);
+}
+
+/* Writes words [start, start + len) of node i's result to out */
+static void
+bitset_lazy_block(bitset_lazy_state *st, Py_ssize_t i, Py_ssize_t start, Py_ssize_t len,
+                  bitset_word *out)
+{
+    const bitset_lazy_node *node = &st->nodes[i];
+    bitset_word *cache = st->cache + i * BITSET_BLOCK_WORDS;
+    Py_ssize_t j, n;
+
+    if (start >= node->nwords) {
+        memset(out, 0, len * sizeof(bitset_word));
+        return;
+    }
+    if (node->shared && st->cached[i] == start) {
+        memcpy(out, cache, len * sizeof(bitset_word));
+        return;
+    }
+
+    if (node->roaring != NULL)
+        bitset_roaring_window(node->roaring, start, len, out);
+    else if (node->op == BITSET_LAZY_LEAF) {
+        n = Py_MIN(len, node->leaf->nwords - start);
+        memcpy(out, node->leaf->words + start, n * sizeof(bitset_word));
+        memset(out + n, 0, (len - n) * sizeof(bitset_word));
+    }
+    else {
+        bitset_lazy_block(st, node->children[0], start, len, out);
+        for (j = 1; j < node->nchildren; j++) {
+            if (node->op != BITSET_LAZY_OR && node->op != BITSET_LAZY_XOR &&
+                bitset_words_empty(out, len))
+                break;
+            bitset_lazy_apply(st, i, node->children[j], node->op, start, len, out);
+        }
+    }
+
+    if (node->shared) {
+        memcpy(cache, out, len * sizeof(bitset_word));
+        st->cached[i] = start;
+    }
+}
+
+/* Runs the plan over [first, end), called without the GIL */
+static Py_ssize_t
+bitset_lazy_range(void *arg, Py_ssize_t first, Py_ssize_t end)
+{
+    bitset_lazy_args *a = (bitset_lazy_args *)arg;
+    Py_ssize_t n = a->plan->n, i, start, len, count = 0;
+    bitset_lazy_state st;
+    bitset_word *out;
+
+    st.nodes = a->plan->nodes;
+    st.scratch = (bitset_word *)malloc((2 * n + 1) * BITSET_BLOCK_WORDS * sizeof(bitset_word));
+    st.cached = (Py_ssize_t *)malloc(n * sizeof(Py_ssize_t));
+    if (st.scratch == NULL || st.cached == NULL) {
+        a->failed = 1;
+        free(st.scratch);
+        free(st.cached);
+        return 0;
+    }
+    st.cache = st.scratch + n * BITSET_BLOCK_WORDS;
+    out = st.cache + n * BITSET_BLOCK_WORDS;
+    for (i = 0; i < n; i++)
+        st.cached[i] = -1;
+
+    for (start = first; start < end; start += BITSET_BLOCK_WORDS) {
+        len = Py_MIN(BITSET_BLOCK_WORDS, end - start);
+        if (a->dst != NULL)
+            bitset_lazy_block(&st, n - 1, start, len, a->dst + start);
+        else {
+            bitset_lazy_block(&st, n - 1, start, len, out);
+            count += bitset_kernels.count(out, len);
+        }
+    }
+
+    free(st.scratch);
+    free(st.cached);
+    return count;
+}
+
+/* Evaluates node into result, or counts its members if result is NULL */
+static Py_ssize_t
+bitset_lazy_run(bitset_LazyObject *node, bitset_BitsetObject *result)
+{
+    bitset_lazy_plan plan;
+    bitset_lazy_args a;
+    Py_ssize_t count, nwords;
+
+    if (bitset_lazy_make_plan(&plan, node))
+        return -1;
+
+    nwords = plan.nodes[plan.n - 1].nwords;
+    if (result != NULL && bitset_grow(result, nwords)) {
+        bitset_lazy_free_plan(&plan);
+        return -1;
+    }
+
+    a.plan = &plan;
+    a.dst = result != NULL ? result->words : NULL;
+    a.failed = 0;
+    bitset_lazy_pin(&plan, 1);
+    if (result != NULL)
+        bitset_pin(result);
+    count = bitset_run_ranges(bitset_lazy_range, &a, nwords);
+    if (result != NULL)
+        bitset_unpin(result);
+    bitset_lazy_pin(&plan, 0);
+    bitset_lazy_free_plan(&plan);
+
+    if (a.failed) {
+        PyErr_NoMemory();
+        return -1;
     }
+    return count;
+}
+
+static PyObject *
+bitset_Lazy_evaluate(bitset_LazyObject *node)
+{
+    bitset_BitsetObject *result;
+
+    result = (bitset_BitsetObject *)Bitset_new(&bitset_BigBitsetType, NULL, NULL);
+    if (result != NULL && bitset_lazy_run(node, result) < 0)
+        Py_CLEAR(result);
+    return (PyObject *)result;
+}
+
+PyDoc_STRVAR(lazy_evaluate_doc,
+"evaluate() -> BigBitset\n\
+\n\
+Compute the expression in one pass over the words of its bitsets.");
+
+static Py_ssize_t
+bitset_Lazy_len(bitset_LazyObject *node)
+{
+    return bitset_lazy_run(node, NULL);
+}
+
+static PyObject *
+bitset_Lazy_iter(bitset_LazyObject *node)
+{
+    PyObject *result = bitset_Lazy_evaluate(node), *it;
+
+    if (result == NULL)
+        return NULL;
+    it = PyObject_GetIter(result);
+    Py_DECREF(result);
+    return it;
+}
+
+static PyObject *
+Lazy_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *arg;
+
+    if (bitset_check_no_keywords(type, kwds != NULL ? PyDict_Size(kwds) : 0) ||
+        !PyArg_ParseTuple(args, "O:LazyBitset", &arg))
+        return NULL;
+
+    return bitset_lazy_wrap(arg);
+}
+
+static void
+Lazy_dealloc(bitset_LazyObject *node)
+{
+    Py_XDECREF(node->operands);
+    PyObject_Del(node);
+}
+
+static PyObject *
+bitset_lazy(PyObject *module, PyObject *obj)
+{
+    return bitset_lazy_wrap(obj);
+}
+
+static PyNumberMethods bitset_lazy_as_number = {
+    0,                              /* nb_add */
+    (binaryfunc)bitset_Lazy_sub,    /* nb_subtract */
+    0,                              /* nb_multiply */
+#if PY_MAJOR_VERSION < 3
+    0,                              /* nb_divide */
+#endif
+    0,                              /* nb_remainder */
+    0,                              /* nb_divmod */
+    0,                              /* nb_power */
+    0,                              /* nb_negative */
+    0,                              /* nb_positive */
+    0,                              /* nb_absolute */
+    0,                              /* nb_nonzero */
+    (unaryfunc)bitset_Lazy_invert,  /* nb_invert */
+    0,                              /* nb_lshift */
+    0,                              /* nb_rshift */
+    (binaryfunc)bitset_Lazy_and,    /* nb_and */
+    (binaryfunc)bitset_Lazy_xor,    /* nb_xor */
+    (binaryfunc)bitset_Lazy_or,     /* nb_or */
+};
+
+static PySequenceMethods bitset_lazy_as_sequence = {
+    (lenfunc)bitset_Lazy_len,               /* sq_length */
+};
+
+static PyMethodDef bitset_Lazy_methods[] = {
+    {"evaluate",        (PyCFunction)bitset_Lazy_evaluate,
+     METH_NOARGS, lazy_evaluate_doc},
+    {NULL,        NULL}                /* sentinel */
+};
+
+PyDoc_STRVAR(bitset_LazyBitset_doc,
+"LazyBitset(bitset)\n\
+\n\
+A bitset expression evaluated only when needed.  The operators &, |, ^\n\
+and - with LazyBitsets or bitsets build a larger expression, and ~x may\n\
+be an operand of &, so that a & ~b is a - b.  evaluate(), len() and\n\
+iteration compute it in one pass over the words of its bitsets, using\n\
+their values at the time.");
+
+static PyTypeObject bitset_LazyBitsetType = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "bitset.LazyBitset",                    /* tp_name */
+    sizeof(bitset_LazyObject),              /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)Lazy_dealloc,               /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    &bitset_lazy_as_number,                 /* tp_as_number */
+    &bitset_lazy_as_sequence,               /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_CHECKTYPES, /* tp_flags */
+    bitset_LazyBitset_doc,                  /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    (getiterfunc)bitset_Lazy_iter,          /* tp_iter */
+    0,                                      /* tp_iternext */
+    bitset_Lazy_methods,                    /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    0,                                      /* tp_init */
+    0,                                      /* tp_alloc */
+    Lazy_new,                               /* tp_new */
+};
 
-    if (!(bso->bits & (1 << (PyInt_AsLong(key) - 1)))) {
-        PyErr_SetObject(PyExc_KeyError, key);
-        return NULL;
-    }
+/***** BitsetArray *****/
 
-    ((bitset_BitsetObject *)bso)->bits &= (~0U - (1 << (PyInt_AsLong(key) - 1)));
-    Py_RETURN_NONE;
-}
+/*
+ * A BitsetArray is a column of Bitsets stored as unsigned 32 bit rows, with
+ * member v of a row as bit (v - 1).  The rows are kept two to a word, with
+ * a zero row padding an odd length, so that operations on whole arrays can
+ * use the word kernels; a Bitset operand is broadcast to a block of words.
+ */
+typedef unsigned int bitset_row;
 
-PyDoc_STRVAR(remove_doc,
-"Remove an element from a bitset; it must be a member.\n\
-\n\
-If the element is not a member, raise a KeyError.");
+typedef struct {
+    PyObject_HEAD
+    Py_ssize_t length;          /* number of rows */
+    bitset_word *words;         /* the rows, or NULL if there are none */
+    Py_ssize_t exports;         /* buffer views; the rows can't move while > 0 */
+} bitset_ArrayObject;
 
+#define BITSET_ARRAY_ROWS(a) ((bitset_row *)(a)->words)
+#define BITSET_ARRAY_WORDS(n) (((n) + 1) / 2)
+#define BITSET_ARRAY_MAX (PY_SSIZE_T_MAX / (Py_ssize_t)sizeof(bitset_word))
 
-static PyObject *
-bitset_Bitset_discard(bitset_BitsetObject *bso, PyObject *key)
+static void
+Array_dealloc(bitset_ArrayObject *self)
 {
-    if (!PyInt_Check(key) || PyInt_AsLong(key) > 32) {
-        PyErr_SetString(PyExc_TypeError, "bitsets can only contain integers [1..32]");
-        return NULL;
-    }
-
-    bso->bits &= (~0U - (1 << (PyInt_AsLong(key) - 1)));
-    Py_RETURN_NONE;
+    PyMem_Free(self->words);
+    Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
-PyDoc_STRVAR(discard_doc,
-"Remove an element from a bitset if it is a member.\n\
-\n\
-If the element is not a member, do nothing.");
-
 static PyObject *
-bitset_Bitset_pop(bitset_BitsetObject *bso)
+Array_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
-    if (bso->bits == 0) {
-        PyErr_SetString(PyExc_KeyError, "pop from an empty bitset");
-        return NULL;
+    bitset_ArrayObject *self = (bitset_ArrayObject *)type->tp_alloc(type, 0);
+
+    if (self != NULL) {
+        self->length = 0;
+        self->words = NULL;
+        self->exports = 0;
     }
 
-    return PyInt_FromLong(bitset_pop(&(bso->bits)));
+    return (PyObject *)self;
 }
 
-PyDoc_STRVAR(pop_doc, "Remove and return an arbitrary bitset element.");
-
-static PyObject *
-bitset_Bitset_issuperset(bitset_BitsetObject *bso, PyObject *other)
+/* Replaces the rows of a with n zero rows */
+static int
+bitset_array_reset(bitset_ArrayObject *a, Py_ssize_t n)
 {
-    unsigned int otherbits = 0;
+    bitset_word *words = NULL;
 
-    if (!bitset_Bitset_Check(other)) {
-        if (bitset_read_bits_from_sequence(other, &otherbits))
-            return NULL;
+    if (a->exports > 0) {
+        PyErr_SetString(PyExc_BufferError,
+                        "Existing exports of data: object cannot be re-sized");
+        return -1;
     }
-    else {
-        otherbits = ((bitset_BitsetObject *)other)->bits;
+
+    if (n > BITSET_ARRAY_MAX) {
+        PyErr_NoMemory();
+        return -1;
     }
 
-    if (((bso->bits | otherbits) == bso->bits) && (bso->bits >= otherbits))
-        Py_RETURN_TRUE;
+    if (n > 0) {
+        words = (bitset_word *)PyMem_Malloc(BITSET_ARRAY_WORDS(n) * sizeof(bitset_word));
+        if (words == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        memset(words, 0, BITSET_ARRAY_WORDS(n) * sizeof(bitset_word));
+    }
 
-    Py_RETURN_FALSE;
+    PyMem_Free(a->words);
+    a->words = words;
+    a->length = n;
+    return 0;
 }
 
-PyDoc_STRVAR(issuperset_doc, "Report whether this bitset contains another bitset.");
-
-static PyObject *
-bitset_Bitset_issubset(bitset_BitsetObject *bso, PyObject *other)
+/* Returns a new array of the given type with n zero rows */
+static bitset_ArrayObject *
+bitset_array_new(PyTypeObject *type, Py_ssize_t n)
 {
-    unsigned int otherbits = 0;
+    bitset_ArrayObject *result = (bitset_ArrayObject *)Array_new(type, NULL, NULL);
 
-    if (!bitset_Bitset_Check(other)) {
-        if (bitset_read_bits_from_sequence(other, &otherbits))
-            return NULL;
-    }
-    else {
-        otherbits = ((bitset_BitsetObject *)other)->bits;
-    }
+    if (result != NULL && bitset_array_reset(result, n))
+        Py_CLEAR(result);
+    return result;
+}
 
-    if (((bso->bits | otherbits) == otherbits) && (bso->bits <= otherbits))
-        Py_RETURN_TRUE;
+static bitset_ArrayObject *
+bitset_array_copy_as(PyTypeObject *type, bitset_ArrayObject *a)
+{
+    bitset_ArrayObject *result = bitset_array_new(type, a->length);
 
-    Py_RETURN_FALSE;
+    if (result != NULL && a->length > 0)
+        memcpy(result->words, a->words, BITSET_ARRAY_WORDS(a->length) * sizeof(bitset_word));
+    return result;
 }
 
-PyDoc_STRVAR(issubset_doc, "Report whether another bitset contains this bitset.");
-
-static PyObject *
-bitset_Bitset_isdisjoint(bitset_BitsetObject *bso, PyObject *other)
+static void
+bitset_array_range_error(void)
 {
-    if ((bso->bits & ((bitset_BitsetObject *)other)->bits) == 0)
-        Py_RETURN_TRUE;
-    Py_RETURN_FALSE;
+    PyErr_SetString(PyExc_TypeError, "bitsets can only contain integers [1..32]");
 }
 
-PyDoc_STRVAR(isdisjoint_doc,
-"Return True if two bitsets have a null intersection.");
-
-static PyObject *
-bitset_Bitset_difference_update(bitset_BitsetObject *bso, PyObject *other)
+/* Converts a bitset, or an iterable of integers [1..32], to a row */
+static int
+bitset_row_from(PyObject *obj, bitset_row *row)
 {
-    unsigned int otherbits = 0;
-
-    if (bitset_Bitset_Check(other)) {
-        bso->bits &= ~0UL - ((bitset_BitsetObject *)other)->bits;
-        Py_RETURN_NONE;
-    }
+    bitset_BitsetObject *b;
+    Py_ssize_t n;
 
-    if (bitset_read_bits_from_sequence(other, &otherbits))
-        return NULL;
+    b = bitset_as_bitset_type(&bitset_BitsetType, obj);
+    if (b == NULL)
+        return -1;
 
-    bso->bits &= ~0UL - otherbits;
+    n = bitset_used_words(b);
+    if (n > 1 || (n == 1 && (b->words[0] & ~BITSET_SMALL_MASK))) {
+        Py_DECREF(b);
+        bitset_array_range_error();
+        return -1;
+    }
 
-    Py_RETURN_NONE;
+    *row = n == 1 ? (bitset_row)(b->words[0] >> BITSET_MIN) : 0;
+    Py_DECREF(b);
+    return 0;
 }
 
-PyDoc_STRVAR(difference_update_doc,
-"Remove all elements of another bitset from this bitset.");
-
+/* Returns a row as a new Bitset */
 static PyObject *
-bitset_Bitset_difference(bitset_BitsetObject *bso, PyObject *other)
+bitset_row_as_bitset(bitset_row row)
 {
     bitset_BitsetObject *result;
 
-    result = (bitset_BitsetObject *)bitset_Bitset_copy(bso);
-    if (result == NULL)
-        return NULL;
-
-    if (bitset_Bitset_difference_update(result, other) == NULL) {
-        Py_DECREF(result);
-        return NULL;
+    result = (bitset_BitsetObject *)Bitset_new(&bitset_BitsetType, NULL, NULL);
+    if (result != NULL && row != 0) {
+        result->nwords = 1;
+        result->smallword = (bitset_word)row << BITSET_MIN;
     }
-
     return (PyObject *)result;
 }
 
-PyDoc_STRVAR(difference_doc,
-"Return the difference of two bitsets as a new bitset.\n\
-\n\
-(i.e. all elements that are in this bitset but not the other.)");
-
-static PyObject *
-bitset_Bitset_symmetric_difference_update(bitset_BitsetObject *bso, PyObject *other)
+/* Replaces the rows of a with the bitsets from iterable */
+static int
+bitset_array_read(bitset_ArrayObject *a, PyObject *iterable)
 {
-    unsigned int otherbits = 0;
+    PyObject *seq;
+    Py_ssize_t i, n;
 
-    if (bitset_Bitset_Check(other)) {
-        bso->bits ^= ((bitset_BitsetObject *)other)->bits;
-        Py_RETURN_NONE;
+    /* another array's rows are copied by word */
+    if (bitset_Array_Check(iterable)) {
+        bitset_ArrayObject *other = (bitset_ArrayObject *)iterable;
+
+        if (other == a)
+            return 0;
+        if (bitset_array_reset(a, other->length))
+            return -1;
+        if (other->length > 0)
+            memcpy(a->words, other->words,
+                   BITSET_ARRAY_WORDS(other->length) * sizeof(bitset_word));
+        return 0;
     }
 
-    if (bitset_read_bits_from_sequence(other, &otherbits))
-        return NULL;
+    seq = PySequence_Fast(iterable, "BitsetArray() argument must be iterable");
+    if (seq == NULL)
+        return -1;
 
-    bso->bits ^= otherbits;
-    Py_RETURN_NONE;
-}
+    n = PySequence_Fast_GET_SIZE(seq);
+    if (bitset_array_reset(a, n)) {
+        Py_DECREF(seq);
+        return -1;
+    }
 
-PyDoc_STRVAR(symmetric_difference_update_doc,
-"Update a bitset with the symmetric difference of itself and another.");
+    for (i = 0; i < n; i++) {
+        if (bitset_row_from(PySequence_Fast_GET_ITEM(seq, i), &BITSET_ARRAY_ROWS(a)[i])) {
+            Py_DECREF(seq);
+            bitset_array_reset(a, 0);
+            return -1;
+        }
+    }
 
-static PyObject *
-bitset_Bitset_symmetric_difference(bitset_BitsetObject *bso, PyObject *other)
-{
-    bitset_BitsetObject *result;
+    Py_DECREF(seq);
+    return 0;
+}
 
-    result = (bitset_BitsetObject *)bitset_Bitset_copy(bso);
-    if (result == NULL)
-        return NULL;
+static int
+Array_init(bitset_ArrayObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *arg = NULL;
 
-    if (bitset_Bitset_symmetric_difference_update(result, other) == NULL) {
-        Py_DECREF(result);
-        return NULL;
-    }
+    if (bitset_check_no_keywords(Py_TYPE(self), kwds != NULL ? PyDict_Size(kwds) : 0) ||
+        !PyArg_ParseTuple(args, "|O:BitsetArray", &arg))
+        return -1;
 
-    return (PyObject *)result;
+    if (arg == NULL)
+        return bitset_array_reset(self, 0);
+    return bitset_array_read(self, arg);
 }
 
-PyDoc_STRVAR(symmetric_difference_doc,
-"Return the symmetric difference of two bitsets as a new bitset.\n\
-\n\
-(i.e. all elements that are in exactly one of the bitsets.)");
-
+#ifdef BITSET_VECTORCALL
 static PyObject *
-bitset_Bitset_union(bitset_BitsetObject *bso, PyObject *other)
+Array_vectorcall(PyObject *type, PyObject *const *args, size_t nargsf, PyObject *kwnames)
 {
-    bitset_BitsetObject *result;
-
-    result = (bitset_BitsetObject *)bitset_Bitset_copy(bso);
-    if (result == NULL)
-        return NULL;
+    PyObject *self;
 
-    if (bitset_Bitset_update(result, other) == NULL) {
-        Py_DECREF(result);
+    if (bitset_vectorcall_check(type, nargsf, kwnames))
         return NULL;
-    }
 
-    return (PyObject *)result;
+    self = Array_new((PyTypeObject *)type, NULL, NULL);
+    if (self != NULL && PyVectorcall_NARGS(nargsf) == 1 &&
+        bitset_array_read((bitset_ArrayObject *)self, args[0]))
+        Py_CLEAR(self);
+    return self;
 }
+#endif
 
-PyDoc_STRVAR(union_doc,
- "Return the union of two bitsets as a new bitset.\n\
-\n\
-(i.e. all elements that are in either bitset.)");
+/***** BitsetArray operations *****/
 
-static PyObject *
-bitset_Bitset_intersection_update(bitset_BitsetObject *bso, PyObject *other)
-{
-    unsigned int otherbits = 0;
+/*
+ * The operand of an elementwise operation: another array of the same
+ * length, or a single bitset applied to every row
+ */
+typedef struct {
+    bitset_ArrayObject *array;
+    bitset_row row;
+} bitset_array_operand;
 
-    if (bitset_Bitset_Check(other)) {
-        bso->bits &= ((bitset_BitsetObject *)other)->bits;
-        Py_RETURN_NONE;
+static int
+bitset_array_operand_from(bitset_ArrayObject *a, PyObject *other, bitset_array_operand *op)
+{
+    if (bitset_Array_Check(other)) {
+        op->array = (bitset_ArrayObject *)other;
+        if (op->array->length != a->length) {
+            PyErr_Format(PyExc_ValueError, "BitsetArray lengths differ: %zd and %zd",
+                         a->length, op->array->length);
+            return -1;
+        }
+        return 0;
     }
 
-    if (bitset_read_bits_from_sequence(other, &otherbits))
-        return NULL;
-
-    bso->bits &= otherbits;
-    Py_RETURN_NONE;
+    op->array = NULL;
+    if (!bitset_BitsetLike_Check(other)) {
+        PyErr_SetString(PyExc_TypeError, "operand must be a BitsetArray or a bitset");
+        return -1;
+    }
+    return bitset_row_from(other, &op->row);
 }
 
-PyDoc_STRVAR(intersection_update_doc,
-"Update a bitset with the intersection of itself and another.");
+typedef struct {
+    bitset_op_kernel op;
+    bitset_word *dst;
+    const bitset_word *src;     /* NULL to apply mask to every word */
+    bitset_word mask;
+} bitset_array_op_args;
 
-static PyObject *
-bitset_Bitset_intersection(bitset_BitsetObject *bso, PyObject *other)
+static Py_ssize_t
+bitset_array_op_range(void *arg, Py_ssize_t start, Py_ssize_t end)
 {
-    bitset_BitsetObject *result;
+    bitset_array_op_args *a = (bitset_array_op_args *)arg;
+    bitset_word block[BITSET_BLOCK_WORDS];
+    Py_ssize_t i, len;
 
-    result = (bitset_BitsetObject *)bitset_Bitset_copy(bso);
-    if (result == NULL)
-        return NULL;
-
-    if (bitset_Bitset_intersection_update(result, other) == NULL) {
-        Py_DECREF(result);
-        return NULL;
+    if (a->src != NULL) {
+        a->op(a->dst + start, a->src + start, end - start);
+        return 0;
     }
 
-    return (PyObject *)result;
-}
+    for (i = 0; i < Py_MIN(BITSET_BLOCK_WORDS, end - start); i++)
+        block[i] = a->mask;
 
-PyDoc_STRVAR(intersection_doc,
-"Return the intersection of two bitsets as a new bitset.\n\
-\n\
-(i.e. all elements that are in both bitsets.)");
+    for (; start < end; start += len) {
+        len = Py_MIN(BITSET_BLOCK_WORDS, end - start);
+        a->op(a->dst + start, block, len);
+    }
+    return 0;
+}
 
-static PyObject *
-bitset_Bitset_reduce(bitset_BitsetObject *bso)
+/* Applies rows = rows op operand to every row of a */
+static void
+bitset_array_apply(bitset_ArrayObject *a, bitset_op_kernel op, bitset_array_operand *operand)
 {
-    PyObject *result, *args, *state;
+    bitset_array_op_args args;
+    bitset_ArrayObject *src = operand->array;
 
-    args = PyTuple_New(0);
-
-    state = PyInt_FromLong(bso->bits);
-    result = PyTuple_Pack(3, bso->ob_type, args, state);
+    if (a->length == 0)
+        return;
 
-    Py_XDECREF(args);
-    Py_XDECREF(state);
-    return result;
+    args.op = op;
+    args.dst = a->words;
+    args.src = src != NULL ? src->words : NULL;
+    args.mask = (bitset_word)operand->row | ((bitset_word)operand->row << 32);
+
+    bitset_pin(a);
+    if (src != NULL)
+        bitset_pin(src);
+    bitset_run_ranges(bitset_array_op_range, &args, BITSET_ARRAY_WORDS(a->length));
+    if (src != NULL)
+        bitset_unpin(src);
+    bitset_unpin(a);
+
+    /* keep the padding row empty */
+    if (a->length % 2)
+        BITSET_ARRAY_ROWS(a)[a->length] = 0;
 }
 
-PyDoc_STRVAR(reduce_doc, "Return state information for pickling.");
+static bitset_op_kernel
+bitset_array_kernel(int op)
+{
+    switch (op) {
+    case ROARING_AND:
+        return bitset_kernels.and_;
+    case ROARING_OR:
+        return bitset_kernels.or_;
+    case ROARING_XOR:
+        return bitset_kernels.xor_;
+    default:
+        return bitset_kernels.andnot;
+    }
+}
 
+/*
+ * Returns v op w, where either may be a bitset applied to every row of the
+ * other, which must be an array
+ */
 static PyObject *
-bitset_Bitset_setstate(bitset_BitsetObject *bso, PyObject *state)
+bitset_array_binary(PyObject *v, PyObject *w, int op)
 {
-    if (!PyInt_Check(state)) {
-        PyErr_SetString(PyExc_TypeError, "Invalid state in __setstate__");
-        return NULL;
+    bitset_ArrayObject *result;
+    bitset_array_operand operand;
+    int reflected = !bitset_Array_Check(v);
+
+    if (reflected ? !bitset_BitsetLike_Check(v) :
+        !bitset_Array_Check(w) && !bitset_BitsetLike_Check(w)) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
     }
 
-    bso->bits = PyInt_AsLong(state);
+    if (reflected) {
+        PyObject *t = v;
+        v = w;
+        w = t;
+    }
 
-    Py_RETURN_NONE;
-}
+    if (bitset_array_operand_from((bitset_ArrayObject *)v, w, &operand))
+        return NULL;
 
-PyDoc_STRVAR(setstate_doc, "Sets state information.");
+    result = bitset_array_copy_as(Py_TYPE(v), (bitset_ArrayObject *)v);
+    if (result == NULL)
+        return NULL;
 
-static PyMethodDef bitset_Bitset_methods[] = {
-    {"add",                         (PyCFunction)bitset_Bitset_add,
-     METH_O, add_doc},
-    {"clear",                       (PyCFunction)bitset_Bitset_clear,
-     METH_NOARGS, clear_doc},
-/*     {"__contains__",                (PyCFunction)bitset_Bitset_direct_contains, */
-/*      METH_O | METH_COEXIST, contains_doc}, */
-    {"copy",                        (PyCFunction)bitset_Bitset_copy,
-     METH_NOARGS, copy_doc},
-    {"discard",                     (PyCFunction)bitset_Bitset_discard,
-     METH_O, discard_doc},
-    {"difference",                  (PyCFunction)bitset_Bitset_difference,
-     METH_O, difference_doc},
-    {"difference_update",           (PyCFunction)bitset_Bitset_difference_update,
-     METH_O, difference_update_doc}, /*  */
-    {"intersection",                (PyCFunction)bitset_Bitset_intersection,
-     METH_O, intersection_doc},
-    {"intersection_update",         (PyCFunction)bitset_Bitset_intersection_update,
-     METH_O, intersection_update_doc},
-    {"isdisjoint",                  (PyCFunction)bitset_Bitset_isdisjoint,
-     METH_O, isdisjoint_doc},
-    {"issubset",                    (PyCFunction)bitset_Bitset_issubset,
-     METH_O, issubset_doc},
-    {"issuperset",                  (PyCFunction)bitset_Bitset_issuperset,
-     METH_O, issuperset_doc},
-    {"pop",                         (PyCFunction)bitset_Bitset_pop,
-     METH_NOARGS, pop_doc},
-    {"__reduce__",                  (PyCFunction)bitset_Bitset_reduce,
-     METH_NOARGS, reduce_doc},
-    {"remove",                      (PyCFunction)bitset_Bitset_remove,
-     METH_O, remove_doc},
-    {"__setstate__",                (PyCFunction)bitset_Bitset_setstate,
-     METH_O, setstate_doc},
-    {"symmetric_difference",        (PyCFunction)bitset_Bitset_symmetric_difference,
-     METH_O, symmetric_difference_doc},
-    {"symmetric_difference_update", (PyCFunction)bitset_Bitset_symmetric_difference_update,
-     METH_O, symmetric_difference_update_doc},
-/* #ifdef Py_DEBUG */
-/*     {"test_c_api",                  (PyCFunction)test_c_api,                                 */
-/*      METH_NOARGS, test_c_api_doc}, */
-/* #endif */
-    {"union",                       (PyCFunction)bitset_Bitset_union,
-     METH_O, union_doc},
-    {"update",                      (PyCFunction)bitset_Bitset_update,
-     METH_O, update_doc},
-    {NULL,        NULL}                /* sentinel */
-};
+    /* bitset - array is computed as ((rows ^ bitset) & bitset) */
+    if (reflected && op == ROARING_ANDNOT) {
+        bitset_array_apply(result, bitset_kernels.xor_, &operand);
+        op = ROARING_AND;
+    }
+    bitset_array_apply(result, bitset_array_kernel(op), &operand);
 
-/***** number methods *****/
+    return (PyObject *)result;
+}
 
 static PyObject *
-bitset_Bitset_sub(bitset_BitsetObject *bso, PyObject *other)
+bitset_array_inplace(PyObject *v, PyObject *w, int op)
 {
-    if (!bitset_Bitset_Check(bso) || !bitset_Bitset_Check(other)) {
+    bitset_array_operand operand;
+
+    if (!bitset_Array_Check(v) || (!bitset_Array_Check(w) && !bitset_BitsetLike_Check(w))) {
         Py_INCREF(Py_NotImplemented);
         return Py_NotImplemented;
     }
 
-    return bitset_Bitset_difference(bso, other);
+    if (bitset_array_operand_from((bitset_ArrayObject *)v, w, &operand))
+        return NULL;
+
+    bitset_array_apply((bitset_ArrayObject *)v, bitset_array_kernel(op), &operand);
+    Py_INCREF(v);
+    return v;
 }
 
-static PyObject *
-bitset_Bitset_isub(bitset_BitsetObject *bso, PyObject *other)
+#define BITSET_ARRAY_BINARY(name, op)                                   \
+static PyObject *                                                       \
+name(PyObject *v, PyObject *w)                                          \
+{                                                                       \
+    return bitset_array_binary(v, w, op);                               \
+}
+
+#define BITSET_ARRAY_INPLACE(name, op)                                  \
+static PyObject *                                                       \
+name(PyObject *v, PyObject *w)                                          \
+{                                                                       \
+    return bitset_array_inplace(v, w, op);                              \
+}
+
+BITSET_ARRAY_BINARY(bitset_Array_sub, ROARING_ANDNOT)
+BITSET_ARRAY_BINARY(bitset_Array_and, ROARING_AND)
+BITSET_ARRAY_BINARY(bitset_Array_xor, ROARING_XOR)
+BITSET_ARRAY_BINARY(bitset_Array_or, ROARING_OR)
+BITSET_ARRAY_INPLACE(bitset_Array_isub, ROARING_ANDNOT)
+BITSET_ARRAY_INPLACE(bitset_Array_iand, ROARING_AND)
+BITSET_ARRAY_INPLACE(bitset_Array_ixor, ROARING_XOR)
+BITSET_ARRAY_INPLACE(bitset_Array_ior, ROARING_OR)
+
+/*
+ * The per-row queries write one byte per row into a bytearray, which numpy
+ * can read without copying as uint8 or bool.
+ */
+#define BITSET_ARRAY_LENGTHS 0
+#define BITSET_ARRAY_CONTAINS 1
+#define BITSET_ARRAY_SUBSET 2
+
+typedef struct {
+    int query;
+    const bitset_row *rows;
+    const bitset_row *other;    /* NULL to use row for every row */
+    bitset_row row;
+    unsigned char *out;
+} bitset_array_query_args;
+
+static Py_ssize_t
+bitset_array_query_range(void *arg, Py_ssize_t start, Py_ssize_t end)
 {
-    if (!bitset_Bitset_Check(bso) || !bitset_Bitset_Check(other)) {
-        Py_INCREF(Py_NotImplemented);
-        return Py_NotImplemented;
+    bitset_array_query_args *a = (bitset_array_query_args *)arg;
+    const bitset_row *rows = a->rows;
+    unsigned char *out = a->out;
+    bitset_row row = a->row;
+    Py_ssize_t i;
+
+    switch (a->query) {
+    case BITSET_ARRAY_LENGTHS:
+        for (i = start; i < end; i++)
+            out[i] = (unsigned char)bitset_popcount(rows[i]);
+        break;
+    case BITSET_ARRAY_CONTAINS:
+        for (i = start; i < end; i++)
+            out[i] = (rows[i] & row) != 0;
+        break;
+    case BITSET_ARRAY_SUBSET:
+        if (a->other != NULL) {
+            for (i = start; i < end; i++)
+                out[i] = (rows[i] & ~a->other[i]) == 0;
+        }
+        else {
+            for (i = start; i < end; i++)
+                out[i] = (rows[i] & ~row) == 0;
+        }
+        break;
     }
+    return 0;
+}
 
-    bitset_Bitset_difference_update(bso, other);
+/* Returns a bytearray with the result of query for each row of a */
+static PyObject *
+bitset_array_query(bitset_ArrayObject *a, int query, bitset_array_operand *operand)
+{
+    bitset_array_query_args args;
+    PyObject *result;
+
+    result = PyByteArray_FromStringAndSize(NULL, a->length);
+    if (result == NULL || a->length == 0)
+        return result;
+
+    args.query = query;
+    args.rows = BITSET_ARRAY_ROWS(a);
+    args.other = operand->array != NULL ? BITSET_ARRAY_ROWS(operand->array) : NULL;
+    args.row = operand->row;
+    args.out = (unsigned char *)PyByteArray_AS_STRING(result);
+
+    bitset_pin(a);
+    if (operand->array != NULL)
+        bitset_pin(operand->array);
+    bitset_run_ranges(bitset_array_query_range, &args, a->length);
+    if (operand->array != NULL)
+        bitset_unpin(operand->array);
+    bitset_unpin(a);
 
-    Py_INCREF(bso);
-    return (PyObject *)bso;
+    return result;
 }
 
 static PyObject *
-bitset_Bitset_and(bitset_BitsetObject *bso, PyObject *other)
+bitset_Array_lengths(bitset_ArrayObject *a)
 {
-    bitset_BitsetObject *result;
+    bitset_array_operand operand;
 
-    if (!bitset_Bitset_Check(bso) || !bitset_Bitset_Check(other)) {
-        Py_INCREF(Py_NotImplemented);
-        return Py_NotImplemented;
+    operand.array = NULL;
+    operand.row = 0;
+    return bitset_array_query(a, BITSET_ARRAY_LENGTHS, &operand);
+}
+
+PyDoc_STRVAR(array_lengths_doc,
+"lengths() -> bytearray\n\
+\n\
+Return the number of members of each row.");
+
+static PyObject *
+bitset_Array_contains(bitset_ArrayObject *a, PyObject *key)
+{
+    bitset_array_operand operand;
+    Py_ssize_t value;
+
+    if (bitset_key_value(key, &value)) {
+        bitset_array_range_error();
+        return NULL;
     }
 
-    result = (bitset_BitsetObject *)bitset_Bitset_copy(bso);
-    if (result == NULL)
+    operand.array = NULL;
+    operand.row = 0;
+    if (value >= BITSET_MIN && value <= BITSET_MAX)
+        operand.row = (bitset_row)1 << (value - BITSET_MIN);
+    return bitset_array_query(a, BITSET_ARRAY_CONTAINS, &operand);
+}
+
+PyDoc_STRVAR(array_contains_doc,
+"contains(k) -> bytearray\n\
+\n\
+Return 1 for each row that has k as a member, and 0 for the others.");
+
+static PyObject *
+bitset_Array_issubset(bitset_ArrayObject *a, PyObject *other)
+{
+    bitset_array_operand operand;
+
+    if (bitset_array_operand_from(a, other, &operand))
         return NULL;
+    return bitset_array_query(a, BITSET_ARRAY_SUBSET, &operand);
+}
+
+PyDoc_STRVAR(array_issubset_doc,
+"issubset(other) -> bytearray\n\
+\n\
+Return 1 for each row that is a subset of the same row of other, or of\n\
+other itself if it is a bitset, and 0 for the others.");
 
-    result->bits &= ((bitset_BitsetObject *)other)->bits;
+/***** BitsetArray methods *****/
 
-    return (PyObject *)result;
+static Py_ssize_t
+bitset_Array_len(bitset_ArrayObject *a)
+{
+    return a->length;
 }
 
 static PyObject *
-bitset_Bitset_iand(bitset_BitsetObject *bso, PyObject *other)
+bitset_Array_item(bitset_ArrayObject *a, Py_ssize_t i)
 {
-    if (!bitset_Bitset_Check(bso) || !bitset_Bitset_Check(other)) {
-        Py_INCREF(Py_NotImplemented);
-        return Py_NotImplemented;
+    if (i < 0 || i >= a->length) {
+        PyErr_SetString(PyExc_IndexError, "BitsetArray index out of range");
+        return NULL;
     }
+    return bitset_row_as_bitset(BITSET_ARRAY_ROWS(a)[i]);
+}
 
-    bso->bits &= ((bitset_BitsetObject *)other)->bits;
+static int
+bitset_Array_ass_item(bitset_ArrayObject *a, Py_ssize_t i, PyObject *value)
+{
+    if (i < 0 || i >= a->length) {
+        PyErr_SetString(PyExc_IndexError, "BitsetArray assignment index out of range");
+        return -1;
+    }
 
-    Py_INCREF(bso);
-    return (PyObject *)bso;
+    if (value == NULL) {
+        PyErr_SetString(PyExc_TypeError, "BitsetArray rows can't be deleted");
+        return -1;
+    }
+
+    return bitset_row_from(value, &BITSET_ARRAY_ROWS(a)[i]);
 }
 
+static PySequenceMethods bitset_array_as_sequence = {
+    (lenfunc)bitset_Array_len,              /* sq_length */
+    0,                                      /* sq_concat */
+    0,                                      /* sq_repeat */
+    (ssizeargfunc)bitset_Array_item,        /* sq_item */
+    0,                                      /* sq_slice */
+    (ssizeobjargproc)bitset_Array_ass_item, /* sq_ass_item */
+    0,                                      /* sq_ass_slice */
+    0,                                      /* sq_contains */
+};
+
 static PyObject *
-bitset_Bitset_xor(bitset_BitsetObject *bso, PyObject *other)
+bitset_Array_copy(bitset_ArrayObject *a)
 {
-    bitset_BitsetObject *result;
+    return (PyObject *)bitset_array_copy_as(Py_TYPE(a), a);
+}
 
-    if (!bitset_Bitset_Check(bso) || !bitset_Bitset_Check(other)) {
-        Py_INCREF(Py_NotImplemented);
-        return Py_NotImplemented;
-    }
+PyDoc_STRVAR(array_copy_doc, "Return a copy of a BitsetArray.");
 
-    result = (bitset_BitsetObject *)bitset_Bitset_copy(bso);
-    if (result == NULL)
+static PyObject *
+bitset_Array_from_buffer(PyTypeObject *type, PyObject *obj)
+{
+    bitset_ArrayObject *result = NULL;
+    Py_buffer view;
+
+    if (bitset_get_buffer(obj, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT))
         return NULL;
 
-    result->bits ^= ((bitset_BitsetObject *)other)->bits;
+    if ((view.itemsize == 1 || view.itemsize == sizeof(bitset_row)) &&
+        view.len % sizeof(bitset_row) == 0) {
+        result = bitset_array_new(type, view.len / sizeof(bitset_row));
+        if (result != NULL && view.len > 0)
+            memcpy(result->words, view.buf, view.len);
+    }
+    else {
+        PyErr_SetString(PyExc_ValueError, "buffer must hold 4 byte rows");
+    }
 
+    PyBuffer_Release(&view);
     return (PyObject *)result;
 }
 
+PyDoc_STRVAR(array_from_buffer_doc,
+"from_buffer(buffer) -> new BitsetArray\n\
+\n\
+Build a BitsetArray by copying rows from an object supporting the buffer\n\
+protocol, such as a numpy uint32 array.  Each native 4 byte integer is a\n\
+row with member v as bit (v - 1); buffers of bytes are read 4 at a time.");
+
+/* Pickled state is bytes holding each row as 4 little-endian bytes */
 static PyObject *
-bitset_Bitset_ixor(bitset_BitsetObject *bso, PyObject *other)
+bitset_Array_reduce(bitset_ArrayObject *a)
 {
-    if (!bitset_Bitset_Check(bso) || !bitset_Bitset_Check(other)) {
-        Py_INCREF(Py_NotImplemented);
-        return Py_NotImplemented;
-    }
+    PyObject *state;
+    unsigned char *p;
+    Py_ssize_t i;
 
-    bso->bits ^= ((bitset_BitsetObject *)other)->bits;
+    state = PyBytes_FromStringAndSize(NULL, a->length * sizeof(bitset_row));
+    if (state == NULL)
+        return NULL;
 
-    Py_INCREF(bso);
-    return (PyObject *)bso;
+    p = (unsigned char *)PyBytes_AS_STRING(state);
+    for (i = 0; i < a->length; i++)
+        bitset_put_le(p + i * sizeof(bitset_row), BITSET_ARRAY_ROWS(a)[i], sizeof(bitset_row));
+
+    return Py_BuildValue("O()N", Py_TYPE(a), state);
 }
 
 static PyObject *
-bitset_Bitset_or(bitset_BitsetObject *bso, PyObject *other)
+bitset_Array_setstate(bitset_ArrayObject *a, PyObject *state)
 {
-    bitset_BitsetObject *result;
+    const unsigned char *p;
+    Py_ssize_t i, n;
 
-    if (!bitset_Bitset_Check(bso) || !bitset_Bitset_Check(other)) {
-        Py_INCREF(Py_NotImplemented);
-        return Py_NotImplemented;
+    if (!PyBytes_Check(state) || PyBytes_GET_SIZE(state) % sizeof(bitset_row)) {
+        PyErr_SetString(PyExc_TypeError, "Invalid state in __setstate__");
+        return NULL;
     }
 
-    result = (bitset_BitsetObject *)bitset_Bitset_copy(bso);
-    if (result == NULL)
+    n = PyBytes_GET_SIZE(state) / sizeof(bitset_row);
+    if (bitset_array_reset(a, n))
         return NULL;
 
-    result->bits |= ((bitset_BitsetObject *)other)->bits;
+    p = (const unsigned char *)PyBytes_AS_STRING(state);
+    for (i = 0; i < n; i++)
+        BITSET_ARRAY_ROWS(a)[i] = (bitset_row)bitset_get_le(p + i * sizeof(bitset_row),
+                                                            sizeof(bitset_row));
 
-    return (PyObject *)result;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+bitset_Array_sizeof(bitset_ArrayObject *a)
+{
+    return PyInt_FromSsize_t(Py_TYPE(a)->tp_basicsize +
+                             BITSET_ARRAY_WORDS(a->length) * sizeof(bitset_word));
 }
 
+PyDoc_STRVAR(array_sizeof_doc, "Return the memory used by a BitsetArray in bytes.");
+
 static PyObject *
-bitset_Bitset_ior(bitset_BitsetObject *bso, PyObject *other)
+bitset_Array_richcompare(bitset_ArrayObject *v, PyObject *w, int op)
 {
-    if (!bitset_Bitset_Check(bso) || !bitset_Bitset_Check(other)) {
+    bitset_ArrayObject *wa = (bitset_ArrayObject *)w;
+    int equal;
+
+    if (!bitset_Array_Check(w) || (op != Py_EQ && op != Py_NE)) {
         Py_INCREF(Py_NotImplemented);
         return Py_NotImplemented;
     }
 
-    bso->bits |= ((bitset_BitsetObject *)other)->bits;
-
-    Py_INCREF(bso);
-    return (PyObject *)bso;
+    equal = v->length == wa->length &&
+        (v->length == 0 ||
+         memcmp(v->words, wa->words, v->length * sizeof(bitset_row)) == 0);
+    return PyBool_FromLong(op == Py_EQ ? equal : !equal);
 }
 
-static PyNumberMethods bitset_as_number = {
+static PyMethodDef bitset_Array_methods[] = {
+    {"contains",        (PyCFunction)bitset_Array_contains,
+     METH_O, array_contains_doc},
+    {"copy",            (PyCFunction)bitset_Array_copy,
+     METH_NOARGS, array_copy_doc},
+    {"from_buffer",     (PyCFunction)bitset_Array_from_buffer,
+     METH_O | METH_CLASS, array_from_buffer_doc},
+    {"issubset",        (PyCFunction)bitset_Array_issubset,
+     METH_O, array_issubset_doc},
+    {"lengths",         (PyCFunction)bitset_Array_lengths,
+     METH_NOARGS, array_lengths_doc},
+    {"__reduce__",      (PyCFunction)bitset_Array_reduce,
+     METH_NOARGS, reduce_doc},
+    {"__setstate__",    (PyCFunction)bitset_Array_setstate,
+     METH_O, setstate_doc},
+    {"__sizeof__",      (PyCFunction)bitset_Array_sizeof,
+     METH_NOARGS, array_sizeof_doc},
+    {NULL,              NULL}           /* sentinel */
+};
+
+static PyNumberMethods bitset_array_as_number = {
     0,                              /* nb_add */
-    (binaryfunc)bitset_Bitset_sub,    /* nb_subtract */
+    bitset_Array_sub,               /* nb_subtract */
     0,                              /* nb_multiply */
+#if PY_MAJOR_VERSION < 3
     0,                              /* nb_divide */
+#endif
     0,                              /* nb_remainder */
     0,                              /* nb_divmod */
     0,                              /* nb_power */
@@ -780,158 +13187,119 @@ static PyNumberMethods bitset_as_number = {
     0,                              /* nb_invert */
     0,                              /* nb_lshift */
     0,                              /* nb_rshift */
-    (binaryfunc)bitset_Bitset_and,    /* nb_and */
-     (binaryfunc)bitset_Bitset_xor,    /* nb_xor */
-    (binaryfunc)bitset_Bitset_or,    /* nb_or */
+    bitset_Array_and,               /* nb_and */
+    bitset_Array_xor,               /* nb_xor */
+    bitset_Array_or,                /* nb_or */
+#if PY_MAJOR_VERSION < 3
     0,                              /* nb_coerce */
+#endif
     0,                              /* nb_int */
     0,                              /* nb_long */
     0,                              /* nb_float */
+#if PY_MAJOR_VERSION < 3
     0,                              /* nb_oct */
     0,                              /* nb_hex */
+#endif
     0,                              /* nb_inplace_add */
-    (binaryfunc)bitset_Bitset_isub, /* nb_inplace_subtract */
+    bitset_Array_isub,              /* nb_inplace_subtract */
     0,                              /* nb_inplace_multiply */
+#if PY_MAJOR_VERSION < 3
     0,                              /* nb_inplace_divide */
+#endif
     0,                              /* nb_inplace_remainder */
     0,                              /* nb_inplace_power */
     0,                              /* nb_inplace_lshift */
     0,                              /* nb_inplace_rshift */
-    (binaryfunc)bitset_Bitset_iand, /* nb_inplace_and */
-    (binaryfunc)bitset_Bitset_ixor, /* nb_inplace_xor */
-    (binaryfunc)bitset_Bitset_ior,    /* nb_inplace_or */
+    bitset_Array_iand,              /* nb_inplace_and */
+    bitset_Array_ixor,              /* nb_inplace_xor */
+    bitset_Array_ior,               /* nb_inplace_or */
 };
 
+/***** BitsetArray buffer interface *****/
+
+/* The rows are exported as native unsigned 32 bit integers (format 'I') */
 static int
-Bitset_init(bitset_BitsetObject *self, PyObject *args, PyObject *kwds)
+bitset_Array_getbuffer(bitset_ArrayObject *a, Py_buffer *view, int flags)
 {
-    PyObject *arg = NULL;
-
-    if (!PyArg_ParseTuple(args, "|O", &arg))
-        return -1;
-
-    if (arg == NULL)
-        return 0;
-
-    if (bitset_read_bits_from_sequence(arg, &(self->bits))) {
-        self->bits = 0;
-        return -1;
+    view->obj = (PyObject *)a;
+    view->buf = a->words != NULL ? (void *)a->words : (void *)&a->length;
+    view->len = a->length * sizeof(bitset_row);
+    view->readonly = 0;
+    view->ndim = 1;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+
+    if (flags & PyBUF_FORMAT) {
+        view->format = "I";
+        view->itemsize = sizeof(bitset_row);
+        view->shape = &a->length;
     }
-
-    return 0;
-}
-
-static PyObject *
-Bitset_repr(bitset_BitsetObject *bso)
-{
-    PyObject *keys, *result=NULL, *listrepr;
-    int status = Py_ReprEnter((PyObject*)bso);
-
-    if (status != 0) {
-        if (status < 0)
-            return NULL;
-        return PyString_FromFormat("%s(...)", bso->ob_type->tp_name);
+    else {
+        view->format = NULL;
+        view->itemsize = 1;
+        view->shape = (flags & PyBUF_ND) ? &view->len : NULL;
     }
+    view->strides = (flags & PyBUF_STRIDES) ? &view->itemsize : NULL;
 
-    keys = PySequence_List((PyObject *)bso);
-    if (keys == NULL)
-        goto done;
-    listrepr = PyObject_Repr(keys);
-    Py_DECREF(keys);
-    if (listrepr == NULL)
-        goto done;
-
-    result = PyString_FromFormat("%s(%s)", bso->ob_type->tp_name,
-        PyString_AS_STRING(listrepr));
-    Py_DECREF(listrepr);
-done:
-    Py_ReprLeave((PyObject*)bso);
-    return result;
+    Py_INCREF(a);
+    a->exports++;
+    return 0;
 }
 
-static PyObject *
-bitset_Bitset_richcompare(bitset_BitsetObject *v, PyObject *w, int op)
+static void
+bitset_Array_releasebuffer(bitset_ArrayObject *a, Py_buffer *view)
 {
-    if (!bitset_Bitset_Check(w)) {
-        if (op == Py_EQ)
-            Py_RETURN_FALSE;
-        if (op == Py_NE)
-            Py_RETURN_TRUE;
-        PyErr_SetString(PyExc_TypeError, "can only compare to a bitset");
-
-        return NULL;
-    }
-    
-    switch (op) {
-    case Py_EQ:
-        if (v->bits == ((bitset_BitsetObject *)w)->bits)
-            Py_RETURN_TRUE;
-        Py_RETURN_FALSE;
-
-    case Py_NE:
-        if (v->bits != ((bitset_BitsetObject *)w)->bits)
-            Py_RETURN_TRUE;
-        Py_RETURN_FALSE;
-
-    case Py_LT:
-        if (v->bits == ((bitset_BitsetObject *)w)->bits)
-            Py_RETURN_FALSE;
-    case Py_LE:
-        return bitset_Bitset_issubset(v, w);
-
-    case Py_GT:
-        if (v->bits == ((bitset_BitsetObject *)w)->bits)
-            Py_RETURN_FALSE;
-    case Py_GE:
-        return bitset_Bitset_issuperset(v, w);
-    }
-
-    Py_INCREF(Py_NotImplemented);
-    return Py_NotImplemented;
+    a->exports--;
 }
 
-static int
-bitset_Bitset_nocmp(PyObject *self, PyObject *other)
-{
-    PyErr_SetString(PyExc_TypeError, "cannot compare bitsets using cmp()");
-    return -1;
-}
+static PyBufferProcs bitset_array_as_buffer = {
+#if PY_MAJOR_VERSION < 3
+    0,                                          /* bf_getreadbuffer */
+    0,                                          /* bf_getwritebuffer */
+    0,                                          /* bf_getsegcount */
+    0,                                          /* bf_getcharbuffer */
+#endif
+    (getbufferproc)bitset_Array_getbuffer,      /* bf_getbuffer */
+    (releasebufferproc)bitset_Array_releasebuffer, /* bf_releasebuffer */
+};
 
-PyDoc_STRVAR(bitset_Bitset_doc,
-"Bitset(iterable) --> Bitset object\n\
+PyDoc_STRVAR(bitset_BitsetArray_doc,
+"BitsetArray(iterable) --> BitsetArray object\n\
 \n\
-Build an unordered set of integers in the range [1,32].");
-
-PyTypeObject bitset_BitsetType = {
-    PyObject_HEAD_INIT(NULL)
-    0,                                      /* ob_size */
-    "bitset.Bitset",                        /* tp_name */
-    sizeof(bitset_BitsetObject),            /* tp_basicsize */
+Build a fixed length array of Bitsets from an iterable of bitsets or of\n\
+iterables of integers in the range [1,32], stored as a column of 32 bit\n\
+rows.  The operators &, |, ^ and - work row by row with another array of\n\
+the same length or with a single bitset.");
+
+PyTypeObject bitset_BitsetArrayType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "bitset.BitsetArray",                   /* tp_name */
+    sizeof(bitset_ArrayObject),             /* tp_basicsize */
     0,                                      /* tp_itemsize */
-    (destructor)Bitset_dealloc,             /* tp_dealloc */
+    (destructor)Array_dealloc,              /* tp_dealloc */
     0,                                      /* tp_print */
     0,                                      /* tp_getattr */
     0,                                      /* tp_setattr */
-    bitset_Bitset_nocmp,                    /* tp_compare */
+    BITSET_NOCMP,                           /* tp_compare */
     (reprfunc)Bitset_repr,                  /* tp_repr */
-    &bitset_as_number,                      /* tp_as_number */
-    &bitset_as_sequence,                    /* tp_as_sequence */
+    &bitset_array_as_number,                /* tp_as_number */
+    &bitset_array_as_sequence,              /* tp_as_sequence */
     0,                                      /* tp_as_mapping */
     (hashfunc)PyObject_HashNotImplemented,  /* tp_hash */
     0,                                      /* tp_call */
     0,                                      /* tp_str */
     0,                                      /* tp_getattro */
     0,                                      /* tp_setattro */
-    0,                                      /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
-    bitset_Bitset_doc,                      /* tp_doc */
+    &bitset_array_as_buffer,                /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_CHECKTYPES | Py_TPFLAGS_HAVE_NEWBUFFER, /* tp_flags */
+    bitset_BitsetArray_doc,                 /* tp_doc */
     0,                                      /* tp_traverse */
     0,                                      /* tp_clear */
-    (richcmpfunc)bitset_Bitset_richcompare, /* tp_richcompare */
+    (richcmpfunc)bitset_Array_richcompare,  /* tp_richcompare */
     0,                                      /* tp_weaklistoffset */
-    (getiterfunc)bitset_Bitset_iter,        /* tp_iter */
+    0,                                      /* tp_iter */
     0,                                      /* tp_iternext */
-    bitset_Bitset_methods,                  /* tp_methods */
+    bitset_Array_methods,                   /* tp_methods */
     0,                                      /* tp_members */
     0,                                      /* tp_getset */
     0,                                      /* tp_base */
@@ -939,29 +13307,120 @@ PyTypeObject bitset_BitsetType = {
     0,                                      /* tp_descr_get */
     0,                                      /* tp_descr_set */
     0,                                      /* tp_dictoffset */
-    (initproc)Bitset_init,                  /* tp_init */
+    (initproc)Array_init,                   /* tp_init */
     0,                                      /* tp_alloc */
-    Bitset_new,                             /* tp_new */
+    Array_new,                              /* tp_new */
 };
 
-#ifndef PyMODINIT_FUNC    /* declarations for DLL import/export */
-#define PyMODINIT_FUNC void
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef bitset_module = {
+    PyModuleDef_HEAD_INIT,
+    "bitset",                               /* m_name */
+    "Bitset module.",                       /* m_doc */
+    -1,                                     /* m_size */
+    bitset_methods,                         /* m_methods */
+};
 #endif
-PyMODINIT_FUNC
-initbitset(void)
+
+static PyObject *
+bitset_init_module(void)
 {
     PyObject* m;
 
-    bitset_BitsetType.tp_new = PyType_GenericNew;
+    bitset_init_kernels();
+    bitset_init_crc32();
+#ifdef BITSET_THREADS
+    pthread_atfork(NULL, NULL, bitset_pool_atfork_child);
+#endif
+
+#ifdef BITSET_VECTORCALL
+    bitset_BitsetType.tp_vectorcall = Bitset_vectorcall;
+    bitset_BigBitsetType.tp_vectorcall = Bitset_vectorcall;
+    bitset_FrozenBitsetType.tp_vectorcall = FrozenBitset_vectorcall;
+    bitset_RoaringBitsetType.tp_vectorcall = Roaring_vectorcall;
+    bitset_BitsetArrayType.tp_vectorcall = Array_vectorcall;
+#endif
+
     if (PyType_Ready(&bitset_BitsetType) < 0)
-        return;
+        return NULL;
+    if (PyType_Ready(&bitset_BigBitsetType) < 0)
+        return NULL;
+    if (PyType_Ready(&bitset_FrozenBitsetType) < 0)
+        return NULL;
+    if (PyType_Ready(&bitset_MappedBitsetType) < 0)
+        return NULL;
+    if (PyType_Ready(&bitset_RoaringBitsetType) < 0)
+        return NULL;
+    if (PyType_Ready(&bitset_BitsetArrayType) < 0)
+        return NULL;
+    if (PyType_Ready(&bitset_BitsetWriterType) < 0)
+        return NULL;
+    if (PyType_Ready(&bitset_BitsetReaderType) < 0)
+        return NULL;
+    if (PyType_Ready(&bitset_BitsetStoreType) < 0)
+        return NULL;
+    if (PyType_Ready(&bitset_BitsetIndexType) < 0)
+        return NULL;
+    if (PyType_Ready(&bitset_BitSlicedIndexType) < 0)
+        return NULL;
+    if (PyType_Ready(&bitset_LazyBitsetType) < 0)
+        return NULL;
 
+#if PY_MAJOR_VERSION >= 3
+    m = PyModule_Create(&bitset_module);
+#else
     m = Py_InitModule3("bitset", bitset_methods,
                        "Bitset module.");
+#endif
 
     if (m == NULL)
-        return;
+        return NULL;
 
     Py_INCREF(&bitset_BitsetType);
     PyModule_AddObject(m, "Bitset", (PyObject *)&bitset_BitsetType);
+    Py_INCREF(&bitset_BigBitsetType);
+    PyModule_AddObject(m, "BigBitset", (PyObject *)&bitset_BigBitsetType);
+    Py_INCREF(&bitset_FrozenBitsetType);
+    PyModule_AddObject(m, "FrozenBitset", (PyObject *)&bitset_FrozenBitsetType);
+    Py_INCREF(&bitset_MappedBitsetType);
+    PyModule_AddObject(m, "MappedBitset", (PyObject *)&bitset_MappedBitsetType);
+    Py_INCREF(&bitset_RoaringBitsetType);
+    PyModule_AddObject(m, "RoaringBitset", (PyObject *)&bitset_RoaringBitsetType);
+    Py_INCREF(&bitset_BitsetArrayType);
+    PyModule_AddObject(m, "BitsetArray", (PyObject *)&bitset_BitsetArrayType);
+    Py_INCREF(&bitset_BitsetWriterType);
+    PyModule_AddObject(m, "BitsetWriter", (PyObject *)&bitset_BitsetWriterType);
+    Py_INCREF(&bitset_BitsetReaderType);
+    PyModule_AddObject(m, "BitsetReader", (PyObject *)&bitset_BitsetReaderType);
+    Py_INCREF(&bitset_BitsetStoreType);
+    PyModule_AddObject(m, "BitsetStore", (PyObject *)&bitset_BitsetStoreType);
+    Py_INCREF(&bitset_BitsetIndexType);
+    PyModule_AddObject(m, "BitsetIndex", (PyObject *)&bitset_BitsetIndexType);
+    Py_INCREF(&bitset_BitSlicedIndexType);
+    PyModule_AddObject(m, "BitSlicedIndex", (PyObject *)&bitset_BitSlicedIndexType);
+    Py_INCREF(&bitset_LazyBitsetType);
+    PyModule_AddObject(m, "LazyBitset", (PyObject *)&bitset_LazyBitsetType);
+
+    /* pickles refer to loads() to rebuild bitsets */
+    bitset_loads_func = PyObject_GetAttrString(m, "loads");
+    if (bitset_loads_func == NULL)
+        return NULL;
+    return m;
+}
+
+#if PY_MAJOR_VERSION >= 3
+PyMODINIT_FUNC
+PyInit_bitset(void)
+{
+    return bitset_init_module();
 }
+#else
+#ifndef PyMODINIT_FUNC    /* declarations for DLL import/export */
+#define PyMODINIT_FUNC void
+#endif
+PyMODINIT_FUNC
+initbitset(void)
+{
+    bitset_init_module();
+}
+#endif
@@ -1,7 +1,23 @@
-from distutils.core import setup, Extension
+import os
+
+try:
+    from distutils.core import setup, Extension
+except ImportError:
+    # distutils is gone from 3.12
+    from setuptools import setup, Extension
+
+# BITSET_STATS=1 compiles in the counts reported by bitset.stats(), and
+# BITSET_STATS=cycles adds histograms of each operation's duration
+define_macros = []
+stats = os.environ.get('BITSET_STATS', '')
+if stats == 'cycles':
+    define_macros.append(('BITSET_STATS_CYCLES', None))
+elif stats not in ('', '0'):
+    define_macros.append(('BITSET_STATS', None))
 
 bitset_extmodule = Extension('bitset',
-                             sources=['bitsetmodule.c'])
+                             sources=['bitsetmodule.c'],
+                             define_macros=define_macros)
 
 setup(name='bitset',
       version='0.1',
@@ -12,4 +28,3 @@ setup(name='bitset',
       url="http://github.com/hollobon/pybitset",
       licence="MIT"
       )
-
@@ -1,7 +1,23 @@
 import unittest
+import sys
 import pickle
+import random
+import struct
+import array
+import bisect
+import io
+import zlib
+import os
+import tempfile
 
-from bitset import Bitset
+try:
+    xrange
+except NameError:
+    xrange = range
+
+import bitset
+from bitset import Bitset, BigBitset, FrozenBitset, RoaringBitset, BitsetArray
+from bitset import BitsetStore, MappedBitset, BitsetIndex, BitSlicedIndex, LazyBitset
 
 class TestBitset(unittest.TestCase):
     def setUp(self):
@@ -253,6 +269,1232 @@ class TestBitset(unittest.TestCase):
 
         self.assertRaises(TypeError, _testisub)
 
+class TestBigBitset(unittest.TestCase):
+    def setUp(self):
+        self.l1 = [0, 1, 63, 64, 1000, 100000]
+        self.b1 = BigBitset(self.l1)
+        self.b2 = BigBitset([1, 64, 65, 5000])
+        self.b3 = BigBitset([2, 3, 4, 32])
+        self.b4 = BigBitset()
+
+    def testinit(self):
+        self.assertEqual(BigBitset(self.l1), BigBitset(reversed(self.l1)))
+        self.assertRaises(TypeError, lambda: BigBitset([-1]))
+        self.assertRaises(TypeError, lambda: BigBitset(["a"]))
+        self.assertRaises(TypeError, lambda: BigBitset(1))
+
+    def testiter(self):
+        self.assertEqual(list(self.b1), self.l1)
+        self.assertEqual(list(self.b4), [])
+
+    def testin(self):
+        for x in self.l1:
+            self.assertTrue(x in self.b1)
+        self.assertFalse(2 in self.b1)
+        self.assertFalse(10 ** 30 in self.b1)
+        self.assertFalse(-1 in self.b1)
+        self.assertRaises(TypeError, lambda: "a" in self.b1)
+
+    def testlen(self):
+        self.assertEqual(len(self.b1), len(self.l1))
+        self.assertEqual(len(BigBitset(xrange(10000))), 10000)
+
+    def testaddremove(self):
+        self.b4.add(70000)
+        self.assertEqual(list(self.b4), [70000])
+        self.b4.remove(70000)
+        self.assertEqual(self.b4, BigBitset())
+        self.assertRaises(KeyError, lambda: self.b4.remove(70000))
+        self.b1.discard(100000)
+        self.b1.discard(100001)
+        self.assertEqual(list(self.b1), self.l1[:-1])
+
+    def testpop(self):
+        self.assertEqual(sorted(self.b1.pop() for x in self.l1), self.l1)
+        self.assertRaises(KeyError, self.b1.pop)
+
+    def testclear(self):
+        self.b1.clear()
+        self.assertEqual(self.b1, self.b4)
+        self.assertEqual(len(self.b1), 0)
+
+    def testoperators(self):
+        s1, s2 = set(self.b1), set(self.b2)
+        self.assertEqual(set(self.b1 & self.b2), s1 & s2)
+        self.assertEqual(set(self.b1 | self.b2), s1 | s2)
+        self.assertEqual(set(self.b1 ^ self.b2), s1 ^ s2)
+        self.assertEqual(set(self.b1 - self.b2), s1 - s2)
+        self.assertEqual(set(self.b2 - self.b1), s2 - s1)
+        self.assertEqual(set(self.b1.union(s2)), s1 | s2)
+        self.assertEqual(set(self.b1.intersection(s2)), s1 & s2)
+
+    def testinplace(self):
+        c = BigBitset(self.b3)
+        c |= self.b2
+        self.assertEqual(set(c), set(self.b3) | set(self.b2))
+        c &= self.b2
+        self.assertEqual(c, self.b2)
+        c ^= self.b1
+        self.assertEqual(set(c), set(self.b1) ^ set(self.b2))
+        c -= self.b1
+        self.assertEqual(set(c), set(self.b2) - set(self.b1))
+
+    def testcompare(self):
+        self.assertTrue(self.b1 & self.b2 < self.b1)
+        self.assertTrue(self.b1 <= self.b1)
+        self.assertFalse(self.b1 < self.b1)
+        self.assertTrue(self.b1 | self.b2 > self.b2)
+        self.assertTrue(self.b1.issuperset([0, 1]))
+        self.assertTrue(self.b3.issubset(xrange(100)))
+        self.assertTrue(self.b2.isdisjoint(self.b3))
+        self.assertFalse(self.b1.isdisjoint([100000]))
+        self.assertEqual((self.b1 | self.b2) - self.b2, self.b1 - self.b2)
+
+    def testmixed(self):
+        small = Bitset([2, 3, 32])
+        self.assertEqual(small, BigBitset([2, 3, 32]))
+        self.assertEqual(type(small | self.b3), Bitset)
+        self.assertEqual(type(self.b3 | small), BigBitset)
+        self.assertEqual(small & self.b1, Bitset())
+        self.assertEqual(set(self.b1 | small), set(self.l1) | set(small))
+        self.assertRaises(TypeError, lambda: small | self.b1)
+        self.assertRaises(TypeError, lambda: small.update(self.b1))
+        self.assertEqual(small, Bitset([2, 3, 32]))
+
+    def testpickle(self):
+        for o in (self.b1, self.b2, self.b3, self.b4):
+            for protocol in (None, 1, 2):
+                self.assertEqual(pickle.loads(pickle.dumps(o, protocol=protocol)), o)
+
+    def testrepr(self):
+        self.assertEqual(repr(self.b3), "bitset.BigBitset([2, 3, 4, 32])")
+
+    def testconstructorargs(self):
+        for cls in (Bitset, BigBitset, FrozenBitset, RoaringBitset):
+            self.assertEqual(len(cls()), 0)
+            self.assertEqual(list(cls([3, 1])), [1, 3])
+            self.assertRaises(TypeError, cls, [1], [2])
+            self.assertRaises(TypeError, lambda: cls(iterable=[1]))
+
+    def testingest(self):
+        for r in (xrange(0), xrange(3, 1000, 7), xrange(999, 2, -7), xrange(64, 640, 64)):
+            self.assertEqual(set(BigBitset(r)), set(r))
+            self.assertEqual(set(BigBitset(tuple(r))), set(r))
+        self.assertEqual(set(Bitset(xrange(1, 33))), set(range(1, 33)))
+        self.assertRaises(TypeError, Bitset, xrange(0, 5))
+        self.assertRaises(TypeError, BigBitset, xrange(-5, 5))
+        self.assertRaises(TypeError, Bitset, [1, 2, 33])
+        for code in "bBhHiIlL":
+            a = array.array(code, [1, 5, 100, 127])
+            self.assertEqual(set(BigBitset(a)), set(a))
+            self.assertEqual(list(Bitset(array.array(code, [32, 1]))), [1, 32])
+        self.assertRaises(TypeError, BigBitset, array.array("i", [3, -1]))
+        if hasattr(memoryview, "cast"):
+            # strided, so read through the iterator
+            m = memoryview(array.array("I", xrange(10)))[::2]
+            self.assertEqual(set(BigBitset(m)), set(xrange(0, 10, 2)))
+        b = BigBitset([1])
+        b.update(xrange(100, 200))
+        self.assertEqual(len(b), 101)
+        self.assertTrue(BigBitset([3]).issubset(xrange(20)))
+
+    def testothers(self):
+        b2, b3 = list(self.b2), self.b3
+        self.assertEqual(self.b1.union(b2, b3), BigBitset(set(self.l1) | set(b2) | set(b3)))
+        self.assertEqual(self.b1.intersection(b2, [1, 2]), BigBitset([1]))
+        self.assertEqual(self.b1.difference(b2, [0]), BigBitset([63, 1000, 100000]))
+        self.assertEqual(self.b1.union(), self.b1)
+        self.assertFalse(self.b1.union() is self.b1)
+        self.assertRaises(TypeError, self.b1.union, b2, 5)
+        b = self.b1.copy()
+        b.update(b2, b3)
+        b.intersection_update(range(8), [0, 1, 2, 3, 5])
+        self.assertEqual(b, BigBitset([0, 1, 2, 3]))
+        b.difference_update([0], [3])
+        self.assertEqual(b, BigBitset([1, 2]))
+        f = FrozenBitset(self.l1).intersection(b2, [1])
+        self.assertEqual((type(f), f), (FrozenBitset, FrozenBitset([1])))
+        r = RoaringBitset(self.l1).union(b2, self.b3)
+        self.assertEqual(r, self.b1.union(b2, self.b3))
+        r.difference_update(self.b1, [2])
+        self.assertEqual(r, BigBitset([3, 4, 32, 65, 5000]))
+        self.assertEqual(Bitset([1, 2, 3]).union([4], Bitset([5])), Bitset([1, 2, 3, 4, 5]))
+
+class TestKernels(unittest.TestCase):
+    levels = ("scalar", "sse2", "avx2", "avx512")
+
+    def setUp(self):
+        self.level = bitset.simd_level()
+        rand = random.Random(42)
+        self.s1 = set(rand.sample(xrange(5000), 1500))
+        self.s2 = set(rand.sample(xrange(3300), 1000))
+
+    def tearDown(self):
+        bitset.set_simd_level(self.level)
+
+    def supported(self):
+        for level in self.levels:
+            try:
+                bitset.set_simd_level(level)
+            except ValueError:
+                continue
+            yield level
+
+    def testlevels(self):
+        self.assertTrue(self.level in self.levels)
+        self.assertTrue("scalar" in list(self.supported()))
+        self.assertRaises(ValueError, lambda: bitset.set_simd_level("mmx"))
+
+    def testoperators(self):
+        for level in self.supported():
+            b1, b2 = BigBitset(self.s1), BigBitset(self.s2)
+            for x, y, sx, sy in ((b1, b2, self.s1, self.s2), (b2, b1, self.s2, self.s1)):
+                self.assertEqual(set(x & y), sx & sy, level)
+                self.assertEqual(set(x | y), sx | sy, level)
+                self.assertEqual(set(x ^ y), sx ^ sy, level)
+                self.assertEqual(set(x - y), sx - sy, level)
+
+    def testcounts(self):
+        for level in self.supported():
+            b1, b2 = BigBitset(self.s1), BigBitset(self.s2)
+            for x, y, sx, sy in ((b1, b2, self.s1, self.s2), (b2, b1, self.s2, self.s1)):
+                self.assertEqual(x.intersection_count(y), len(sx & sy), level)
+                self.assertEqual(x.union_count(y), len(sx | sy), level)
+                self.assertEqual(x.symmetric_difference_count(y), len(sx ^ sy), level)
+                self.assertEqual(x.difference_count(y), len(sx - sy), level)
+            self.assertEqual(b1.intersection_count(list(self.s2)), len(self.s1 & self.s2))
+
+    def testlen(self):
+        rand = random.Random(7)
+        for level in self.supported():
+            for size in (1, 63, 64, 257, 4095, 4096 + 64 * 5 + 3, 70001):
+                members = set(rand.sample(xrange(size), size // 2 or 1))
+                b = BigBitset(members)
+                self.assertEqual(len(b), len(members), (level, size))
+            self.assertEqual(len(BigBitset(xrange(100000))), 100000, level)
+
+    def testiterpop(self):
+        for level in self.supported():
+            b = BigBitset(self.s1)
+            self.assertEqual(list(b), sorted(self.s1))
+            popped = [b.pop() for x in xrange(len(self.s1))]
+            self.assertEqual(popped, sorted(self.s1))
+            self.assertEqual(len(b), 0)
+
+    def testsmallcounts(self):
+        b1, b2 = Bitset([1, 2, 3, 32]), Bitset([2, 3, 4])
+        self.assertEqual(b1.intersection_count(b2), 2)
+        self.assertEqual(b1.union_count(b2), 5)
+        self.assertEqual(b1.difference_count(b2), 2)
+        self.assertEqual(b1.symmetric_difference_count([2, 3, 4]), 3)
+
+    def testpredicates(self):
+        b1, b2 = BigBitset(self.s1), BigBitset(self.s2)
+        both = self.s1 & self.s2
+        self.assertTrue(b1.intersects(b2))
+        self.assertFalse(b1.intersects(BigBitset([10 ** 6])))
+        self.assertFalse(b1.intersects(BigBitset()))
+        self.assertAlmostEqual(b1.jaccard(b2), len(both) / float(len(self.s1 | self.s2)))
+        self.assertEqual(b1.jaccard(b1), 1.0)
+        self.assertEqual(BigBitset().jaccard([]), 1.0)
+        self.assertEqual(b1.jaccard([10 ** 6]), 0.0)
+        self.assertTrue(b1.intersection_equals(b2, both))
+        self.assertTrue(b2.intersection_equals(list(self.s1), BigBitset(both)))
+        self.assertFalse(b1.intersection_equals(b2, both | set([10 ** 6])))
+        self.assertFalse(b1.intersection_equals(b2, both - set([min(both)])))
+        self.assertTrue(b1.intersection_equals(BigBitset([10 ** 6]), []))
+        self.assertTrue(Bitset([1, 2, 3]).intersection_equals(BigBitset([2, 3, 100]), Bitset([2, 3])))
+        self.assertTrue(FrozenBitset([1, 2]).intersects(RoaringBitset([2])))
+        self.assertRaises(TypeError, b1.intersection_equals, b2)
+        self.assertRaises(TypeError, b1.intersects, 1)
+
+class TestBuffer(unittest.TestCase):
+    def setUp(self):
+        self.b1 = BigBitset([0, 1, 64, 130])
+
+    def words(self, b):
+        data = memoryview(b).tobytes()
+        return list(struct.unpack("%dQ" % (len(data) // 8), data))
+
+    def testexport(self):
+        m = memoryview(self.b1)
+        self.assertEqual(m.format, "Q")
+        self.assertEqual(m.itemsize, 8)
+        self.assertFalse(m.readonly)
+        self.assertEqual(self.words(self.b1), [3, 1, 4])
+        self.assertEqual(self.words(Bitset([1, 32])), [2 | 2 ** 32])
+        m = memoryview(Bitset([1, 32]))
+        self.assertTrue(m.readonly)
+        self.assertRaises(TypeError, m.__setitem__, 0, 1)
+        self.assertEqual(self.words(BigBitset()), [])
+
+    def testresize(self):
+        m = memoryview(self.b1)
+        self.b1.add(65)
+        self.assertRaises(BufferError, lambda: self.b1.add(1000))
+        self.assertEqual(self.words(self.b1), [3, 3, 4])
+        self.b1 &= BigBitset([0])
+        self.assertEqual(self.words(self.b1), [1, 0, 0])
+        self.b1.clear()
+        self.assertEqual(m.tobytes(), b"\0" * 24)
+        del m
+        self.b1.add(1000)
+        self.assertEqual(list(self.b1), [1000])
+
+    def testfrom_buffer(self):
+        self.assertEqual(BigBitset.from_buffer(self.b1), self.b1)
+        self.assertEqual(BigBitset.from_buffer(memoryview(self.b1)), self.b1)
+        self.assertEqual(BigBitset.from_buffer(array.array("B", [3, 0, 1])), BigBitset([0, 1, 16]))
+        self.assertEqual(Bitset.from_buffer(BigBitset([5, 6])), Bitset([5, 6]))
+        self.assertRaises(TypeError, lambda: Bitset.from_buffer(self.b1))
+        self.assertRaises(TypeError, lambda: BigBitset.from_buffer(1))
+
+    def testfrombytes(self):
+        self.assertEqual(BigBitset.frombytes(b"\x01\x80\x00\x00\x00\x00\x00\x00\x01"), BigBitset([0, 15, 64]))
+        self.assertEqual(BigBitset.frombytes(b""), BigBitset())
+        self.assertEqual(Bitset.frombytes(b"\x06"), Bitset([1, 2]))
+        self.assertRaises(TypeError, lambda: Bitset.frombytes(b"\x01"))
+        self.assertEqual(BigBitset.frombytes(memoryview(self.b1).tobytes()), self.b1)
+
+    def testcontains_many(self):
+        rnd = random.Random(24)
+        items = [rnd.randrange(-10, 200) for i in range(10000)] + [-2 ** 15, 2 ** 15 - 1]
+        for b in (self.b1, Bitset([1, 5, 32]), FrozenBitset(self.b1), RoaringBitset(self.b1)):
+            expected = [x for x in items if x in b]
+            for code in "ihlq":
+                if sys.version_info[0] < 3 and code == "q":
+                    continue
+                a = array.array(code, items)
+                self.assertEqual(list(b.contains_many(a)), [int(x in b) for x in items])
+                f = b.filter(a)
+                self.assertEqual(list(f), expected)
+                if sys.version_info[0] >= 3:
+                    self.assertEqual(f.typecode, a.typecode)
+                    self.assertEqual(b.contains_many(memoryview(a)), b.contains_many(a))
+            self.assertEqual(b.contains_many([64, -1, 2 ** 70 // 2 ** 10]), bytearray([64 in b, 0, 0]))
+            self.assertEqual(list(b.filter(iter([1, 5, 130]))), [x for x in [1, 5, 130] if x in b])
+            self.assertEqual(b.contains_many(array.array("i")), bytearray())
+            if sys.version_info[0] >= 3:
+                f = b.filter(array.array("Q", [1, 5, 2 ** 63]))
+                self.assertEqual(f.typecode, "Q")
+                self.assertEqual(list(f), [x for x in [1, 5] if x in b])
+        self.assertEqual(self.b1.contains_many(array.array("B", [0, 2, 130])), bytearray([1, 0, 1]))
+        self.assertRaises(TypeError, self.b1.contains_many, array.array("d", [1.0]))
+        self.assertRaises(TypeError, self.b1.filter, [1.5])
+        self.assertRaises(TypeError, self.b1.contains_many, 1)
+
+    def testto_array(self):
+        rnd = random.Random(25)
+        members = sorted(rnd.sample(range(2 ** 20), 5000)) + list(range(2 ** 20, 2 ** 20 + 3000))
+        runs = RoaringBitset(members)
+        runs.optimize()
+        for b in (self.b1, Bitset([1, 5, 32]), BigBitset(members), FrozenBitset(members),
+                  RoaringBitset(members), runs, BigBitset()):
+            expected = list(b)
+            a = b.to_array()
+            self.assertEqual(list(a), expected)
+            self.assertEqual(a.itemsize, array.array("l").itemsize)
+            self.assertEqual(list(b.to_array("I")), expected)
+            if sys.version_info[0] >= 3:
+                a = array.array("q", [-1] * (len(expected) + 2))
+                self.assertEqual(b.into(a), len(expected))
+                self.assertEqual(list(a), expected + [-1, -1])
+                self.assertEqual(b.into(memoryview(a)), len(expected))
+                if expected:
+                    self.assertRaises(ValueError, b.into, array.array("q", expected[1:]))
+        self.assertEqual(list(self.b1.to_array("B")), [0, 1, 64, 130])
+        self.assertRaises(OverflowError, self.b1.to_array, "b")
+        self.assertRaises(OverflowError, BigBitset(members).to_array, "H")
+        self.assertRaises(ValueError, self.b1.to_array, "d")
+        self.assertRaises(ValueError, self.b1.to_array, "ll")
+        self.assertRaises(TypeError, self.b1.into, 1)
+
+class TestFreelist(unittest.TestCase):
+    def testreuse(self):
+        b1, b2 = Bitset([1, 2]), BigBitset([2, 100])
+        bitset.clear_freelists()
+        for i in xrange(10):
+            self.assertEqual(b1 & b2, Bitset([2]))
+            self.assertEqual(b2 | b1, BigBitset([1, 2, 100]))
+            self.assertEqual(list(b2), [2, 100])
+        stats = bitset.freelist_stats()
+        self.assertTrue(stats["bitset_reused"] > 0)
+        self.assertTrue(stats["bitset_free"] > 0)
+        self.assertTrue(stats["iterator_reused"] > 0)
+        self.assertEqual(type(b1 & b2), Bitset)
+        self.assertEqual(type(b2 & b1), BigBitset)
+
+    def testclear(self):
+        list(BigBitset([1]) | BigBitset([2]))
+        self.assertTrue(bitset.clear_freelists() > 0)
+        stats = bitset.freelist_stats()
+        self.assertEqual(stats["bitset_free"], 0)
+        self.assertEqual(stats["iterator_free"], 0)
+        self.assertEqual(stats["bitset_reused"], 0)
+
+class TestStats(unittest.TestCase):
+    def testcounts(self):
+        bitset.reset_stats()
+        stats = bitset.stats()
+        if not stats:
+            return              # built without BITSET_STATS
+        self.assertEqual(stats["and"]["calls"], 0)
+        a, b = BigBitset([1, 2, 1000]), BigBitset([2, 1000])
+        a & b
+        a.update([5, 6], range(8, 10), b)
+        bitset.union_all([a, b])
+        stats = bitset.stats()
+        self.assertEqual(stats["update"]["fallbacks"], 0)
+        a.update(iter([7]))
+        stats = bitset.stats()
+        self.assertEqual(stats["and"]["calls"], 1)
+        self.assertTrue(stats["and"]["allocations"] > 0)
+        self.assertTrue(stats["and"]["words"] > 0)
+        self.assertEqual(stats["update"]["calls"], 2)
+        self.assertEqual(stats["update"]["fallbacks"], 1)
+        self.assertEqual(stats["union_all"]["calls"], 1)
+        self.assertEqual(stats["construct"]["calls"], 2)
+        if "cycles" in stats["and"]:
+            self.assertEqual(sum(stats["and"]["cycles"]), 1)
+        bitset.reset_stats()
+        self.assertEqual(bitset.stats()["and"]["calls"], 0)
+
+
+class TestFrozenBitset(unittest.TestCase):
+    def setUp(self):
+        self.l1 = [0, 2, 64, 1000]
+        self.f1 = FrozenBitset(self.l1)
+        self.f2 = FrozenBitset([2, 3, 1000, 5000])
+
+    def testhash(self):
+        self.assertEqual(hash(self.f1), hash(FrozenBitset(reversed(self.l1))))
+        self.assertEqual(hash(self.f1 | self.f2), hash(self.f2 | self.f1))
+        self.assertEqual(hash(self.f1 & FrozenBitset([0])), hash(FrozenBitset([0])))
+        d = {self.f1: 1, self.f2: 2}
+        self.assertEqual(d[FrozenBitset(self.l1)], 1)
+        self.assertTrue(FrozenBitset(self.f2) in set([self.f2]))
+        self.assertRaises(TypeError, lambda: hash(BigBitset()))
+        self.assertRaises(TypeError, lambda: hash(Bitset()))
+
+    def testimmutable(self):
+        for name in ("add", "clear", "discard", "pop", "remove", "update",
+                     "intersection_update", "difference_update",
+                     "symmetric_difference_update"):
+            self.assertFalse(hasattr(self.f1, name), name)
+        f = self.f1
+        f |= self.f2
+        self.assertEqual(self.f1, FrozenBitset(self.l1))
+        self.assertEqual(set(f), set(self.l1) | set(self.f2))
+        self.assertTrue(memoryview(self.f1).readonly)
+
+    def testconstruct(self):
+        self.assertTrue(FrozenBitset(self.f1) is self.f1)
+        self.assertTrue(self.f1.copy() is self.f1)
+        self.assertEqual(FrozenBitset(BigBitset(self.l1)), self.f1)
+        self.assertEqual(FrozenBitset(), FrozenBitset([]))
+        self.assertEqual(FrozenBitset.frombytes(b"\x05"), FrozenBitset([0, 2]))
+        self.assertEqual(type(FrozenBitset.frombytes(b"\x05")), FrozenBitset)
+        self.assertRaises(TypeError, lambda: FrozenBitset([-1]))
+
+    def testmixed(self):
+        b = BigBitset([2, 7])
+        self.assertEqual(type(self.f1 | b), FrozenBitset)
+        self.assertEqual(type(b | self.f1), BigBitset)
+        self.assertEqual(type(self.f1.union(b)), FrozenBitset)
+        self.assertEqual(type(Bitset([2]) & self.f1), Bitset)
+        self.assertEqual(self.f1 & b, BigBitset([2]))
+        self.assertTrue(FrozenBitset([2]) < self.f1)
+        b |= self.f1
+        self.assertEqual(set(b), set(self.l1) | set([7]))
+
+    def testpickle(self):
+        for o in (self.f1, self.f2, FrozenBitset()):
+            for protocol in (None, 1, 2):
+                p = pickle.loads(pickle.dumps(o, protocol=protocol))
+                self.assertEqual(p, o)
+                self.assertEqual(type(p), FrozenBitset)
+                self.assertEqual(hash(p), hash(o))
+
+class TestRoaringBitset(unittest.TestCase):
+    def setUp(self):
+        rnd = random.Random(7)
+        self.sparse = set(rnd.randrange(2 ** 32) for i in xrange(200))
+        self.dense = set(rnd.randrange(65536, 3 * 65536) for i in xrange(20000))
+        self.runs = set(xrange(100000, 180000)) | set(xrange(2 ** 32 - 100, 2 ** 32))
+        self.sets = [self.sparse, self.dense, self.runs, set()]
+
+    def testbasic(self):
+        for s in self.sets:
+            r = RoaringBitset(s)
+            self.assertEqual(len(r), len(s))
+            self.assertEqual(list(r), sorted(s))
+            for v in list(s)[:50]:
+                self.assertTrue(v in r)
+        r = RoaringBitset([0, 2 ** 32 - 1])
+        self.assertFalse(1 in r)
+        self.assertFalse(-1 in r)
+        self.assertEqual(r.pop(), 0)
+        self.assertRaises(KeyError, r.remove, 5)
+        r.clear()
+        self.assertEqual(len(r), 0)
+        self.assertRaises(KeyError, r.pop)
+        self.assertRaises(TypeError, RoaringBitset, [-1])
+        self.assertRaises(TypeError, RoaringBitset, [2 ** 32])
+
+    def testaddremove(self):
+        # crosses the array/bitmap limit in both directions, and splits
+        # and joins runs
+        for start in (set(), self.runs):
+            r = RoaringBitset(start)
+            s = set(start)
+            rnd = random.Random(3)
+            for i in xrange(30000):
+                v = rnd.randrange(90000, 190000)
+                if rnd.random() < 0.6:
+                    r.add(v)
+                    s.add(v)
+                else:
+                    r.discard(v)
+                    s.discard(v)
+            self.assertEqual(set(r), s)
+            self.assertEqual(len(r), len(s))
+            r.optimize()
+            self.assertEqual(set(r), s)
+
+    def testoperators(self):
+        for a in self.sets:
+            for b in self.sets:
+                ra, rb = RoaringBitset(a), RoaringBitset(b)
+                self.assertEqual(set(ra | rb), a | b)
+                self.assertEqual(set(ra & rb), a & b)
+                self.assertEqual(set(ra ^ rb), a ^ b)
+                self.assertEqual(set(ra - rb), a - b)
+                self.assertEqual(ra.union_count(rb), len(a | b))
+                self.assertEqual(ra.intersection_count(rb), len(a & b))
+                self.assertEqual(ra.symmetric_difference_count(rb), len(a ^ b))
+                self.assertEqual(ra.difference_count(list(b)), len(a - b))
+                self.assertEqual(ra.isdisjoint(rb), a.isdisjoint(b))
+                self.assertEqual(ra.intersects(rb), not a.isdisjoint(b))
+                self.assertEqual(ra.jaccard(rb), len(a & b) / float(len(a | b)) if a | b else 1.0)
+                self.assertTrue(ra.intersection_equals(rb, a & b))
+                self.assertEqual(ra.intersection_equals(list(b), a), a <= b)
+                self.assertEqual(ra <= rb, a <= b)
+                self.assertEqual(ra < rb, a < b)
+                self.assertEqual(ra == rb, a == b)
+                r = ra.copy()
+                r &= rb
+                self.assertEqual(set(r), a & b)
+                r.symmetric_difference_update(rb)
+                self.assertEqual(set(r), (a & b) ^ b)
+
+    def testconvert(self):
+        s = set(xrange(0, 10 ** 6, 7)) | set(xrange(2 * 10 ** 6, 2 * 10 ** 6 + 5000))
+        b = BigBitset(s)
+        r = RoaringBitset(b)
+        self.assertEqual(set(r), s)
+        self.assertEqual(BigBitset(r), b)
+        self.assertEqual(FrozenBitset(r), FrozenBitset(b))
+        self.assertEqual(Bitset(RoaringBitset([1, 32])), Bitset([1, 32]))
+        self.assertRaises(TypeError, Bitset, RoaringBitset([33]))
+        self.assertTrue(r == b)
+        self.assertTrue(b == r)
+        self.assertEqual(type(r | b), RoaringBitset)
+        self.assertEqual(type(b | r), BigBitset)
+        self.assertEqual(type(Bitset([2]) & RoaringBitset([2, 100])), Bitset)
+        self.assertEqual(RoaringBitset.frombytes(b"\x05"), RoaringBitset([0, 2]))
+
+    def testmixed(self):
+        # the RoaringBitsets reach 2**32, which a BigBitset would hold in 512 MB
+        for a in (self.dense, set(xrange(100, 70000, 3)), set([5]), set()):
+            for T in (BigBitset, FrozenBitset):
+                b = T(a)
+                for s in self.sets:
+                    r = RoaringBitset(s)
+                    self.assertEqual(set(b & r), a & s)
+                    self.assertEqual(type(b & r), T)
+                    self.assertEqual(set(b - r), a - s)
+                    self.assertEqual(b.intersection_count(r), len(a & s))
+                    self.assertEqual(b.union_count(r), len(a | s))
+                    self.assertEqual(b.difference_count(r), len(a - s))
+                    self.assertEqual(b.symmetric_difference_count(r), len(a ^ s))
+                    self.assertEqual(b.isdisjoint(r), a.isdisjoint(s))
+                    self.assertEqual(b.intersects(r), not a.isdisjoint(s))
+                    self.assertEqual(b.jaccard(r), len(a & s) / float(len(a | s)) if a | s else 1.0)
+                    self.assertEqual(b.issubset(r), a <= s)
+                    self.assertEqual(b.issuperset(r), a >= s)
+                    self.assertEqual(b == r, a == s)
+                    self.assertEqual(b < r, a < s)
+                    self.assertEqual(b >= r, a >= s)
+                    self.assertTrue(b.intersection_equals(r, RoaringBitset(a & s)))
+                    self.assertEqual(set((bitset.lazy(b) & r).evaluate()), a & s)
+                    self.assertEqual(len(bitset.lazy(r) - b), len(s - a))
+        b = BigBitset(self.dense)
+        b ^= RoaringBitset(self.runs)
+        self.assertEqual(set(b), self.dense ^ self.runs)
+        b -= RoaringBitset(self.runs)
+        self.assertEqual(set(b), self.dense - self.runs)
+        b &= RoaringBitset(self.runs)
+        self.assertEqual(set(b), set())
+        self.assertEqual(Bitset([1, 5]) | RoaringBitset([32]), Bitset([1, 5, 32]))
+        self.assertRaises(TypeError, Bitset([1]).__ior__, RoaringBitset([33]))
+
+    def testsize(self):
+        r = RoaringBitset(xrange(10 ** 6))
+        self.assertTrue(r.__sizeof__() < 1000)
+        r = RoaringBitset(self.sparse)
+        self.assertTrue(r.__sizeof__() < 100 * len(self.sparse))
+
+    def testpickle(self):
+        for s in self.sets:
+            r = RoaringBitset(s)
+            for protocol in (None, 1, 2):
+                p = pickle.loads(pickle.dumps(r, protocol=protocol))
+                self.assertEqual(p, r)
+                self.assertEqual(type(p), RoaringBitset)
+        self.assertRaises(TypeError, RoaringBitset().__setstate__, b"\x00\x00\x05")
+
+class TestMultiOperand(unittest.TestCase):
+    def setUp(self):
+        rnd = random.Random(9)
+        self.sets = [set(rnd.sample(range(100000), 30000)) for i in range(6)]
+        self.bitsets = [BigBitset(s) for s in self.sets]
+
+    def testunion_all(self):
+        expected = set().union(*self.sets)
+        self.assertEqual(set(bitset.union_all(self.bitsets)), expected)
+        self.assertEqual(set(bitset.union_all(iter(self.sets))), expected)
+        self.assertEqual(bitset.union_all([]), BigBitset())
+        self.assertEqual(bitset.union_all([BigBitset([5]), [1 << 20]]), BigBitset([5, 1 << 20]))
+        self.assertEqual(type(bitset.union_all([FrozenBitset([1]), [2]])), FrozenBitset)
+        self.assertEqual(bitset.union_all([Bitset([1]), [32]]), Bitset([1, 32]))
+        self.assertRaises(TypeError, bitset.union_all, [Bitset([1]), [33]])
+        self.assertRaises(TypeError, bitset.union_all, [BigBitset(), 5])
+        self.assertRaises(TypeError, bitset.union_all, 5)
+
+    def testintersect_all(self):
+        expected = set.intersection(*self.sets)
+        self.assertEqual(set(bitset.intersect_all(self.bitsets)), expected)
+        self.assertEqual(bitset.intersect_all(self.bitsets[:1]), self.bitsets[0])
+        self.assertFalse(bitset.intersect_all(self.bitsets[:1]) is self.bitsets[0])
+        self.assertEqual(bitset.intersect_all(self.bitsets + [BigBitset()]), BigBitset())
+        self.assertEqual(bitset.intersect_all([[1, 2, 3], BigBitset([2, 3, 1 << 20]), [3, 2]]),
+                         BigBitset([2, 3]))
+        disjoint = [BigBitset([0]), BigBitset([1])] + self.bitsets
+        self.assertEqual(len(bitset.intersect_all(disjoint)), 0)
+        self.assertRaises(ValueError, bitset.intersect_all, [])
+
+    def testcount_intersection(self):
+        for n in range(1, len(self.sets) + 1):
+            self.assertEqual(bitset.count_intersection(self.bitsets[:n]),
+                             len(set.intersection(*self.sets[:n])))
+        self.assertEqual(bitset.count_intersection([BigBitset([1, 2]), [2, 3], FrozenBitset([2])]), 1)
+        self.assertRaises(ValueError, bitset.count_intersection, [])
+
+    def testroaring(self):
+        r = RoaringBitset(self.sets[0])
+        u = bitset.union_all([r] + self.bitsets[1:])
+        self.assertEqual(type(u), RoaringBitset)
+        self.assertEqual(set(u), set().union(*self.sets))
+        i = bitset.intersect_all([r, self.bitsets[1], RoaringBitset(self.sets[2])])
+        self.assertEqual(type(i), RoaringBitset)
+        self.assertEqual(set(i), self.sets[0] & self.sets[1] & self.sets[2])
+        self.assertEqual(bitset.count_intersection([self.bitsets[1], r, r]),
+                         len(self.sets[0] & self.sets[1]))
+        # all RoaringBitsets are merged a container at a time, and mixed
+        # ones are applied to the bitsets' result, so 2**32 - 1 costs nothing
+        top = 2 ** 32 - 1
+        rs = [RoaringBitset(s | set([top])) for s in self.sets]
+        rs[1].optimize()
+        self.assertEqual(set(bitset.union_all(rs)), set().union(*self.sets) | set([top]))
+        i = bitset.intersect_all(rs)
+        self.assertEqual(type(i), RoaringBitset)
+        self.assertEqual(set(i), set.intersection(*self.sets) | set([top]))
+        self.assertEqual(bitset.count_intersection(rs), len(i))
+        self.assertEqual(bitset.count_intersection(rs[:2]), len(self.sets[0] & self.sets[1]) + 1)
+        mixed = [self.bitsets[0]] + rs[1:]
+        self.assertEqual(type(bitset.intersect_all(mixed)), type(self.bitsets[0]))
+        self.assertEqual(set(bitset.intersect_all(mixed)), set.intersection(*self.sets))
+        self.assertEqual(bitset.count_intersection(mixed), len(set.intersection(*self.sets)))
+        self.assertEqual(set(bitset.intersect_all(rs[:1] + [self.bitsets[1]])),
+                         self.sets[0] & self.sets[1])
+
+    def testsort(self):
+        rand = random.Random(5)
+        masks = [BigBitset(rand.sample(xrange(200), rand.randrange(4))) for i in xrange(300)]
+        masks += [Bitset([1, 2]), FrozenBitset([1, 2]), BigBitset(), BigBitset([1 << 20])]
+        key = lambda b: sum(1 << x for x in b)
+        ordered = bitset.sort_bitsets(masks)
+        self.assertEqual([key(b) for b in ordered], sorted(key(b) for b in masks))
+        self.assertEqual(ordered, sorted(masks, key=lambda b: b.cmp_key()))
+        self.assertTrue(ordered[ordered.index(Bitset([1, 2]))] is masks[-4])
+        unique = bitset.unique_bitsets(masks)
+        self.assertEqual([key(b) for b in unique], sorted(set(key(b) for b in masks)))
+        self.assertEqual(bitset.unique_bitsets([[3], (3,), [1]]), [BigBitset([1]), BigBitset([3])])
+        self.assertEqual(bitset.sort_bitsets([]), [])
+        self.assertEqual(Bitset([32]).cmp_key(), BigBitset([32]).cmp_key())
+        self.assertTrue(BigBitset([64]).cmp_key() > BigBitset(xrange(64)).cmp_key())
+        self.assertRaises(TypeError, bitset.sort_bitsets, [BigBitset(), 1])
+
+    def testproper(self):
+        a, b = BigBitset([1, 2]), BigBitset([1, 2, 1000])
+        self.assertTrue(a < b and b > a and not a < a and not b < a)
+        self.assertFalse(BigBitset([1, 2, 0]) < b)
+        self.assertTrue(Bitset([1]) < BigBitset([1, 2]))
+
+class TestThreads(unittest.TestCase):
+    def setUp(self):
+        rnd = random.Random(10)
+        # large enough to be split across the workers
+        n = 64 * 200000
+        self.sets = [set(rnd.sample(range(n), 50000)) | set([n - i]) for i in range(3)]
+        self.bitsets = [BigBitset(s) for s in self.sets]
+
+    def tearDown(self):
+        bitset.set_threads(1)
+
+    def check(self):
+        a, b, c = self.bitsets
+        sa, sb, sc = self.sets
+        self.assertEqual(len(a), len(sa))
+        self.assertEqual(set(a | b), sa | sb)
+        self.assertEqual(set(a & b), sa & sb)
+        self.assertEqual(set(a ^ b), sa ^ sb)
+        self.assertEqual(set(a - b), sa - sb)
+        self.assertEqual(a.union_count(b), len(sa | sb))
+        self.assertEqual(a.symmetric_difference_count(c), len(sa ^ sc))
+        self.assertEqual(a.difference_count(c), len(sa - sc))
+        self.assertEqual(set(bitset.union_all(self.bitsets)), sa | sb | sc)
+        self.assertEqual(bitset.count_intersection([a, b, c]), len(sa & sb & sc))
+        self.assertEqual(pickle.loads(pickle.dumps(a, pickle.HIGHEST_PROTOCOL)), a)
+        self.assertEqual(BigBitset.frombytes(memoryview(a).tobytes()), a)
+
+    def testthreads(self):
+        self.assertEqual(bitset.threads(), 1)
+        self.check()
+        for n in (2, 4, 8):
+            bitset.set_threads(n)
+            self.assertEqual(bitset.threads(), n)
+            self.check()
+        self.assertRaises(ValueError, bitset.set_threads, 0)
+        self.assertRaises(TypeError, bitset.set_threads, "2")
+
+    def testunpinned(self):
+        # bitsets are pinned only while the GIL is released
+        bitset.set_threads(2)
+        a = self.bitsets[0]
+        a |= self.bitsets[1]
+        a -= self.bitsets[2]
+        a.add(1 << 30)
+        self.assertTrue((1 << 30) in a)
+
+    def testconcurrent(self):
+        import threading
+        bitset.set_threads(2)
+        results, errors = [], []
+
+        def work():
+            try:
+                for i in range(5):
+                    results.append(bitset.count_intersection(self.bitsets))
+            except Exception as e:
+                errors.append(e)
+
+        threads = [threading.Thread(target=work) for i in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(errors, [])
+        self.assertEqual(set(results), set([len(self.sets[0] & self.sets[1] & self.sets[2])]))
+
+class TestBitsetArray(unittest.TestCase):
+    def setUp(self):
+        rnd = random.Random(11)
+        self.rows = [set(rnd.sample(range(1, 33), rnd.randint(0, 32))) for i in range(1001)]
+        self.other = [set(rnd.sample(range(1, 33), rnd.randint(0, 32))) for i in range(1001)]
+        self.a = BitsetArray(self.rows)
+        self.b = BitsetArray(Bitset(r) for r in self.other)
+
+    def rowsof(self, a):
+        return [set(row) for row in a]
+
+    def testinit(self):
+        self.assertEqual(len(self.a), len(self.rows))
+        self.assertEqual(self.rowsof(self.a), self.rows)
+        self.assertEqual(self.a[0], Bitset(self.rows[0]))
+        self.assertEqual(self.a[-1], Bitset(self.rows[-1]))
+        self.assertEqual(len(BitsetArray()), 0)
+        self.assertEqual(BitsetArray([BigBitset([1, 32]), FrozenBitset(), RoaringBitset([5])]),
+                         BitsetArray([[1, 32], [], [5]]))
+        self.assertEqual(BitsetArray(self.a), self.a)
+        self.assertRaises(TypeError, BitsetArray, [[0]])
+        self.assertRaises(TypeError, BitsetArray, [BigBitset([33])])
+        self.assertRaises(TypeError, BitsetArray, [5])
+        self.assertRaises(IndexError, lambda: self.a[len(self.a)])
+
+    def testsetitem(self):
+        self.a[3] = [1, 2]
+        self.assertEqual(self.a[3], Bitset([1, 2]))
+        self.a[-1] = Bitset([32])
+        self.assertEqual(self.a[len(self.a) - 1], Bitset([32]))
+        self.assertRaises(TypeError, self.a.__setitem__, 0, [33])
+        def delete():
+            del self.a[0]
+        self.assertRaises(TypeError, delete)
+
+    def testops(self):
+        a, b = self.a, self.b
+        self.assertEqual(self.rowsof(a & b), [x & y for x, y in zip(self.rows, self.other)])
+        self.assertEqual(self.rowsof(a | b), [x | y for x, y in zip(self.rows, self.other)])
+        self.assertEqual(self.rowsof(a ^ b), [x ^ y for x, y in zip(self.rows, self.other)])
+        self.assertEqual(self.rowsof(a - b), [x - y for x, y in zip(self.rows, self.other)])
+        s = Bitset([1, 5, 32])
+        self.assertEqual(self.rowsof(a & s), [x & set(s) for x in self.rows])
+        self.assertEqual(self.rowsof(s | a), [x | set(s) for x in self.rows])
+        self.assertEqual(self.rowsof(a ^ s), [x ^ set(s) for x in self.rows])
+        self.assertEqual(self.rowsof(a - s), [x - set(s) for x in self.rows])
+        self.assertEqual(self.rowsof(s - a), [set(s) - x for x in self.rows])
+        self.assertEqual(self.rowsof(a), self.rows)
+        c = a.copy()
+        c |= b
+        c -= BigBitset([2])
+        self.assertEqual(self.rowsof(c), [(x | y) - set([2]) for x, y in zip(self.rows, self.other)])
+        self.assertRaises(ValueError, lambda: a & BitsetArray([[1]]))
+        self.assertRaises(TypeError, lambda: a & [1])
+        self.assertRaises(TypeError, lambda: a & BigBitset([40]))
+
+    def testqueries(self):
+        self.assertEqual(list(self.a.lengths()), [len(x) for x in self.rows])
+        self.assertEqual(list(self.a.contains(7)), [int(7 in x) for x in self.rows])
+        self.assertEqual(list(self.a.contains(0)), [0] * len(self.rows))
+        self.assertEqual(list(self.a.issubset(self.b)),
+                         [int(x <= y) for x, y in zip(self.rows, self.other)])
+        s = Bitset(range(1, 20))
+        self.assertEqual(list(self.a.issubset(s)), [int(x <= set(s)) for x in self.rows])
+        self.assertRaises(TypeError, self.a.contains, "a")
+        self.assertEqual(type(self.a.lengths()), bytearray)
+
+    def testbuffer(self):
+        m = memoryview(self.a)
+        self.assertEqual((m.format, m.itemsize, len(m)), ("I", 4, len(self.rows)))
+        rows = array.array("I", m.tobytes())
+        self.assertEqual(rows[1], sum(1 << (v - 1) for v in self.rows[1]))
+        self.assertEqual(BitsetArray.from_buffer(rows), self.a)
+        self.assertRaises(BufferError, self.a.__init__, [])
+        del m
+        self.assertRaises(ValueError, BitsetArray.from_buffer, b"abc")
+
+    def testpickle(self):
+        for proto in range(pickle.HIGHEST_PROTOCOL + 1):
+            self.assertEqual(pickle.loads(pickle.dumps(self.a, proto)), self.a)
+
+    def testlarge(self):
+        # long enough to release the GIL and be split across threads
+        rows = [[i % 32 + 1, (i * 7) % 32 + 1] for i in range(300001)]
+        a = BitsetArray(rows)
+        bitset.set_threads(4)
+        try:
+            b = a | Bitset([3])
+            c = a & b
+        finally:
+            bitset.set_threads(1)
+        self.assertEqual(c, a)
+        self.assertEqual(b[300000], Bitset(rows[300000] + [3]))
+        self.assertEqual(sum(a.lengths()), sum(len(set(r)) for r in rows))
+
+class TestRankSelect(unittest.TestCase):
+    def setUp(self):
+        rnd = random.Random(12)
+        # spans many rank blocks, with some of them empty
+        self.members = sorted(set(rnd.randrange(0, 60000) for i in xrange(2000)) |
+                              set(xrange(200000, 203000)))
+        self.points = [-3, 0, 1, 60000, 199999, 203000, 10 ** 6, 2 ** 70] + \
+            [rnd.randrange(0, 210000) for i in xrange(300)] + self.members[::50]
+
+    def check(self, b, members):
+        for x in self.points:
+            rank = bisect.bisect_left(members, max(x, 0))
+            self.assertEqual(b.rank(x), rank)
+            self.assertEqual(b.nextset(x), members[rank] if rank < len(members) else -1)
+            after = bisect.bisect_right(members, x)
+            self.assertEqual(b.prevset(x), members[after - 1] if after > 0 and x >= 0 else -1)
+        for k in xrange(0, len(members), 7):
+            self.assertEqual(b.select(k), members[k])
+        self.assertRaises(IndexError, b.select, -1)
+        self.assertRaises(IndexError, b.select, len(members))
+
+    def testbitsets(self):
+        for cls in (BigBitset, FrozenBitset, RoaringBitset):
+            self.check(cls(self.members), self.members)
+            self.check(cls(), [])
+        r = RoaringBitset(self.members)
+        r.optimize()
+        self.check(r, self.members)
+        b = Bitset([3, 7, 32])
+        self.assertEqual((b.rank(8), b.select(2), b.nextset(8), b.prevset(31)), (2, 32, 32, 7))
+        self.assertRaises(TypeError, b.rank, "a")
+
+    def testmutation(self):
+        b = BigBitset(self.members)
+        self.check(b, self.members)
+        b.add(70000)
+        b.remove(self.members[0])
+        members = sorted(set(self.members[1:]) | set([70000]))
+        self.check(b, members)
+        b |= BigBitset([300000])
+        self.check(b, members + [300000])
+        b &= BigBitset(xrange(100000))
+        self.check(b, [v for v in members if v < 100000])
+        self.assertEqual(len(b), b.rank(100000))
+
+class TestRanges(unittest.TestCase):
+    def setUp(self):
+        rnd = random.Random(13)
+        self.members = set(rnd.sample(xrange(300000), 20000))
+        self.ranges = [(lo, lo + rnd.choice([-5, 0, 1, 63, 64, 65, 5000, 70000]))
+                       for lo in (rnd.randrange(-10, 300000) for i in xrange(60))]
+
+    def check(self, cls):
+        b, members = cls(self.members), set(self.members)
+        for i, (lo, hi) in enumerate(self.ranges):
+            r = set(xrange(max(lo, 0), hi))
+            self.assertEqual(b.count(lo, hi), len(members & r))
+            self.assertEqual(b.any_in_range(lo, hi), bool(members & r))
+            self.assertEqual(b.all_in_range(lo, hi), hi <= lo or (lo >= 0 and r <= members))
+            if i % 3 == 0 and lo >= 0:
+                b.add_range(lo, hi)
+                members |= r
+            elif i % 3 == 1:
+                b.discard_range(lo, hi)
+                members -= r
+            elif lo >= 0:
+                b.flip(lo, hi)
+                members ^= r
+        self.assertEqual(set(b), members)
+        self.assertRaises(TypeError, b.add_range, -1, 5)
+        self.assertRaises(TypeError, b.flip, -1, 5)
+        self.assertRaises(TypeError, b.count, 1)
+        b.discard_range(-2 ** 80, 2 ** 80)
+        self.assertEqual(len(b), 0)
+
+    def testbigbitset(self):
+        self.check(BigBitset)
+
+    def testroaring(self):
+        self.check(RoaringBitset)
+        r = RoaringBitset()
+        r.add_range(2 ** 32 - 10, 2 ** 32)
+        self.assertTrue(r.all_in_range(2 ** 32 - 10, 2 ** 32))
+        self.assertRaises(TypeError, r.add_range, 0, 2 ** 32 + 1)
+        r.flip(0, 2 ** 32)
+        self.assertEqual(r.count(0, 2 ** 40), 2 ** 32 - 10)
+
+    def testbitset(self):
+        b = Bitset([1, 5])
+        b.add_range(1, 33)
+        self.assertEqual(len(b), 32)
+        b.flip(3, 10)
+        self.assertEqual(set(b), set(range(1, 33)) - set(range(3, 10)))
+        self.assertRaises(TypeError, b.add_range, 0, 2)
+        self.assertRaises(TypeError, b.add_range, 30, 34)
+        f = FrozenBitset(range(100, 200))
+        self.assertEqual(f.count(0, 150), 50)
+        self.assertTrue(f.all_in_range(100, 200))
+        self.assertFalse(f.all_in_range(99, 200))
+        self.assertFalse(hasattr(f, "add_range"))
+
+class TestSerialization(unittest.TestCase):
+    def setUp(self):
+        rnd = random.Random(15)
+        self.bitsets = [Bitset([1, 5, 32]), BigBitset([0, 5, 10 ** 6]), FrozenBitset([3, 70]),
+                        RoaringBitset([1, 2 ** 20, 2 ** 32 - 1]), Bitset(), BigBitset(),
+                        BigBitset(xrange(100000)), BigBitset(rnd.sample(xrange(10 ** 6), 500)),
+                        RoaringBitset(rnd.sample(xrange(2 ** 32), 1000))]
+
+    def testdumps(self):
+        for b in self.bitsets:
+            data = bitset.dumps(b)
+            self.assertEqual(data[:5], b"BSET\x01")
+            n, crc = struct.unpack("<QI", data[8:20])
+            self.assertEqual(len(data), 24 + n)
+            self.assertEqual(crc, zlib.crc32(data[24:]) & 0xFFFFFFFF)
+            c = bitset.loads(data)
+            self.assertEqual((type(c), c), (type(b), b))
+        # long runs of full words are run-length encoded
+        self.assertTrue(len(bitset.dumps(BigBitset(xrange(100000)))) < 100)
+        self.assertRaises(TypeError, bitset.dumps, [1])
+
+    def testinvalid(self):
+        data = bitset.dumps(BigBitset([1, 100, 1000]))
+        corrupt = bytearray(data)
+        corrupt[-1] ^= 1
+        for bad in (bytes(corrupt), data[:-1], data + b"x", b"XXXX" + data[4:], b""):
+            self.assertRaises(ValueError, bitset.loads, bad)
+        # a Bitset can't hold 100
+        self.assertRaises(TypeError, bitset.loads, data[:5] + b"\x00" + data[6:])
+
+    def testpickle(self):
+        for b in self.bitsets:
+            for proto in range(pickle.HIGHEST_PROTOCOL + 1):
+                c = pickle.loads(pickle.dumps(b, proto))
+                self.assertEqual((type(c), c), (type(b), b))
+
+    def teststream(self):
+        f = io.BytesIO()
+        with bitset.BitsetWriter(f) as w:
+            for i in xrange(20000):
+                w.write(BigBitset([i, i + 3]))
+            for b in self.bitsets:
+                w.write(b)
+        f.seek(0)
+        result = list(bitset.BitsetReader(f))
+        self.assertEqual(len(result), 20000 + len(self.bitsets))
+        self.assertEqual(result[12345], BigBitset([12345, 12348]))
+        self.assertEqual(result[20000:], self.bitsets)
+        truncated = io.BytesIO(f.getvalue()[:-3])
+        self.assertRaises(ValueError, list, bitset.BitsetReader(truncated))
+
+class TestBitsetStore(unittest.TestCase):
+    def setUp(self):
+        rnd = random.Random(16)
+        self.items = [("small", Bitset([1, 5, 32])), ("big", BigBitset(xrange(0, 300000, 7))),
+                      ("empty", BigBitset()), ("roaring", RoaringBitset([1, 2 ** 20])),
+                      ("sparse", FrozenBitset(rnd.sample(xrange(10 ** 6), 500)))]
+        fd, self.path = tempfile.mkstemp()
+        os.close(fd)
+        BitsetStore.write(self.path, self.items)
+
+    def tearDown(self):
+        os.remove(self.path)
+
+    def testmapping(self):
+        store = BitsetStore(self.path)
+        self.assertEqual(len(store), 5)
+        self.assertEqual(store.keys(), [name for name, b in self.items])
+        self.assertEqual(list(store), store.keys())
+        self.assertTrue("big" in store)
+        self.assertFalse("missing" in store)
+        self.assertRaises(KeyError, store.__getitem__, "missing")
+        self.assertEqual(store.get("missing", 1), 1)
+        for name, b in self.items:
+            m = store[name]
+            self.assertEqual(type(m), MappedBitset)
+            self.assertEqual(m, BigBitset(b))
+        self.assertRaises(TypeError, MappedBitset)
+
+    def testoperations(self):
+        store = BitsetStore(self.path)
+        big, sparse = store["big"], store["sparse"]
+        del store
+        expected = BigBitset(xrange(0, 300000, 7))
+        self.assertTrue(isinstance(big, FrozenBitset))
+        self.assertEqual(hash(big), hash(FrozenBitset(expected)))
+        self.assertEqual(big | sparse, expected | BigBitset(sparse))
+        self.assertEqual(type(big & sparse), FrozenBitset)
+        self.assertEqual(type(big.copy()), FrozenBitset)
+        self.assertEqual(type(bitset.union_all([big, sparse])), FrozenBitset)
+        self.assertEqual(big.rank(701), 101)
+        self.assertEqual(big.count(0, 7000), 1000)
+        self.assertTrue(memoryview(big).readonly)
+        self.assertFalse(hasattr(big, "add"))
+        # the words are the store's, not the bitset's
+        self.assertTrue(sys.getsizeof(big) < sys.getsizeof(big.copy()) - 40000)
+        self.assertEqual(pickle.loads(pickle.dumps(big)), expected)
+
+    def testfile(self):
+        f = io.BytesIO()
+        BitsetStore.write(f, dict(self.items))
+        with open(self.path, "rb") as g:
+            store = BitsetStore(g)
+        self.assertEqual(sorted(BitsetStore(io.BytesIO(f.getvalue())).keys()),
+                         sorted(store.keys()))
+        self.assertEqual(store["sparse"], self.items[-1][1])
+
+    def testinvalid(self):
+        with open(self.path, "rb") as f:
+            data = f.read()
+        corrupt = bytearray(data)
+        corrupt[-40] ^= 1
+        for bad in (bytes(corrupt), data[:-1], b"XXXX" + data[4:], b""):
+            self.assertRaises(ValueError, BitsetStore, io.BytesIO(bad))
+        self.assertRaises(ValueError, BitsetStore.write, io.BytesIO(), [("a", [1]), ("a", [2])])
+        self.assertRaises(TypeError, BitsetStore.write, io.BytesIO(), [(1, [1])])
+        self.assertRaises(TypeError, BitsetStore.write, io.BytesIO(), [("a", [-1])])
+
+class TestBitsetIndex(unittest.TestCase):
+    def setUp(self):
+        self.rows = {1: ["US", "pro"], 2: ["CA"], 3: ["US", "churned"],
+                     5: ["FR", "pro"], 1000: ["CA", "churned", "pro"]}
+        self.index = BitsetIndex(self.rows.items())
+
+    def match(self, pred):
+        return BigBitset(row for row, values in self.rows.items() if pred(set(values)))
+
+    def testquery(self):
+        ix = self.index
+        self.assertEqual(ix.query(("eq", "US")), BigBitset([1, 3]))
+        self.assertEqual(ix.query(("in", "US", "CA", "missing")), BigBitset([1, 2, 3, 1000]))
+        q = ("and", ("in", "US", "CA"), ("not", ("eq", "churned")))
+        self.assertEqual(ix.query(q), self.match(lambda v: v & set(["US", "CA"]) and "churned" not in v))
+        self.assertEqual(ix.count(q), 2)
+        q = ("or", ("not", ("eq", "pro")), ("and", ("eq", "FR"), ("eq", "pro")))
+        self.assertEqual(ix.query(q), self.match(lambda v: "pro" not in v or "FR" in v))
+        self.assertEqual(ix.query(("and", ("not", ("eq", "US")), ("not", ("eq", "CA")))), BigBitset([5]))
+        self.assertEqual(ix.count(("and", ("eq", "missing"), ("eq", "US"))), 0)
+        for q in ("US", (), ("eq",), ("not", ("eq", 1), ("eq", 2)), ("and",), ("xor", ("eq", 1))):
+            self.assertRaises(ValueError, ix.query, q)
+        q = ("and", ("eq", "missing"), ("bogus",))
+        self.assertRaises(ValueError, ix.query, q)
+        self.assertRaises(ValueError, ix.count, q)
+        self.assertRaises(TypeError, ix.count, ("eq", []))
+
+    def testupdate(self):
+        ix = self.index
+        self.assertEqual(len(ix), 5)
+        self.assertEqual(ix["pro"], FrozenBitset([1, 5, 1000]))
+        ix.add(7, ("FR", "new"))
+        self.assertEqual(ix.query(("eq", "new")), BigBitset([7]))
+        ix.remove(5)
+        ix.remove(7)
+        self.assertFalse("FR" in ix)
+        self.assertFalse("new" in ix)
+        self.assertRaises(KeyError, ix.__getitem__, "FR")
+        self.assertEqual(ix.rows(), BigBitset([1, 2, 3, 1000]))
+        self.assertEqual(ix.count(("not", ("eq", "pro"))), 2)
+        self.assertRaises(KeyError, ix.remove, 5)
+        self.assertRaises(TypeError, ix.add, -1, ["US"])
+        self.assertRaises(TypeError, ix.add, 8, ["US", "added", []])
+        self.assertEqual(ix["US"], FrozenBitset([1, 3]))
+        self.assertFalse("added" in ix)
+        self.assertFalse(8 in ix.rows())
+        ix.add(8, ["added", "added"])
+        self.assertEqual(ix["added"], FrozenBitset([8]))
+        self.assertRaises(TypeError, BitsetIndex, [1])
+
+class TestBitSlicedIndex(unittest.TestCase):
+    def setUp(self):
+        rnd = random.Random(23)
+        self.values = dict((rnd.randrange(20000), rnd.randrange(1000)) for i in range(5000))
+        self.values[7] = 2 ** 63 - 1
+        self.index = BitSlicedIndex(self.values.items())
+        self.filter = BigBitset(rnd.sample(range(20000), 3000))
+
+    def match(self, pred, f=None):
+        return BigBitset(r for r, v in self.values.items() if pred(v) and (f is None or r in f))
+
+    def testcompare(self):
+        ix = self.index
+        for x in (-2 ** 80, -2 ** 63, -1, 0, 1, 500, 999, 1000, 2 ** 63 - 1, 2 ** 63, 2 ** 80):
+            for f in (None, self.filter):
+                self.assertEqual(ix.lt(x, f), self.match(lambda v: v < x, f))
+                self.assertEqual(ix.le(x, f), self.match(lambda v: v <= x, f))
+                self.assertEqual(ix.eq(x, f), self.match(lambda v: v == x, f))
+                self.assertEqual(ix.ge(x, f), self.match(lambda v: v >= x, f))
+                self.assertEqual(ix.gt(x, f), self.match(lambda v: v > x, f))
+                self.assertEqual(ix.between(x, x + 300, f), self.match(lambda v: x <= v <= x + 300, f))
+        self.assertEqual(ix.lt(500, list(self.filter)), self.match(lambda v: v < 500, self.filter))
+        roaring = RoaringBitset(list(self.filter) + [2 ** 32 - 1])
+        self.assertEqual(ix.lt(500, roaring), self.match(lambda v: v < 500, self.filter))
+        self.assertEqual(ix.sum(roaring), ix.sum(self.filter))
+        self.assertRaises(TypeError, ix.lt, 1.5)
+        self.assertRaises(TypeError, ix.between, 1)
+
+    def testaggregate(self):
+        ix = self.index
+        self.assertEqual(ix.sum(), sum(self.values.values()))
+        self.assertEqual(ix.sum(self.filter), sum(v for r, v in self.values.items() if r in self.filter))
+        self.assertEqual(BitSlicedIndex().sum(), 0)
+        for k in (0, 1, 10, 4999, 10 ** 6):
+            for f in (None, self.filter):
+                ranked = sorted((-v, r) for r, v in self.values.items() if f is None or r in f)
+                self.assertEqual(ix.top_k(k, f), BigBitset(r for v, r in ranked[:k]))
+        self.assertRaises(ValueError, ix.top_k, -1)
+
+    def testupdate(self):
+        ix = self.index
+        self.assertEqual(len(ix), len(self.values))
+        self.assertEqual(ix[7], 2 ** 63 - 1)
+        self.assertEqual(ix.rows(), BigBitset(self.values))
+        self.assertEqual(sorted(ix), sorted(self.values))
+        ix.add(7, 3)
+        self.assertEqual(ix[7], 3)
+        self.assertTrue(7 in ix.eq(3))
+        ix.remove(7)
+        self.assertFalse(7 in ix)
+        self.assertRaises(KeyError, ix.__getitem__, 7)
+        self.assertRaises(KeyError, ix.remove, 7)
+        self.assertRaises(ValueError, ix.add, 1, -1)
+        self.assertRaises(ValueError, ix.add, 1, 2 ** 63)
+        self.assertRaises(TypeError, ix.add, -1, 1)
+        self.assertRaises(TypeError, BitSlicedIndex, [1])
+
+class TestLazyBitset(unittest.TestCase):
+    def setUp(self):
+        rnd = random.Random(22)
+        self.sets = [set(rnd.sample(range(100000), n)) for n in (50000, 3000, 20000, 40)]
+        self.bitsets = [BigBitset(s) for s in self.sets]
+
+    def testoperators(self):
+        a, b, c, d = [bitset.lazy(x) for x in self.bitsets]
+        sa, sb, sc, sd = self.sets
+        cases = [(a & b & c & d, sa & sb & sc & sd),
+                 (a | b | c, sa | sb | sc),
+                 (a ^ b ^ c, sa ^ sb ^ sc),
+                 (a - b - c, sa - sb - sc),
+                 ((a | d) & ~b & c, ((sa | sd) - sb) & sc),
+                 (a & ~(b | c), sa - (sb | sc)),
+                 ((a - b) | (c & d) ^ a, (sa - sb) | ((sc & sd) ^ sa)),
+                 (self.bitsets[0] & b, sa & sb),
+                 (a & bitset.lazy([1, 2, 3]), sa & set([1, 2, 3])),
+                 (~~a, sa)]
+        for expr, expected in cases:
+            self.assertEqual(expr.evaluate(), BigBitset(expected))
+            self.assertEqual(len(expr), len(expected))
+            self.assertEqual(list(expr), sorted(expected))
+        self.assertTrue(isinstance(a.evaluate(), BigBitset))
+
+    def testshared(self):
+        a, b, c, d = [bitset.lazy(x) for x in self.bitsets]
+        sa, sb, sc, sd = self.sets
+        ab = a & b
+        expr = (ab | c) & (ab | d) & ~(ab & d)
+        self.assertEqual(expr.evaluate(), BigBitset(((sa & sb) | sc) & ((sa & sb) | sd) - (sa & sb & sd)))
+        # the same bitset under two leaves
+        self.assertEqual(len(bitset.lazy(self.bitsets[0]) - a), 0)
+        # leaves see changes made after the expression was built
+        x = BigBitset([1, 2])
+        expr = LazyBitset(x) | b
+        x.add(100001)
+        self.assertTrue(100001 in expr.evaluate())
+        r, y = RoaringBitset([1]), BigBitset([2])
+        expr = bitset.lazy(r) | y
+        r.add(5)
+        y.add(6)
+        self.assertEqual(list(expr), [1, 2, 5, 6])
+        self.assertEqual(len(bitset.lazy(r) - r), 0)
+
+    def testempty(self):
+        a, b = [bitset.lazy(x) for x in self.bitsets[:2]]
+        empty = bitset.lazy(BigBitset())
+        self.assertEqual(len(a & empty & b), 0)
+        self.assertEqual(len(empty), 0)
+        self.assertEqual((empty | Bitset([3])).evaluate(), BigBitset([3]))
+        self.assertEqual(len(a & BigBitset([10 ** 6])), 0)
+
+    def testerrors(self):
+        a, b = [bitset.lazy(x) for x in self.bitsets[:2]]
+        for expr in (~a, ~a | b, ~a & ~b, b - ~a):
+            self.assertRaises(ValueError, expr.evaluate)
+            self.assertRaises(ValueError, len, expr)
+        self.assertRaises(TypeError, lambda: a & 1)
+        self.assertRaises(TypeError, bitset.lazy, 1)
+        self.assertRaises(TypeError, LazyBitset, [1], x=1)
+
+    def testdeep(self):
+        x = bitset.lazy(self.bitsets[0])
+        for s in self.bitsets[1:] * 5000:
+            x = (x | s) & s
+        self.assertRaises(RuntimeError, x.evaluate)
+
 if __name__ == '__main__':
-    import sys
     unittest.main()